@@ -42,6 +42,9 @@ static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /* Protect globals */
 static rpc_instance rpc = NULL;         /* RPC Service */
 static bool bound = false;              /* Do we have a listen socket open */
 static bool have_callbacks = false;     /* Have we ever registered any callbacks */
+static int pool_size = 1;               /* Connections per destination */
+static bool pool_least_inflight = false;/* Pool selection policy */
+#define PROCESS_BATCH 64                /* Callbacks per apteryx_process call */
 
 static pthread_mutex_t pending_watches_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t no_pending_watches = PTHREAD_COND_INITIALIZER;
@@ -59,28 +62,26 @@ typedef struct _cb_t
 } cb_t;
 static uint64_t next_ref = 0;
 static GList *cb_list = NULL;
+static GHashTable *cb_table = NULL;     /* cb_t indexed by ref */
+static pthread_rwlock_t cb_lock = PTHREAD_RWLOCK_INITIALIZER; /* Protect cb_list/cb_table */
 
 static bool
 find_callback (uint64_t ref, void **fn, void **data, bool *val, uint32_t *flags)
 {
     bool rc = false;
-    GList *iter;
     cb_t *cb;
 
-    pthread_mutex_lock (&lock);
-    for (iter = g_list_first (cb_list); iter; iter = g_list_next (iter))
+    pthread_rwlock_rdlock (&cb_lock);
+    cb = cb_table ? g_hash_table_lookup (cb_table, &ref) : NULL;
+    if (cb)
     {
-        cb = (cb_t *) iter->data;
-        if (cb->ref == ref)
-        {
-            *fn = cb->fn;
-            *data = cb->data;
-            *val = cb->value;
-            *flags = cb->flags;
-            rc = true;
-        }
+        *fn = cb->fn;
+        *data = cb->data;
+        *val = cb->value;
+        *flags = cb->flags;
+        rc = true;
     }
-    pthread_mutex_unlock (&lock);
+    pthread_rwlock_unlock (&cb_lock);
     return rc;
 }
 
@@ -198,7 +199,7 @@ handle_watch (rpc_message msg)
     pthread_mutex_lock (&pending_watches_lock);
     ++pending_watch_count;
     pthread_mutex_unlock (&pending_watches_lock);
-    if (flags == 0)
+    if (!(flags & CB_FLAG_TREE))
     {
         path = rpc_msg_decode_string (msg);
         value = rpc_msg_decode_string (msg);
@@ -323,6 +324,13 @@ handle_provide (rpc_message msg)
 static bool
 msg_handler (rpc_message msg)
 {
+    /* Apteryxd has stopped waiting for this callback */
+    if (rpc_msg_expired ())
+    {
+        DEBUG ("MSG: Dropping expired callback\n");
+        return false;
+    }
+
     APTERYX_MODE mode = rpc_msg_decode_uint8 (msg);
     switch (mode)
     {
@@ -364,6 +372,8 @@ apteryx_init (bool debug_enabled)
             pthread_mutex_unlock (&lock);
             return false;
         }
+        rpc_client_pool_set (rpc, pool_size, pool_least_inflight ?
+                             RPC_POOL_LEAST_INFLIGHT : RPC_POOL_ROUND_ROBIN);
 
         /* Only need to bind if we have previously added callbacks */
         if (have_callbacks)
@@ -433,7 +443,31 @@ int
 apteryx_process (bool poll)
 {
     ASSERT ((ref_count > 0), return false, "PROCESS: Not initialised\n");
-    return rpc_server_process (rpc, poll);
+    return rpc_server_process (rpc, poll, PROCESS_BATCH, 0);
+}
+
+int
+apteryx_process_batch (int max_jobs, uint64_t max_us)
+{
+    ASSERT ((ref_count > 0), return -1, "PROCESS: Not initialised\n");
+    return rpc_server_process (rpc, true, max_jobs, max_us);
+}
+
+bool
+apteryx_connection_pool (int size, bool least_inflight)
+{
+    ASSERT ((size > 0), return false, "POOL: Invalid parameters\n");
+
+    DEBUG ("POOL: %d connections (%s)\n", size, least_inflight ? "least in-flight" : "round-robin");
+
+    pthread_mutex_lock (&lock);
+    pool_size = size;
+    pool_least_inflight = least_inflight;
+    if (rpc)
+        rpc_client_pool_set (rpc, pool_size, pool_least_inflight ?
+                             RPC_POOL_LEAST_INFLIGHT : RPC_POOL_ROUND_ROBIN);
+    pthread_mutex_unlock (&lock);
+    return true;
 }
 
 bool
@@ -626,6 +660,142 @@ apteryx_set_full (const char *path, const char *value, uint64_t ts, bool ack)
     return result == 0;
 }
 
+/* Operations are encoded as they are added and sent on commit */
+struct apteryx_txn_s
+{
+    char *url;
+    rpc_message_t ops;
+};
+
+apteryx_txn
+apteryx_txn_begin (void)
+{
+    ASSERT ((ref_count > 0), return NULL, "TXN: Not initialised\n");
+    return (apteryx_txn) calloc (1, sizeof (struct apteryx_txn_s));
+}
+
+static const char *
+txn_path (apteryx_txn txn, const char *path)
+{
+    char *url = NULL;
+
+    path = validate_path (path, &url);
+    if (!path || path[strlen (path) - 1] == '/')
+    {
+        ERROR ("TXN: invalid path (%s)!\n", path);
+        free (url);
+        return NULL;
+    }
+
+    /* Everything in a transaction goes to the same place */
+    if (!txn->url)
+        txn->url = url;
+    else if (strcmp (txn->url, url) != 0)
+    {
+        ERROR ("TXN: Path(%s) is not on %s\n", path, txn->url);
+        free (url);
+        return NULL;
+    }
+    else
+        free (url);
+    return path;
+}
+
+bool
+apteryx_txn_add (apteryx_txn txn, const char *path, const char *value)
+{
+    ASSERT (txn && path, return false, "TXN: Invalid parameters\n");
+
+    DEBUG ("TXN: %s = %s\n", path, value);
+
+    path = txn_path (txn, path);
+    if (!path)
+        return false;
+    rpc_msg_encode_uint8 (&txn->ops, value ? TXN_SET : TXN_DELETE);
+    rpc_msg_encode_string (&txn->ops, path);
+    if (value)
+        rpc_msg_encode_string (&txn->ops, value);
+    return true;
+}
+
+bool
+apteryx_txn_check (apteryx_txn txn, const char *path, uint64_t ts)
+{
+    ASSERT (txn && path, return false, "TXN: Invalid parameters\n");
+
+    DEBUG ("TXN: %s unchanged since %"PRIu64"\n", path, ts);
+
+    path = txn_path (txn, path);
+    if (!path)
+        return false;
+    rpc_msg_encode_uint8 (&txn->ops, TXN_CHECK);
+    rpc_msg_encode_string (&txn->ops, path);
+    rpc_msg_encode_uint64 (&txn->ops, ts);
+    return true;
+}
+
+void
+apteryx_txn_abort (apteryx_txn txn)
+{
+    if (txn)
+    {
+        rpc_msg_reset (&txn->ops);
+        free (txn->url);
+        free (txn);
+    }
+}
+
+bool
+apteryx_txn_commit (apteryx_txn txn, bool wait_for_completion)
+{
+    rpc_client rpc_client;
+    rpc_message_t msg = {};
+    int32_t result = 0;
+
+    ASSERT ((ref_count > 0), return false, "TXN: Not initialised\n");
+    ASSERT (txn, return false, "TXN: Invalid parameters\n");
+
+    /* Nothing to do */
+    if (!txn->url)
+    {
+        apteryx_txn_abort (txn);
+        return true;
+    }
+
+    /* IPC */
+    rpc_client = rpc_client_connect (rpc, txn->url);
+    if (!rpc_client)
+    {
+        ERROR ("TXN: Failed to connect to server: %s\n", strerror (errno));
+        apteryx_txn_abort (txn);
+        return false;
+    }
+    rpc_msg_encode_uint8 (&msg, MODE_TXN);
+    rpc_msg_encode_uint8 (&msg, wait_for_completion);
+    rpc_msg_append (&msg, &txn->ops);
+    rpc_msg_encode_uint8 (&msg, TXN_END);
+    if (!rpc_msg_send (rpc_client, &msg))
+    {
+        ERROR ("TXN: No response\n");
+        rpc_msg_reset (&msg);
+        rpc_client_release (rpc, rpc_client, false);
+        apteryx_txn_abort (txn);
+        return false;
+    }
+    result = rpc_msg_decode_uint64 (&msg);
+    rpc_msg_reset (&msg);
+    if (result < 0)
+    {
+        DEBUG ("TXN: Error response: %s\n", strerror (-result));
+        errno = result;
+    }
+    rpc_client_release (rpc, rpc_client, true);
+    apteryx_txn_abort (txn);
+
+    /* Success */
+    return result == 0;
+}
+
 bool
 apteryx_cas_string (const char *path, const char *key, const char *value, uint64_t ts)
 {
@@ -737,6 +907,65 @@ apteryx_get (const char *path)
     return value;
 }
 
+bool
+apteryx_get_if_modified (const char *path, uint64_t *ts, char **value)
+{
+    char *url = NULL;
+    rpc_client rpc_client;
+    rpc_message_t msg = {};
+    bool modified;
+
+    ASSERT ((ref_count > 0), return false, "GET: Not initialised\n");
+    ASSERT (path && ts && value, return false, "GET: Invalid parameters\n");
+
+    DEBUG ("GET: %s if modified since %"PRIu64"\n", path, *ts);
+
+    /* Check path */
+    path = validate_path (path, &url);
+    if (!path || path[strlen(path)-1] == '/')
+    {
+        ERROR ("GET: invalid path (%s)!\n", path);
+        free (url);
+        assert (!apteryx_debug || path);
+        return false;
+    }
+
+    /* IPC */
+    rpc_client = rpc_client_connect (rpc, url);
+    if (!rpc_client)
+    {
+        ERROR ("GET: Path(%s) Failed to connect to server: %s\n", path, strerror (errno));
+        free (url);
+        return false;
+    }
+    rpc_msg_encode_uint8 (&msg, MODE_GET_IF_MODIFIED);
+    rpc_msg_encode_string (&msg, path);
+    rpc_msg_encode_uint64 (&msg, *ts);
+    if (!rpc_msg_send (rpc_client, &msg))
+    {
+        ERROR ("GET: No response Path(%s)\n", path);
+        rpc_msg_reset (&msg);
+        rpc_client_release (rpc, rpc_client, false);
+        free (url);
+        return false;
+    }
+    modified = rpc_msg_decode_uint8 (&msg);
+    *ts = rpc_msg_decode_uint64 (&msg);
+    if (modified)
+    {
+        *value = rpc_msg_decode_string (&msg);
+        if (*value)
+            *value = strdup (*value);
+        DEBUG ("    = %s\n", *value);
+    }
+    else
+        DEBUG ("    not modified\n");
+    rpc_msg_reset (&msg);
+    rpc_client_release (rpc, rpc_client, true);
+    free (url);
+    return modified;
+}
+
 char *
 apteryx_get_string (const char *path, const char *key)
 {
@@ -1065,8 +1294,17 @@ _set_multi (GNode *node, gpointer data)
     return FALSE;
 }
 
-bool
-apteryx_set_tree_full (GNode* root, uint64_t ts, bool wait_for_completion)
+static void
+_encode_timestamp (gpointer path, gpointer ts, gpointer data)
+{
+    rpc_message msg = (rpc_message) data;
+    rpc_msg_encode_string (msg, (const char *) path);
+    rpc_msg_encode_uint64 (msg, *(uint64_t *) ts);
+}
+
+/* Either every path is checked against ts, or just those in timestamps */
+static bool
+_set_tree (GNode* root, uint64_t ts, GHashTable *timestamps, bool wait_for_completion)
 {
     const char *path = NULL;
     char *old_root_name = NULL;
@@ -1108,8 +1346,18 @@ apteryx_set_tree_full (GNode* root, uint64_t ts, bool wait_for_completion)
     root->data = (char*) path;
 
     /* Create the list of Paths/Value's */
-    rpc_msg_encode_uint8 (&msg, wait_for_completion ? MODE_SET_WITH_ACK : MODE_SET);
-    rpc_msg_encode_uint64 (&msg, ts);
+    if (timestamps)
+    {
+        rpc_msg_encode_uint8 (&msg, MODE_SET_CHECKED);
+        rpc_msg_encode_uint8 (&msg, wait_for_completion);
+        rpc_msg_encode_uint64 (&msg, g_hash_table_size (timestamps));
+        g_hash_table_foreach (timestamps, _encode_timestamp, &msg);
+    }
+    else
+    {
+        rpc_msg_encode_uint8 (&msg, wait_for_completion ? MODE_SET_WITH_ACK : MODE_SET);
+        rpc_msg_encode_uint64 (&msg, ts);
+    }
     g_node_traverse (root, G_PRE_ORDER, G_TRAVERSE_NON_LEAFS, -1, _set_multi, &msg);
     if (!rpc_msg_send (rpc_client, &msg))
     {
@@ -1137,6 +1385,87 @@ apteryx_set_tree_full (GNode* root, uint64_t ts, bool wait_for_completion)
     return result == 0;
 }
 
+bool
+apteryx_set_tree_full (GNode* root, uint64_t ts, bool wait_for_completion)
+{
+    return _set_tree (root, ts, NULL, wait_for_completion);
+}
+
+bool
+apteryx_cas_tree_full (GNode* root, GHashTable *timestamps, bool wait_for_completion)
+{
+    ASSERT (timestamps, return false, "SET_TREE: Invalid parameters\n");
+    return _set_tree (root, UINT64_MAX, timestamps, wait_for_completion);
+}
+
+int32_t
+apteryx_sync_tree (GNode* root)
+{
+    const char *path = NULL;
+    char *old_root_name = NULL;
+    char *url = NULL;
+    rpc_client rpc_client;
+    rpc_message_t msg = {};
+    int32_t result = 0;
+
+    ASSERT ((ref_count > 0), return -EINVAL, "SYNC_TREE: Not initialised\n");
+    ASSERT (root, return -EINVAL, "SYNC_TREE: Invalid parameters\n");
+
+    DEBUG ("SYNC_TREE: %d paths\n", g_node_n_nodes (root, G_TRAVERSE_LEAVES));
+
+    /* Check path */
+    path = validate_path (APTERYX_NAME (root), &url);
+    if (!path || strlen (path) < 2 || path[strlen (path) - 1] == '/')
+    {
+        ERROR ("SYNC_TREE: invalid path (%s)!\n", path);
+        assert (!apteryx_debug || path);
+        free (url);
+        return -EINVAL;
+    }
+
+    /* IPC */
+    rpc_client = rpc_client_connect (rpc, url);
+    if (!rpc_client)
+    {
+        ERROR ("SYNC_TREE: Path(%s) Failed to connect to server: %s\n", path, strerror (errno));
+        free (url);
+        return -ENOTCONN;
+    }
+
+    /* Save sanitized root path (less URL) to root node */
+    old_root_name = APTERYX_NAME (root);
+    root->data = (char*) path;
+
+    /* The root and the desired list of Paths/Value's */
+    rpc_msg_encode_uint8 (&msg, MODE_SYNC);
+    rpc_msg_encode_string (&msg, path);
+    g_node_traverse (root, G_PRE_ORDER, G_TRAVERSE_NON_LEAFS, -1, _set_multi, &msg);
+    if (!rpc_msg_send (rpc_client, &msg))
+    {
+        ERROR ("SYNC_TREE: No response Path(%s)\n", path);
+        rpc_msg_reset (&msg);
+        rpc_client_release (rpc, rpc_client, false);
+        root->data = old_root_name;
+        free (url);
+        return -ETIMEDOUT;
+    }
+    result = rpc_msg_decode_uint64 (&msg);
+    rpc_msg_reset (&msg);
+    if (result < 0)
+    {
+        DEBUG ("SYNC_TREE: Error response: %s\n", strerror (-result));
+        errno = result;
+    }
+    rpc_client_release (rpc, rpc_client, true);
+    free (url);
+
+    /* Reinstate original root name */
+    root->data = old_root_name;
+
+    /* Return result */
+    return result;
+}
+
 typedef struct _traverse_data_t
 {
     GNode* root;
@@ -1188,35 +1517,68 @@ apteryx_path_to_node (GNode* root, const char *path, const char *value)
     return rnode;
 }
 
-GNode*
-apteryx_get_tree (const char *path)
+/* Build a tree from the path/value pairs of a traverse */
+static GNode *
+decode_tree (rpc_message msg, const char *rpath)
 {
-    char *url = NULL;
-    const char *rpath = path;
-    rpc_client rpc_client;
-    rpc_message_t msg = {};
     GNode *root = NULL;
-    int slen = strlen (path);
+    int slen = strlen (rpath);
+    char *path;
     char *value;
 
-    ASSERT ((ref_count > 0), return NULL, "GET_TREE: Not initialised\n");
-    ASSERT (path, return NULL, "GET_TREE: Invalid parameters\n");
-
-    DEBUG ("GET_TREE: %s\n", path);
-
-    /* Check path */
-    path = validate_path (path, &url);
-    if (!path || path[strlen(path) - 1] == '/')
+    path = rpc_msg_decode_string (msg);
+    if (path && strcmp (path, rpath) == 0)
     {
-        ERROR ("GET_TREE: invalid path (%s)!\n", path);
-        assert (!apteryx_debug || path);
-        free (url);
-        return NULL;
+        root = g_node_new (strdup (rpath));
+        value = rpc_msg_decode_string (msg);
+        DEBUG ("   = %s\n", value);
+        g_node_append_data (root, (gpointer) strdup (value));
     }
-
-    /* IPC */
-    rpc_client = rpc_client_connect (rpc, url);
-    if (!rpc_client)
+    else if (path)
+    {
+        root = g_node_new (strdup (rpath));
+        while (path)
+        {
+            value = rpc_msg_decode_string (msg);
+            DEBUG ("  %s = %s\n", path + slen, value);
+            apteryx_path_to_node (root, path + slen, value);
+            path = rpc_msg_decode_string (msg);
+        }
+    }
+    else
+    {
+        DEBUG ("  = (null)\n");
+    }
+    return root;
+}
+
+GNode*
+apteryx_get_tree (const char *path)
+{
+    char *url = NULL;
+    const char *rpath = path;
+    rpc_client rpc_client;
+    rpc_message_t msg = {};
+    GNode *root = NULL;
+
+    ASSERT ((ref_count > 0), return NULL, "GET_TREE: Not initialised\n");
+    ASSERT (path, return NULL, "GET_TREE: Invalid parameters\n");
+
+    DEBUG ("GET_TREE: %s\n", path);
+
+    /* Check path */
+    path = validate_path (path, &url);
+    if (!path || path[strlen(path) - 1] == '/')
+    {
+        ERROR ("GET_TREE: invalid path (%s)!\n", path);
+        assert (!apteryx_debug || path);
+        free (url);
+        return NULL;
+    }
+
+    /* IPC */
+    rpc_client = rpc_client_connect (rpc, url);
+    if (!rpc_client)
     {
         ERROR ("GET_TREE: Path(%s) Failed to connect to server: %s\n", path, strerror (errno));
         free (url);
@@ -1232,33 +1594,148 @@ apteryx_get_tree (const char *path)
         free (url);
         return NULL;
     }
-    path = rpc_msg_decode_string (&msg);
-    if (path && strcmp (path, rpath) == 0)
-    {
-        root = g_node_new (strdup (rpath));
-        value = rpc_msg_decode_string (&msg);
-        DEBUG ("   = %s\n", value);
-        g_node_append_data (root, (gpointer) strdup (value));
-    }
-    else if (path)
+    root = decode_tree (&msg, rpath);
+    rpc_msg_reset (&msg);
+    rpc_client_release (rpc, rpc_client, true);
+    free (url);
+    return root;
+}
+
+GNode *
+apteryx_get_trees (GList *paths)
+{
+    char *url = NULL;
+    char *purl = NULL;
+    rpc_client rpc_client;
+    rpc_message_t msg = {};
+    GNode *root = NULL;
+    const char *path;
+    char *value;
+    GList *iter;
+
+    ASSERT ((ref_count > 0), return NULL, "GET_TREES: Not initialised\n");
+    ASSERT (paths, return NULL, "GET_TREES: Invalid parameters\n");
+
+    DEBUG ("GET_TREES: %d roots\n", g_list_length (paths));
+
+    /* Check paths - every root must be on the same instance */
+    rpc_msg_encode_uint8 (&msg, MODE_TRAVERSE_MULTI);
+    for (iter = paths; iter; iter = g_list_next (iter))
     {
-        root = g_node_new (strdup (rpath));
-        while (path)
+        path = validate_path ((const char *) iter->data, &purl);
+        /* if path is empty, or path ends in '/' but is not the root db path (ie "/") */
+        if (!path ||
+            ((path[strlen(path)-1] == '/') && strlen(path) > 1))
         {
-            value = rpc_msg_decode_string (&msg);
-            DEBUG ("  %s = %s\n", path + slen, value);
-            apteryx_path_to_node (root, path + slen, value);
-            path = rpc_msg_decode_string (&msg);
+            ERROR ("GET_TREES: invalid path (%s)!\n", path);
+            assert (!apteryx_debug || path);
+            goto error;
+        }
+        if (!url)
+        {
+            url = purl;
+        }
+        else if (strcmp (url, purl) != 0)
+        {
+            ERROR ("GET_TREES: Path(%s) is not on %s\n", path, url);
+            goto error;
+        }
+        else
+        {
+            free (purl);
         }
+        purl = NULL;
+        rpc_msg_encode_string (&msg, path);
     }
-    else
+
+    /* IPC */
+    rpc_client = rpc_client_connect (rpc, url);
+    if (!rpc_client)
     {
-        DEBUG ("  = (null)\n");
+        ERROR ("GET_TREES: Failed to connect to server: %s\n", strerror (errno));
+        goto error;
+    }
+    if (!rpc_msg_send (rpc_client, &msg))
+    {
+        ERROR ("GET_TREES: No response\n");
+        rpc_client_release (rpc, rpc_client, false);
+        goto error;
+    }
+
+    /* One tree from the root holds every subtree */
+    while ((path = rpc_msg_decode_string (&msg)) != NULL)
+    {
+        value = rpc_msg_decode_string (&msg);
+        DEBUG ("  %s = %s\n", path, value);
+        if (!root)
+            root = g_node_new (strdup ("/"));
+        apteryx_path_to_node (root, path, value);
     }
     rpc_msg_reset (&msg);
     rpc_client_release (rpc, rpc_client, true);
     free (url);
     return root;
+
+error:
+    rpc_msg_reset (&msg);
+    free (purl);
+    free (url);
+    return NULL;
+}
+
+bool
+apteryx_get_tree_if_modified (const char *path, uint64_t *ts, GNode **root)
+{
+    char *url = NULL;
+    const char *rpath = path;
+    rpc_client rpc_client;
+    rpc_message_t msg = {};
+    bool modified;
+
+    ASSERT ((ref_count > 0), return false, "GET_TREE: Not initialised\n");
+    ASSERT (path && ts && root, return false, "GET_TREE: Invalid parameters\n");
+
+    DEBUG ("GET_TREE: %s if modified since %"PRIu64"\n", path, *ts);
+
+    /* Check path */
+    path = validate_path (path, &url);
+    if (!path || path[strlen(path) - 1] == '/')
+    {
+        ERROR ("GET_TREE: invalid path (%s)!\n", path);
+        assert (!apteryx_debug || path);
+        free (url);
+        return false;
+    }
+
+    /* IPC */
+    rpc_client = rpc_client_connect (rpc, url);
+    if (!rpc_client)
+    {
+        ERROR ("GET_TREE: Path(%s) Failed to connect to server: %s\n", path, strerror (errno));
+        free (url);
+        return false;
+    }
+    rpc_msg_encode_uint8 (&msg, MODE_TRAVERSE_IF_MODIFIED);
+    rpc_msg_encode_string (&msg, path);
+    rpc_msg_encode_uint64 (&msg, *ts);
+    if (!rpc_msg_send (rpc_client, &msg))
+    {
+        ERROR ("GET_TREE: No response Path(%s)\n", path);
+        rpc_msg_reset (&msg);
+        rpc_client_release (rpc, rpc_client, false);
+        free (url);
+        return false;
+    }
+    modified = rpc_msg_decode_uint8 (&msg);
+    *ts = rpc_msg_decode_uint64 (&msg);
+    if (modified)
+        *root = decode_tree (&msg, rpath);
+    else
+        DEBUG ("  not modified\n");
+    rpc_msg_reset (&msg);
+    rpc_client_release (rpc, rpc_client, true);
+    free (url);
+    return modified;
 }
 
 static gboolean
@@ -1272,6 +1749,153 @@ _get_multi (GNode *node, gpointer data)
     return FALSE;
 }
 
+struct apteryx_iter_s
+{
+    rpc_client client;
+    rpc_id id;
+    rpc_message_t msg;
+    bool more;
+    bool failed;
+};
+
+static apteryx_iter *
+iter_start (const char *url, rpc_message msg)
+{
+    rpc_client rpc_client;
+    apteryx_iter *iter;
+    rpc_id id;
+
+    /* IPC */
+    rpc_client = rpc_client_connect (rpc, url);
+    if (!rpc_client)
+    {
+        ERROR ("ITER: Failed to connect to server: %s\n", strerror (errno));
+        rpc_msg_reset (msg);
+        return NULL;
+    }
+    id = rpc_msg_send_stream (rpc_client, msg);
+    if (!id)
+    {
+        ERROR ("ITER: Failed to send request\n");
+        rpc_client_release (rpc, rpc_client, false);
+        return NULL;
+    }
+    iter = g_malloc0 (sizeof (*iter));
+    iter->client = rpc_client;
+    iter->id = id;
+    iter->more = true;
+    return iter;
+}
+
+apteryx_iter *
+apteryx_traverse_iter (const char *path)
+{
+    char *url = NULL;
+    rpc_message_t msg = {};
+    apteryx_iter *iter;
+
+    ASSERT ((ref_count > 0), return NULL, "TRAVERSE_ITER: Not initialised\n");
+    ASSERT (path, return NULL, "TRAVERSE_ITER: Invalid parameters\n");
+
+    DEBUG ("TRAVERSE_ITER: %s\n", path);
+
+    /* Check path */
+    path = validate_path (path, &url);
+    if (!path || path[strlen(path) - 1] == '/')
+    {
+        ERROR ("TRAVERSE_ITER: invalid path (%s)!\n", path);
+        assert (!apteryx_debug || path);
+        free (url);
+        return NULL;
+    }
+
+    rpc_msg_encode_uint8 (&msg, MODE_TRAVERSE);
+    rpc_msg_encode_string (&msg, path);
+    iter = iter_start (url, &msg);
+    free (url);
+    return iter;
+}
+
+static gboolean _get_multi (GNode *node, gpointer data);
+
+apteryx_iter *
+apteryx_query_iter (GNode *root)
+{
+    char *url = NULL;
+    rpc_message_t msg = {};
+    const char *path = NULL;
+    char *old_root_name = NULL;
+    apteryx_iter *iter;
+
+    ASSERT ((ref_count > 0), return NULL, "QUERY_ITER: Not initialised\n");
+    ASSERT (root, return NULL, "QUERY_ITER: Invalid parameters\n");
+
+    DEBUG ("QUERY_ITER\n");
+
+    /* Check path */
+    path = validate_path (APTERYX_NAME (root), &url);
+    if (path && strcmp (path, "/") == 0)
+    {
+        path = "";
+    }
+    else if (!path ||
+             ((strlen (path) > 0) &&
+              ((path[strlen (path) - 1] == '/') || path[0] != '/' ||
+               strstr (path, "//") != NULL)))
+    {
+        free (url);
+        ERROR ("QUERY_ITER: invalid root (%s)!\n", path);
+        return NULL;
+    }
+
+    /* Encode using the sanitized root path (less URL) */
+    old_root_name = APTERYX_NAME (root);
+    root->data = (char *) path;
+    rpc_msg_encode_uint8 (&msg, MODE_QUERY);
+    g_node_traverse (root, G_PRE_ORDER, G_TRAVERSE_LEAVES, -1, _get_multi, &msg);
+    root->data = old_root_name;
+
+    iter = iter_start (url, &msg);
+    free (url);
+    return iter;
+}
+
+bool
+apteryx_iter_next (apteryx_iter *iter, const char **path, const char **value)
+{
+    ASSERT (iter && path && value, return false, "ITER: Invalid parameters\n");
+
+    /* Results are only split between a path and its value */
+    while (!iter->msg.buffer || (*path = rpc_msg_decode_string (&iter->msg)) == NULL)
+    {
+        if (!iter->more)
+            return false;
+        if (!rpc_msg_recv_stream (iter->client, iter->id, &iter->msg, &iter->more))
+        {
+            ERROR ("ITER: No response\n");
+            iter->failed = true;
+            return false;
+        }
+    }
+    *value = rpc_msg_decode_string (&iter->msg);
+    DEBUG ("  %s = %s\n", *path, *value);
+    return true;
+}
+
+void
+apteryx_iter_free (apteryx_iter *iter)
+{
+    if (!iter)
+        return;
+
+    /* Tell the server to stop rather than read the rest */
+    if (iter->more && !iter->failed)
+        rpc_msg_cancel_stream (iter->client, iter->id);
+    rpc_msg_reset (&iter->msg);
+    rpc_client_release (rpc, iter->client, !iter->failed);
+    g_free (iter);
+}
+
 GNode *
 apteryx_query (GNode *root)
 {
@@ -1437,6 +2061,82 @@ apteryx_search (const char *path)
     return paths;
 }
 
+GList *
+apteryx_search_range (const char *path, const char *after, size_t limit)
+{
+    char *url = NULL;
+    rpc_client rpc_client;
+    rpc_message_t msg = {};
+    GList *paths = NULL;
+
+    ASSERT ((ref_count > 0), return NULL, "SEARCH: Not initialised\n");
+    ASSERT (path, return NULL, "SEARCH: Invalid parameters\n");
+
+    DEBUG ("SEARCH: %s after %s (limit %zu)\n", path, after, limit);
+
+    /* Check path */
+    path = validate_path (path, &url);
+    if (!path)
+    {
+        ERROR ("SEARCH: invalid path!\n");
+        free (url);
+        assert (!apteryx_debug || path);
+        return NULL;
+    }
+
+    /* Validate path */
+    if (strcmp (path, "/") == 0 ||
+        strcmp (path, "/*") == 0 ||
+        strcmp (path, "*") == 0 ||
+        strlen (path) == 0)
+    {
+        path = "";
+    }
+    else if (path[0] != '/' ||
+             path[strlen (path) - 1] != '/' ||
+             strstr (path, "//") != NULL)
+    {
+        free (url);
+        ERROR ("SEARCH: invalid root (%s)!\n", path);
+        assert(!apteryx_debug || path[0] == '/');
+        assert(!apteryx_debug || path[strlen (path) - 1] == '/');
+        assert(!apteryx_debug || strstr (path, "//") == NULL);
+        return NULL;
+    }
+
+    /* IPC */
+    rpc_client = rpc_client_connect (rpc, url);
+    if (!rpc_client)
+    {
+        ERROR ("SEARCH: Path(%s) Failed to connect to server: %s\n", path, strerror (errno));
+        free (url);
+        return NULL;
+    }
+    rpc_msg_encode_uint8 (&msg, MODE_SEARCH_RANGE);
+    rpc_msg_encode_string (&msg, path);
+    rpc_msg_encode_string (&msg, after ?: "");
+    rpc_msg_encode_uint64 (&msg, limit);
+    if (!rpc_msg_send (rpc_client, &msg))
+    {
+        ERROR ("SEARCH: No response Path(%s)\n", path);
+        rpc_msg_reset (&msg);
+        rpc_client_release (rpc, rpc_client, false);
+        free (url);
+        return NULL;
+    }
+    while ((path = rpc_msg_decode_string (&msg)) != NULL)
+    {
+        DEBUG ("    = %s\n", path);
+        paths = g_list_prepend (paths, (gpointer) strdup (path));
+    }
+    rpc_msg_reset (&msg);
+    rpc_client_release (rpc, rpc_client, true);
+    free (url);
+
+    /* Result - in order */
+    return g_list_reverse (paths);
+}
+
 char *
 apteryx_search_simple (const char *path)
 {
@@ -1623,10 +2323,20 @@ apteryx_find_tree (GNode *root)
     return paths;
 }
 
+/* Path apteryxd knows the callback by - PID-REF-HASH(path)[-FLAGS] */
+static bool
+callback_guid (char *guid, const char *type, uint64_t ref, const char *path, uint32_t flags)
+{
+    if (flags & CB_FLAG_PRUNE)
+        return sprintf (guid, "%s/%zX-%"PRIX64"-%zX-%X", type, (size_t) getpid (), ref,
+                        (size_t) g_str_hash (path), CB_FLAG_PRUNE) > 0;
+    return sprintf (guid, "%s/%zX-%"PRIX64"-%zX", type, (size_t) getpid (), ref,
+                    (size_t) g_str_hash (path)) > 0;
+}
+
 bool
 add_callback (const char *type, const char *path, void *fn, bool value, void *data, uint32_t flags)
 {
-    size_t pid = getpid ();
     char _path[PATH_MAX];
     cb_t *cb;
 
@@ -1635,15 +2345,21 @@ add_callback (const char *type, const char *path, void *fn, bool value, void *da
     ASSERT (path, return false, "ADD_CB: Invalid path\n");
     ASSERT (fn, return false, "ADD_CB: Invalid callback\n");
 
-    pthread_mutex_lock (&lock);
     cb = calloc (1, sizeof (cb_t));
-    cb->ref = next_ref++;
     cb->path = strdup (path);
     cb->fn = fn;
     cb->value = value;
     cb->data = data;
     cb->flags = flags;
+    pthread_rwlock_wrlock (&cb_lock);
+    cb->ref = next_ref++;
+    if (!cb_table)
+        cb_table = g_hash_table_new (g_int64_hash, g_int64_equal);
+    g_hash_table_insert (cb_table, &cb->ref, cb);
     cb_list = g_list_prepend (cb_list, (void *) cb);
+    pthread_rwlock_unlock (&cb_lock);
+
+    pthread_mutex_lock (&lock);
     if (!bound)
     {
         char * uri = NULL;
@@ -1663,8 +2379,7 @@ add_callback (const char *type, const char *path, void *fn, bool value, void *da
     }
     pthread_mutex_unlock (&lock);
 
-    if (sprintf (_path, "%s/%zX-%"PRIX64"-%zX",
-            type, (size_t)pid, cb->ref, (size_t)g_str_hash (path)) <= 0)
+    if (!callback_guid (_path, type, cb->ref, path, flags))
         return false;
     if (!apteryx_set (_path, path))
         return false;
@@ -1673,7 +2388,7 @@ add_callback (const char *type, const char *path, void *fn, bool value, void *da
 }
 
 bool
-delete_callback (const char *type, const char *path, void *fn, void *data)
+delete_callback (const char *type, const char *path, void *fn, void *data, uint32_t flags)
 {
     char _path[PATH_MAX];
     uint64_t ref;
@@ -1685,25 +2400,26 @@ delete_callback (const char *type, const char *path, void *fn, void *data)
     ASSERT (path, return false, "DEL_CB: Invalid path\n");
     ASSERT (fn, return false, "DEL_CB: Invalid callback\n");
 
-    pthread_mutex_lock (&lock);
+    pthread_rwlock_wrlock (&cb_lock);
     for (iter = g_list_first (cb_list); iter; iter = g_list_next (iter))
     {
         cb = (cb_t *) iter->data;
-        if (cb->fn == fn && strcmp (cb->path, path) == 0 && cb->data == data)
+        if (cb->fn == fn && strcmp (cb->path, path) == 0 && cb->data == data &&
+            cb->flags == flags)
         {
+            g_hash_table_remove (cb_table, &cb->ref);
             cb_list = g_list_remove (cb_list, cb);
             break;
         }
         cb = NULL;
     }
-    pthread_mutex_unlock (&lock);
+    pthread_rwlock_unlock (&cb_lock);
     ASSERT (cb, return false, "CB: not found (%s)\n", path);
     ref = cb->ref;
     free ((void *) cb->path);
     free (cb);
 
-    if (sprintf (_path, "%s/%zX-%"PRIX64"-%zX",
-            type, (size_t)getpid (), ref, (size_t)g_str_hash (path)) <= 0)
+    if (!callback_guid (_path, type, ref, path, flags))
         return false;
     if (!apteryx_set (_path, NULL))
         return false;
@@ -1719,7 +2435,7 @@ apteryx_index (const char *path, apteryx_index_callback cb)
 bool
 apteryx_unindex (const char *path, apteryx_index_callback cb)
 {
-    return delete_callback (APTERYX_INDEXERS_PATH, path, (void *)cb, NULL);
+    return delete_callback (APTERYX_INDEXERS_PATH, path, (void *)cb, NULL, 0);
 }
 
 bool
@@ -1731,19 +2447,31 @@ apteryx_watch (const char *path, apteryx_watch_callback cb)
 bool
 apteryx_unwatch (const char *path, apteryx_watch_callback cb)
 {
-    return delete_callback (APTERYX_WATCHERS_PATH, path, (void *)cb, NULL);
+    return delete_callback (APTERYX_WATCHERS_PATH, path, (void *)cb, NULL, 0);
+}
+
+bool
+apteryx_watch_prune (const char *path, apteryx_watch_callback cb)
+{
+    return add_callback (APTERYX_WATCHERS_PATH, path, (void *)cb, true, NULL, CB_FLAG_PRUNE);
+}
+
+bool
+apteryx_unwatch_prune (const char *path, apteryx_watch_callback cb)
+{
+    return delete_callback (APTERYX_WATCHERS_PATH, path, (void *)cb, NULL, CB_FLAG_PRUNE);
 }
 
 bool
 apteryx_watch_tree (const char *path, apteryx_watch_tree_callback cb)
 {
-    return add_callback (APTERYX_WATCHERS_PATH, path, (void *)cb, true, NULL, 1);
+    return add_callback (APTERYX_WATCHERS_PATH, path, (void *)cb, true, NULL, CB_FLAG_TREE);
 }
 
 bool
 apteryx_unwatch_tree (const char *path, apteryx_watch_tree_callback cb)
 {
-    return delete_callback (APTERYX_WATCHERS_PATH, path, (void *)cb, NULL);
+    return delete_callback (APTERYX_WATCHERS_PATH, path, (void *)cb, NULL, CB_FLAG_TREE);
 }
 
 bool
@@ -1755,7 +2483,7 @@ apteryx_validate (const char *path, apteryx_validate_callback cb)
 bool
 apteryx_unvalidate (const char *path, apteryx_validate_callback cb)
 {
-    return delete_callback (APTERYX_VALIDATORS_PATH, path, (void *)cb, NULL);
+    return delete_callback (APTERYX_VALIDATORS_PATH, path, (void *)cb, NULL, 0);
 }
 
 bool
@@ -1767,7 +2495,7 @@ apteryx_refresh (const char *path, apteryx_refresh_callback cb)
 bool
 apteryx_unrefresh (const char *path, apteryx_refresh_callback cb)
 {
-    return delete_callback (APTERYX_REFRESHERS_PATH, path, (void *)cb, NULL);
+    return delete_callback (APTERYX_REFRESHERS_PATH, path, (void *)cb, NULL, 0);
 }
 
 bool
@@ -1779,7 +2507,7 @@ apteryx_provide (const char *path, apteryx_provide_callback cb)
 bool
 apteryx_unprovide (const char *path, apteryx_provide_callback cb)
 {
-    return delete_callback (APTERYX_PROVIDERS_PATH, path, (void *)cb, NULL);
+    return delete_callback (APTERYX_PROVIDERS_PATH, path, (void *)cb, NULL, 0);
 }
 
 bool
@@ -1805,7 +2533,7 @@ apteryx_unproxy (const char *path, const char *url)
     if (asprintf (&value, "%s:%s", url, path) <= 0)
         return false;
     res = delete_callback (APTERYX_PROXIES_PATH, value,
-            (void *)(size_t)g_str_hash (url), NULL);
+            (void *)(size_t)g_str_hash (url), NULL, 0);
     free (value);
     return res;
 }
@@ -1862,6 +2590,145 @@ apteryx_timestamp (const char *path)
     return value;
 }
 
+GHashTable *
+apteryx_timestamps (GList *paths)
+{
+    char *url = NULL;
+    char *purl = NULL;
+    rpc_client rpc_client;
+    rpc_message_t msg = {};
+    GHashTable *timestamps = NULL;
+    const char *path;
+    uint64_t *value;
+    GList *iter;
+
+    ASSERT ((ref_count > 0), return NULL, "TIMESTAMPS: Not initialised\n");
+    ASSERT (paths, return NULL, "TIMESTAMPS: Invalid parameters\n");
+
+    DEBUG ("TIMESTAMPS: %d paths\n", g_list_length (paths));
+
+    /* Check paths - every path must be on the same instance */
+    rpc_msg_encode_uint8 (&msg, MODE_TIMESTAMPS);
+    for (iter = paths; iter; iter = g_list_next (iter))
+    {
+        path = validate_path ((const char *) iter->data, &purl);
+        if (!path ||
+            ((path[strlen(path)-1] == '/') && strlen(path) > 1))
+        {
+            ERROR ("TIMESTAMPS: invalid path (%s)!\n", path);
+            assert (!apteryx_debug || path);
+            goto error;
+        }
+        if (!url)
+        {
+            url = purl;
+        }
+        else if (strcmp (url, purl) != 0)
+        {
+            ERROR ("TIMESTAMPS: Path(%s) is not on %s\n", path, url);
+            goto error;
+        }
+        else
+        {
+            free (purl);
+        }
+        purl = NULL;
+        rpc_msg_encode_string (&msg, path);
+    }
+
+    /* IPC */
+    rpc_client = rpc_client_connect (rpc, url);
+    if (!rpc_client)
+    {
+        ERROR ("TIMESTAMPS: Failed to connect to server: %s\n", strerror (errno));
+        goto error;
+    }
+    if (!rpc_msg_send (rpc_client, &msg))
+    {
+        ERROR ("TIMESTAMPS: No response\n");
+        rpc_client_release (rpc, rpc_client, false);
+        goto error;
+    }
+
+    /* One timestamp for each path in the order they were asked for */
+    timestamps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    for (iter = paths; iter; iter = g_list_next (iter))
+    {
+        value = g_new (uint64_t, 1);
+        *value = rpc_msg_decode_uint64 (&msg);
+        DEBUG ("  %s = %"PRIu64"\n", (const char *) iter->data, *value);
+        g_hash_table_replace (timestamps, g_strdup ((const char *) iter->data), value);
+    }
+    rpc_msg_reset (&msg);
+    rpc_client_release (rpc, rpc_client, true);
+    free (url);
+    return timestamps;
+
+error:
+    rpc_msg_reset (&msg);
+    free (purl);
+    free (url);
+    return NULL;
+}
+
+uint64_t
+apteryx_wait (const char *path, uint64_t since, uint64_t timeout_us)
+{
+    char *url = NULL;
+    uint64_t value = 0;
+    uint64_t now = get_time_us ();
+    uint64_t deadline = now + timeout_us;
+    rpc_client rpc_client;
+    rpc_message_t msg = {};
+
+    ASSERT ((ref_count > 0), return 0, "WAIT: Not initialised\n");
+    ASSERT (path, return 0, "WAIT: Invalid parameters\n");
+
+    DEBUG ("WAIT: %s since %"PRIu64" for %"PRIu64"us\n", path, since, timeout_us);
+
+    /* Check path */
+    path = validate_path (path, &url);
+    if (!path ||
+        ((path[strlen(path)-1] == '/') && strlen(path) > 1))
+    {
+        ERROR ("WAIT: invalid path (%s)!\n", path);
+        free (url);
+        assert (!apteryx_debug || path);
+        return 0;
+    }
+
+    /* Each request must be answered within the RPC timeout so long waits
+     * are made up of several shorter ones */
+    do
+    {
+        rpc_client = rpc_client_connect (rpc, url);
+        if (!rpc_client)
+        {
+            ERROR ("WAIT: Path(%s) Failed to connect to server: %s\n", path, strerror (errno));
+            break;
+        }
+        rpc_msg_encode_uint8 (&msg, MODE_WAIT);
+        rpc_msg_encode_string (&msg, path);
+        rpc_msg_encode_uint64 (&msg, since);
+        rpc_msg_encode_uint64 (&msg, MIN (deadline - now, RPC_CLIENT_TIMEOUT_US / 2));
+        if (!rpc_msg_send (rpc_client, &msg))
+        {
+            ERROR ("WAIT: No response Path(%s)\n", path);
+            rpc_msg_reset (&msg);
+            rpc_client_release (rpc, rpc_client, false);
+            break;
+        }
+        value = rpc_msg_decode_uint64 (&msg);
+        rpc_msg_reset (&msg);
+        rpc_client_release (rpc, rpc_client, true);
+        now = get_time_us ();
+    } while (value == 0 && now < deadline);
+    free (url);
+
+    DEBUG ("    = %"PRIu64"\n", value);
+    return value;
+}
+
 uint64_t
 apteryx_memuse (const char *path)
 {
@@ -1913,3 +2780,57 @@ apteryx_memuse (const char *path)
     DEBUG ("    = %"PRIu64"\n", value);
     return value;
 }
+
+bool
+apteryx_aggregate (const char *path, apteryx_aggregate_op op, int64_t *result)
+{
+    char *url = NULL;
+    rpc_client rpc_client;
+    rpc_message_t msg = {};
+    bool found;
+
+    ASSERT ((ref_count > 0), return false, "AGGREGATE: Not initialised\n");
+    ASSERT (path && result && op <= APTERYX_AGGREGATE_MAX, return false,
+            "AGGREGATE: Invalid parameters\n");
+
+    DEBUG ("AGGREGATE: %s (%d)\n", path, op);
+
+    /* Check path */
+    path = validate_path (path, &url);
+    if (!path ||
+        ((path[strlen(path)-1] == '/') && strlen(path) > 1))
+    {
+        ERROR ("AGGREGATE: invalid path (%s)!\n", path);
+        free (url);
+        assert (!apteryx_debug || path);
+        return false;
+    }
+
+    /* IPC */
+    rpc_client = rpc_client_connect (rpc, url);
+    if (!rpc_client)
+    {
+        ERROR ("AGGREGATE: Path(%s) Failed to connect to server: %s\n", path, strerror (errno));
+        free (url);
+        return false;
+    }
+    rpc_msg_encode_uint8 (&msg, MODE_AGGREGATE);
+    rpc_msg_encode_uint8 (&msg, op);
+    rpc_msg_encode_string (&msg, path);
+    if (!rpc_msg_send (rpc_client, &msg))
+    {
+        ERROR ("AGGREGATE: No response Path(%s)\n", path);
+        rpc_msg_reset (&msg);
+        rpc_client_release (rpc, rpc_client, false);
+        free (url);
+        return false;
+    }
+    found = rpc_msg_decode_uint8 (&msg);
+    *result = (int64_t) rpc_msg_decode_uint64 (&msg);
+    rpc_msg_reset (&msg);
+    rpc_client_release (rpc, rpc_client, true);
+    free (url);
+
+    DEBUG ("    = %"PRId64"%s\n", *result, found ? "" : " (none)");
+    return found;
+}
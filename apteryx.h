@@ -47,7 +47,7 @@
   /apteryx/sockets                         - List of sockets (urls) that apteryxd will accept connections on.
   /apteryx/sockets/-                       - Unique identifier based on HASH(url). Value is the url to listen on.
   /apteryx/watchers                        - List of watched paths and registered callbacks for those watches.
-  /apteryx/watchers/-                      - Unique identifier based on PID-CALLBACK-HASH(path). Value is the path.
+  /apteryx/watchers/-                      - Unique identifier based on PID-CALLBACK-HASH(path)[-FLAGS]. Value is the path.
   /apteryx/refreshers                      - List of refreshed paths and registered callbacks for those refreshers.
   /apteryx/refreshers/-                    - Unique identifier based on PID-CALLBACK-HASH(path). Value is the path.
   /apteryx/providers                       - List of provided paths and registered callbacks for providing gets to that path.
@@ -58,8 +58,12 @@
   /apteryx/indexers/-                      - Unique identifier based on PID-CALLBACK-HASH(path). Value is the path.
   /apteryx/proxies                         - List of proxied paths and remote url to proxy gets and sets to.
   /apteryx/proxies/-                       - Unique identifier based on PID-HASH(path)-HASH(url). Value is the full url for the path.
+  /apteryx/suppress                        - List of paths where sets that do not change anything are ignored.
+  /apteryx/suppress/-                      - Unique identifier. Value is the path prefix.
   /apteryx/counters                        - Formatted list of counters and values for Apteryx usage
   /apteryx/statistics                      - Statistics for callback usage
+  /apteryx/clients                         - Request statistics per client process
+  /apteryx/clients/-                       - Client PID. Value is requests,queued,in-flight,max-pending,rejected
  */
 #define APTERYX_PATH                             "/apteryx"
 #define APTERYX_DEBUG_PATH                       "/apteryx/debug"
@@ -73,8 +77,10 @@
 #define APTERYX_VALIDATORS_PATH                  "/apteryx/validators"
 #define APTERYX_INDEXERS_PATH                    "/apteryx/indexers"
 #define APTERYX_PROXIES_PATH                     "/apteryx/proxies"
+#define APTERYX_SUPPRESS_PATH                    "/apteryx/suppress"
 #define APTERYX_COUNTERS                         "/apteryx/counters"
 #define APTERYX_STATISTICS                       "/apteryx/statistics"
+#define APTERYX_CLIENTS                          "/apteryx/clients"
 
 /** Initialise this instance of the Apteryx library.
  * @param debug verbose debug to stdout
@@ -98,27 +104,46 @@ bool apteryx_shutdown_force (void);
 
 /**
  * Process callback requests in client thread context.
+ * Each call processes the callbacks queued so far (up to a batch of 64) and
+ * the returned fd is readable while more are waiting. There is no need to
+ * read from the fd.
  * Example:
     int fd = 0;
     struct pollfd pfd;
-    uint8_t dummy = 0;
     while (fd >= 0)
     {
         fd = apteryx_process (true);
         CU_ASSERT (fd >= 0);
         pfd.fd = fd;
         pfd.events = POLLIN;
-        poll (&pfd, 1, 0);
-        if (read (fd, &dummy, 1) == 0)
-        {
-            ERROR ("Poll/Read error: %s\n", strerror (errno));
-        }
+        poll (&pfd, 1, -1);
     }
  * @param poll enable polling and disable multi-threaded callbacks
  * @return fd for using select for detecting there is work to process
  */
 int apteryx_process (bool poll);
 
+/**
+ * Process callback requests in client thread context (enables polling).
+ * Stops after max_jobs callbacks or once max_us has elapsed, leaving the
+ * rest for the next call.
+ * @param max_jobs maximum callbacks to process (0 for all that are queued)
+ * @param max_us time budget in microseconds (0 for no limit)
+ * @return fd for using select for detecting there is work to process
+ */
+int apteryx_process_batch (int max_jobs, uint64_t max_us);
+
+/**
+ * Use multiple connections to each destination so that a large request
+ * from one thread does not hold up requests from other threads.
+ * Applies to this process only and may be called before apteryx_init.
+ * @param size number of connections per destination (1 to disable)
+ * @param least_inflight choose the connection with the fewest requests
+ *        in flight rather than round-robin
+ * @return true on success
+ */
+bool apteryx_connection_pool (int size, bool least_inflight);
+
 /**
  * Bind the Apteryx server to accepts connections on the specified URL.
  * Can be used to enable remote access to Apteryx (e.g. for proxy).
@@ -201,6 +226,26 @@ bool apteryx_set_int (const char *path, const char *key, int32_t value);
  * @return NULL if the path is invalid
  */
 char *apteryx_get (const char *path);
+
+/**
+ * Get a path/value from Apteryx only if it has changed since an earlier get.
+ * Values that are provided (or proxied) have no stored timestamp so are
+ * always returned.
+ * Example: Only parse the value when it changes
+    uint64_t ts = 0;
+    char *value = NULL;
+    if (apteryx_get_if_modified ("/system/hostname", &ts, &value))
+    {
+        update_hostname (value);
+        free (value);
+    }
+ * @param path path to the value to get
+ * @param ts timestamp from the previous call (0 for none), updated when changed
+ * @param value set to the value (NULL if none) when changed
+ * @return true if the value has changed and value has been set
+ * @return false if it has not changed (or the path is invalid)
+ */
+bool apteryx_get_if_modified (const char *path, uint64_t *ts, char **value);
 /** Helper to retrieve the value using an extended path based on the specified key */
 char *apteryx_get_string (const char *path, const char *key);
 char *apteryx_get_string_default (const char *path, const char *key, const char *deflt);
@@ -226,6 +271,37 @@ bool apteryx_has_value (const char *path);
  */
 uint64_t apteryx_timestamp (const char *path);
 
+/**
+ * Get the last change timestamps of several paths in one request
+ * All paths must be on the same instance (e.g. all local or all on the same
+ * remote url). Paths proxied from there are all requested before any reply
+ * is waited on.
+ * Example: Revalidate a cache and only update it if nothing has changed
+    GHashTable *timestamps = apteryx_timestamps (cached_paths);
+    ...
+    apteryx_cas_tree_full (root, timestamps, false);
+    g_hash_table_destroy (timestamps);
+ * @param paths list of paths to get the timestamps for
+ * @return table of path to (uint64_t *) timestamp (0 if the path doesn't exist),
+ *         suitable for apteryx_cas_tree_full. NULL on error.
+ */
+GHashTable *apteryx_timestamps (GList *paths);
+
+/**
+ * Wait for a path (or anything below it) to change
+ * Example: Follow changes to a subtree
+    uint64_t ts = apteryx_timestamp ("/interfaces");
+    while ((ts = apteryx_wait ("/interfaces", ts, 10 * 1000 * 1000)))
+        reload_interfaces ();
+ * @param path path to wait on
+ * @param since timestamp last seen for the path (from apteryx_timestamp or apteryx_wait)
+ * @param timeout_us how long to wait in microseconds (0 to just check)
+ * @return the new timestamp of the path once it differs from since
+ * @return UINT64_MAX if the path was removed
+ * @return 0 if the path did not change before the timeout
+ */
+uint64_t apteryx_wait (const char *path, uint64_t since, uint64_t timeout_us);
+
 /**
  * Get the memory usage in bytes of a given path
  * @param path path to get the memory usage for
@@ -233,6 +309,35 @@ uint64_t apteryx_timestamp (const char *path);
  */
 uint64_t apteryx_memuse (const char *path);
 
+/** Operations for apteryx_aggregate */
+typedef enum
+{
+    APTERYX_AGGREGATE_CHILDREN, /* Number of children of the path */
+    APTERYX_AGGREGATE_VALUES,   /* Number of values at or below the path */
+    APTERYX_AGGREGATE_EXISTS,   /* 1 if there is a value at or below the path */
+    APTERYX_AGGREGATE_SUM,      /* Sum of the numbers at paths matching the pattern */
+    APTERYX_AGGREGATE_MIN,      /* Smallest number at paths matching the pattern */
+    APTERYX_AGGREGATE_MAX,      /* Largest number at paths matching the pattern */
+} apteryx_aggregate_op;
+
+/**
+ * Count or combine values inside Apteryx and return just the result.
+ * Refreshers below the path (or the part of the pattern before the first '*')
+ * are called first. Only values stored in the database are included, so
+ * provided and indexed paths are never counted or combined.
+ * Example: Count the routes in the RIB and find the best metric
+    int64_t routes, metric;
+    apteryx_aggregate ("/routing/ipv4/rib", APTERYX_AGGREGATE_CHILDREN, &routes);
+    if (apteryx_aggregate ("/routing/ipv4/rib/\*\/metric", APTERYX_AGGREGATE_MIN, &metric))
+        printf ("%"PRId64" routes, best metric %"PRId64"\n", routes, metric);
+ * @param path path to count below, or for SUM/MIN/MAX a pattern where '*' matches any one node
+ * @param op the aggregate to calculate
+ * @param result the count or combined value
+ * @return true on success
+ * @return false if the path is invalid or (for SUM/MIN/MAX) no number matched
+ */
+bool apteryx_aggregate (const char *path, apteryx_aggregate_op op, int64_t *result);
+
 /**
  * Set a path/value in Apteryx, but only if the existing
  * value has not changed since the specified monotonic timestamp.
@@ -422,6 +527,50 @@ GList *apteryx_find (const char *path, const char *value);
  */
 #define apteryx_set_tree_wait(root) apteryx_set_tree_full((root), UINT64_MAX, true)
 
+/**
+ * Make the tree at the root of a N-ary tree match it exactly
+ * Paths that are set under the root path but not in the tree are
+ * deleted, and paths in the tree that differ from Apteryx are set.
+ * Only the changes are validated and reported to watchers. Provided,
+ * indexed and proxied paths are not supported.
+ * @param root pointer to the N-ary tree of nodes with the desired state
+ * @return the number of paths changed or -errno on failure
+ */
+int32_t apteryx_sync_tree (GNode *root);
+
+/** A set of changes to be made all at once */
+typedef struct apteryx_txn_s *apteryx_txn;
+
+/**
+ * Start a transaction
+ * Changes added to the transaction are all made, or none of them are,
+ * when it is committed. They are validated together and each watcher
+ * is notified once with all of the changes it is watching. Paths that are
+ * changed or checked must not be proxied (the commit fails with -ENOTSUP).
+ * example:
+ * - txn = apteryx_txn_begin ();
+ * - apteryx_txn_check (txn, "/interfaces/eth0/state", ts);
+ * - apteryx_txn_add (txn, "/interfaces/eth0/state", "up");
+ * - apteryx_txn_add (txn, "/interfaces/eth1/state", NULL);
+ * - apteryx_txn_commit (txn, false);
+ * @return the new transaction or NULL on failure
+ */
+apteryx_txn apteryx_txn_begin (void);
+/** Set path to value (NULL to delete) when the transaction is committed */
+bool apteryx_txn_add (apteryx_txn txn, const char *path, const char *value);
+/** Only commit if path has not changed since timestamp ts */
+bool apteryx_txn_check (apteryx_txn txn, const char *path, uint64_t ts);
+/**
+ * Commit and free a transaction
+ * @param txn the transaction
+ * @param wait_for_completion wait for watchers to be called
+ * @return true if all of the changes were made
+ * @return false (and errno set) if none were made
+ */
+bool apteryx_txn_commit (apteryx_txn txn, bool wait_for_completion);
+/** Free a transaction without making any changes */
+void apteryx_txn_abort (apteryx_txn txn);
+
 /**
  * Get a tree of multiple values from Apteryx.
  * @param path path to the root of the tree to return.
@@ -429,6 +578,31 @@ GList *apteryx_find (const char *path, const char *value);
  */
 GNode *apteryx_get_tree (const char *path);
 
+/**
+ * Get several trees from Apteryx in one request.
+ * Roots that are inside another root are only fetched (and refreshed) once.
+ * Example: Get everything "show interface" needs at once
+    GList *paths = g_list_append (NULL, "/interfaces/eth0");
+    paths = g_list_append (paths, "/vlans/10");
+    GNode *root = apteryx_get_trees (paths);
+    GNode *eth0 = apteryx_path_node (root, "/interfaces/eth0");
+ * @param paths list of paths to the roots of the trees to return
+ * @return N-ary tree from "/" holding every tree (NULL if they are all empty)
+ */
+GNode *apteryx_get_trees (GList *paths);
+
+/**
+ * Get a tree of multiple values from Apteryx only if something in it has
+ * changed since an earlier call. Refreshers are called first. Trees that
+ * contain provided, indexed or proxied paths are always returned.
+ * @param path path to the root of the tree to return.
+ * @param ts timestamp from the previous call (0 for none), updated when changed
+ * @param root set to the tree (NULL if empty) when changed
+ * @return true if the tree has changed and root has been set
+ * @return false if it has not changed (or the path is invalid)
+ */
+bool apteryx_get_tree_if_modified (const char *path, uint64_t *ts, GNode **root);
+
 /**
  * Get a tree of multiple values from Apteryx that match this tree below the root path given.
  * @param root pointer to the N-ary tree of nodes.
@@ -440,6 +614,44 @@ GNode *apteryx_get_tree (const char *path);
  */
 GNode *apteryx_query (GNode *root);
 
+/** Incremental result of a traverse or query (see apteryx_traverse_iter) */
+typedef struct apteryx_iter_s apteryx_iter;
+
+/**
+ * Get all values below a path one at a time. Apteryx streams the result
+ * in parts so very large trees can be processed without the whole result
+ * being held in memory.
+ * @param path path to the root of the tree to walk.
+ * @return iterator to pass to apteryx_iter_next, or NULL on failure.
+ * Example:
+    const char *path, *value;
+    apteryx_iter *iter = apteryx_traverse_iter ("/routing/ipv4/rib");
+    while (apteryx_iter_next (iter, &path, &value))
+        printf ("%s = %s\n", path, value);
+    apteryx_iter_free (iter);
+ */
+apteryx_iter *apteryx_traverse_iter (const char *path);
+
+/**
+ * Get the values matching a query tree one at a time (see apteryx_query).
+ * @param root pointer to the N-ary tree of nodes.
+ * @return iterator to pass to apteryx_iter_next, or NULL on failure.
+ */
+apteryx_iter *apteryx_query_iter (GNode *root);
+
+/**
+ * Get the next path and value from an iterator.
+ * @param iter iterator from apteryx_traverse_iter or apteryx_query_iter
+ * @param path returned full path (without any URL). Valid until the next call.
+ * @param value returned value. Valid until the next call.
+ * @return true if a path and value were returned
+ * @return false when there are no more results (or on error)
+ */
+bool apteryx_iter_next (apteryx_iter *iter, const char **path, const char **value);
+
+/** Finish with an iterator (need not have reached the end) */
+void apteryx_iter_free (apteryx_iter *iter);
+
 /**
  * Set a tree of multiple values in Apteryx, but only if
  * the existing value has not changed since the specified monotonic timestamp.
@@ -461,6 +673,21 @@ GNode *apteryx_query (GNode *root);
  */
 #define apteryx_cas_tree_wait(root, ts) apteryx_set_tree_full((root), (ts), true)
 
+/**
+ * Set a tree of multiple values in Apteryx, but only if none of the
+ * listed paths have changed since their own monotonic timestamps.
+ * All of the timestamps are checked together before anything is set,
+ * so a change to an unlisted path (e.g. a different row of a table)
+ * does not cause the set to fail.
+ * @param root pointer to the N-ary tree of nodes.
+ * @param timestamps table of path to (uint64_t *) timestamp to be compared to
+ *        the last change time of that path. Paths need not be in the tree.
+ * @param wait_for_completion wait for watches to be executed before returning
+ * @return true on a successful set.
+ * @return false on failure.
+ */
+bool apteryx_cas_tree_full (GNode *root, GHashTable *timestamps, bool wait_for_completion);
+
 /**
  * Search for all children that start with the root path.
  * Does not go further than one level down.
@@ -474,6 +701,27 @@ GNode *apteryx_query (GNode *root);
  */
 GList *apteryx_search (const char *root);
 
+/**
+ * Search for a page of the children of the root path, in a stable order.
+ * Keys are in natural order so numbers sort by value ("2" before "10").
+ * Resume from the last key of one page to get the next.
+ * example:
+    GList *page = apteryx_search_range ("/routing/ipv4/rib/", NULL, 50);
+    while (page)
+    {
+        char *after = g_strdup (strrchr (g_list_last (page)->data, '/') + 1);
+        show_routes (page);
+        g_list_free_full (page, free);
+        page = apteryx_search_range ("/routing/ipv4/rib/", after, 50);
+        g_free (after);
+    }
+ * @param root root path to search on
+ * @param after key to start after (NULL to start from the first)
+ * @param limit maximum number of paths to return (0 for all)
+ * @return GList of full paths
+ */
+GList *apteryx_search_range (const char *root, const char *after, size_t limit);
+
 /**
  * Search for all children that start with the root path.
  * Does not go further than one level down.
@@ -536,6 +784,22 @@ bool apteryx_watch (const char *path, apteryx_watch_callback cb);
 /** UnWatch for changes in the path */
 bool apteryx_unwatch (const char *path, apteryx_watch_callback cb);
 
+/**
+ * Watch for changes in the path, with one event for a pruned subtree
+ * The same as apteryx_watch, except that when apteryx_prune removes
+ * watched paths, cb is called once with the pruned path followed by
+ * "/\*" and a NULL value, instead of once for every path removed.
+ * The pruned path may be above the watched path.
+ * example:
+ * - apteryx_prune ("/firewall/rules") calls cb ("/firewall/rules/\*", NULL)
+ * @param path path to the value to be watched
+ * @param cb function to call when the value changes
+ * @return true on successful registration
+ */
+bool apteryx_watch_prune (const char *path, apteryx_watch_callback cb);
+/** UnWatch for changes in the path */
+bool apteryx_unwatch_prune (const char *path, apteryx_watch_callback cb);
+
 /**
  * Callback function to be called when a watched tree changes.
  * @param root pointer to the N-ary tree of nodes representing the changed data
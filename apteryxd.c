@@ -45,6 +45,24 @@ counters_t counters = {};
 /* Synchronise validation */
 static pthread_mutex_t validating;
 
+/* Helpers for walking very large trees in parallel. Trees are walked in
+ * parts of up to TRAVERSE_PART_NODES nodes or RPC_STREAM_CHUNK_SIZE bytes */
+#define TRAVERSE_PART_NODES 4096
+static int traverse_threads = 1;
+static GThreadPool *traverse_pool = NULL;
+
+/* Stop calling out once the client has given up on the request */
+static bool
+callback_expired (void)
+{
+    if (rpc_msg_expired ())
+    {
+        INC_COUNTER (counters.expired_callbacks);
+        return true;
+    }
+    return false;
+}
+
 /* This function returns true if indexers were called (list may still be NULL) */
 static bool
 index_get (const char *path, GList **result)
@@ -55,6 +73,10 @@ index_get (const char *path, GList **result)
     uint64_t start, duration;
     bool res;
 
+    /* Our own paths are indexed directly */
+    if (config_internal_index (path, result))
+        return true;
+
     /* Retrieve a list of providers for this path */
     indexers = config_get_indexers (path);
     if (!indexers)
@@ -70,6 +92,9 @@ index_get (const char *path, GList **result)
         rpc_client rpc_client;
         rpc_message_t msg = {};
 
+        if (callback_expired ())
+            break;
+
         /* Check for local provider */
         if (indexer->id == getpid ())
         {
@@ -159,6 +184,12 @@ validate_set (const char *path, const char *value)
         rpc_client rpc_client;
         rpc_message_t msg = {};
 
+        if (callback_expired ())
+        {
+            result = -ETIMEDOUT;
+            break;
+        }
+
         /* Check for local validator */
         if (validator->id == getpid ())
         {
@@ -337,11 +368,12 @@ send_watch_notification (cb_info_t *watcher, GList *paths, GList *values, int ac
     INC_COUNTER (watcher->count);
 }
 
+/* Notify watchers of changes, except for any already in skip */
 static void
-notify_watchers (GList *paths, GList *values, bool ack)
+_notify_watchers (GList *paths, GList *values, bool ack, GList *skip)
 {
     GList *common_watchers = NULL;
-    GList *used_watchers = NULL;
+    GList *used_watchers = g_list_copy (skip);
     gchar *cpath = NULL;
     GList *ipath;
     GList *ivalue;
@@ -359,6 +391,8 @@ notify_watchers (GList *paths, GList *values, bool ack)
             {
                 cb_info_t *watcher = iter->data;
 
+                if (g_list_find_custom (skip, watcher, (GCompareFunc) compare_watcher))
+                    continue;
                 if (watcher->id != getpid ())
                 {
                     send_watch_notification (watcher, paths, values, ack);
@@ -379,6 +413,10 @@ notify_watchers (GList *paths, GList *values, bool ack)
         gchar *value = ivalue ? (gchar *) ivalue->data : NULL;
         GList *watchers;
 
+        /* Our own paths are watched directly */
+        if (path)
+            config_internal_watch (path, (value && value[0] == '\0') ? NULL : value);
+
         if (path && (watchers = config_get_watchers (path)))
         {
             GList *iter;
@@ -413,6 +451,353 @@ notify_watchers (GList *paths, GList *values, bool ack)
     g_list_free_full (common_watchers, (GDestroyNotify) cb_release);
 }
 
+static void
+notify_watchers (GList *paths, GList *values, bool ack)
+{
+    _notify_watchers (paths, values, ack, NULL);
+}
+
+/* Notify watchers of changes, sending each watcher all of its
+ * changes in one go rather than one path at a time */
+static void
+notify_watchers_coalesced (GList *paths, GList *values, bool ack)
+{
+    GHashTable *batches = g_hash_table_new (NULL, NULL);
+    GList *order = NULL;
+    GList *ipath, *ivalue, *iter;
+
+    for (ipath = paths, ivalue = values; ipath && ivalue;
+         ipath = ipath->next, ivalue = ivalue->next)
+    {
+        const char *path = (const char *) ipath->data;
+        const char *value = (const char *) ivalue->data;
+        GList *watchers;
+
+        /* Our own paths are watched directly */
+        config_internal_watch (path, (value && value[0] == '\0') ? NULL : value);
+
+        watchers = config_get_watchers (path);
+        for (iter = watchers; iter; iter = iter->next)
+        {
+            cb_info_t *watcher = iter->data;
+            GList **batch;
+
+            if (watcher->id == getpid ())
+            {
+                apteryx_watch_callback cb = (apteryx_watch_callback) (long) watcher->ref;
+                cb (path, (value && value[0] == '\0') ? NULL : value);
+                continue;
+            }
+            batch = g_hash_table_lookup (batches, watcher);
+            if (!batch)
+            {
+                batch = g_malloc0 (2 * sizeof (GList *));
+                cb_take (watcher);
+                g_hash_table_insert (batches, watcher, batch);
+                order = g_list_prepend (order, watcher);
+            }
+            batch[0] = g_list_prepend (batch[0], (gpointer) path);
+            batch[1] = g_list_prepend (batch[1], (gpointer) value);
+        }
+        g_list_free_full (watchers, (GDestroyNotify) cb_release);
+    }
+
+    order = g_list_reverse (order);
+    for (iter = order; iter; iter = iter->next)
+    {
+        cb_info_t *watcher = iter->data;
+        GList **batch = g_hash_table_lookup (batches, watcher);
+
+        batch[0] = g_list_reverse (batch[0]);
+        batch[1] = g_list_reverse (batch[1]);
+        send_watch_notification (watcher, batch[0], batch[1], ack);
+        g_list_free (batch[0]);
+        g_list_free (batch[1]);
+        g_free (batch);
+        cb_release (watcher);
+    }
+    g_list_free (order);
+    g_hash_table_destroy (batches);
+}
+
+/* The watchers of a pruned path or anything below it that asked for a
+ * single event for the whole subtree rather than one for each path removed */
+static GList *
+prune_watchers (const char *path)
+{
+    GList *pruners = NULL;
+    GList *watchers, *iter;
+
+    if (!config_has_prune_watchers ())
+        return NULL;
+    watchers = config_get_tree_watchers (path, CB_FLAG_PRUNE);
+    for (iter = watchers; iter; iter = g_list_next (iter))
+    {
+        cb_info_t *watcher = iter->data;
+        if (g_list_find_custom (pruners, watcher, (GCompareFunc) compare_watcher))
+        {
+            cb_release (watcher);
+            continue;
+        }
+        pruners = g_list_prepend (pruners, watcher);
+    }
+    g_list_free (watchers);
+    return pruners;
+}
+
+/* Notify watchers of a prune */
+static void
+notify_prune (const char *path, GList *paths, GList *pruners)
+{
+    GList *iter;
+
+    if (pruners)
+    {
+        size_t length = strlen (path);
+        char *event;
+        GList *events;
+
+        if (length && path[length - 1] == '/')
+            length--;
+        event = g_strdup_printf ("%.*s/*", (int) length, path);
+        events = g_list_append (NULL, event);
+        for (iter = pruners; iter; iter = g_list_next (iter))
+        {
+            DEBUG ("PRUNE: %s to watcher %s\n", event, ((cb_info_t *) iter->data)->path);
+            send_watch_notification (iter->data, events, NULL, false);
+        }
+        g_list_free_full (events, g_free);
+    }
+    _notify_watchers (paths, NULL, false, pruners);
+}
+
+/* Clients blocked in apteryx_wait. A waiter keeps its request rather than
+ * a worker thread and is answered once the path changes or it times out */
+typedef struct waiter_s
+{
+    rpc_deferred deferred;
+    rpc_message msg;
+    char *path;
+    uint64_t since;
+    uint64_t until;
+    uint64_t value;
+} waiter_t;
+
+/* The waiters on one path */
+typedef struct wait_queue_s
+{
+    GList *waiters;
+} wait_queue_t;
+static pthread_mutex_t wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wait_cond = PTHREAD_COND_INITIALIZER;
+static GHashTable *wait_queues = NULL;
+/* Every waiter in the order they time out */
+static GList *wait_timers = NULL;
+static pthread_t wait_thread;
+static bool wait_running = false;
+/* Proxied waits block on the other instance so get threads of their own */
+static GThreadPool *wait_pool = NULL;
+static int waiting = 0;
+
+/* The timestamp reported to waiters - UINT64_MAX once the path is gone */
+static uint64_t
+wait_timestamp (const char *path, uint64_t since)
+{
+    uint64_t value = db_timestamp (path);
+    if (value == 0 && since != 0)
+        value = UINT64_MAX;
+    return value;
+}
+
+static gint
+waiter_compare (gconstpointer a, gconstpointer b)
+{
+    const waiter_t *wa = (const waiter_t *) a;
+    const waiter_t *wb = (const waiter_t *) b;
+    return wa->until < wb->until ? -1 : wa->until > wb->until;
+}
+
+/* Keep the request being handled so it can be answered later */
+static waiter_t *
+waiter_new (rpc_message msg, const char *path, uint64_t since, uint64_t timeout)
+{
+    waiter_t *waiter = g_malloc0 (sizeof (waiter_t));
+    waiter->deferred = rpc_msg_defer ();
+    waiter->msg = msg;
+    waiter->path = g_strdup (path);
+    waiter->since = since;
+    waiter->until = get_time_us () + timeout;
+    return waiter;
+}
+
+/* Send the waiter its result and forget it */
+static void
+waiter_respond (waiter_t *waiter)
+{
+    DEBUG ("WAIT: %s = %"PRIu64"\n", waiter->path, waiter->value);
+    rpc_msg_reset (waiter->msg);
+    rpc_msg_encode_uint64 (waiter->msg, waiter->value);
+    rpc_deferred_respond (waiter->deferred);
+    g_free (waiter->path);
+    g_free (waiter);
+}
+
+/* Queue a waiter on its path and start its timer. Needs wait_lock and the
+ * waiter already counted in waiting */
+static void
+waiter_add (waiter_t *waiter)
+{
+    wait_queue_t *queue = g_hash_table_lookup (wait_queues, waiter->path);
+
+    if (!queue)
+    {
+        queue = g_malloc0 (sizeof (wait_queue_t));
+        g_hash_table_insert (wait_queues, g_strdup (waiter->path), queue);
+    }
+    queue->waiters = g_list_append (queue->waiters, waiter);
+    wait_timers = g_list_insert_sorted (wait_timers, waiter, waiter_compare);
+    if (wait_timers->data == waiter)
+        pthread_cond_signal (&wait_cond);
+}
+
+/* Take a waiter off its queue and the timers. Needs wait_lock */
+static void
+waiter_remove (waiter_t *waiter)
+{
+    wait_queue_t *queue = g_hash_table_lookup (wait_queues, waiter->path);
+
+    queue->waiters = g_list_remove (queue->waiters, waiter);
+    if (!queue->waiters)
+        g_hash_table_remove (wait_queues, waiter->path);
+    wait_timers = g_list_remove (wait_timers, waiter);
+    g_atomic_int_add (&waiting, -1);
+}
+
+/* Collect the waiters on key whose path has changed. Needs wait_lock */
+static void
+_wake_queue (const char *key, GList **done)
+{
+    wait_queue_t *queue = g_hash_table_lookup (wait_queues, key);
+    GList *iter, *next;
+
+    for (iter = queue ? queue->waiters : NULL; iter; iter = next)
+    {
+        waiter_t *waiter = (waiter_t *) iter->data;
+        next = g_list_next (iter);
+        waiter->value = wait_timestamp (waiter->path, waiter->since);
+        if (waiter->value != waiter->since)
+        {
+            waiter_remove (waiter);
+            *done = g_list_prepend (*done, waiter);
+        }
+    }
+}
+
+/* Wake anyone waiting on the path or one of its ancestors */
+static void
+_wake_waiters (const char *path, GList **done)
+{
+    char *prefix = g_strdup (path);
+    char *end;
+
+    while (true)
+    {
+        _wake_queue (prefix, done);
+        end = strrchr (prefix, '/');
+        if (!end || (end == prefix && prefix[1] == '\0'))
+            break;
+        end[end == prefix ? 1 : 0] = '\0';
+    }
+    g_free (prefix);
+}
+
+static void
+wake_waiters (GList *paths)
+{
+    GList *done = NULL;
+    GList *iter;
+
+    if (!g_atomic_int_get (&waiting))
+        return;
+    pthread_mutex_lock (&wait_lock);
+    for (iter = paths; iter; iter = g_list_next (iter))
+    {
+        if (iter->data)
+            _wake_waiters ((const char *) iter->data, &done);
+    }
+    pthread_mutex_unlock (&wait_lock);
+
+    /* Answer them without holding the lock */
+    g_list_free_full (done, (GDestroyNotify) waiter_respond);
+}
+
+/* A prune also changes everything that was below the path */
+static void
+wake_waiters_prune (const char *path)
+{
+    size_t length = strlen (path);
+    GHashTableIter iter;
+    const char *key;
+    GList *keys = NULL;
+    GList *done = NULL;
+    GList *kiter;
+
+    if (!g_atomic_int_get (&waiting))
+        return;
+    pthread_mutex_lock (&wait_lock);
+    _wake_waiters (path, &done);
+    if (length && path[length - 1] == '/')
+        length--;
+    g_hash_table_iter_init (&iter, wait_queues);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &key, NULL))
+    {
+        if (strncmp (key, path, length) == 0 && key[length] == '/')
+            keys = g_list_prepend (keys, g_strdup (key));
+    }
+    for (kiter = keys; kiter; kiter = g_list_next (kiter))
+        _wake_queue ((const char *) kiter->data, &done);
+    pthread_mutex_unlock (&wait_lock);
+    g_list_free_full (keys, g_free);
+
+    /* Answer them without holding the lock */
+    g_list_free_full (done, (GDestroyNotify) waiter_respond);
+}
+
+/* Answer waiters that have run out of time */
+static void *
+wait_timer (void *data)
+{
+    struct timespec until;
+    waiter_t *waiter;
+
+    pthread_mutex_lock (&wait_lock);
+    while (wait_running)
+    {
+        waiter = wait_timers ? (waiter_t *) wait_timers->data : NULL;
+        if (!waiter)
+        {
+            pthread_cond_wait (&wait_cond, &wait_lock);
+            continue;
+        }
+        if (waiter->until > get_time_us ())
+        {
+            until.tv_sec = waiter->until / (1000UL * 1000UL);
+            until.tv_nsec = (waiter->until % (1000UL * 1000UL)) * 1000UL;
+            pthread_cond_timedwait (&wait_cond, &wait_lock, &until);
+            continue;
+        }
+        waiter->value = wait_timestamp (waiter->path, waiter->since);
+        if (waiter->value == waiter->since)
+            waiter->value = 0;
+        waiter_remove (waiter);
+        pthread_mutex_unlock (&wait_lock);
+        waiter_respond (waiter);
+        pthread_mutex_lock (&wait_lock);
+    }
+    pthread_mutex_unlock (&wait_lock);
+    return NULL;
+}
+
 static uint64_t
 calculate_timestamp (void)
 {
@@ -455,6 +840,9 @@ call_refreshers (const char *path)
         uint64_t start, duration;
         bool res;
 
+        if (callback_expired ())
+            break;
+
         if (pthread_mutex_trylock (&refresher->lock))
         {
             /* If this refresher was being called when we came in, take the lock once
@@ -544,6 +932,10 @@ provide_get (const char *path)
     char *value = NULL;
     GList *iter = NULL;
 
+    /* Our own paths are provided directly */
+    if (config_internal_provide (path, &value))
+        return value;
+
     /* Retrieve a list of providers for this path */
     providers = config_get_providers (path);
     if (!providers)
@@ -558,6 +950,9 @@ provide_get (const char *path)
         uint64_t start, duration;
         bool res;
 
+        if (callback_expired ())
+            break;
+
         /* Check for local provider */
         if (provider->id == getpid ())
         {
@@ -621,14 +1016,12 @@ provide_get (const char *path)
 }
 
 static void*
-find_proxy (const char **path, cb_info_t **proxy_pt)
+find_proxy (const char **path, char **uri)
 {
-    rpc_client rpc_client;
+    rpc_client rpc_client = NULL;
     GList *proxies = NULL;
     GList *iter = NULL;
 
-    *proxy_pt = NULL;
-
     /* Retrieve a list of proxies for this path */
     proxies = config_get_proxies (*path);
     if (!proxies)
@@ -659,67 +1052,23 @@ find_proxy (const char **path, cb_info_t **proxy_pt)
             len -= 1;
         *path = *path  + len;
         DEBUG ("PROXY CB \"%s\" to \"%s\"\n", *path, proxy->uri);
-        *proxy_pt = proxy;
+        if (uri)
+            *uri = g_strdup (proxy->uri);
         break;
     }
     g_list_free_full (proxies, (GDestroyNotify) cb_release);
     return rpc_client;
 }
 
-static int32_t
-proxy_set (const char *path, const char *value, uint64_t ts)
-{
-    rpc_client rpc_client;
-    rpc_message_t msg = {};
-    int32_t result = 1;
-    cb_info_t *proxy = NULL;
-
-    /* Find and connect to a proxied instance */
-    rpc_client = find_proxy (&path, &proxy);
-    if (!rpc_client)
-    {
-        /* A positive value is interpreted as proxy not found */
-        return 1;
-    }
-
-    /* Do remote set */
-    rpc_msg_encode_uint8 (&msg, MODE_SET);
-    rpc_msg_encode_uint64 (&msg, ts);
-    rpc_msg_encode_string (&msg, path);
-    if (value)
-        rpc_msg_encode_string (&msg, value);
-    else
-        rpc_msg_encode_string (&msg, "");
-    if (!rpc_msg_send (rpc_client, &msg))
-    {
-        ERROR ("PROXY SET: No response\n");
-        rpc_msg_reset (&msg);
-        rpc_client_release (rpc, rpc_client, false);
-    }
-    else
-    {
-        result = rpc_msg_decode_uint64 (&msg);
-        rpc_msg_reset (&msg);
-        if (result < 0)
-        {
-            DEBUG ("PROXY SET: Error response: %s\n", strerror (-result));
-            errno = result;
-        }
-        rpc_client_release (rpc, rpc_client, true);
-    }
-    return result;
-}
-
 static char *
 proxy_get (const char *path)
 {
     rpc_client rpc_client;
     rpc_message_t msg = {};
-    cb_info_t *proxy = NULL;
     char *value = NULL;
 
     /* Find and connect to a proxied instance */
-    rpc_client = find_proxy (&path, &proxy);
+    rpc_client = find_proxy (&path, NULL);
     if (!rpc_client)
         return NULL;
 
@@ -730,11 +1079,11 @@ proxy_get (const char *path)
     {
         INC_COUNTER (counters.proxied_timeout);
         ERROR ("No response from proxy for path \"%s\"\n", (char *)path);
-        rpc_client_release (rpc, rpc_client, false);
+        rpc_client_release (proxy_rpc, rpc_client, false);
     }
     else
     {
-        rpc_client_release (rpc, rpc_client, true);
+        rpc_client_release (proxy_rpc, rpc_client, true);
         value = rpc_msg_decode_string (&msg);
         if (value)
             value = strdup (value);
@@ -751,10 +1100,9 @@ proxy_search (const char *path)
     rpc_message_t msg = {};
     GList *paths = NULL;
     const char *in_path = path;
-    cb_info_t *proxy = NULL;
 
     /* Find and connect to a proxied instance */
-    rpc_client = find_proxy (&path, &proxy);
+    rpc_client = find_proxy (&path, NULL);
     if (!rpc_client)
         return NULL;
 
@@ -765,7 +1113,7 @@ proxy_search (const char *path)
     {
         INC_COUNTER (counters.proxied_timeout);
         ERROR ("No response from proxy for path \"%s\"\n", (char *)path);
-        rpc_client_release (rpc, rpc_client, false);
+        rpc_client_release (proxy_rpc, rpc_client, false);
     }
     else
     {
@@ -779,72 +1127,22 @@ proxy_search (const char *path)
             paths = g_list_prepend (paths, (gpointer) tmp);
         }
         g_free (local_path);
-        rpc_client_release (rpc, rpc_client, true);
+        rpc_client_release (proxy_rpc, rpc_client, true);
     }
     rpc_msg_reset (&msg);
 
     return paths;
 }
 
-static bool
-proxy_traverse (GList **paths, GList **values, const char *path)
-{
-    rpc_client rpc_client;
-    rpc_message_t msg = {};
-    const char *in_path = path;
-    int slen;
-    char *value;
-
-    cb_info_t *proxy = NULL;
-
-    /* Find and connect to a proxied instance */
-    rpc_client = find_proxy (&path, &proxy);
-    if (!rpc_client)
-        return false;
-    slen = strlen (path);
-
-    /* Do remote traverse */
-    rpc_msg_encode_uint8 (&msg, MODE_TRAVERSE);
-    rpc_msg_encode_string (&msg, path);
-    if (!rpc_msg_send (rpc_client, &msg))
-    {
-        INC_COUNTER (counters.proxied_timeout);
-        ERROR ("No response from proxy for path \"%s\"\n", (char *)path);
-        rpc_msg_reset (&msg);
-        rpc_client_release (rpc, rpc_client, false);
-        return false;
-    }
-    path = rpc_msg_decode_string (&msg);
-    if (path)
-    {
-        while (path)
-        {
-            value = rpc_msg_decode_string (&msg);
-            *paths = g_list_prepend (*paths, (gpointer) g_strconcat (in_path, path + slen, NULL));
-            *values = g_list_prepend (*values, (gpointer) g_strdup (value));
-            path = rpc_msg_decode_string (&msg);
-        }
-    }
-    else
-    {
-        DEBUG ("(P)  = (null)\n");
-    }
-    rpc_msg_reset (&msg);
-    rpc_client_release (rpc, rpc_client, true);
-
-    return true;
-}
-
 static int32_t
 proxy_prune (const char *path)
 {
     rpc_client rpc_client;
     rpc_message_t msg = {};
-    cb_info_t *proxy = NULL;
     int32_t result = 0;
 
     /* Find and connect to a proxied instance */
-    rpc_client = find_proxy (&path, &proxy);
+    rpc_client = find_proxy (&path, NULL);
     if (!rpc_client)
         return 1;
 
@@ -855,7 +1153,7 @@ proxy_prune (const char *path)
     {
         ERROR ("PROXY PRUNE: No response\n");
         rpc_msg_reset (&msg);
-        rpc_client_release (rpc, rpc_client, false);
+        rpc_client_release (proxy_rpc, rpc_client, false);
         return -ETIMEDOUT;
     }
     result = rpc_msg_decode_uint64 (&msg);
@@ -864,58 +1162,402 @@ proxy_prune (const char *path)
     {
         DEBUG ("PROXY PRUNE: Error response: %s\n", strerror (-result));
     }
-    rpc_client_release (rpc, rpc_client, true);
+    rpc_client_release (proxy_rpc, rpc_client, true);
     return result;
 }
 
-static uint64_t
-proxy_timestamp (const char *path)
+/* A proxied request in flight. Requests to several proxies (or several
+ * requests to one) are all sent before waiting for any of the results */
+typedef struct proxy_call_s
 {
-    rpc_client rpc_client;
-    rpc_message_t msg = {};
-    uint64_t value = 0;
-    cb_info_t *proxy = NULL;
-
-    /* Find and connect to a proxied instance */
-    rpc_client = find_proxy (&path, &proxy);
-    if (!rpc_client)
-        return 0;
+    const char *path;       /* Local path */
+    const char *remote;     /* Path on the proxied instance */
+    char *uri;
+    rpc_client client;
+    rpc_id id;
+    rpc_message_t msg;
+    bool more;
+} proxy_call_t;
+
+/* Find the proxy for a path. Returns false if it is not proxied */
+static bool
+proxy_call_connect (proxy_call_t *call, const char *path)
+{
+    memset (call, 0, sizeof (*call));
+    call->path = call->remote = path;
+    call->client = find_proxy (&call->remote, &call->uri);
+    return call->client != NULL;
+}
 
-    /* Do remote timestamp */
-    rpc_msg_encode_uint8 (&msg, MODE_TIMESTAMP);
-    rpc_msg_encode_string (&msg, path);
-    if (!rpc_msg_send (rpc_client, &msg))
+/* Send the request encoded in call->msg without waiting for the result */
+static void
+proxy_call_send (proxy_call_t *call)
+{
+    call->id = rpc_msg_send_stream (call->client, &call->msg);
+    call->more = true;
+    if (!call->id)
     {
         INC_COUNTER (counters.proxied_timeout);
-        ERROR ("No response from proxy for path \"%s\"\n", (char *)path);
-        rpc_client_release (rpc, rpc_client, false);
-        return value;
+        ERROR ("No response from proxy for path \"%s\"\n", call->path);
+        rpc_client_release (proxy_rpc, call->client, false);
+        call->client = NULL;
     }
-    value = rpc_msg_decode_uint64 (&msg);
-    rpc_msg_reset (&msg);
-    rpc_client_release (rpc, rpc_client, true);
-    return value;
 }
 
+/* Wait for the next part of the result (false once there is no more) */
 static bool
-handle_set (rpc_message msg, bool ack)
+proxy_call_recv (proxy_call_t *call)
 {
-    int result = 0;
-    uint64_t ts = 0;
-    GList *paths = NULL;
-    GList *ipath;
-    const char *path;
-    GList *values = NULL;
-    GList *ivalue;
-    const char *value;
-    int proxy_result = 0;
-    int validation_result = 0;
-    int validation_lock = 0;
-    bool db_result = false;
-    GList *next;
-
-    /* Parse the parameters */
-    ts = rpc_msg_decode_uint64 (msg);
+    rpc_msg_reset (&call->msg);
+    if (!call->client || !call->more)
+        return false;
+    if (!rpc_msg_recv_stream (call->client, call->id, &call->msg, &call->more))
+    {
+        INC_COUNTER (counters.proxied_timeout);
+        ERROR ("No response from proxy for path \"%s\"\n", call->path);
+        rpc_client_release (proxy_rpc, call->client, false);
+        call->client = NULL;
+        return false;
+    }
+    if (!call->more)
+    {
+        rpc_client_release (proxy_rpc, call->client, true);
+        call->client = NULL;
+    }
+    return true;
+}
+
+static void
+proxy_call_free (proxy_call_t *call)
+{
+    rpc_msg_reset (&call->msg);
+    if (call->client)
+    {
+        /* Stop the proxied instance sending whatever is left */
+        if (call->more)
+            rpc_msg_cancel_stream (call->client, call->id);
+        rpc_client_release (proxy_rpc, call->client, true);
+    }
+    g_free (call->uri);
+    g_free (call);
+}
+
+/* Find the proxy for a path and encode the mode of a request to it.
+ * Returns NULL if the path is not proxied */
+static proxy_call_t *
+proxy_call_new (APTERYX_MODE mode, const char *path)
+{
+    proxy_call_t *call = g_malloc (sizeof (*call));
+
+    if (!proxy_call_connect (call, path))
+    {
+        g_free (call);
+        return NULL;
+    }
+    rpc_msg_encode_uint8 (&call->msg, mode);
+    return call;
+}
+
+/* Send the rest of a request from proxy_call_new (NULL if it failed) */
+static proxy_call_t *
+proxy_call_begin (proxy_call_t *call)
+{
+    proxy_call_send (call);
+    if (!call->client)
+    {
+        proxy_call_free (call);
+        return NULL;
+    }
+    return call;
+}
+
+/* Start a get/search/traverse/timestamp of a proxied path */
+static proxy_call_t *
+proxy_call_start (APTERYX_MODE mode, const char *path)
+{
+    proxy_call_t *call = proxy_call_new (mode, path);
+
+    if (!call)
+        return NULL;
+    rpc_msg_encode_string (&call->msg, call->remote);
+    return proxy_call_begin (call);
+}
+
+/* Local path for a path returned by the proxied instance */
+static char *
+proxy_call_local (proxy_call_t *call, const char *remote)
+{
+    return g_strdup_printf ("%.*s%s", (int) (call->remote - call->path), call->path, remote);
+}
+
+/* Value returned by a proxied get (NULL if none) */
+static char *
+proxy_call_value (proxy_call_t *call)
+{
+    char *value = NULL;
+
+    if (proxy_call_recv (call))
+    {
+        value = rpc_msg_decode_string (&call->msg);
+        if (value)
+            value = g_strdup (value);
+    }
+    proxy_call_free (call);
+    return value;
+}
+
+/* Timestamp returned by a proxied timestamp (0 if none) */
+static uint64_t
+proxy_call_timestamp (proxy_call_t *call)
+{
+    uint64_t value = 0;
+
+    if (proxy_call_recv (call))
+        value = rpc_msg_decode_uint64 (&call->msg);
+    proxy_call_free (call);
+    return value;
+}
+
+/* Encode the results of a proxied traverse as each part arrives */
+static void
+proxy_call_encode (proxy_call_t *call, rpc_message msg)
+{
+    const char *path;
+    const char *value;
+
+    while (proxy_call_recv (call))
+    {
+        while ((path = rpc_msg_decode_string (&call->msg)) != NULL)
+        {
+            char *local = proxy_call_local (call, path);
+            value = rpc_msg_decode_string (&call->msg);
+            DEBUG ("  %s = %s\n", local, value);
+            rpc_msg_encode_string (msg, local);
+            rpc_msg_encode_string (msg, value ?: "");
+            rpc_msg_stream (msg);
+            g_free (local);
+        }
+
+        /* Nobody is waiting for the rest */
+        if (rpc_msg_expired ())
+            break;
+    }
+    proxy_call_free (call);
+}
+
+/* Wait on the proxied instance. Returns false if the path is not proxied */
+static bool
+proxy_wait (const char *path, uint64_t since, uint64_t timeout, uint64_t *value)
+{
+    proxy_call_t *call = proxy_call_new (MODE_WAIT, path);
+
+    if (!call)
+        return false;
+
+    /* Do remote wait */
+    rpc_msg_encode_string (&call->msg, call->remote);
+    rpc_msg_encode_uint64 (&call->msg, since);
+    rpc_msg_encode_uint64 (&call->msg, timeout);
+    call = proxy_call_begin (call);
+    *value = call ? proxy_call_timestamp (call) : 0;
+    return true;
+}
+
+/* Aggregate on the proxied instance. Returns false if the path is not proxied */
+static bool
+proxy_aggregate (const char *path, uint8_t op, bool *found, int64_t *result)
+{
+    proxy_call_t *call = proxy_call_new (MODE_AGGREGATE, path);
+
+    if (!call)
+        return false;
+
+    /* Do remote aggregate */
+    *found = false;
+    *result = 0;
+    rpc_msg_encode_uint8 (&call->msg, op);
+    rpc_msg_encode_string (&call->msg, call->remote);
+    call = proxy_call_begin (call);
+    if (call && proxy_call_recv (call))
+    {
+        *found = rpc_msg_decode_uint8 (&call->msg);
+        *result = (int64_t) rpc_msg_decode_uint64 (&call->msg);
+    }
+    if (call)
+        proxy_call_free (call);
+    return true;
+}
+
+/* A batch of sets for one proxied instance */
+typedef struct proxy_set_s
+{
+    proxy_call_t call;
+    GList *paths;
+    GList *values;
+} proxy_set_t;
+
+/* Send the proxied paths of a set to their instances, one batch per instance,
+ * and remove them from paths/values. Watchers are notified for each batch
+ * that succeeds. Returns 0 on success or a negative error */
+static int32_t
+proxy_set (GList **paths, GList **values, uint64_t ts, bool ack)
+{
+    GList *batches = NULL, *iter, *ipath, *ivalue, *next;
+    int32_t result = 0;
+
+    ipath = *paths;
+    ivalue = *values;
+    while (ipath && ivalue)
+    {
+        const char *path = (const char *) ipath->data;
+        const char *value = (const char *) ivalue->data;
+        proxy_set_t *batch = NULL;
+        proxy_call_t call;
+
+        if (!proxy_call_connect (&call, path))
+        {
+            ipath = g_list_next (ipath);
+            ivalue = g_list_next (ivalue);
+            continue;
+        }
+
+        /* Add to the batch for this instance */
+        for (iter = batches; iter; iter = iter->next)
+        {
+            proxy_set_t *b = (proxy_set_t *) iter->data;
+            if (g_strcmp0 (b->call.uri, call.uri) == 0)
+            {
+                batch = b;
+                break;
+            }
+        }
+        if (batch)
+        {
+            rpc_client_release (proxy_rpc, call.client, true);
+            g_free (call.uri);
+        }
+        else
+        {
+            batch = g_malloc0 (sizeof (*batch));
+            batch->call = call;
+            rpc_msg_encode_uint8 (&batch->call.msg, MODE_SET);
+            rpc_msg_encode_uint64 (&batch->call.msg, ts);
+            batches = g_list_append (batches, batch);
+        }
+        rpc_msg_encode_string (&batch->call.msg, call.remote);
+        rpc_msg_encode_string (&batch->call.msg, value ? value : "");
+        if (value && value[0] == '\0')
+            value = NULL;
+        batch->paths = g_list_append (batch->paths, (gpointer) path);
+        batch->values = g_list_append (batch->values, (gpointer) value);
+
+        /* No more processing required locally */
+        next = g_list_next (ipath);
+        *paths = g_list_delete_link (*paths, ipath);
+        ipath = next;
+        next = g_list_next (ivalue);
+        *values = g_list_delete_link (*values, ivalue);
+        ivalue = next;
+    }
+
+    /* Send all the batches before waiting for any of them */
+    for (iter = batches; iter; iter = iter->next)
+        proxy_call_send (&((proxy_set_t *) iter->data)->call);
+
+    for (iter = batches; iter; iter = iter->next)
+    {
+        proxy_set_t *batch = (proxy_set_t *) iter->data;
+        int32_t res = -ETIMEDOUT;
+
+        if (proxy_call_recv (&batch->call))
+            res = (int32_t) rpc_msg_decode_uint64 (&batch->call.msg);
+        if (res == 0)
+        {
+            DEBUG ("SET: %d paths proxied to %s\n", g_list_length (batch->paths), batch->call.uri);
+            notify_watchers (batch->paths, batch->values, ack);
+        }
+        else
+        {
+            DEBUG ("PROXY SET: Error response: %s\n", strerror (-res));
+            if (result == 0)
+                result = res;
+        }
+        while (proxy_call_recv (&batch->call));
+        g_free (batch->call.uri);
+        g_list_free (batch->paths);
+        g_list_free (batch->values);
+        g_free (batch);
+    }
+    g_list_free (batches);
+    return result;
+}
+
+/* A timestamp precondition - path must not have changed since ts */
+typedef struct txn_check_s
+{
+    const char *path;
+    uint64_t ts;
+} txn_check_t;
+
+/* Check every precondition. The caller must hold db_lock */
+static bool
+check_timestamps_no_lock (GList *checks)
+{
+    for (GList *iter = checks; iter; iter = iter->next)
+    {
+        txn_check_t *check = iter->data;
+        if (db_timestamp_no_lock (check->path) > check->ts)
+        {
+            DEBUG ("SET: %s changed since %"PRIu64"\n", check->path, check->ts);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+handle_set (rpc_message msg, bool ack, bool checked)
+{
+    int result = 0;
+    uint64_t ts = 0;
+    GList *paths = NULL;
+    GList *ipath;
+    const char *path;
+    GList *values = NULL;
+    GList *ivalue;
+    const char *value;
+    int proxy_result = 0;
+    int validation_result = 0;
+    int validation_lock = 0;
+    bool db_result = false;
+    bool suppress;
+    int unchanged = 0;
+    GList *checks = NULL;
+
+    /* Parse the parameters */
+    if (checked)
+    {
+        /* Each path in the list must not have changed since its own timestamp */
+        ack = rpc_msg_decode_uint8 (msg);
+        ts = UINT64_MAX;
+        for (uint64_t count = rpc_msg_decode_uint64 (msg); count; count--)
+        {
+            txn_check_t *check = g_malloc (sizeof (txn_check_t));
+            check->path = rpc_msg_decode_string (msg);
+            check->ts = rpc_msg_decode_uint64 (msg);
+            checks = g_list_prepend (checks, check);
+            if (!check->path)
+            {
+                ERROR ("SET: Invalid parameters.\n");
+                INC_COUNTER (counters.set_invalid);
+                result = -EINVAL;
+                goto exit;
+            }
+            DEBUG ("SET: %s unchanged since %"PRIu64"\n", check->path, check->ts);
+        }
+    }
+    else
+        ts = rpc_msg_decode_uint64 (msg);
     while ((path = rpc_msg_decode_string (msg)) != NULL)
     {
         value = rpc_msg_decode_string (msg);
@@ -928,42 +1570,26 @@ handle_set (rpc_message msg, bool ack)
     INC_COUNTER (counters.set);
 
     /* Proxy first */
-    ipath = g_list_first (paths);
-    ivalue = g_list_first (values);
-    while (ipath && ivalue)
+    if (checks)
     {
-        path = (const char *) ipath->data;
-        value = (const char *) ivalue->data;
-        if (value && value[0] == '\0')
-            value = NULL;
-
-        proxy_result = proxy_set (path, value, ts);
-        if (proxy_result == 0)
-        {
-            /* Result success */
-            DEBUG ("SET: %s = %s proxied\n", path, value);
-            /* Call any watchers */
-            GList *wpaths = g_list_append (NULL, (gpointer) path);
-            GList *wvalues = g_list_append (NULL, (gpointer) value);
-            notify_watchers (wpaths, wvalues, ack);
-            g_list_free (wpaths);
-            g_list_free (wvalues);
-            /* Safely remove from both lists as we dont need to do any more processing */
-            next = g_list_next (ipath);
-            paths = g_list_delete_link (paths, ipath);
-            ipath = next;
-            next = g_list_next (ivalue);
-            values = g_list_delete_link (values, ivalue);
-            ivalue = next;
-            continue;
+        /* The checks can only be made atomically here */
+        for (ipath = paths; ipath; ipath = ipath->next)
+        {
+            if (config_tree_has_proxies ((const char *) ipath->data))
+            {
+                result = -ENOTSUP;
+                goto exit;
+            }
         }
-        else if (proxy_result < 0)
+    }
+    else
+    {
+        proxy_result = proxy_set (&paths, &values, ts, ack);
+        if (proxy_result < 0)
         {
             result = proxy_result;
             goto exit;
         }
-        ipath = g_list_next (ipath);
-        ivalue = g_list_next (ivalue);
     }
 
     /* Validate */
@@ -988,7 +1614,14 @@ handle_set (rpc_message msg, bool ack)
     }
 
     /* Set in the database */
+    suppress = ts == UINT64_MAX && !checks && config_has_suppress ();
     pthread_rwlock_wrlock (&db_lock);
+    if (!check_timestamps_no_lock (checks))
+    {
+        result = -EBUSY;
+        pthread_rwlock_unlock (&db_lock);
+        goto exit;
+    }
     for (ipath = g_list_first (paths), ivalue = g_list_first (values);
          ipath && ivalue; ipath = g_list_next (ipath), ivalue = g_list_next (ivalue))
     {
@@ -997,6 +1630,19 @@ handle_set (rpc_message msg, bool ack)
         if (value && value[0] == '\0')
             value = NULL;
 
+        /* Leave unchanged values (and their timestamps) alone and do not
+         * tell anyone about them */
+        if (suppress && config_suppress_unchanged (path) &&
+            db_unchanged_no_lock (path, (const unsigned char *) value,
+                                  value ? strlen (value) + 1 : 0))
+        {
+            DEBUG ("SET: %s = %s unchanged\n", path, value);
+            INC_COUNTER (counters.set_unchanged);
+            ipath->data = ivalue->data = NULL;
+            unchanged++;
+            continue;
+        }
+
         /* Add/Delete to/from database */
         if (value)
             db_result = db_add_no_lock (path, (unsigned char*)value, strlen (value) + 1, ts);
@@ -1011,12 +1657,18 @@ handle_set (rpc_message msg, bool ack)
         }
     }
     pthread_rwlock_unlock (&db_lock);
+    if (unchanged)
+    {
+        paths = g_list_remove_all (paths, NULL);
+        values = g_list_remove_all (values, NULL);
+    }
 
 exit:
     /* Return result and notify watchers */
-    if (validation_result >= 0 && result == 0)
+    if (validation_result >= 0 && result == 0 && paths)
     {
-        /* Notify watchers */
+        /* Notify waiters and watchers */
+        wake_waiters (paths);
         notify_watchers (paths, values, ack);
     }
 
@@ -1031,131 +1683,719 @@ exit:
     /* Send result */
     rpc_msg_reset (msg);
     rpc_msg_encode_uint64 (msg, result);
+    g_list_free_full (checks, g_free);
     g_list_free (paths);
     g_list_free (values);
     return true;
 }
 
+/* Work out what needs to change to make the tree at root match desired */
+struct sync_diff_s
+{
+    GHashTable *desired;
+    GList *paths;
+    GList *values;
+};
+
+static bool
+_sync_current (const char *path, const unsigned char *value, size_t length, void *data)
+{
+    struct sync_diff_s *diff = (struct sync_diff_s *) data;
+
+    if (!g_hash_table_contains (diff->desired, path))
+    {
+        /* Not wanted anymore */
+        diff->paths = g_list_prepend (diff->paths, g_strdup (path));
+        diff->values = g_list_prepend (diff->values, g_strdup (""));
+    }
+    return true;
+}
+
+static void
+sync_diff_no_lock (const char *root, struct sync_diff_s *diff)
+{
+    GHashTableIter iter;
+    gpointer path, value;
+
+    db_traverse_no_lock (root, _sync_current, diff);
+    g_hash_table_iter_init (&iter, diff->desired);
+    while (g_hash_table_iter_next (&iter, &path, &value))
+    {
+        if (!db_unchanged_no_lock ((const char *) path, (const unsigned char *) value,
+                                   strlen ((const char *) value) + 1))
+        {
+            diff->paths = g_list_prepend (diff->paths, g_strdup ((const char *) path));
+            diff->values = g_list_prepend (diff->values, g_strdup ((const char *) value));
+        }
+    }
+}
+
+static bool
+sync_apply_no_lock (struct sync_diff_s *diff)
+{
+    GList *ipath, *ivalue;
+
+    for (ipath = diff->paths, ivalue = diff->values; ipath && ivalue;
+         ipath = ipath->next, ivalue = ivalue->next)
+    {
+        const char *path = (const char *) ipath->data;
+        const char *value = (const char *) ivalue->data;
+        bool db_result;
+
+        if (value[0] == '\0')
+            db_result = db_delete_no_lock (path, UINT64_MAX);
+        else
+            db_result = db_add_no_lock (path, (unsigned char *) value, strlen (value) + 1,
+                                        UINT64_MAX);
+        if (!db_result)
+        {
+            DEBUG ("SYNC: %s = %s refused by DB\n", path, value);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+handle_sync (rpc_message msg)
+{
+    struct sync_diff_s diff = {};
+    const char *root;
+    const char *path;
+    const char *value;
+    GList *ipath, *ivalue;
+    int32_t result = 0;
+    int validation_result = 0;
+    int validation_lock = 0;
+    uint64_t ts;
+    size_t len;
+
+    /* Parse the parameters */
+    root = rpc_msg_decode_string (msg);
+    if (root == NULL || root[0] != '/' || root[1] == '\0')
+    {
+        ERROR ("SYNC: Invalid parameters.\n");
+        INC_COUNTER (counters.sync_invalid);
+        rpc_msg_reset (msg);
+        rpc_msg_encode_uint64 (msg, (uint64_t) -EINVAL);
+        return true;
+    }
+    INC_COUNTER (counters.sync);
+    DEBUG ("SYNC: %s\n", root);
+
+    len = strlen (root);
+    diff.desired = g_hash_table_new (g_str_hash, g_str_equal);
+    while ((path = rpc_msg_decode_string (msg)) != NULL)
+    {
+        value = rpc_msg_decode_string (msg);
+        if (!value)
+            break;
+        if (strncmp (path, root, len) != 0 || (path[len] != '\0' && path[len] != '/'))
+        {
+            DEBUG ("SYNC: %s is not under %s\n", path, root);
+            INC_COUNTER (counters.sync_invalid);
+            result = -EINVAL;
+            goto exit;
+        }
+        /* Setting to NULL is the same as leaving it out */
+        if (value[0] != '\0')
+            g_hash_table_insert (diff.desired, (gpointer) path, (gpointer) value);
+    }
+
+    if (config_tree_has_proxies (root))
+    {
+        DEBUG ("SYNC: %s is proxied\n", root);
+        result = -ENOTSUP;
+        goto exit;
+    }
+
+    if (!config_tree_has_validators (root))
+    {
+        /* Nobody to ask, so diff and apply in one go */
+        pthread_rwlock_wrlock (&db_lock);
+        sync_diff_no_lock (root, &diff);
+        if (!sync_apply_no_lock (&diff))
+            result = -EBUSY;
+        pthread_rwlock_unlock (&db_lock);
+    }
+    else
+    {
+        /* Validators may read the database, so they are called without
+         * the lock and the changes only made if nothing else changed
+         * the tree in the meantime */
+        pthread_rwlock_rdlock (&db_lock);
+        ts = db_timestamp_no_lock (root);
+        sync_diff_no_lock (root, &diff);
+        pthread_rwlock_unlock (&db_lock);
+
+        for (ipath = diff.paths, ivalue = diff.values; ipath && ivalue;
+             ipath = ipath->next, ivalue = ivalue->next)
+        {
+            path = (const char *) ipath->data;
+            value = (const char *) ivalue->data;
+            validation_result = validate_set (path, value[0] ? value : NULL);
+            if (validation_result != 0)
+                validation_lock++;
+            if (validation_result < 0)
+            {
+                DEBUG ("SYNC: %s = %s refused by validate\n", path, value);
+                result = validation_result;
+                goto exit;
+            }
+        }
+
+        pthread_rwlock_wrlock (&db_lock);
+        if (db_timestamp_no_lock (root) != ts)
+        {
+            DEBUG ("SYNC: %s changed while validating\n", root);
+            result = -EBUSY;
+        }
+        else if (!sync_apply_no_lock (&diff))
+            result = -EBUSY;
+        pthread_rwlock_unlock (&db_lock);
+    }
+
+    /* Only the differences are reported */
+    if (result == 0)
+    {
+        result = g_list_length (diff.paths);
+        if (diff.paths)
+        {
+            wake_waiters (diff.paths);
+            notify_watchers (diff.paths, diff.values, false);
+        }
+    }
+
+exit:
+    /* Release validation lock - this is a sensitive value */
+    while (validation_lock)
+    {
+        DEBUG ("SYNC: unlocking mutex\n");
+        pthread_mutex_unlock (&validating);
+        validation_lock--;
+    }
+
+    g_list_free_full (diff.paths, g_free);
+    g_list_free_full (diff.values, g_free);
+    g_hash_table_destroy (diff.desired);
+    rpc_msg_reset (msg);
+    rpc_msg_encode_uint64 (msg, (uint64_t) result);
+    return true;
+}
+
+static bool
+handle_txn (rpc_message msg)
+{
+    GList *paths = NULL;
+    GList *values = NULL;
+    GList *checks = NULL;
+    GList *ipath, *ivalue;
+    const char *path;
+    const char *value;
+    int32_t result = 0;
+    int validation_result = 0;
+    int validation_lock = 0;
+    uint8_t op;
+    bool ack;
+
+    /* Parse the operations */
+    ack = rpc_msg_decode_uint8 (msg);
+    while ((op = rpc_msg_decode_uint8 (msg)) != TXN_END)
+    {
+        path = rpc_msg_decode_string (msg);
+        value = NULL;
+        if (path && op == TXN_SET)
+            value = rpc_msg_decode_string (msg);
+        else if (op == TXN_DELETE)
+            value = "";
+        if (path && op == TXN_CHECK)
+        {
+            txn_check_t *check = g_malloc (sizeof (txn_check_t));
+            check->path = path;
+            check->ts = rpc_msg_decode_uint64 (msg);
+            DEBUG ("TXN: %s unchanged since %"PRIu64"\n", path, check->ts);
+            checks = g_list_prepend (checks, check);
+            continue;
+        }
+        if (!path || !value)
+        {
+            ERROR ("TXN: Invalid parameters.\n");
+            INC_COUNTER (counters.txn_invalid);
+            result = -EINVAL;
+            goto exit;
+        }
+        DEBUG ("TXN: %s = %s\n", path, value);
+        paths = g_list_prepend (paths, (gpointer) path);
+        values = g_list_prepend (values, (gpointer) value);
+    }
+    paths = g_list_reverse (paths);
+    values = g_list_reverse (values);
+    INC_COUNTER (counters.txn);
+
+    /* Everything must be local to be done in one go */
+    for (ipath = paths; ipath; ipath = ipath->next)
+    {
+        if (config_tree_has_proxies ((const char *) ipath->data))
+        {
+            DEBUG ("TXN: %s is proxied\n", (const char *) ipath->data);
+            result = -ENOTSUP;
+            goto exit;
+        }
+    }
+    for (ipath = checks; ipath; ipath = ipath->next)
+    {
+        txn_check_t *check = (txn_check_t *) ipath->data;
+        if (config_tree_has_proxies (check->path))
+        {
+            DEBUG ("TXN: %s is proxied\n", check->path);
+            result = -ENOTSUP;
+            goto exit;
+        }
+    }
+
+    /* Validate all the changes first */
+    for (ipath = paths, ivalue = values; ipath && ivalue;
+         ipath = ipath->next, ivalue = ivalue->next)
+    {
+        path = (const char *) ipath->data;
+        value = (const char *) ivalue->data;
+        validation_result = validate_set (path, value[0] ? value : NULL);
+        if (validation_result != 0)
+            validation_lock++;
+        if (validation_result < 0)
+        {
+            DEBUG ("TXN: %s = %s refused by validate\n", path, value);
+            result = validation_result;
+            goto exit;
+        }
+    }
+
+    /* Check the preconditions and make the changes in one write section */
+    pthread_rwlock_wrlock (&db_lock);
+    if (!check_timestamps_no_lock (checks))
+        result = -EBUSY;
+    for (ipath = paths, ivalue = values; result == 0 && ipath && ivalue;
+         ipath = ipath->next, ivalue = ivalue->next)
+    {
+        path = (const char *) ipath->data;
+        value = (const char *) ivalue->data;
+        if (value[0] == '\0')
+            db_delete_no_lock (path, UINT64_MAX);
+        else
+            db_add_no_lock (path, (unsigned char *) value, strlen (value) + 1, UINT64_MAX);
+    }
+    pthread_rwlock_unlock (&db_lock);
+
+    /* One notification for each watcher */
+    if (result == 0 && paths)
+    {
+        wake_waiters (paths);
+        notify_watchers_coalesced (paths, values, ack);
+    }
+
+exit:
+    /* Release validation lock - this is a sensitive value */
+    while (validation_lock)
+    {
+        DEBUG ("TXN: unlocking mutex\n");
+        pthread_mutex_unlock (&validating);
+        validation_lock--;
+    }
+
+    g_list_free_full (checks, g_free);
+    g_list_free (paths);
+    g_list_free (values);
+    rpc_msg_reset (msg);
+    rpc_msg_encode_uint64 (msg, (uint64_t) result);
+    return true;
+}
+
+static char *
+get_local_value (const char *path)
+{
+    char *value = NULL;
+    size_t vsize = 0;
+
+    /* Call refreshers */
+    call_refreshers (path);
+
+    /* Database second */
+    if (!db_get (path, (unsigned char**)&value, &vsize))
+    {
+        /* Provide third */
+        if ((value = provide_get (path)) == NULL)
+        {
+            DEBUG ("GET: not in database or provided or proxied\n");
+        }
+    }
+
+    return value;
+}
+
+static char *
+get_value (const char *path)
+{
+    char *value = NULL;
+
+    /* Proxy first */
+    if ((value = proxy_get (path)) == NULL)
+        value = get_local_value (path);
+
+    return value;
+}
+
+/* Values from proxies and providers have no stored timestamp so are always
+ * treated as modified. Refreshers update the database (and its timestamps)
+ * so are called before the timestamp is checked. */
+static char *
+get_value_if_modified (const char *path, uint64_t *ts, bool *modified)
+{
+    uint64_t since = *ts;
+    char *value = NULL;
+    size_t vsize = 0;
+
+    *modified = true;
+    *ts = 0;
+
+    /* Proxy first */
+    if ((value = proxy_get (path)) != NULL)
+        return value;
+
+    /* Call refreshers */
+    call_refreshers (path);
+
+    /* Nothing newer in the database */
+    *ts = db_timestamp (path);
+    if (since && *ts == since && !config_tree_has_providers (path))
+    {
+        *modified = false;
+        return NULL;
+    }
+
+    /* Database second */
+    if (!db_get (path, (unsigned char**)&value, &vsize))
+    {
+        /* Provide third */
+        value = provide_get (path);
+    }
+    return value;
+}
+
+static bool
+handle_get (rpc_message msg, bool conditional)
+{
+    const char *path;
+    char *value = NULL;
+    uint64_t ts = 0;
+    bool modified = true;
+
+    /* Parse the parameters */
+    path = rpc_msg_decode_string (msg);
+    if (path == NULL)
+    {
+        ERROR ("GET: Invalid parameters.\n");
+        INC_COUNTER (counters.get_invalid);
+        rpc_msg_reset (msg);
+        return false;
+    }
+    if (conditional)
+        ts = rpc_msg_decode_uint64 (msg);
+    INC_COUNTER (counters.get);
+
+    DEBUG ("GET: %s\n", path);
+
+    /* Lookup value */
+    if (conditional)
+        value = get_value_if_modified (path, &ts, &modified);
+    else
+        value = get_value (path);
+
+    /* Send result */
+    rpc_msg_reset (msg);
+    if (conditional)
+    {
+        DEBUG ("     %s at %"PRIu64"\n", modified ? "modified" : "not modified", ts);
+        if (!modified)
+            INC_COUNTER (counters.not_modified);
+        rpc_msg_encode_uint8 (msg, modified);
+        rpc_msg_encode_uint64 (msg, ts);
+    }
+    DEBUG ("     = %s\n", value);
+    if (value)
+    {
+        rpc_msg_encode_string (msg, value);
+        g_free (value);
+    }
+    return true;
+}
+
+static GList *
+search_path (const char *path)
+{
+    GList *results = NULL;
+    GList *iter;
+
+    /* Proxy first */
+    results = proxy_search (path);
+    if (!results)
+    {
+        /* Indexers second */
+        if (index_get (path, &results) == true)
+        {
+            DEBUG (" (index result:)\n");
+        }
+        else
+        {
+            /* Call refreshers */
+            call_refreshers (path);
+
+            /* Search database next */
+            results = db_search (path);
+            DEBUG (" Got %d entries from database...\n", g_list_length (results));
+            /* Append any provided or refreshed paths */
+            GList *callbacks = NULL;
+            callbacks = config_search_providers (path);
+            callbacks = g_list_concat (config_search_refreshers (path), callbacks);
+            DEBUG (" Got %d entries from providers and refreshers...\n", g_list_length (callbacks));
+            for (iter = callbacks; iter; iter = iter->next)
+            {
+                char *p = (char*)iter->data;
+                if (!g_list_find_custom (results, p, (GCompareFunc)strcmp))
+                    results = g_list_prepend (results, strdup (p));
+            }
+            g_list_free_full (callbacks, free);
+        }
+    }
+    return results;
+}
+
+/* A query or find is planned as a whole. Wildcard expansions are shared
+ * between every path in the request and each directory is checked once for
+ * callbacks. Where there are none, the database is read directly */
+typedef struct query_plan_s
+{
+    GHashTable *searches;   /* Search path -> GList of paths */
+    GHashTable *plain;      /* Directory -> PLAN_PLAIN or PLAN_CALLBACKS */
+} query_plan_t;
+
+#define PLAN_PLAIN      GINT_TO_POINTER (1)
+#define PLAN_CALLBACKS  GINT_TO_POINTER (2)
+
+static void
+plan_free_paths (gpointer paths)
+{
+    g_list_free_full ((GList *) paths, g_free);
+}
+
+static void
+plan_init (query_plan_t *plan)
+{
+    plan->searches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, plan_free_paths);
+    plan->plain = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+static void
+plan_clear (query_plan_t *plan)
+{
+    g_hash_table_destroy (plan->searches);
+    g_hash_table_destroy (plan->plain);
+}
+
+/* True if nothing in the directory of this path is proxied, indexed,
+ * provided or refreshed. A directory without callbacks has none in any
+ * directory below it either, so the callback trees are only checked when
+ * no parent directory is already known to be plain */
+static bool
+plan_plain (query_plan_t *plan, const char *path)
+{
+    const char *last = strrchr (path, '/');
+    char *dir = g_strndup (path, last ? last - path + 1 : 0);
+    gpointer plain = g_hash_table_lookup (plan->plain, dir);
+    char *slash;
+
+    if (plain)
+    {
+        g_free (dir);
+        return plain == PLAN_PLAIN;
+    }
+
+    /* Look for a parent directory known to be plain */
+    for (slash = strchr (dir, '/'); slash && slash[1]; slash = strchr (slash + 1, '/'))
+    {
+        char next = slash[1];
+
+        slash[1] = '\0';
+        plain = g_hash_table_lookup (plan->plain, dir);
+        slash[1] = next;
+        if (plain == PLAN_PLAIN)
+            break;
+        plain = NULL;
+    }
+    if (!plain)
+    {
+        plain = (config_tree_has_proxies (dir) || config_tree_has_indexers (dir) ||
+                 config_tree_has_providers (dir) || config_tree_has_refreshers (dir)) ?
+            PLAN_CALLBACKS : PLAN_PLAIN;
+    }
+    g_hash_table_insert (plan->plain, dir, plain);
+    return plain == PLAN_PLAIN;
+}
+
+/* Search results are kept by the plan - do not free */
+static GList *
+plan_search (query_plan_t *plan, const char *path)
+{
+    GList *results;
+
+    if (g_hash_table_lookup_extended (plan->searches, path, NULL, (gpointer *) &results))
+        return results;
+    results = plan_plain (plan, path) ? db_search (path) : search_path (path);
+    g_hash_table_insert (plan->searches, g_strdup (path), results);
+    return results;
+}
+
+/* Copy of the results of a search */
+static GList *
+plan_search_copy (query_plan_t *plan, const char *path)
+{
+    GList *copy = NULL;
+
+    for (GList *iter = plan_search (plan, path); iter; iter = g_list_next (iter))
+        copy = g_list_prepend (copy, g_strdup (iter->data));
+    return g_list_reverse (copy);
+}
+
+/* Expand each '*' in a pattern by searching every candidate */
+static GList *
+plan_expand (query_plan_t *plan, const char *pattern)
+{
+    GList *matches = NULL;
+    GList *iter;
+    char *tmp = g_strdup (pattern);
+    char *ptr = NULL;
+    char *chunk;
+
+    chunk = strtok_r (tmp, "*", &ptr);
+    if (chunk)
+    {
+        matches = plan_search_copy (plan, chunk);
+    }
+
+    /* For each * do a search + add keys, then re-search */
+    while ((chunk = strtok_r (NULL, "*", &ptr)) != NULL)
+    {
+        GList *last_round = matches;
+        matches = NULL;
+        for (iter = g_list_first (last_round); iter; iter = g_list_next (iter))
+        {
+            char *next_level = g_strdup_printf ("%s%s", (char *) iter->data, chunk);
+            matches = g_list_concat (plan_search_copy (plan, next_level), matches);
+            g_free (next_level);
+        }
+        g_list_free_full (last_round, g_free);
+    }
+    g_free (tmp);
+    return matches;
+}
+
 static char *
-get_value (const char *path)
+plan_get (query_plan_t *plan, const char *path)
 {
     char *value = NULL;
     size_t vsize = 0;
 
-    /* Proxy first */
-    if ((value = proxy_get (path)) == NULL)
-    {
-        /* Call refreshers */
-        call_refreshers (path);
-
-        /* Database second */
-        if (!db_get (path, (unsigned char**)&value, &vsize))
-        {
-            /* Provide third */
-            if ((value = provide_get (path)) == NULL)
-            {
-                DEBUG ("GET: not in database or provided or proxied\n");
-            }
-        }
-    }
-
+    if (!plan_plain (plan, path))
+        return get_value (path);
+    if (!db_get (path, (unsigned char **) &value, &vsize))
+        return NULL;
     return value;
 }
 
 static bool
-handle_get (rpc_message msg)
+handle_search (rpc_message msg)
 {
     const char *path;
-    char *value = NULL;
+    GList *results = NULL;
+    GList *iter = NULL;
 
-    /* Parse the parameters */
+    /* Check parameters */
     path = rpc_msg_decode_string (msg);
     if (path == NULL)
     {
-        ERROR ("GET: Invalid parameters.\n");
-        INC_COUNTER (counters.get_invalid);
+        ERROR ("SEARCH: Invalid parameters.\n");
+        INC_COUNTER (counters.search_invalid);
         rpc_msg_reset (msg);
         return false;
     }
-    INC_COUNTER (counters.get);
+    INC_COUNTER (counters.search);
 
-    DEBUG ("GET: %s\n", path);
+    DEBUG ("SEARCH: %s\n", path);
 
-    /* Lookup value */
-    value = get_value (path);
+    results = search_path (path);
 
-    /* Send result */
-    DEBUG ("     = %s\n", value);
+    /* Prepare the results */
     rpc_msg_reset (msg);
-    if (value)
+    for (iter = results; iter; iter = g_list_next (iter))
     {
-        rpc_msg_encode_string (msg, value);
-        g_free (value);
+        DEBUG ("         = %s\n", (char *) iter->data);
+        rpc_msg_encode_string (msg, (char *)iter->data);
     }
+    g_list_free_full (results, g_free);
     return true;
 }
 
-static GList *
-search_path (const char *path)
-{
-    GList *results = NULL;
-    GList *iter;
-
-    /* Proxy first */
-    results = proxy_search (path);
-    if (!results)
-    {
-        /* Indexers second */
-        if (index_get (path, &results) == true)
-        {
-            DEBUG (" (index result:)\n");
-        }
-        else
-        {
-            /* Call refreshers */
-            call_refreshers (path);
-
-            /* Search database next */
-            results = db_search (path);
-            DEBUG (" Got %d entries from database...\n", g_list_length (results));
-            /* Append any provided or refreshed paths */
-            GList *callbacks = NULL;
-            callbacks = config_search_providers (path);
-            callbacks = g_list_concat (config_search_refreshers (path), callbacks);
-            DEBUG (" Got %d entries from providers and refreshers...\n", g_list_length (callbacks));
-            for (iter = callbacks; iter; iter = iter->next)
-            {
-                char *p = (char*)iter->data;
-                if (!g_list_find_custom (results, p, (GCompareFunc)strcmp))
-                    results = g_list_prepend (results, strdup (p));
-            }
-            g_list_free_full (callbacks, free);
-        }
-    }
-    return results;
-}
-
 static bool
-handle_search (rpc_message msg)
+handle_search_range (rpc_message msg)
 {
     const char *path;
+    const char *after;
+    uint64_t limit;
     GList *results = NULL;
-    GList *iter = NULL;
+    GList *iter, *next;
+    size_t count = 0;
 
     /* Check parameters */
     path = rpc_msg_decode_string (msg);
-    if (path == NULL)
+    after = path ? rpc_msg_decode_string (msg) : NULL;
+    if (path == NULL || after == NULL)
     {
         ERROR ("SEARCH: Invalid parameters.\n");
         INC_COUNTER (counters.search_invalid);
         rpc_msg_reset (msg);
         return false;
     }
+    limit = rpc_msg_decode_uint64 (msg);
+    if (after[0] == '\0')
+        after = NULL;
     INC_COUNTER (counters.search);
 
-    DEBUG ("SEARCH: %s\n", path);
+    DEBUG ("SEARCH: %s after %s (limit %"PRIu64")\n", path, after, limit);
 
-    results = search_path (path);
+    if (config_tree_has_proxies (path) || config_tree_has_indexers (path) ||
+        config_tree_has_providers (path) || config_tree_has_refreshers (path))
+    {
+        /* Callbacks add paths the database does not have in order so
+         * sort the whole search */
+        results = g_list_sort (search_path (path), (GCompareFunc) db_natural_compare);
+        for (iter = results; iter; iter = next)
+        {
+            const char *key = strrchr ((char *) iter->data, '/');
+
+            next = g_list_next (iter);
+            key = key ? key + 1 : (char *) iter->data;
+            if ((after && db_natural_compare (key, after) <= 0) || (limit && count == limit))
+            {
+                g_free (iter->data);
+                results = g_list_delete_link (results, iter);
+                continue;
+            }
+            count++;
+        }
+    }
+    else
+    {
+        results = db_search_range (path, after, limit);
+    }
 
     /* Prepare the results */
     rpc_msg_reset (msg);
@@ -1180,10 +2420,8 @@ handle_find (rpc_message msg)
     char *value;
     GList *possible_matches = NULL;
     GList *iter = NULL;
-    char *tmp = NULL;
-    char *ptr = NULL;
-    char *chunk;
     GList *matches = NULL;
+    query_plan_t plan;
 
     /* Parse the parameters */
     rpath = rpc_msg_decode_string (msg);
@@ -1205,28 +2443,9 @@ handle_find (rpc_message msg)
     values = g_list_reverse (values);
     INC_COUNTER (counters.find);
 
-    /* Grab first level (from root) */
-    tmp = g_strdup (rpath);
-    chunk = strtok_r( tmp, "*", &ptr);
-    if (chunk)
-    {
-        possible_matches = search_path (chunk);
-    }
-
-    /* For each * do a search + add keys, then re-search */
-    while ((chunk = strtok_r (NULL, "*", &ptr)) != NULL)
-    {
-        GList *last_round = possible_matches;
-        possible_matches = NULL;
-        for (iter = g_list_first (last_round); iter; iter = g_list_next (iter))
-        {
-            char *next_level = NULL;
-            next_level = g_strdup_printf("%s%s", (char*) iter->data, chunk);
-            possible_matches = g_list_concat (search_path (next_level), possible_matches);
-            g_free (next_level);
-        }
-        g_list_free_full (last_round, g_free);
-    }
+    /* Expand the wildcards once for all keys */
+    plan_init (&plan);
+    possible_matches = plan_expand (&plan, rpath);
 
     /* Go through each path match and see if all keys match */
     for (iter = g_list_first (possible_matches); iter; iter = g_list_next (iter))
@@ -1241,7 +2460,7 @@ handle_find (rpc_message msg)
 
             key = g_strdup_printf("%s%s", (char*)iter->data,
                               strrchr (ipath->data, '*') + 1);
-            value = get_value (key);
+            value = plan_get (&plan, key);
 
 
             /* A "" value on a match maps to no return value from provider / database */
@@ -1290,7 +2509,7 @@ handle_find (rpc_message msg)
     }
 
     /* Cleanup */
-    g_free (tmp);
+    plan_clear (&plan);
     g_list_free_full (matches, g_free);
     g_list_free (paths);
     g_list_free (values);
@@ -1322,13 +2541,43 @@ _update_path_callbacks (const char *path, char cb_lookup)
     return cb_lookup;
 }
 
+/* Send what a traverse has held back, noting the most it has held */
+static void
+traverse_release (rpc_message msg)
+{
+    size_t length = rpc_msg_stream_release (msg);
+    uint32_t held = MIN (length, UINT32_MAX);
+    uint32_t max;
+
+    while (held > (max = GET_COUNTER (counters.traverse_held_max)) &&
+           !g_atomic_int_compare_and_exchange (&counters.traverse_held_max, max, held));
+}
+
+/* Send what has been held back once the reader could take it. db_lock is
+ * dropped meanwhile, so the walk must be able to carry on from where it is
+ * after the database has changed. */
+static void
+traverse_yield (rpc_message msg)
+{
+    if (!rpc_msg_stream_full (msg))
+        return;
+    pthread_rwlock_unlock (&db_lock);
+    traverse_release (msg);
+    rpc_msg_stream_hold (msg);
+    pthread_rwlock_rdlock (&db_lock);
+}
+
 static void
-_traverse_paths (GList **paths, GList **values, const char *path, char cb_lookup)
+_traverse_paths (rpc_message msg, const char *path, char cb_lookup)
 {
     GList *children, *iter;
     char *value = NULL;
     size_t vsize;
 
+    /* Nobody is waiting for the rest */
+    if (rpc_msg_expired ())
+        return;
+
     /* Look for a value - db first */
     if (!db_get (path, (unsigned char**)&value, &vsize) && (cb_lookup & cb_provide))
     {
@@ -1338,12 +2587,16 @@ _traverse_paths (GList **paths, GList **values, const char *path, char cb_lookup
 
     if (value)
     {
-        *paths = g_list_prepend (*paths, (gpointer) g_strdup (path));
-        *values = g_list_prepend (*values, (gpointer) value);
+        DEBUG ("  %s = %s\n", path, value);
+        rpc_msg_encode_string (msg, path);
+        rpc_msg_encode_string (msg, value);
+        g_free (value);
+        rpc_msg_stream (msg);
+        traverse_yield (msg);
     }
 
-    /* Check for children - index first */
-    char *path_s = g_strdup_printf ("%s/", path);
+    /* Check for children - index first (the root already ends in '/') */
+    char *path_s = strcmp (path, "/") == 0 ? g_strdup (path) : g_strdup_printf ("%s/", path);
     if (!(cb_lookup & cb_index) || !index_get (path_s, &children))
     {
         /* Search database next */
@@ -1372,17 +2625,266 @@ _traverse_paths (GList **paths, GList **values, const char *path, char cb_lookup
     for (iter = children; iter; iter = g_list_next (iter))
     {
         DEBUG ("TRAVERSE: %s\n", (const char *) iter->data);
-        _traverse_paths (paths, values, (const char *) iter->data, cb_lookup);
+        _traverse_paths (msg, (const char *) iter->data, cb_lookup);
     }
     g_list_free_full (children, g_free);
     g_free (path_s);
 }
 
+/* Encode database nodes straight into a traverse response */
+struct traverse_encode_s
+{
+    rpc_message msg;
+    unsigned int count;
+    uint64_t deadline;
+};
+
+static bool
+_traverse_encode (const char *path, const unsigned char *value, size_t length, void *data)
+{
+    struct traverse_encode_s *encode = (struct traverse_encode_s *) data;
+
+    /* Nobody is waiting for the rest - helpers have no request of their
+     * own so the deadline is carried with the encoder */
+    if ((++encode->count % 1024) == 0 &&
+        ((encode->deadline && get_time_us () >= encode->deadline) || rpc_msg_cancelled ()))
+        return false;
+
+    DEBUG ("  %s = %s\n", path, (const char *) value);
+    rpc_msg_encode_string (encode->msg, path);
+    rpc_msg_encode_string (encode->msg, (const char *) value);
+    rpc_msg_stream (encode->msg);
+    return true;
+}
+
+/* Parts of a tree shared out between the handler and traverse helpers.
+ * Whoever is free takes the next part, encodes it into its own fragment
+ * and the handler stitches the fragments back together in order. */
+struct traverse_task_s
+{
+    db_part **parts;
+    rpc_message_t *fragments;
+    bool *done;
+    int count;
+    int next;
+    int emitted;
+    int ahead;
+    int active;
+    bool paused;
+    bool cancelled;
+    int runners;
+    uint64_t deadline;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Let go of the database to send what has been held back. Helpers finish
+ * the parts they have and wait. Called with task->lock held. */
+static void
+traverse_pause (struct traverse_task_s *task, rpc_message msg)
+{
+    task->paused = true;
+    while (task->active)
+        pthread_cond_wait (&task->cond, &task->lock);
+    pthread_mutex_unlock (&task->lock);
+    traverse_yield (msg);
+    pthread_mutex_lock (&task->lock);
+    task->paused = false;
+    pthread_cond_broadcast (&task->cond);
+}
+
+/* Send on whatever is ready in order. Called with task->lock held. */
+static void
+traverse_emit (struct traverse_task_s *task, rpc_message msg)
+{
+    while (task->emitted < task->count && task->done[task->emitted])
+    {
+        rpc_message fragment = &task->fragments[task->emitted++];
+        pthread_mutex_unlock (&task->lock);
+        rpc_msg_append (msg, fragment);
+        rpc_msg_reset (fragment);
+        rpc_msg_stream (msg);
+        pthread_mutex_lock (&task->lock);
+        pthread_cond_broadcast (&task->cond);
+        if (rpc_msg_stream_full (msg))
+            traverse_pause (task, msg);
+        if (rpc_msg_cancelled ())
+            task->cancelled = true;
+    }
+}
+
+static void
+traverse_run (struct traverse_task_s *task, rpc_message msg)
+{
+    int i;
+
+    pthread_mutex_lock (&task->lock);
+    while ((i = task->next) < task->count)
+    {
+        /* Stay a few parts ahead of what has been sent at most and keep
+         * out of the database while the handler has let go of it */
+        if (task->paused || i >= task->emitted + task->ahead)
+        {
+            if (msg && task->done[task->emitted])
+                traverse_emit (task, msg);
+            else
+                pthread_cond_wait (&task->cond, &task->lock);
+            continue;
+        }
+        task->next++;
+        task->active++;
+        bool cancelled = task->cancelled;
+        pthread_mutex_unlock (&task->lock);
+
+        struct traverse_encode_s encode = {
+            .msg = &task->fragments[i],
+            .deadline = task->deadline,
+        };
+        /* Parts not started before the request expired or was cancelled
+         * are left empty */
+        if (!cancelled && (!task->deadline || get_time_us () < task->deadline))
+            db_traverse_part_no_lock (task->parts[i], _traverse_encode, &encode);
+
+        pthread_mutex_lock (&task->lock);
+        task->active--;
+        task->done[i] = true;
+        pthread_cond_broadcast (&task->cond);
+
+        /* Send on whatever is ready while there is still work to do */
+        if (msg)
+            traverse_emit (task, msg);
+    }
+    pthread_mutex_unlock (&task->lock);
+}
+
+static void
+traverse_helper (gpointer data, gpointer user_data)
+{
+    struct traverse_task_s *task = (struct traverse_task_s *) data;
+
+    traverse_run (task, NULL);
+    pthread_mutex_lock (&task->lock);
+    task->runners--;
+    pthread_cond_broadcast (&task->cond);
+    pthread_mutex_unlock (&task->lock);
+}
+
+/* Walk the tree at path with the help of up to traverse_threads - 1 other
+ * threads. The caller holds db_lock and is holding back the stream. Once
+ * the reader could take what is held back, db_lock is dropped between
+ * parts to send it - a large tree is then not from a single point in time,
+ * but the timestamp of any path changed meanwhile has moved on too. */
+static void
+traverse_parallel (rpc_message msg, const char *path)
+{
+    db_size limit = { .nodes = TRAVERSE_PART_NODES, .bytes = RPC_STREAM_CHUNK_SIZE };
+    struct traverse_task_s task = {};
+    GList *parts = NULL;
+    GList *iter;
+    int i;
+
+    parts = db_partition_no_lock (path, &limit);
+    if (!parts || !parts->next)
+    {
+        struct traverse_encode_s encode = { .msg = msg, .deadline = rpc_msg_deadline () };
+        g_list_free_full (parts, (GDestroyNotify) db_part_free);
+        db_traverse_no_lock (path, _traverse_encode, &encode);
+        return;
+    }
+
+    task.count = g_list_length (parts);
+    task.deadline = rpc_msg_deadline ();
+    task.ahead = 2 * traverse_threads;
+    task.parts = g_malloc (task.count * sizeof (db_part *));
+    task.fragments = g_malloc0 (task.count * sizeof (rpc_message_t));
+    task.done = g_malloc0 (task.count * sizeof (bool));
+    for (i = 0, iter = parts; iter; iter = iter->next)
+        task.parts[i++] = iter->data;
+    pthread_mutex_init (&task.lock, NULL);
+    pthread_cond_init (&task.cond, NULL);
+    DEBUG ("TRAVERSE: %s in %d parts\n", path, task.count);
+
+    if (traverse_pool)
+    {
+        task.runners = MIN (traverse_threads - 1, task.count - 1);
+        for (i = task.runners; i > 0; i--)
+            g_thread_pool_push (traverse_pool, &task, NULL);
+    }
+    traverse_run (&task, msg);
+
+    /* Stitch in the rest as the helpers finish */
+    pthread_mutex_lock (&task.lock);
+    while (task.emitted < task.count)
+    {
+        if (!task.done[task.emitted])
+            pthread_cond_wait (&task.cond, &task.lock);
+        else
+            traverse_emit (&task, msg);
+    }
+    while (task.runners)
+        pthread_cond_wait (&task.cond, &task.lock);
+    pthread_mutex_unlock (&task.lock);
+
+    pthread_cond_destroy (&task.cond);
+    pthread_mutex_destroy (&task.lock);
+    g_free (task.done);
+    g_free (task.fragments);
+    g_free (task.parts);
+    g_list_free_full (parts, (GDestroyNotify) db_part_free);
+}
+
+static void
+traverse_local (rpc_message msg, const char *path)
+{
+    if (!config_tree_has_providers (path) && !config_tree_has_indexers (path))
+    {
+        /* Nothing below here is provided or indexed so walk the
+         * database directly. Nothing is sent while the lock is held
+         * so a slow reader cannot hold up writers. */
+        rpc_msg_stream_hold (msg);
+        pthread_rwlock_rdlock (&db_lock);
+        traverse_parallel (msg, path);
+        pthread_rwlock_unlock (&db_lock);
+        traverse_release (msg);
+    }
+    else
+    {
+        /* Traverse (local) paths and make sure the database
+         * doesn't change while we're reading it. If there are
+         * providers or indexers we are unable to serve a tree
+         * from a single point in time, so don't bother with
+         * the locking.
+         * */
+        bool lock_possible = true;
+        GList *callbacks = NULL;
+        callbacks = config_search_providers (path);
+        if (!callbacks)
+            callbacks = config_search_indexers (path);
+        if (callbacks)
+        {
+            lock_possible = false;
+            g_list_free_full (callbacks, free);
+        }
+        if (lock_possible)
+        {
+            rpc_msg_stream_hold (msg);
+            pthread_rwlock_rdlock (&db_lock);
+        }
+        _traverse_paths (msg, path, cb_all);
+        if (lock_possible)
+        {
+            pthread_rwlock_unlock (&db_lock);
+            traverse_release (msg);
+        }
+    }
+}
+
 static void
 refreshers_traverse (const char *top_path, char cb_lookup)
 {
     GList *iter, *paths = NULL;
-    gchar *needle = g_strdup_printf("%s/", top_path);
+    gchar *needle = strcmp (top_path, "/") == 0 ? g_strdup (top_path) :
+        g_strdup_printf("%s/", top_path);
 
     call_refreshers (needle);
 
@@ -1422,14 +2924,12 @@ refreshers_traverse (const char *top_path, char cb_lookup)
 }
 
 static bool
-handle_traverse (rpc_message msg)
+handle_traverse (rpc_message msg, bool conditional)
 {
-    const char *path;
-    const char *value;
-    GList *paths = NULL;
-    GList *ipath;
-    GList *values = NULL;
-    GList *ivalue;
+    proxy_call_t *call;
+    char *path;
+    uint64_t since = 0;
+    uint64_t ts;
 
     /* Parse the parameters */
     path = rpc_msg_decode_string (msg);
@@ -1440,203 +2940,316 @@ handle_traverse (rpc_message msg)
         rpc_msg_reset (msg);
         return false;
     }
+    if (conditional)
+        since = rpc_msg_decode_uint64 (msg);
     INC_COUNTER (counters.traverse);
 
     DEBUG ("TRAVERSE: %s\n", path);
 
+    /* Results are encoded (and possibly streamed) as we go */
+    path = g_strdup (path);
+    rpc_msg_reset (msg);
+
     /* Call refreshers */
     refreshers_traverse (path, cb_all);
 
     /* Proxy first */
-    if (!proxy_traverse (&paths, &values, path))
+    call = proxy_call_start (MODE_TRAVERSE, path);
+    if (call)
     {
-        /* Traverse (local) paths and make sure the database
-         * doesn't change while we're reading it. If there are
-         * providers or indexers we are unable to serve a tree
-         * from a single point in time, so don't bother with
-         * the locking.
-         * */
-        bool lock_possible = true;
-        GList *callbacks = NULL;
-        callbacks = config_search_providers (path);
-        if (!callbacks)
-            callbacks = config_search_indexers (path);
-        if (callbacks)
+        /* Proxied trees are always sent */
+        if (conditional)
+        {
+            rpc_msg_encode_uint8 (msg, true);
+            rpc_msg_encode_uint64 (msg, 0);
+        }
+        proxy_call_encode (call, msg);
+    }
+    else if (conditional && !config_tree_has_providers (path) &&
+             !config_tree_has_indexers (path))
+    {
+        /* Check the timestamp and walk the tree from the same point in time */
+        rpc_msg_stream_hold (msg);
+        pthread_rwlock_rdlock (&db_lock);
+        ts = db_timestamp_no_lock (path);
+        DEBUG ("     %s at %"PRIu64"\n", since && ts == since ? "not modified" : "modified", ts);
+        rpc_msg_encode_uint8 (msg, !since || ts != since);
+        rpc_msg_encode_uint64 (msg, ts);
+        if (!since || ts != since)
+            traverse_parallel (msg, path);
+        else
+            INC_COUNTER (counters.not_modified);
+        pthread_rwlock_unlock (&db_lock);
+        traverse_release (msg);
+    }
+    else
+    {
+        /* Provided or indexed trees are always sent */
+        if (conditional)
+        {
+            rpc_msg_encode_uint8 (msg, true);
+            rpc_msg_encode_uint64 (msg, db_timestamp (path));
+        }
+        traverse_local (msg, path);
+    }
+    g_free (path);
+
+    if (rpc_msg_cancelled ())
+        INC_COUNTER (counters.traverse_cancelled);
+    return true;
+}
+
+/* True if the tree at root includes path */
+static bool
+root_covers (const char *root, const char *path)
+{
+    size_t length = strlen (root);
+    if (strcmp (root, "/") == 0)
+        return true;
+    return strncmp (root, path, length) == 0 &&
+        (path[length] == '\0' || path[length] == '/');
+}
+
+static bool
+handle_traverse_multi (rpc_message msg)
+{
+    GList *roots = NULL;
+    GList *calls = NULL;
+    GList *iter, *citer, *next;
+    const char *path;
+
+    /* Parse the parameters - roots inside another are only done once */
+    while ((path = rpc_msg_decode_string (msg)) != NULL)
+    {
+        bool covered = false;
+
+        for (iter = roots; iter && !covered; iter = next)
         {
-            lock_possible = false;
-            g_list_free_full (callbacks, free);
+            next = g_list_next (iter);
+            if (root_covers ((const char *) iter->data, path))
+                covered = true;
+            else if (root_covers (path, (const char *) iter->data))
+            {
+                g_free (iter->data);
+                roots = g_list_delete_link (roots, iter);
+            }
         }
-        if (lock_possible)
-            pthread_rwlock_rdlock (&db_lock);
-        _traverse_paths (&paths, &values, path, cb_all);
-        if (lock_possible)
-            pthread_rwlock_unlock (&db_lock);
+        if (!covered)
+            roots = g_list_append (roots, g_strdup (path));
     }
-    paths = g_list_reverse (paths);
-    values = g_list_reverse (values);
+    if (roots == NULL)
+    {
+        ERROR ("TRAVERSE: Invalid parameters.\n");
+        INC_COUNTER (counters.traverse_invalid);
+        rpc_msg_reset (msg);
+        return false;
+    }
+    INC_COUNTER (counters.traverse);
 
-    /* Send result */
+    /* Results are encoded (and possibly streamed) as we go */
     rpc_msg_reset (msg);
-    for (ipath = g_list_first (paths), ivalue = g_list_first (values);
-         ipath && ivalue; ipath = g_list_next (ipath), ivalue = g_list_next (ivalue))
+
+    /* Refresh every root and send every proxied request before waiting
+     * for any of them */
+    for (iter = roots; iter; iter = g_list_next (iter))
     {
-        path = (char *) ipath->data;
-        value = (char *) ivalue->data;
-        DEBUG ("  %s = %s\n", path, value);
-        rpc_msg_encode_string (msg, path);
-        rpc_msg_encode_string (msg, value);
+        DEBUG ("TRAVERSE: %s\n", (const char *) iter->data);
+        refreshers_traverse ((const char *) iter->data, cb_all);
+        calls = g_list_append (calls, proxy_call_start (MODE_TRAVERSE, (const char *) iter->data));
     }
-    g_list_free_full (paths, g_free);
-    g_list_free_full (values, g_free);
+    for (iter = roots, citer = calls; iter && citer;
+         iter = g_list_next (iter), citer = g_list_next (citer))
+    {
+        if (citer->data)
+            proxy_call_encode ((proxy_call_t *) citer->data, msg);
+        else
+            traverse_local (msg, (const char *) iter->data);
+    }
+    g_list_free (calls);
+    g_list_free_full (roots, g_free);
 
     return true;
 }
 
+/* apteryxd handles its own /apteryx paths without registered callbacks.
+ * Prune watchers get one event for the subtree so never need its paths. */
+static bool
+prune_covered (const char *path)
+{
+    return strcmp (path, "/") == 0 || root_covers (APTERYX_PATH, path) ||
+        config_tree_has_watchers_except (path, CB_FLAG_PRUNE) ||
+        config_tree_has_validators (path);
+}
+
+/* Collect path and every set path below it, skipping any subtree that
+ * no watcher or validator could be interested in */
 static void
-_search_paths (GList **paths, const char *path)
+_prune_paths (GList **paths, const char *path)
 {
     GList *children, *iter;
     char *value = NULL;
     size_t vsize = 0;
 
-    children = db_search (path);
-    for (iter = children; iter; iter = g_list_next (iter))
+    if (!prune_covered (path))
+        return;
+    if (db_get (path, (unsigned char**) &value, &vsize))
     {
-        const char *_path = (const char *) iter->data;
-        if (db_get (_path, (unsigned char**) &value, &vsize))
-        {
-            *paths = g_list_prepend (*paths, g_strdup (_path));
-            g_free (value);
-        }
-        _search_paths (paths, _path);
+        *paths = g_list_prepend (*paths, g_strdup (path));
+        g_free (value);
     }
+    children = db_search (path);
+    for (iter = children; iter; iter = g_list_next (iter))
+        _prune_paths (paths, (const char *) iter->data);
     g_list_free_full (children, g_free);
 }
 
+static void
+_query_encode (rpc_message msg, const char *path, const char *value)
+{
+    DEBUG ("  %s = %s\n", path, value);
+    rpc_msg_encode_string (msg, path);
+    rpc_msg_encode_string (msg, value);
+    rpc_msg_stream (msg);
+}
+
+/* A path to get (or traverse) when answering a query */
+typedef struct query_item_s
+{
+    char *path;
+    bool traverse;
+    bool plain;
+    proxy_call_t *call;
+} query_item_t;
+
+static GList *
+_query_add (GList *items, char *path, bool traverse)
+{
+    query_item_t *item = g_malloc0 (sizeof (query_item_t));
+    item->path = path;
+    item->traverse = traverse;
+    return g_list_prepend (items, item);
+}
+
 static bool
 handle_query (rpc_message msg)
 {
     char *path;
     char *value;
     GList *paths = NULL;
-    GList *ipath;
-    GList *ivalue;
-    GList *value_matches = NULL;
+    GList *items = NULL;
     GList *possible_matches = NULL;
-    GList *matches = NULL;
     GList *iter = NULL;
     GList *iter2 = NULL;
-    char *tmp = NULL;
-    char *ptr = NULL;
-    char *chunk;
+    query_plan_t plan;
 
     INC_COUNTER (counters.query);
 
     while ((path = rpc_msg_decode_string (msg)) != NULL)
     {
-        paths = g_list_prepend (paths, path);
+        paths = g_list_prepend (paths, g_strdup (path));
         DEBUG ("QUERY: %s\n", path);
     }
     paths = g_list_reverse (paths);
+    rpc_msg_reset (msg);
+
+    /* Expand the query into the paths to get or traverse */
+    plan_init (&plan);
     for (iter2 = g_list_first (paths); iter2; iter2 = g_list_next (iter2))
     {
+        const char *query = (const char *) iter2->data;
+        const char *star = strrchr (query, '*');
         bool traverse = false;
         bool one_level = false;
+        char *tmp;
 
-        if (strchr (iter2->data, '*') == NULL)
+        if (star == NULL)
         {
-            value = get_value ((char *) iter2->data);
-            if (value)
-            {
-                matches = g_list_prepend (matches, g_strdup ((char *) iter2->data));
-                value_matches = g_list_prepend (value_matches, g_strdup (value));
-            }
-            g_free (value);
+            items = _query_add (items, g_strdup (query), false);
+            continue;
         }
-        else
+
+        /* Path contains a "*". Expand all but the last one */
+        if (query[strlen (query) - 1] == '*')
         {
-            /* Path contains a "*".
-             * Grab first level (from root) */
-            tmp = g_strdup (iter2->data);
-            if (tmp[strlen (tmp) - 1] == '*')
-            {
-                traverse = true;
-            }
-            else if (tmp[strlen (tmp) - 1] == '/')
+            traverse = true;
+        }
+        else if (query[strlen (query) - 1] == '/')
+        {
+            one_level = true;
+        }
+        tmp = g_strndup (query, star - query);
+        possible_matches = plan_expand (&plan, tmp);
+        g_free (tmp);
+        for (iter = g_list_first (possible_matches); iter; iter = g_list_next (iter))
+        {
+            char *key;
+
+            if (traverse)
             {
-                one_level = true;
+                items = _query_add (items, g_strdup (iter->data), true);
+                continue;
             }
-            *strrchr (tmp, '*') = '\0';
-            chunk = strtok_r (tmp, "*", &ptr);
-            if (chunk)
+
+            /* Go through each path match and see if all keys match */
+            key = g_strdup_printf ("%s%s", (char *) iter->data, star + 1);
+            if (one_level)
             {
-                possible_matches = search_path (chunk);
+                /* Remove the slash off the end of the string */
+                key[strlen (key) - 1] = '\0';
             }
-            /* For each * do a search + add keys, then re-search */
-            while ((chunk = strtok_r (NULL, "*", &ptr)) != NULL)
-            {
-                GList *last_round = possible_matches;
-                possible_matches = NULL;
-                for (iter = g_list_first (last_round); iter; iter = g_list_next (iter))
-                {
-                    char *next_level = NULL;
+            items = _query_add (items, key, false);
+        }
+        g_list_free_full (possible_matches, g_free);
+    }
+    g_list_free_full (paths, g_free);
+    items = g_list_reverse (items);
 
-                    next_level = g_strdup_printf ("%s%s", (char *) iter->data, chunk);
-                    possible_matches =
-                        g_list_concat (search_path (next_level), possible_matches);
-                    g_free (next_level);
-                }
-                g_list_free_full (last_round, g_free);
+    /* Send every proxied request before waiting for any of them */
+    for (iter = items; iter; iter = g_list_next (iter))
+    {
+        query_item_t *item = (query_item_t *) iter->data;
+        item->plain = plan_plain (&plan, item->path);
+        if (!item->plain)
+            item->call = proxy_call_start (item->traverse ? MODE_TRAVERSE : MODE_GET, item->path);
+    }
+
+    /* Results are encoded (and possibly streamed) in order */
+    for (iter = items; iter; iter = g_list_next (iter))
+    {
+        query_item_t *item = (query_item_t *) iter->data;
+
+        if (item->traverse)
+        {
+            if (item->call)
+                proxy_call_encode (item->call, msg);
+            else
+                traverse_local (msg, item->path);
+        }
+        else
+        {
+            size_t vsize = 0;
+
+            value = item->call ? proxy_call_value (item->call) : NULL;
+            if (item->plain)
+            {
+                if (!db_get (item->path, (unsigned char **) &value, &vsize))
+                    value = NULL;
             }
-            if (traverse)
+            else if (!value)
             {
-                for (iter = g_list_first (possible_matches); iter;
-                     iter = g_list_next (iter))
-                {
-                    _traverse_paths (&matches, &value_matches, (char *) iter->data, cb_all);
-                }
+                value = get_local_value (item->path);
             }
-            else
+            if (value)
             {
-                /* Go through each path match and see if all keys match */
-                for (iter = g_list_first (possible_matches); iter;
-                     iter = g_list_next (iter))
-                {
-                    char *key = NULL;
-
-                    key = g_strdup_printf ("%s%s", (char *) iter->data,
-                                           strrchr (iter2->data, '*') + 1);
-                    if (one_level)
-                    {
-                        /* Remove the slash off the end of the string */
-                        key[strlen (key) - 1] = '\0';
-                    }
-                    value = get_value (key);
-                    if (value)
-                    {
-                        matches = g_list_prepend (matches, g_strdup (key));
-                        value_matches = g_list_prepend (value_matches, g_strdup (value));
-                    }
-                    g_free (value);
-                    g_free (key);
-                }
+                _query_encode (msg, item->path, value);
             }
-            g_free (tmp);
-            g_list_free_full (possible_matches, g_free);
+            g_free (value);
         }
+        g_free (item->path);
+        g_free (item);
     }
-    /* Send result */
-    rpc_msg_reset (msg);
-    for (ipath = g_list_first (matches), ivalue = g_list_first (value_matches);
-         ipath && ivalue; ipath = g_list_next (ipath), ivalue = g_list_next (ivalue))
-    {
-        DEBUG ("  %s = %s\n", (char *) ipath->data, (char *) ivalue->data);
-        rpc_msg_encode_string (msg, (char *) ipath->data);
-        rpc_msg_encode_string (msg, (char *) ivalue->data);
-    }
-    g_list_free_full (matches, g_free);
-    g_list_free_full (value_matches, g_free);
-    g_list_free (paths);
+    g_list_free (items);
+    plan_clear (&plan);
 
     return true;
 }
@@ -1646,11 +3259,9 @@ handle_prune (rpc_message msg)
 {
     int32_t result = 0;
     const char *path;
-    GList *paths = NULL, *iter;
+    GList *paths = NULL, *pruners = NULL, *iter;
     int32_t validation_result = 0;
     int validation_lock = 0;
-    char *value = NULL;
-    size_t vsize = 0;
 
     /* Parse the parameters */
     path = rpc_msg_decode_string (msg);
@@ -1676,13 +3287,8 @@ handle_prune (rpc_message msg)
     }
     result = 0;
 
-    /* Collect the list of deleted paths for notification */
-    if (db_get (path, (unsigned char**)&value, &vsize))
-    {
-        paths = g_list_prepend (paths, g_strdup (path));
-        g_free (value);
-    }
-    _search_paths (&paths, path);
+    /* Collect the list of deleted paths for validation and notification */
+    _prune_paths (&paths, path);
 
     /* Call validators for each pruned path to ensure the path can be set to NULL. */
     for (iter = paths; iter; iter = g_list_next (iter))
@@ -1702,6 +3308,10 @@ handle_prune (rpc_message msg)
     /* Only do the prune if it is valid to do so. */
     if (validation_result >= 0)
     {
+        /* Prune watchers only hear about trees that held something */
+        if (paths || db_timestamp (path))
+            pruners = prune_watchers (path);
+
         /* Prune from database - but protect /apteryx */
         if (strcmp (path, "/") == 0)
         {
@@ -1725,8 +3335,9 @@ handle_prune (rpc_message msg)
 
     if (validation_result >= 0)
     {
-        /* Call watchers for each pruned path */
-        notify_watchers (paths, NULL, false);
+        /* Call waiters and watchers for each pruned path */
+        wake_waiters_prune (path);
+        notify_prune (path, paths, pruners);
     }
 
     /* Release validation lock - this is a sensitive value */
@@ -1740,12 +3351,14 @@ handle_prune (rpc_message msg)
     rpc_msg_reset (msg);
     rpc_msg_encode_uint64 (msg, (uint64_t) result);
     g_list_free_full (paths, g_free);
+    g_list_free_full (pruners, (GDestroyNotify) cb_release);
     return true;
 }
 
 static bool
 handle_timestamp (rpc_message msg)
 {
+    proxy_call_t *call;
     uint64_t value;
     const char *path;
 
@@ -1762,7 +3375,9 @@ handle_timestamp (rpc_message msg)
     INC_COUNTER (counters.timestamp);
 
     /* Proxy first */
-    if ((value = proxy_timestamp (path)) == 0)
+    call = proxy_call_start (MODE_TIMESTAMP, path);
+    value = call ? proxy_call_timestamp (call) : 0;
+    if (value == 0)
     {
         /* Lookup value */
         value = db_timestamp (path);
@@ -1775,6 +3390,277 @@ handle_timestamp (rpc_message msg)
     return true;
 }
 
+static bool
+handle_timestamps (rpc_message msg)
+{
+    GList *paths = NULL;
+    GList *calls = NULL;
+    GList *iter, *citer;
+    const char *path;
+    uint64_t value;
+
+    /* Parse the parameters */
+    while ((path = rpc_msg_decode_string (msg)) != NULL)
+        paths = g_list_prepend (paths, g_strdup (path));
+    if (paths == NULL)
+    {
+        ERROR ("TIMESTAMP: Invalid parameters.\n");
+        INC_COUNTER (counters.timestamp_invalid);
+        return false;
+    }
+    paths = g_list_reverse (paths);
+    INC_COUNTER (counters.timestamp);
+
+    /* Send every proxied request before waiting for any of them */
+    for (iter = paths; iter; iter = g_list_next (iter))
+        calls = g_list_append (calls, proxy_call_start (MODE_TIMESTAMP, (const char *) iter->data));
+
+    /* Send results in the order they were asked for */
+    rpc_msg_reset (msg);
+    for (iter = paths, citer = calls; iter && citer;
+         iter = g_list_next (iter), citer = g_list_next (citer))
+    {
+        path = (const char *) iter->data;
+        DEBUG ("TIMESTAMP: %s\n", path);
+
+        /* Proxy first */
+        value = citer->data ? proxy_call_timestamp ((proxy_call_t *) citer->data) : 0;
+        if (value == 0)
+        {
+            /* Lookup value */
+            value = db_timestamp (path);
+        }
+        DEBUG ("     = %"PRIu64"\n", value);
+        rpc_msg_encode_uint64 (msg, value);
+    }
+    g_list_free (calls);
+    g_list_free_full (paths, g_free);
+    return true;
+}
+
+/* Wait on the proxied instance on a thread of the wait pool */
+static void
+proxy_wait_func (gpointer data, gpointer user_data)
+{
+    waiter_t *waiter = (waiter_t *) data;
+    uint64_t now = get_time_us ();
+
+    if (!proxy_wait (waiter->path, waiter->since,
+                     waiter->until > now ? waiter->until - now : 0, &waiter->value))
+    {
+        /* No proxy to ask after all - wait here instead */
+        g_atomic_int_inc (&waiting);
+        pthread_mutex_lock (&wait_lock);
+        waiter->value = wait_timestamp (waiter->path, waiter->since);
+        if (waiter->value == waiter->since && waiter->until > now && wait_running)
+        {
+            waiter_add (waiter);
+            pthread_mutex_unlock (&wait_lock);
+            return;
+        }
+        pthread_mutex_unlock (&wait_lock);
+        g_atomic_int_add (&waiting, -1);
+        if (waiter->value == waiter->since)
+            waiter->value = 0;
+    }
+    waiter_respond (waiter);
+}
+
+static void
+wait_init (void)
+{
+    wait_queues = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    wait_pool = g_thread_pool_new (proxy_wait_func, NULL, -1, FALSE, NULL);
+    wait_running = true;
+    if (pthread_create (&wait_thread, NULL, wait_timer, NULL) != 0)
+    {
+        ERROR ("Failed to start the wait timer\n");
+        wait_running = false;
+    }
+}
+
+/* Answer everyone still waiting while they can still be sent a response */
+static void
+wait_shutdown (void)
+{
+    bool running;
+    waiter_t *waiter;
+
+    if (!wait_queues)
+        return;
+    pthread_mutex_lock (&wait_lock);
+    running = wait_running;
+    wait_running = false;
+    pthread_cond_signal (&wait_cond);
+    pthread_mutex_unlock (&wait_lock);
+    if (running)
+        pthread_join (wait_thread, NULL);
+    g_thread_pool_free (wait_pool, FALSE, TRUE);
+    while (wait_timers)
+    {
+        waiter = (waiter_t *) wait_timers->data;
+        waiter->value = 0;
+        waiter_remove (waiter);
+        waiter_respond (waiter);
+    }
+    g_hash_table_destroy (wait_queues);
+    wait_queues = NULL;
+}
+
+static bool
+handle_wait (rpc_message msg)
+{
+    GList *proxies;
+    const char *path;
+    uint64_t since;
+    uint64_t timeout;
+    uint64_t value;
+
+    /* Parse the parameters */
+    path = rpc_msg_decode_string (msg);
+    if (path == NULL)
+    {
+        ERROR ("WAIT: Invalid parameters.\n");
+        INC_COUNTER (counters.wait_invalid);
+        return false;
+    }
+    since = rpc_msg_decode_uint64 (msg);
+    timeout = MIN (rpc_msg_decode_uint64 (msg), RPC_TIMEOUT_US / 2);
+
+    DEBUG ("WAIT: %s since %"PRIu64" for %"PRIu64"us\n", path, since, timeout);
+    INC_COUNTER (counters.wait);
+
+    /* Proxy first - the wait pool blocks on the proxied instance so that
+     * this worker is free for other requests */
+    proxies = config_get_proxies (path);
+    if (proxies)
+    {
+        g_list_free_full (proxies, (GDestroyNotify) cb_release);
+        pthread_mutex_lock (&wait_lock);
+        if (wait_running)
+        {
+            g_thread_pool_push (wait_pool, waiter_new (msg, path, since, timeout), NULL);
+            pthread_mutex_unlock (&wait_lock);
+            return true;
+        }
+        pthread_mutex_unlock (&wait_lock);
+        value = 0;
+        goto exit;
+    }
+
+    /* Count ourselves before checking so no change can be missed */
+    g_atomic_int_inc (&waiting);
+    pthread_mutex_lock (&wait_lock);
+    value = wait_timestamp (path, since);
+    if (value == since && timeout && wait_running)
+    {
+        /* Park the request until the path changes or the time is up */
+        waiter_add (waiter_new (msg, path, since, timeout));
+        pthread_mutex_unlock (&wait_lock);
+        return true;
+    }
+    pthread_mutex_unlock (&wait_lock);
+    g_atomic_int_add (&waiting, -1);
+    if (value == since)
+        value = 0;
+
+exit:
+    /* Send result */
+    DEBUG ("     = %"PRIu64"\n", value);
+    rpc_msg_reset (msg);
+    rpc_msg_encode_uint64 (msg, value);
+    return true;
+}
+
+static void
+aggregate_sum (int64_t number, void *data)
+{
+    *(int64_t *) data += number;
+}
+
+static void
+aggregate_min (int64_t number, void *data)
+{
+    *(int64_t *) data = MIN (*(int64_t *) data, number);
+}
+
+static void
+aggregate_max (int64_t number, void *data)
+{
+    *(int64_t *) data = MAX (*(int64_t *) data, number);
+}
+
+static bool
+handle_aggregate (rpc_message msg)
+{
+    const char *path;
+    uint8_t op;
+    int64_t result = 0;
+    bool found = true;
+
+    /* Parse the parameters */
+    op = rpc_msg_decode_uint8 (msg);
+    path = rpc_msg_decode_string (msg);
+    if (path == NULL || op > APTERYX_AGGREGATE_MAX)
+    {
+        ERROR ("AGGREGATE: Invalid parameters.\n");
+        INC_COUNTER (counters.aggregate_invalid);
+        return false;
+    }
+
+    DEBUG ("AGGREGATE: %s (%d)\n", path, op);
+    INC_COUNTER (counters.aggregate);
+
+    /* Proxy first */
+    if (!proxy_aggregate (path, op, &found, &result))
+    {
+        /* Refresh everything the path or pattern could match before
+         * taking the lock - refreshers write to the database */
+        char *top = g_strdup (path);
+        char *star = strstr (top, "/*");
+        if (star)
+            *star = '\0';
+        refreshers_traverse (top[0] ? top : "/", cb_refresh);
+        g_free (top);
+
+        /* Counts are kept in the database nodes, the rest are one walk */
+        pthread_rwlock_rdlock (&db_lock);
+        switch (op)
+        {
+        case APTERYX_AGGREGATE_CHILDREN:
+            result = db_children_no_lock (path);
+            break;
+        case APTERYX_AGGREGATE_VALUES:
+            result = db_values_no_lock (path);
+            break;
+        case APTERYX_AGGREGATE_EXISTS:
+            result = db_values_no_lock (path) != 0;
+            break;
+        case APTERYX_AGGREGATE_SUM:
+            found = db_numbers_no_lock (path, aggregate_sum, &result) != 0;
+            break;
+        case APTERYX_AGGREGATE_MIN:
+            result = INT64_MAX;
+            found = db_numbers_no_lock (path, aggregate_min, &result) != 0;
+            break;
+        case APTERYX_AGGREGATE_MAX:
+            result = INT64_MIN;
+            found = db_numbers_no_lock (path, aggregate_max, &result) != 0;
+            break;
+        }
+        pthread_rwlock_unlock (&db_lock);
+        if (!found)
+            result = 0;
+    }
+
+    /* Send result */
+    DEBUG ("     = %"PRId64"%s\n", result, found ? "" : " (none)");
+    rpc_msg_reset (msg);
+    rpc_msg_encode_uint8 (msg, found);
+    rpc_msg_encode_uint64 (msg, (uint64_t) result);
+    return true;
+}
+
 static bool
 handle_memuse (rpc_message msg)
 {
@@ -1806,15 +3692,26 @@ handle_memuse (rpc_message msg)
 static bool
 msg_handler (rpc_message msg)
 {
+    /* Drop requests that waited in the queue for longer than the client */
+    if (rpc_msg_expired ())
+    {
+        INC_COUNTER (counters.expired);
+        return false;
+    }
+
     APTERYX_MODE mode = rpc_msg_decode_uint8 (msg);
     switch (mode)
     {
     case MODE_SET_WITH_ACK:
-        return handle_set (msg, true);
+        return handle_set (msg, true, false);
     case MODE_SET:
-        return handle_set (msg, false);
+        return handle_set (msg, false, false);
+    case MODE_SET_CHECKED:
+        return handle_set (msg, false, true);
     case MODE_GET:
-        return handle_get (msg);
+        return handle_get (msg, false);
+    case MODE_GET_IF_MODIFIED:
+        return handle_get (msg, true);
     case MODE_QUERY:
         return handle_query (msg);
     case MODE_SEARCH:
@@ -1822,13 +3719,29 @@ msg_handler (rpc_message msg)
     case MODE_FIND:
         return handle_find (msg);
     case MODE_TRAVERSE:
-        return handle_traverse (msg);
+        return handle_traverse (msg, false);
+    case MODE_TRAVERSE_IF_MODIFIED:
+        return handle_traverse (msg, true);
+    case MODE_TRAVERSE_MULTI:
+        return handle_traverse_multi (msg);
     case MODE_PRUNE:
         return handle_prune (msg);
     case MODE_TIMESTAMP:
         return handle_timestamp (msg);
+    case MODE_TIMESTAMPS:
+        return handle_timestamps (msg);
+    case MODE_WAIT:
+        return handle_wait (msg);
     case MODE_MEMUSE:
         return handle_memuse (msg);
+    case MODE_AGGREGATE:
+        return handle_aggregate (msg);
+    case MODE_SEARCH_RANGE:
+        return handle_search_range (msg);
+    case MODE_SYNC:
+        return handle_sync (msg);
+    case MODE_TXN:
+        return handle_txn (msg);
     default:
         ERROR ("MSG: Unexpected mode %d\n", mode);
         break;
@@ -1845,13 +3758,18 @@ termination_handler (void)
 void
 help (void)
 {
-    printf ("Usage: apteryxd [-h] [-b] [-d] [-p <pidfile>] [-r <runfile>] [-l <url>]\n"
+    printf ("Usage: apteryxd [-h] [-b] [-d] [-p <pidfile>] [-r <runfile>] [-l <url>] [-c <count>] [-i] [-m <count>] [-t <count>]\n"
             "  -h   show this help\n"
             "  -b   background mode\n"
             "  -d   enable verbose debug\n"
             "  -p   use <pidfile> (background mode only)\n"
             "  -r   use <runfile>\n"
-            "  -l   listen on URL <url> (defaults to "APTERYX_SERVER")\n");
+            "  -l   listen on URL <url> (defaults to "APTERYX_SERVER")\n"
+            "  -c   use <count> connections to each callback/proxy destination\n"
+            "  -i   use the connection with the fewest requests in flight (default round-robin)\n"
+            "  -m   allow at most <count> requests queued or in progress per client, refusing\n"
+            "       more with EBUSY (default unlimited)\n"
+            "  -t   use up to <count> threads to walk each very large tree (default 1)\n");
 }
 
 int
@@ -1861,12 +3779,15 @@ main (int argc, char **argv)
     const char *run_file = NULL;
     const char *url = APTERYX_SERVER;
     bool background = false;
+    int pool_size = 1;
+    rpc_pool_policy pool_policy = RPC_POOL_ROUND_ROBIN;
+    int client_limit = 0;
     pthread_mutexattr_t callback_recursive;
     FILE *fp;
     int i;
 
     /* Parse options */
-    while ((i = getopt (argc, argv, "hdbp:r:l:")) != -1)
+    while ((i = getopt (argc, argv, "hdbp:r:l:c:im:t:")) != -1)
     {
         switch (i)
         {
@@ -1886,6 +3807,18 @@ main (int argc, char **argv)
         case 'l':
             url = optarg;
             break;
+        case 'c':
+            pool_size = atoi (optarg);
+            break;
+        case 'i':
+            pool_policy = RPC_POOL_LEAST_INFLIGHT;
+            break;
+        case 'm':
+            client_limit = atoi (optarg);
+            break;
+        case 't':
+            traverse_threads = atoi (optarg);
+            break;
         case '?':
         case 'h':
         default:
@@ -1970,12 +3903,19 @@ main (int argc, char **argv)
     db_init ();
     /* Configuration Set/Get */
     config_init ();
+    /* Clients waiting for changes */
+    wait_init ();
 
     /* Create a lock for currently-validating */
     pthread_mutexattr_init (&callback_recursive);
     pthread_mutexattr_settype (&callback_recursive, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init (&validating, &callback_recursive);
 
+    /* Helpers for large traversals */
+    if (traverse_threads > 1)
+        traverse_pool = g_thread_pool_new (traverse_helper, NULL, traverse_threads - 1,
+                                           FALSE, NULL);
+
     /* Init the RPC for the server instance */
     rpc = rpc_init (RPC_TIMEOUT_US, msg_handler);
     if (rpc == NULL)
@@ -1983,6 +3923,8 @@ main (int argc, char **argv)
         ERROR ("Failed to initialise RPC service\n");
         goto exit;
     }
+    rpc_client_pool_set (rpc, pool_size, pool_policy);
+    rpc_server_limit (rpc, client_limit);
 
     /* Create server and process requests */
     if (!rpc_server_bind (rpc, url, url))
@@ -1998,6 +3940,7 @@ main (int argc, char **argv)
         ERROR ("Failed to initialise proxy RPC service\n");
         goto exit;
     }
+    rpc_client_pool_set (proxy_rpc, pool_size, pool_policy);
 
     /* Create run file */
     if (run_file)
@@ -2036,6 +3979,9 @@ exit:
         close (child_ready[1]);
     }
 
+    /* Answer anyone still waiting */
+    wait_shutdown ();
+
     /* Cleanup callbacks */
     if (proxy_rpc)
     {
@@ -2047,6 +3993,9 @@ exit:
         rpc_shutdown (rpc);
     }
 
+    if (traverse_pool)
+        g_thread_pool_free (traverse_pool, FALSE, TRUE);
+
     db_shutdown ();
     config_shutdown ();
 
@@ -392,12 +392,47 @@ cb_match (struct callback_node *list, const char *path)
     return matches;
 }
 
+/* Whether a list has a callback without any of the skipped flags */
+static bool
+cb_list_has (GList *list, uint32_t skip)
+{
+    if (!skip)
+    {
+        return list != NULL;
+    }
+    for (GList *iter = list; iter; iter = iter->next)
+    {
+        if (!(((cb_info_t *) iter->data)->flags & skip))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Whether anything below a node has a callback without the skipped flags */
+static bool
+cb_children_have (struct callback_node *node, uint32_t skip)
+{
+    GList *children = hashtree_children_get (&node->hashtree_node);
+    bool found = false;
+
+    for (GList *iter = children; iter && !found; iter = iter->next)
+    {
+        struct callback_node *child = iter->data;
+        found = cb_list_has (child->exact, skip) || cb_list_has (child->directory, skip) ||
+            cb_list_has (child->following, skip) || cb_children_have (child, skip);
+    }
+    g_list_free (children);
+    return found;
+}
+
 /* Finds if a given path has any callbacks from this tree under it */
 static bool
-_cb_exists (struct callback_node *node, const char *path)
+_cb_exists (struct callback_node *node, const char *path, uint32_t skip)
 {
     bool found = false;
-    if (node->following)
+    if (cb_list_has (node->following, skip))
     {
         return true;
     }
@@ -405,11 +440,16 @@ _cb_exists (struct callback_node *node, const char *path)
     /* Terminating condition */
     if (strlen (path) == 0 || !strchr (path + 1, '/'))
     {
-        if (node->directory)
+        if (cb_list_has (node->directory, skip))
         {
             return true;
         }
 
+        if (skip)
+        {
+            return cb_children_have (node, skip);
+        }
+
         struct hashtree_node *next_stage =
             hashtree_path_to_node (&node->hashtree_node, "/*");
         if (next_stage)
@@ -440,7 +480,8 @@ _cb_exists (struct callback_node *node, const char *path)
     struct hashtree_node *next_stage = hashtree_path_to_node (&node->hashtree_node, "/*");
     if (next_stage)
     {
-        found = _cb_exists ((struct callback_node *) next_stage, path + strlen (tmp) + 1);
+        found = _cb_exists ((struct callback_node *) next_stage, path + strlen (tmp) + 1,
+                            skip);
     }
 
     if (!found && strlen (tmp) > 0)
@@ -453,7 +494,7 @@ _cb_exists (struct callback_node *node, const char *path)
         if (next_stage)
         {
             found = _cb_exists ((struct callback_node *) next_stage,
-                                path + strlen (with_leading_slash));
+                                path + strlen (with_leading_slash), skip);
         }
         free (with_leading_slash);
     }
@@ -468,11 +509,136 @@ cb_exists (struct callback_node *node, const char *path)
 {
     bool result = false;
     pthread_mutex_lock (&tree_lock);
-    result = _cb_exists (node, path);
+    result = _cb_exists (node, path, 0);
     pthread_mutex_unlock (&tree_lock);
     return result;
 }
 
+bool
+cb_exists_except (struct callback_node *node, const char *path, uint32_t flags)
+{
+    bool result = false;
+    pthread_mutex_lock (&tree_lock);
+    result = _cb_exists (node, path, flags);
+    pthread_mutex_unlock (&tree_lock);
+    return result;
+}
+
+static GList *
+cb_gather_flagged (GList *list, GList *callbacks_so_far, uint32_t flags)
+{
+    for (GList *iter = list; iter; iter = iter->next)
+    {
+        cb_info_t *cb = iter->data;
+        if (cb->active && (cb->flags & flags) && !g_list_find (callbacks_so_far, cb))
+        {
+            callbacks_so_far = g_list_prepend (callbacks_so_far, cb);
+        }
+    }
+    return callbacks_so_far;
+}
+
+static GList *
+cb_gather_flagged_tree (struct callback_node *node, GList *callbacks_so_far, uint32_t flags)
+{
+    GList *children = hashtree_children_get (&node->hashtree_node);
+
+    callbacks_so_far = cb_gather_flagged (node->exact, callbacks_so_far, flags);
+    callbacks_so_far = cb_gather_flagged (node->directory, callbacks_so_far, flags);
+    callbacks_so_far = cb_gather_flagged (node->following, callbacks_so_far, flags);
+    for (GList *iter = children; iter; iter = iter->next)
+    {
+        callbacks_so_far = cb_gather_flagged_tree ((struct callback_node *) iter->data,
+                                                   callbacks_so_far, flags);
+    }
+    g_list_free (children);
+    return callbacks_so_far;
+}
+
+static GList *
+cb_gather_below (struct callback_node *node, GList *callbacks_so_far, const char *path,
+                 uint32_t flags)
+{
+    struct hashtree_node *next_stage;
+
+    callbacks_so_far = cb_gather_flagged (node->following, callbacks_so_far, flags);
+
+    /* The whole tree */
+    if (strlen (path) == 0)
+    {
+        return cb_gather_flagged_tree (node, callbacks_so_far, flags);
+    }
+
+    /* Terminating condition - everything registered at or below the path */
+    if (!strchr (path + 1, '/'))
+    {
+        callbacks_so_far = cb_gather_flagged (node->directory, callbacks_so_far, flags);
+        next_stage = hashtree_path_to_node (&node->hashtree_node, "/*");
+        if (next_stage)
+        {
+            callbacks_so_far = cb_gather_flagged_tree ((struct callback_node *) next_stage,
+                                                       callbacks_so_far, flags);
+        }
+        next_stage = hashtree_path_to_node (&node->hashtree_node, path);
+        if (next_stage)
+        {
+            callbacks_so_far = cb_gather_flagged_tree ((struct callback_node *) next_stage,
+                                                       callbacks_so_far, flags);
+        }
+        return callbacks_so_far;
+    }
+
+    char *tmp = strdup (path + 1);
+    *strchr (tmp, '/') = '\0';
+
+    next_stage = hashtree_path_to_node (&node->hashtree_node, "/*");
+    if (next_stage)
+    {
+        callbacks_so_far = cb_gather_below ((struct callback_node *) next_stage,
+                                            callbacks_so_far, path + strlen (tmp) + 1, flags);
+    }
+
+    if (strlen (tmp) > 0)
+    {
+        char *with_leading_slash = NULL;
+        if (asprintf (&with_leading_slash, "/%s", tmp) >= 0)
+        {
+            next_stage = hashtree_path_to_node (&node->hashtree_node, with_leading_slash);
+            if (next_stage)
+            {
+                callbacks_so_far = cb_gather_below ((struct callback_node *) next_stage,
+                                                    callbacks_so_far,
+                                                    path + strlen (with_leading_slash),
+                                                    flags);
+            }
+            free (with_leading_slash);
+        }
+    }
+
+    free (tmp);
+
+    return callbacks_so_far;
+}
+
+GList *
+cb_match_tree (struct callback_node *list, const char *path, uint32_t flags)
+{
+    GList *matches = NULL;
+    char *tmp = g_strdup (path);
+    size_t length = strlen (tmp);
+
+    if (length && tmp[length - 1] == '/')
+    {
+        tmp[length - 1] = '\0';
+    }
+    pthread_mutex_lock (&tree_lock);
+    matches = cb_gather_below (list, matches, tmp, flags);
+    g_list_foreach (matches, (GFunc) cb_ref, NULL);
+    pthread_mutex_unlock (&tree_lock);
+    g_free (tmp);
+    return matches;
+}
+
 struct callback_node *
 cb_init (void)
 {
@@ -648,6 +814,46 @@ test_cb_match ()
     cb_shutdown (watch_list);
 }
 
+void
+test_cb_match_tree ()
+{
+    GList *matches = NULL;
+    cb_info_t *cb = NULL;
+    struct callback_node *watch_list = cb_init ();
+
+    cb = cb_create (watch_list, "above", "/firewall/*", 1, 0);
+    cb->flags = CB_FLAG_PRUNE;
+    cb_release (cb);
+    cb = cb_create (watch_list, "below", "/firewall/rules/*/app", 2, 0);
+    cb->flags = CB_FLAG_PRUNE;
+    cb_release (cb);
+    cb = cb_create (watch_list, "sibling", "/firewall/zones/*", 3, 0);
+    cb->flags = CB_FLAG_PRUNE;
+    cb_release (cb);
+    cb = cb_create (watch_list, "plain", "/firewall/rules/10/", 4, 0);
+    cb_release (cb);
+
+    matches = cb_match_tree (watch_list, "/firewall/rules", CB_FLAG_PRUNE);
+    CU_ASSERT (g_list_length (matches) == 2);
+    g_list_free_full (matches, (GDestroyNotify) cb_release);
+    matches = cb_match_tree (watch_list, "/firewall/rules/", CB_FLAG_PRUNE);
+    CU_ASSERT (g_list_length (matches) == 2);
+    g_list_free_full (matches, (GDestroyNotify) cb_release);
+    matches = cb_match_tree (watch_list, "/", CB_FLAG_PRUNE);
+    CU_ASSERT (g_list_length (matches) == 3);
+    g_list_free_full (matches, (GDestroyNotify) cb_release);
+    matches = cb_match_tree (watch_list, "/interfaces", CB_FLAG_PRUNE);
+    CU_ASSERT (matches == NULL);
+
+    CU_ASSERT (cb_exists (watch_list, "/firewall/zones/private"));
+    CU_ASSERT (!cb_exists_except (watch_list, "/firewall/zones/private", CB_FLAG_PRUNE));
+    CU_ASSERT (cb_exists_except (watch_list, "/firewall/rules", CB_FLAG_PRUNE));
+    CU_ASSERT (cb_exists_except (watch_list, "/firewall/rules/10/app", CB_FLAG_PRUNE));
+    CU_ASSERT (!cb_exists_except (watch_list, "/firewall/rules/20/app", CB_FLAG_PRUNE));
+
+    cb_shutdown (watch_list);
+}
+
 void
 test_cb_release ()
 {
@@ -779,6 +985,7 @@ test_cb_exist_locking ()
 CU_TestInfo tests_callbacks[] = {
     { "init", test_cb_init },
     { "match", test_cb_match },
+    { "match tree", test_cb_match_tree },
     { "release", test_cb_release },
     { "disable", test_cb_disable },
     { "match performance random", test_cb_match_perf_random },
@@ -33,6 +33,12 @@ static struct callback_node *index_list;
 static struct callback_node *proxy_list;
 static GHashTable *guid_to_callback = NULL;
 static pthread_rwlock_t guid_lock = PTHREAD_RWLOCK_INITIALIZER;
+/* Watchers that want a single event for a pruned subtree */
+static int prune_watchers = 0;
+/* Path prefixes where sets that change nothing are ignored */
+static GHashTable *suppress = NULL;
+static int suppress_count = 0;
+static pthread_rwlock_t suppress_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 static bool
 handle_debug_set (const char *path, const char *value)
@@ -61,6 +67,23 @@ handle_sockets_set (const char *path, const char *value)
     return res;
 }
 
+static bool
+handle_suppress_set (const char *path, const char *value)
+{
+    const char *guid = path + strlen (APTERYX_SUPPRESS_PATH "/");
+
+    DEBUG ("SUPPRESS %s:%s\n", guid, value);
+
+    pthread_rwlock_wrlock (&suppress_lock);
+    if (value)
+        g_hash_table_replace (suppress, g_strdup (guid), g_strdup (value));
+    else
+        g_hash_table_remove (suppress, guid);
+    g_atomic_int_set (&suppress_count, g_hash_table_size (suppress));
+    pthread_rwlock_unlock (&suppress_lock);
+    return true;
+}
+
 static cb_info_t *
 find_callback (const char *guid)
 {
@@ -81,9 +104,11 @@ update_callback (struct callback_node *list, const char *guid, const char *value
 {
     cb_info_t *cb;
     uint64_t pid, callback, hash;
+    uint32_t flags = 0;
 
-    /* Parse callback info from the encoded guid */
-    if (sscanf (guid, "%" PRIX64 "-%" PRIx64 "-%" PRIx64 "", &pid, &callback, &hash) != 3)
+    /* Parse callback info from the encoded guid (flags are optional) */
+    if (sscanf (guid, "%" PRIX64 "-%" PRIx64 "-%" PRIx64 "-%" SCNx32, &pid, &callback,
+                &hash, &flags) < 3)
     {
         ERROR ("Invalid GUID (%s)\n", guid ? : "NULL");
         return NULL;
@@ -101,6 +126,8 @@ update_callback (struct callback_node *list, const char *guid, const char *value
         DEBUG ("Callback GUID(%s) already exists - releasing old version\n", guid);
         pthread_rwlock_wrlock (&guid_lock);
         g_hash_table_remove (guid_to_callback, (char *) cb->guid);
+        if (cb->flags & CB_FLAG_PRUNE)
+            g_atomic_int_add (&prune_watchers, -1);
         cb_disable (cb);
         cb_release (cb);
         pthread_rwlock_unlock (&guid_lock);
@@ -117,6 +144,9 @@ update_callback (struct callback_node *list, const char *guid, const char *value
             cb_release (cb);
         }
         cb = cb_create (list, guid, value, pid, callback);
+        cb->flags = flags;
+        if (flags & CB_FLAG_PRUNE)
+            g_atomic_int_add (&prune_watchers, 1);
 
         /* This will either replace the entry removed above, or add a new one. */
         pthread_rwlock_wrlock (&guid_lock);
@@ -131,6 +161,8 @@ update_callback (struct callback_node *list, const char *guid, const char *value
         {
             pthread_rwlock_wrlock (&guid_lock);
             g_hash_table_remove (guid_to_callback, (char *) cb->guid);
+            if (cb->flags & CB_FLAG_PRUNE)
+                g_atomic_int_add (&prune_watchers, -1);
             cb_disable (cb);
             cb_release (cb);
             pthread_rwlock_unlock (&guid_lock);
@@ -296,6 +328,125 @@ handle_statistics_refresh (const char *path)
     return (1 * 1000 * 1000);
 }
 
+static uint64_t
+handle_clients_refresh (const char *path)
+{
+    GList *peers = rpc_server_peers (rpc);
+    char *peer_path, *value;
+
+    db_prune (APTERYX_CLIENTS);
+    for (GList *iter = peers; iter; iter = iter->next)
+    {
+        rpc_peer_stats *peer = (rpc_peer_stats *) iter->data;
+        peer_path = g_strdup_printf (APTERYX_CLIENTS "/%d", peer->pid);
+        value = g_strdup_printf ("%u,%u,%u,%u,%u", peer->requests, peer->queued,
+                                 peer->inflight, peer->max_pending, peer->rejected);
+        db_add (peer_path, (const unsigned char *)value, strlen (value) + 1, get_time_us ());
+        g_free (peer_path);
+        g_free (value);
+    }
+    g_list_free_full (peers, g_free);
+    return (1 * 1000 * 1000);
+}
+
+/* Handlers for apteryxd's own paths are called directly rather than being
+ * matched in the callback trees. Paths follow the callback syntax: an exact
+ * path, a directory ending in '/' or a subtree ending in '/*'. */
+typedef struct config_handler_s
+{
+    const char *path;
+    void *fn;
+} config_handler_t;
+
+static const config_handler_t config_watchers[] = {
+    { APTERYX_DEBUG_PATH, handle_debug_set },
+    { APTERYX_SOCKETS_PATH "/", handle_sockets_set },
+    { APTERYX_INDEXERS_PATH "/", handle_indexers_set },
+    { APTERYX_WATCHERS_PATH "/", handle_watchers_set },
+    { APTERYX_REFRESHERS_PATH "/", handle_refreshers_set },
+    { APTERYX_PROVIDERS_PATH "/", handle_providers_set },
+    { APTERYX_VALIDATORS_PATH "/", handle_validators_set },
+    { APTERYX_PROXIES_PATH "/", handle_proxies_set },
+    { APTERYX_SUPPRESS_PATH "/", handle_suppress_set },
+    { NULL, NULL },
+};
+
+static const config_handler_t config_indexers[] = {
+    { APTERYX_COUNTERS "/", handle_counters_index },
+    { NULL, NULL },
+};
+
+static const config_handler_t config_providers[] = {
+    { APTERYX_COUNTERS "/", handle_counters_get },
+    { NULL, NULL },
+};
+
+static void *
+config_handler_find (const config_handler_t *handlers, const char *path)
+{
+    if (strncmp (path, APTERYX_PATH "/", strlen (APTERYX_PATH "/")) != 0)
+        return NULL;
+
+    for (const config_handler_t *handler = handlers; handler->path; handler++)
+    {
+        size_t len = strlen (handler->path);
+
+        if (handler->path[len - 1] == '*')
+        {
+            /* Subtree - the path itself or anything below it */
+            len -= 2;
+            if (strncmp (path, handler->path, len) == 0 &&
+                (path[len] == '\0' || path[len] == '/'))
+                return handler->fn;
+        }
+        else if (handler->path[len - 1] == '/')
+        {
+            /* Directory - one level only */
+            if (strncmp (path, handler->path, len) == 0 &&
+                strchr (path + len, '/') == NULL)
+                return handler->fn;
+        }
+        else if (strcmp (path, handler->path) == 0)
+        {
+            return handler->fn;
+        }
+    }
+    return NULL;
+}
+
+bool
+config_internal_watch (const char *path, const char *value)
+{
+    apteryx_watch_callback cb = config_handler_find (config_watchers, path);
+    if (!cb)
+        return false;
+    DEBUG ("WATCH INTERNAL \"%s\"\n", path);
+    cb (path, value);
+    return true;
+}
+
+bool
+config_internal_index (const char *path, GList **result)
+{
+    apteryx_index_callback cb = config_handler_find (config_indexers, path);
+    if (!cb)
+        return false;
+    DEBUG ("INDEX INTERNAL \"%s\"\n", path);
+    *result = cb (path);
+    return true;
+}
+
+bool
+config_internal_provide (const char *path, char **value)
+{
+    apteryx_provide_callback cb = config_handler_find (config_providers, path);
+    if (!cb)
+        return false;
+    DEBUG ("PROVIDE INTERNAL \"%s\"\n", path);
+    *value = cb (path);
+    return true;
+}
+
 void
 config_shutdown ()
 {
@@ -305,6 +456,7 @@ config_shutdown ()
     cb_shutdown (provide_list);
     cb_shutdown (index_list);
     cb_shutdown (proxy_list);
+    g_hash_table_destroy (suppress);
 }
 
 GList *
@@ -361,6 +513,64 @@ config_get_validators (const char *path)
     return cb_match (validation_list, path);
 }
 
+GList *
+config_get_tree_watchers (const char *path, uint32_t flags)
+{
+    return cb_match_tree (watch_list, path, flags);
+}
+
+bool
+config_tree_has_watchers (const char *path)
+{
+    return cb_exists (watch_list, path);
+}
+
+bool
+config_tree_has_watchers_except (const char *path, uint32_t flags)
+{
+    return cb_exists_except (watch_list, path, flags);
+}
+
+bool
+config_has_prune_watchers (void)
+{
+    return g_atomic_int_get (&prune_watchers) > 0;
+}
+
+bool
+config_has_suppress (void)
+{
+    return g_atomic_int_get (&suppress_count) > 0;
+}
+
+bool
+config_suppress_unchanged (const char *path)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    bool found = false;
+
+    pthread_rwlock_rdlock (&suppress_lock);
+    g_hash_table_iter_init (&iter, suppress);
+    while (!found && g_hash_table_iter_next (&iter, &key, &value))
+    {
+        const char *prefix = (const char *) value;
+        size_t len = strlen (prefix);
+
+        /* Only match whole path elements - "/foo" does not cover "/foobar" */
+        found = strncmp (path, prefix, len) == 0 &&
+            (len == 0 || prefix[len - 1] == '/' || path[len] == '\0' || path[len] == '/');
+    }
+    pthread_rwlock_unlock (&suppress_lock);
+    return found;
+}
+
+bool
+config_tree_has_validators (const char *path)
+{
+    return cb_exists (validation_list, path);
+}
+
 bool
 config_tree_has_refreshers (const char *path)
 {
@@ -379,6 +589,12 @@ config_tree_has_indexers (const char *path)
     return cb_exists (index_list, path);
 }
 
+bool
+config_tree_has_proxies (const char *path)
+{
+    return cb_exists (proxy_list, path);
+}
+
 void
 config_init (void)
 {
@@ -392,13 +608,10 @@ config_init (void)
     proxy_list = cb_init ();
 
     guid_to_callback = g_hash_table_new (g_str_hash, g_str_equal);
+    suppress = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 
-    /* Debug set */
-    cb = cb_create (watch_list, "debug", APTERYX_DEBUG_PATH,
-                    (uint64_t) getpid (), (uint64_t) (size_t) handle_debug_set);
-    cb_release (cb);
-
-    /* Counters */
+    /* Counters are dispatched directly (see config_indexers/config_providers)
+     * but still registered so that searches and traversals find them */
     cb = cb_create (index_list, "counters", APTERYX_COUNTERS "/",
                     (uint64_t) getpid (), (uint64_t) (size_t) handle_counters_index);
     cb_release (cb);
@@ -411,42 +624,8 @@ config_init (void)
                     (uint64_t) getpid (), (uint64_t) (size_t) handle_statistics_refresh);
     cb_release (cb);
 
-    /* Sockets */
-    cb = cb_create (watch_list, "sockets", APTERYX_SOCKETS_PATH "/",
-                    (uint64_t) getpid (), (uint64_t) (size_t) handle_sockets_set);
-    cb_release (cb);
-
-    /* Indexers */
-    cb = cb_create (watch_list, "indexers", APTERYX_INDEXERS_PATH "/",
-                    (uint64_t) getpid (), (uint64_t) (size_t) handle_indexers_set);
+    /* Clients */
+    cb = cb_create (refresh_list, "clients", APTERYX_CLIENTS "/*",
+                    (uint64_t) getpid (), (uint64_t) (size_t) handle_clients_refresh);
     cb_release (cb);
-
-    /* Watchers */
-    cb = cb_create (watch_list, "watchers", APTERYX_WATCHERS_PATH "/",
-                    (uint64_t) getpid (), (uint64_t) (size_t) handle_watchers_set);
-    cb_release (cb);
-
-    /* Refeshers */
-    cb = cb_create (watch_list, "refreshers", APTERYX_REFRESHERS_PATH "/",
-                    (uint64_t) getpid (), (uint64_t) (size_t) handle_refreshers_set);
-    cb_release (cb);
-
-    /* Providers */
-    cb = cb_create (watch_list, "providers", APTERYX_PROVIDERS_PATH "/",
-                    (uint64_t) getpid (), (uint64_t) (size_t) handle_providers_set);
-    cb_release (cb);
-
-    /* Validators */
-    cb = cb_create (watch_list, "validators", APTERYX_VALIDATORS_PATH "/",
-                    (uint64_t) getpid (), (uint64_t) (size_t) handle_validators_set);
-    cb_release (cb);
-
-    /* Proxies */
-    cb = cb_create (watch_list, "proxies", APTERYX_PROXIES_PATH "/",
-                    (uint64_t) getpid (), (uint64_t) (size_t) handle_proxies_set);
-    cb_release (cb);
-    if (!cb)
-    {
-        return;
-    }
 }
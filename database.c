@@ -38,6 +38,10 @@ struct database_node
     uint64_t timestamp;
     size_t length;
     unsigned char *value;
+    /* Number of values at or below this node */
+    size_t values;
+    /* Children in natural key order - built by the first range search */
+    GSequence *ordered;
 };
 
 struct hashtree_node *root = NULL;  /* The database root */
@@ -59,7 +63,85 @@ db_calculate_timestamp (void)
 }
 
 
-static uint64_t
+/* Natural order - runs of digits compare by value so "2" is before "10" */
+int
+db_natural_compare (const char *a, const char *b)
+{
+    const char *sa = a, *sb = b;
+
+    while (*a && *b)
+    {
+        if (isdigit ((unsigned char) *a) && isdigit ((unsigned char) *b))
+        {
+            size_t la = 0, lb = 0;
+            int cmp;
+
+            while (*a == '0')
+                a++;
+            while (*b == '0')
+                b++;
+            while (isdigit ((unsigned char) a[la]))
+                la++;
+            while (isdigit ((unsigned char) b[lb]))
+                lb++;
+            if (la != lb)
+                return la < lb ? -1 : 1;
+            if ((cmp = memcmp (a, b, la)) != 0)
+                return cmp;
+            a += la;
+            b += lb;
+        }
+        else if (*a != *b)
+        {
+            return (unsigned char) *a - (unsigned char) *b;
+        }
+        else
+        {
+            a++;
+            b++;
+        }
+    }
+    if (*a || *b)
+        return *a ? 1 : -1;
+    /* Only leading zeros differ */
+    return strcmp (sa, sb);
+}
+
+static gint
+db_order_compare (gconstpointer a, gconstpointer b, gpointer data)
+{
+    return db_natural_compare (((const struct hashtree_node *) a)->key,
+                               ((const struct hashtree_node *) b)->key);
+}
+
+static void
+db_order_insert (struct database_node *parent, struct database_node *node)
+{
+    g_sequence_insert_sorted (parent->ordered, node, db_order_compare, NULL);
+}
+
+/* Forget a node that is about to be removed from its parent */
+static void
+db_order_remove (struct database_node *node)
+{
+    struct database_node *parent =
+        (struct database_node *) hashtree_parent_get (&node->hashtree_node);
+
+    if (parent && parent->ordered)
+    {
+        GSequenceIter *iter =
+            g_sequence_lookup (parent->ordered, node, db_order_compare, NULL);
+        if (iter)
+            g_sequence_remove (iter);
+    }
+    if (node->ordered)
+    {
+        g_sequence_free (node->ordered);
+        node->ordered = NULL;
+    }
+}
+
+uint64_t
 db_timestamp_no_lock (const char *path)
 {
     uint64_t timestamp = 0;
@@ -117,6 +199,81 @@ db_memuse (const char *path)
     return memuse;
 }
 
+/* Number of children of the node at path */
+size_t
+db_children_no_lock (const char *path)
+{
+    struct hashtree_node *node = hashtree_path_to_node (root, path);
+
+    if (!node || !node->children)
+        return 0;
+    return g_hash_table_size (node->children);
+}
+
+/* Number of values at or below path */
+size_t
+db_values_no_lock (const char *path)
+{
+    struct database_node *node =
+        (struct database_node *) hashtree_path_to_node (root, path);
+
+    return node ? node->values : 0;
+}
+
+static size_t
+db_numbers (struct database_node *node, char **parts, db_number_fn fn, void *data)
+{
+    struct database_node *child;
+    GHashTableIter iter;
+    gpointer key, value;
+    size_t count = 0;
+
+    if (!*parts)
+    {
+        const char *string = (const char *) node->value;
+        char *end;
+        int64_t number;
+
+        if (!string)
+            return 0;
+        errno = 0;
+        number = strtoll (string, &end, 10);
+        if (errno || end == string || *end != '\0')
+            return 0;
+        fn (number, data);
+        return 1;
+    }
+    if (!node->hashtree_node.children)
+        return 0;
+    if (strcmp (*parts, "*") == 0)
+    {
+        g_hash_table_iter_init (&iter, node->hashtree_node.children);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            count += db_numbers ((struct database_node *) value, parts + 1, fn, data);
+    }
+    else if ((child = g_hash_table_lookup (node->hashtree_node.children, *parts)))
+    {
+        count = db_numbers (child, parts + 1, fn, data);
+    }
+    return count;
+}
+
+/* Call fn with each value at a path matching pattern ('*' matches any one
+ * node) that is a whole number. Returns how many there were */
+size_t
+db_numbers_no_lock (const char *pattern, db_number_fn fn, void *data)
+{
+    char **parts;
+    size_t count;
+
+    if (pattern[0] != '/')
+        return 0;
+    parts = g_strsplit (pattern + 1, "/", -1);
+    count = db_numbers ((struct database_node *) root, parts, fn, data);
+    g_strfreev (parts);
+    return count;
+}
+
 static void
 _db_update_timestamps (struct database_node *node, uint64_t ts)
 {
@@ -142,6 +299,18 @@ db_update_timestamps (const char *path, uint64_t ts)
     return;
 }
 
+/* True if setting path to value (NULL to delete) would change nothing */
+bool
+db_unchanged_no_lock (const char *path, const unsigned char *value, size_t length)
+{
+    struct database_node *node =
+        (struct database_node *) hashtree_path_to_node (root, path);
+
+    if (!node || !node->value)
+        return value == NULL;
+    return value && node->length == length && memcmp (node->value, value, length) == 0;
+}
+
 bool
 db_add_no_lock (const char *path, const unsigned char *value, size_t length, uint64_t ts)
 {
@@ -157,6 +326,7 @@ db_add_no_lock (const char *path, const unsigned char *value, size_t length, uin
         new_value =
             (struct database_node *) hashtree_node_add (root, sizeof (*new_value), path);
     }
+    int delta = (length > 0) - (new_value->value != NULL);
     g_free (new_value->value);
     new_value->value = NULL;
     if (length > 0)
@@ -169,7 +339,14 @@ db_add_no_lock (const char *path, const unsigned char *value, size_t length, uin
     /* This node is in a path that is being updated */
     do
     {
+        struct database_node *parent =
+            (struct database_node *) hashtree_parent_get (&new_value->hashtree_node);
+
+        /* Nodes created by this add have never had a timestamp */
+        if (new_value->timestamp == 0 && parent && parent->ordered)
+            db_order_insert (parent, new_value);
         new_value->timestamp = timestamp;
+        new_value->values += delta;
     }
     while ((new_value =
             (struct database_node *) hashtree_parent_get ((struct hashtree_node *)
@@ -201,9 +378,11 @@ db_delete_no_lock (const char *path, uint64_t ts)
             uint64_t now = db_calculate_timestamp ();
             struct hashtree_node *iter = node;
             struct hashtree_node *parent = hashtree_parent_get (node);
+            int delta = ((struct database_node *) node)->value != NULL;
             while ((iter = hashtree_parent_get (iter)) != NULL)
             {
                 ((struct database_node *) iter)->timestamp = now;
+                ((struct database_node *) iter)->values -= delta;
             }
 
             if (((struct database_node *) node)->value != NULL)
@@ -211,10 +390,12 @@ db_delete_no_lock (const char *path, uint64_t ts)
                 g_free (((struct database_node *) node)->value);
                 ((struct database_node *) node)->value = NULL;
                 ((struct database_node *) node)->length = 0;
+                ((struct database_node *) node)->values--;
             }
 
             if (hashtree_empty (node))
             {
+                db_order_remove ((struct database_node *) node);
                 hashtree_node_delete (root, node);
             }
 
@@ -304,6 +485,304 @@ db_search (const char *path)
     return paths;
 }
 
+/* Children of path in natural key order, starting after the key after (NULL
+ * for the first) and returning at most limit (0 for all). Each node's order
+ * is built by its first range search and kept up to date from then on, so
+ * later pages cost O(log n + limit) */
+GList *
+db_search_range (const char *path, const char *after, size_t limit)
+{
+    bool end_with_slash = strlen (path) > 0 ? path[strlen (path) - 1] == '/' : false;
+    struct database_node *node;
+    struct hashtree_node probe = { .key = (char *) after };
+    GSequenceIter *iter;
+    GList *paths = NULL;
+    size_t count = 0;
+
+    pthread_rwlock_rdlock (&db_lock);
+    node = (struct database_node *) hashtree_path_to_node (root, path);
+    if (node && !hashtree_empty (&node->hashtree_node) && !node->ordered)
+    {
+        pthread_rwlock_unlock (&db_lock);
+        pthread_rwlock_wrlock (&db_lock);
+        node = (struct database_node *) hashtree_path_to_node (root, path);
+        if (node && !hashtree_empty (&node->hashtree_node) && !node->ordered)
+        {
+            GHashTableIter hiter;
+            gpointer key, value;
+
+            node->ordered = g_sequence_new (NULL);
+            g_hash_table_iter_init (&hiter, node->hashtree_node.children);
+            while (g_hash_table_iter_next (&hiter, &key, &value))
+                g_sequence_append (node->ordered, value);
+            g_sequence_sort (node->ordered, db_order_compare, NULL);
+        }
+    }
+    if (!node || !node->ordered)
+    {
+        pthread_rwlock_unlock (&db_lock);
+        return NULL;
+    }
+
+    if (after)
+    {
+        iter = g_sequence_search (node->ordered, &probe, db_order_compare, NULL);
+        while (!g_sequence_iter_is_end (iter) &&
+               db_order_compare (g_sequence_get (iter), &probe, NULL) <= 0)
+            iter = g_sequence_iter_next (iter);
+    }
+    else
+    {
+        iter = g_sequence_get_begin_iter (node->ordered);
+    }
+    for (; !g_sequence_iter_is_end (iter) && (!limit || count < limit);
+         iter = g_sequence_iter_next (iter), count++)
+    {
+        struct hashtree_node *child = g_sequence_get (iter);
+        paths = g_list_prepend (paths, g_strdup_printf ("%s%s%s", path,
+                                                        end_with_slash ? "" : "/", child->key));
+    }
+    pthread_rwlock_unlock (&db_lock);
+    return g_list_reverse (paths);
+}
+
+/* Path of the node being visited - extended and truncated in place */
+struct db_traverse_s
+{
+    char *path;
+    size_t length;
+    size_t size;
+    db_traverse_fn fn;
+    void *data;
+};
+
+static bool db_traverse_children (struct database_node *node, struct db_traverse_s *walk);
+
+static bool
+db_traverse_child (struct database_node *child, struct db_traverse_s *walk)
+{
+    size_t length = walk->length;
+    size_t klen = strlen (child->hashtree_node.key);
+
+    if (length + klen + 2 > walk->size)
+    {
+        walk->size = (length + klen + 2) * 2;
+        walk->path = g_realloc (walk->path, walk->size);
+    }
+    walk->path[length] = '/';
+    memcpy (walk->path + length + 1, child->hashtree_node.key, klen + 1);
+    walk->length = length + klen + 1;
+    if (child->value &&
+        !walk->fn (walk->path, child->value, child->length, walk->data))
+        return false;
+    return db_traverse_children (child, walk);
+}
+
+static bool
+db_traverse_children (struct database_node *node, struct db_traverse_s *walk)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    size_t length = walk->length;
+
+    if (!node->hashtree_node.children)
+        return true;
+
+    g_hash_table_iter_init (&iter, node->hashtree_node.children);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        if (!db_traverse_child ((struct database_node *) value, walk))
+            return false;
+        walk->length = length;
+    }
+    walk->path[length] = '\0';
+    return true;
+}
+
+/* Walk node and either all of its children or just those whose keys are
+ * listed (skipping any that have gone) */
+static bool
+db_traverse_node (struct database_node *node, const char *path, bool value,
+                  bool subtree, GList *children, db_traverse_fn fn, void *data)
+{
+    struct db_traverse_s walk = { .fn = fn, .data = data };
+    bool ret = true;
+    GList *iter;
+
+    if (value && node->value && !fn (path, node->value, node->length, data))
+        return false;
+
+    /* Children are appended to the path without its trailing slash */
+    walk.length = strlen (path);
+    if (walk.length && path[walk.length - 1] == '/')
+        walk.length--;
+    walk.size = walk.length + 256;
+    walk.path = g_malloc (walk.size);
+    memcpy (walk.path, path, walk.length);
+    walk.path[walk.length] = '\0';
+    if (subtree)
+        ret = db_traverse_children (node, &walk);
+    for (iter = children; ret && iter && node->hashtree_node.children; iter = iter->next)
+    {
+        size_t length = walk.length;
+        struct database_node *child = (struct database_node *)
+            g_hash_table_lookup (node->hashtree_node.children, iter->data);
+        if (!child)
+            continue;
+        ret = db_traverse_child (child, &walk);
+        walk.length = length;
+    }
+    g_free (walk.path);
+    return ret;
+}
+
+/* Call fn for the node at path and every node below it that has a value.
+ * Nothing is allocated per node. The caller must hold db_lock. Returns
+ * false if fn stopped the walk. */
+bool
+db_traverse_no_lock (const char *path, db_traverse_fn fn, void *data)
+{
+    struct database_node *node =
+        (struct database_node *) hashtree_path_to_node (root, path);
+
+    if (!node)
+        return true;
+    return db_traverse_node (node, path, true, true, NULL, fn, data);
+}
+
+/* Add up the nodes and value bytes in a subtree, giving up once either
+ * reaches its limit */
+static void
+db_count_nodes (struct database_node *node, db_size *size, const db_size *limit)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    size->nodes++;
+    size->bytes += node->length;
+    if (!node->hashtree_node.children)
+        return;
+
+    g_hash_table_iter_init (&iter, node->hashtree_node.children);
+    while (size->nodes < limit->nodes && size->bytes < limit->bytes &&
+           g_hash_table_iter_next (&iter, &key, &value))
+        db_count_nodes ((struct database_node *) value, size, limit);
+}
+
+static bool
+db_size_within (const db_size *size, const db_size *limit)
+{
+    return size->nodes < limit->nodes && size->bytes < limit->bytes;
+}
+
+static db_part *
+db_part_new (const char *path, bool value, GList **parts)
+{
+    db_part *part = g_malloc0 (sizeof (db_part));
+    part->path = g_strdup (path);
+    part->value = value;
+    part->subtree = value;
+    *parts = g_list_prepend (*parts, part);
+    return part;
+}
+
+static void
+db_partition_node (struct database_node *node, const char *path, const db_size *limit,
+                   GList **parts)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    db_part *part;
+    db_size size = {};
+    size_t length;
+
+    part = db_part_new (path, true, parts);
+    db_count_nodes (node, &size, limit);
+    if (db_size_within (&size, limit))
+        return;
+    part->subtree = false;
+
+    /* Too big - share the children out between parts within the limit,
+     * in the same order the serial walk would visit them */
+    size.nodes = 1;
+    size.bytes = node->length;
+    length = strlen (path);
+    if (length && path[length - 1] == '/')
+        length--;
+    g_hash_table_iter_init (&iter, node->hashtree_node.children);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        struct database_node *child = (struct database_node *) value;
+        db_size count = {};
+
+        db_count_nodes (child, &count, limit);
+        if (!db_size_within (&count, limit))
+        {
+            char *child_path = g_strdup_printf ("%.*s/%s", (int) length, path,
+                                                (const char *) key);
+            db_partition_node (child, child_path, limit, parts);
+            g_free (child_path);
+            part = NULL;
+            continue;
+        }
+        if (!part || size.nodes + count.nodes > limit->nodes ||
+            size.bytes + count.bytes > limit->bytes)
+        {
+            part = db_part_new (path, false, parts);
+            size.nodes = 0;
+            size.bytes = 0;
+        }
+        part->children = g_list_prepend (part->children, g_strdup ((const char *) key));
+        size.nodes += count.nodes;
+        size.bytes += count.bytes;
+    }
+}
+
+/* Split the subtree at path into an ordered list of parts that are within
+ * limit (apart from single-node parts). Walking each part in list order
+ * visits nodes in exactly the order db_traverse_no_lock would. Parts only
+ * hold paths, so db_lock may be dropped between walking them - anything
+ * removed in the meantime is skipped and anything added is missed. */
+GList *
+db_partition_no_lock (const char *path, const db_size *limit)
+{
+    struct database_node *node =
+        (struct database_node *) hashtree_path_to_node (root, path);
+    GList *parts = NULL;
+
+    if (!node)
+        return NULL;
+    db_partition_node (node, path, limit, &parts);
+    for (GList *iter = parts; iter; iter = iter->next)
+    {
+        db_part *part = iter->data;
+        part->children = g_list_reverse (part->children);
+    }
+    return g_list_reverse (parts);
+}
+
+/* Walk a part returned by db_partition_no_lock. Safe to call for different
+ * parts from several threads at once. */
+bool
+db_traverse_part_no_lock (db_part *part, db_traverse_fn fn, void *data)
+{
+    struct database_node *node =
+        (struct database_node *) hashtree_path_to_node (root, part->path);
+
+    if (!node)
+        return true;
+    return db_traverse_node (node, part->path, part->value, part->subtree,
+                             part->children, fn, data);
+}
+
+void
+db_part_free (db_part *part)
+{
+    g_list_free_full (part->children, g_free);
+    g_free (part->path);
+    g_free (part);
+}
+
 void
 db_init ()
 {
@@ -331,6 +810,12 @@ db_purge (struct database_node *node)
     }
     node->value = NULL;
     node->length = 0;
+    node->values = 0;
+    if (node->ordered)
+    {
+        g_sequence_free (node->ordered);
+        node->ordered = NULL;
+    }
 }
 
 static void
@@ -339,12 +824,55 @@ db_evaporate (struct database_node *node)
     struct database_node *parent =
       (struct database_node *) hashtree_parent_get (&node->hashtree_node);
 
+    db_order_remove (node);
     hashtree_node_delete (&parent->hashtree_node, &node->hashtree_node);
     if ((void*)parent != (void*)root && parent
         && hashtree_empty (&parent->hashtree_node) && parent->length == 0)
         db_evaporate (parent);
 }
 
+/* Free a subtree that is no longer linked into the tree */
+static void
+db_free_subtree (struct database_node *node)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (node->hashtree_node.children)
+    {
+        g_hash_table_iter_init (&iter, node->hashtree_node.children);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            db_free_subtree ((struct database_node *) value);
+        g_hash_table_destroy (node->hashtree_node.children);
+    }
+    if (node->ordered)
+        g_sequence_free (node->ordered);
+    g_free (node->value);
+    g_free (node->hashtree_node.key);
+    g_free (node);
+}
+
+/* Unlink a node from its parent and free it with everything below it in
+ * one pass, then remove any parents left empty */
+static void
+db_detach (struct database_node *node)
+{
+    struct database_node *parent =
+        (struct database_node *) hashtree_parent_get (&node->hashtree_node);
+
+    if (!parent)
+    {
+        db_purge (node);
+        return;
+    }
+    db_order_remove (node);
+    g_hash_table_remove (parent->hashtree_node.children, node->hashtree_node.key);
+    db_free_subtree (node);
+    if ((void *) parent != (void *) root
+        && hashtree_empty (&parent->hashtree_node) && parent->length == 0)
+        db_evaporate (parent);
+}
+
 void
 db_prune (const char *path)
 {
@@ -360,9 +888,9 @@ db_prune (const char *path)
         while ((iter = hashtree_parent_get (iter)) != NULL)
         {
             ((struct database_node *) iter)->timestamp = now;
+            ((struct database_node *) iter)->values -= node->values;
         }
-        db_purge (node);
-        db_evaporate (node);
+        db_detach (node);
     }
 
     pthread_rwlock_unlock (&db_lock);
@@ -648,6 +1176,260 @@ test_db_search ()
     db_shutdown ();
 }
 
+void
+test_db_search_range ()
+{
+    const char *keys[] = { "10", "2", "b", "1", "a2", "a10", "01" };
+    GList *paths = NULL;
+    char *path;
+    int i;
+
+    db_init ();
+    CU_ASSERT (db_natural_compare ("2", "10") < 0);
+    CU_ASSERT (db_natural_compare ("a10", "a2") > 0);
+    CU_ASSERT (db_natural_compare ("01", "1") < 0);
+    CU_ASSERT (db_natural_compare ("1", "1") == 0);
+
+    for (i = 0; i < 5; i++)
+    {
+        path = g_strdup_printf ("/database/%s", keys[i]);
+        CU_ASSERT (db_add (path, (const unsigned char *) "test", strlen ("test") + 1, UINT64_MAX));
+        g_free (path);
+    }
+    CU_ASSERT ((paths = db_search_range ("/database/", NULL, 0)) != NULL);
+    CU_ASSERT (g_list_length (paths) == 5);
+    CU_ASSERT (strcmp (g_list_nth_data (paths, 0), "/database/1") == 0);
+    CU_ASSERT (strcmp (g_list_nth_data (paths, 1), "/database/2") == 0);
+    CU_ASSERT (strcmp (g_list_nth_data (paths, 2), "/database/10") == 0);
+    CU_ASSERT (strcmp (g_list_nth_data (paths, 3), "/database/a2") == 0);
+    CU_ASSERT (strcmp (g_list_nth_data (paths, 4), "/database/b") == 0);
+    g_list_free_full (paths, g_free);
+
+    /* Keep the order through adds and deletes */
+    for (; i < 7; i++)
+    {
+        path = g_strdup_printf ("/database/%s/child", keys[i]);
+        CU_ASSERT (db_add (path, (const unsigned char *) "test", strlen ("test") + 1, UINT64_MAX));
+        g_free (path);
+    }
+    CU_ASSERT (db_delete ("/database/2", UINT64_MAX));
+    db_prune ("/database/b");
+    CU_ASSERT ((paths = db_search_range ("/database", "01", 3)) != NULL);
+    CU_ASSERT (g_list_length (paths) == 3);
+    CU_ASSERT (strcmp (g_list_nth_data (paths, 0), "/database/1") == 0);
+    CU_ASSERT (strcmp (g_list_nth_data (paths, 1), "/database/10") == 0);
+    CU_ASSERT (strcmp (g_list_nth_data (paths, 2), "/database/a2") == 0);
+    g_list_free_full (paths, g_free);
+    CU_ASSERT ((paths = db_search_range ("/database", "a2", 3)) != NULL);
+    CU_ASSERT (g_list_length (paths) == 1);
+    CU_ASSERT (strcmp (g_list_nth_data (paths, 0), "/database/a10") == 0);
+    g_list_free_full (paths, g_free);
+
+    db_prune ("/database");
+    CU_ASSERT (db_search_range ("/database/", NULL, 0) == NULL);
+    db_shutdown ();
+}
+
+static bool
+test_db_traverse_fn (const char *path, const unsigned char *value, size_t length, void *data)
+{
+    GList **paths = (GList **) data;
+    CU_ASSERT (length == strlen ((const char *) value) + 1);
+    *paths = g_list_prepend (*paths, g_strdup (path));
+    return true;
+}
+
+void
+test_db_traverse ()
+{
+    GList *paths = NULL;
+    db_init ();
+    CU_ASSERT (db_add ("/database/test", (const unsigned char *) "test", strlen ("test") + 1, UINT64_MAX));
+    CU_ASSERT (db_add ("/database/test/a/b", (const unsigned char *) "b", strlen ("b") + 1, UINT64_MAX));
+    CU_ASSERT (db_add ("/database/other", (const unsigned char *) "other", strlen ("other") + 1, UINT64_MAX));
+
+    pthread_rwlock_rdlock (&db_lock);
+    CU_ASSERT (db_traverse_no_lock ("/database/test", test_db_traverse_fn, &paths));
+    pthread_rwlock_unlock (&db_lock);
+    CU_ASSERT (g_list_length (paths) == 2);
+    CU_ASSERT (g_list_find_custom (paths, "/database/test", (GCompareFunc) strcmp) != NULL);
+    CU_ASSERT (g_list_find_custom (paths, "/database/test/a/b", (GCompareFunc) strcmp) != NULL);
+    g_list_free_full (paths, g_free);
+    paths = NULL;
+
+    pthread_rwlock_rdlock (&db_lock);
+    CU_ASSERT (db_traverse_no_lock ("/database/", test_db_traverse_fn, &paths));
+    pthread_rwlock_unlock (&db_lock);
+    CU_ASSERT (g_list_length (paths) == 3);
+    CU_ASSERT (g_list_find_custom (paths, "/database/other", (GCompareFunc) strcmp) != NULL);
+    g_list_free_full (paths, g_free);
+
+    CU_ASSERT (db_delete ("/database/test/a/b", UINT64_MAX));
+    CU_ASSERT (db_delete ("/database/test", UINT64_MAX));
+    CU_ASSERT (db_delete ("/database/other", UINT64_MAX));
+    db_shutdown ();
+}
+
+/* Everything below path the way the recursive traverse finds it */
+static void
+test_db_search_walk (const char *path, GHashTable *found)
+{
+    GList *children, *iter;
+    unsigned char *value = NULL;
+    size_t length = 0;
+
+    if (db_get (path, &value, &length))
+        g_hash_table_insert (found, g_strdup (path), value);
+    children = db_search (path);
+    for (iter = children; iter; iter = iter->next)
+        test_db_search_walk ((const char *) iter->data, found);
+    g_list_free_full (children, g_free);
+}
+
+static bool
+test_db_traverse_collect (const char *path, const unsigned char *value, size_t length, void *data)
+{
+    GHashTable *found = (GHashTable *) data;
+    CU_ASSERT (g_hash_table_lookup (found, path) == NULL);
+    g_hash_table_insert (found, g_strdup (path), g_strndup ((const char *) value, length));
+    return true;
+}
+
+static bool
+test_db_traverse_stop (const char *path, const unsigned char *value, size_t length, void *data)
+{
+    return --(*(int *) data) > 0;
+}
+
+void
+test_db_traverse_search ()
+{
+    GHashTable *walked = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    GHashTable *searched = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    GHashTableIter iter;
+    gpointer key, value;
+    char *long_key;
+    char *path;
+    int count;
+    int i, j;
+
+    db_init ();
+    /* Keys long enough to outgrow the walk's path buffer */
+    long_key = g_strnfill (300, 'x');
+    for (i = 0; i < 10; i++)
+    {
+        for (j = 0; j < 10; j++)
+        {
+            path = g_strdup_printf ("/database/test/%d/%s/%d", i, j & 1 ? long_key : "short", j);
+            CU_ASSERT (db_add (path, (const unsigned char *) path, strlen (path) + 1, UINT64_MAX));
+            g_free (path);
+        }
+    }
+    /* Values on inner nodes and nodes with no value */
+    CU_ASSERT (db_add ("/database/test/3", (const unsigned char *) "3", 2, UINT64_MAX));
+    CU_ASSERT (db_add ("/database/test", (const unsigned char *) "test", 5, UINT64_MAX));
+    CU_ASSERT (db_add ("/database/testing", (const unsigned char *) "testing", 8, UINT64_MAX));
+    g_free (long_key);
+
+    /* Same paths and values as db_get/db_search, each only once */
+    test_db_search_walk ("/database/test", searched);
+    pthread_rwlock_rdlock (&db_lock);
+    CU_ASSERT (db_traverse_no_lock ("/database/test", test_db_traverse_collect, walked));
+    pthread_rwlock_unlock (&db_lock);
+    CU_ASSERT (g_hash_table_size (searched) == 102);
+    CU_ASSERT (g_hash_table_size (walked) == g_hash_table_size (searched));
+    g_hash_table_iter_init (&iter, searched);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        const char *other = g_hash_table_lookup (walked, key);
+        CU_ASSERT (other && strcmp (other, (const char *) value) == 0);
+    }
+    CU_ASSERT (g_hash_table_lookup (walked, "/database/testing") == NULL);
+
+    /* Nothing there */
+    g_hash_table_remove_all (walked);
+    pthread_rwlock_rdlock (&db_lock);
+    CU_ASSERT (db_traverse_no_lock ("/database/missing", test_db_traverse_collect, walked));
+    pthread_rwlock_unlock (&db_lock);
+    CU_ASSERT (g_hash_table_size (walked) == 0);
+
+    /* The walk stops as soon as the callback says so */
+    count = 5;
+    pthread_rwlock_rdlock (&db_lock);
+    CU_ASSERT (!db_traverse_no_lock ("/database/test", test_db_traverse_stop, &count));
+    pthread_rwlock_unlock (&db_lock);
+    CU_ASSERT (count == 0);
+
+    g_hash_table_destroy (walked);
+    g_hash_table_destroy (searched);
+    db_prune ("/database/test");
+    db_prune ("/database/testing");
+    db_shutdown ();
+}
+
+void
+test_db_partition ()
+{
+    db_size limit = { .nodes = 16, .bytes = SIZE_MAX };
+    GList *serial = NULL;
+    GList *parallel = NULL;
+    GList *parts;
+    GList *a, *b;
+    char *path;
+    int i, j;
+
+    db_init ();
+    for (i = 0; i < 5; i++)
+    {
+        for (j = 0; j < 20; j++)
+        {
+            path = g_strdup_printf ("/database/test/%d/%d", i, j);
+            CU_ASSERT (db_add (path, (const unsigned char *) "value", strlen ("value") + 1, UINT64_MAX));
+            g_free (path);
+        }
+    }
+    CU_ASSERT (db_add ("/database/test", (const unsigned char *) "test", strlen ("test") + 1, UINT64_MAX));
+
+    pthread_rwlock_rdlock (&db_lock);
+    CU_ASSERT (db_traverse_no_lock ("/database/test/", test_db_traverse_fn, &serial));
+    parts = db_partition_no_lock ("/database/test/", &limit);
+    CU_ASSERT (g_list_length (parts) > 5);
+    for (a = parts; a; a = a->next)
+        CU_ASSERT (db_traverse_part_no_lock (a->data, test_db_traverse_fn, &parallel));
+    g_list_free_full (parts, (GDestroyNotify) db_part_free);
+    pthread_rwlock_unlock (&db_lock);
+
+    CU_ASSERT (g_list_length (serial) == 101);
+    CU_ASSERT (g_list_length (parallel) == g_list_length (serial));
+    for (a = serial, b = parallel; a && b; a = a->next, b = b->next)
+        CU_ASSERT (strcmp (a->data, b->data) == 0);
+    g_list_free_full (parallel, g_free);
+    parallel = NULL;
+
+    /* Values count towards the limit too */
+    limit.nodes = SIZE_MAX;
+    limit.bytes = 6 * 16;
+    pthread_rwlock_rdlock (&db_lock);
+    parts = db_partition_no_lock ("/database/test/", &limit);
+    CU_ASSERT (g_list_length (parts) > 5);
+    pthread_rwlock_unlock (&db_lock);
+
+    /* Parts can still be walked after the lock has been dropped */
+    CU_ASSERT (db_delete ("/database/test/0/0", UINT64_MAX));
+    pthread_rwlock_rdlock (&db_lock);
+    for (a = parts; a; a = a->next)
+        CU_ASSERT (db_traverse_part_no_lock (a->data, test_db_traverse_fn, &parallel));
+    pthread_rwlock_unlock (&db_lock);
+    g_list_free_full (parts, (GDestroyNotify) db_part_free);
+    CU_ASSERT (g_list_length (parallel) == 100);
+    CU_ASSERT (!g_list_find_custom (parallel, "/database/test/0/0", (GCompareFunc) strcmp));
+    g_list_free_full (serial, g_free);
+    g_list_free_full (parallel, g_free);
+
+    db_prune ("/database/test");
+    db_shutdown ();
+}
+
 void
 test_db_search_perf ()
 {
@@ -716,6 +1498,52 @@ test_db_timestamping ()
     db_shutdown ();
 }
 
+static void
+test_db_sum (int64_t number, void *data)
+{
+    *(int64_t *) data += number;
+}
+
+void
+test_db_counts ()
+{
+    int64_t sum = 0;
+
+    db_init ();
+
+    CU_ASSERT (db_add ("/test/rib/1/metric", (const unsigned char *) "10", 3, UINT64_MAX));
+    CU_ASSERT (db_add ("/test/rib/1/nexthop", (const unsigned char *) "a", 2, UINT64_MAX));
+    CU_ASSERT (db_add ("/test/rib/2/metric", (const unsigned char *) "-3", 3, UINT64_MAX));
+    CU_ASSERT (db_add ("/test/rib/3/metric", (const unsigned char *) "x", 2, UINT64_MAX));
+    CU_ASSERT (db_add ("/test/rib", (const unsigned char *) "rib", 4, UINT64_MAX));
+    CU_ASSERT (db_children_no_lock ("/test/rib") == 3);
+    CU_ASSERT (db_values_no_lock ("/test/rib") == 5);
+    CU_ASSERT (db_values_no_lock ("/test/rib/1") == 2);
+    CU_ASSERT (db_values_no_lock ("/") == 5);
+    CU_ASSERT (db_numbers_no_lock ("/test/rib/*/metric", test_db_sum, &sum) == 2);
+    CU_ASSERT (sum == 7);
+
+    /* Replacing a value does not change the counts */
+    CU_ASSERT (db_add ("/test/rib/1/metric", (const unsigned char *) "20", 3, UINT64_MAX));
+    CU_ASSERT (db_values_no_lock ("/test") == 5);
+
+    CU_ASSERT (db_delete ("/test/rib/1/nexthop", UINT64_MAX));
+    CU_ASSERT (db_values_no_lock ("/test/rib/1") == 1);
+    CU_ASSERT (db_values_no_lock ("/test") == 4);
+    CU_ASSERT (db_delete ("/test/rib", UINT64_MAX));
+    CU_ASSERT (db_values_no_lock ("/test") == 3);
+    CU_ASSERT (db_children_no_lock ("/test/rib") == 3);
+
+    db_prune ("/test/rib/2");
+    CU_ASSERT (db_children_no_lock ("/test/rib") == 2);
+    CU_ASSERT (db_values_no_lock ("/test/rib") == 2);
+    db_prune ("/test");
+    CU_ASSERT (db_values_no_lock ("/") == 0);
+    CU_ASSERT (db_children_no_lock ("/test") == 0);
+
+    db_shutdown ();
+}
+
 
 CU_TestInfo tests_database[] = {
     { "add/delete", test_db_add_delete },
@@ -729,7 +1557,12 @@ CU_TestInfo tests_database[] = {
     { "replace", test_db_replace },
     { "search", test_db_search },
     { "search performance", test_db_search_perf },
+    { "search range", test_db_search_range },
+    { "traverse", test_db_traverse },
+    { "traverse matches search", test_db_traverse_search },
+    { "partition", test_db_partition },
     { "timestamping", test_db_timestamping },
+    { "counts", test_db_counts },
     CU_TEST_INFO_NULL,
 };
 #endif
@@ -105,8 +105,27 @@ typedef enum
     MODE_TEST,
     MODE_MEMUSE,
     MODE_COUNTERS,
+    MODE_SYNC,
+    MODE_TXN,
+    MODE_SET_CHECKED,
+    MODE_WAIT,
+    MODE_GET_IF_MODIFIED,
+    MODE_TRAVERSE_IF_MODIFIED,
+    MODE_AGGREGATE,
+    MODE_SEARCH_RANGE,
+    MODE_TRAVERSE_MULTI,
+    MODE_TIMESTAMPS,
 } APTERYX_MODE;
 
+/* Transaction operations */
+typedef enum
+{
+    TXN_END,
+    TXN_SET,
+    TXN_DELETE,
+    TXN_CHECK,
+} APTERYX_TXN_OP;
+
 /* Callback */
 struct callback_node;
 typedef struct _cb_info_t
@@ -118,6 +137,7 @@ typedef struct _cb_info_t
     const char *uri;
     uint64_t id;
     uint64_t ref;
+    uint32_t flags;
 
     struct callback_node *node;
     int refcnt;
@@ -132,6 +152,11 @@ typedef struct _cb_info_t
 #define X_FIELDS \
     X(uint32_t, set) \
     X(uint32_t, set_invalid) \
+    X(uint32_t, set_unchanged) \
+    X(uint32_t, sync) \
+    X(uint32_t, sync_invalid) \
+    X(uint32_t, txn) \
+    X(uint32_t, txn_invalid) \
     X(uint32_t, get) \
     X(uint32_t, query) \
     X(uint32_t, get_invalid) \
@@ -139,6 +164,7 @@ typedef struct _cb_info_t
     X(uint32_t, search_invalid) \
     X(uint32_t, traverse) \
     X(uint32_t, traverse_invalid) \
+    X(uint32_t, not_modified) \
     X(uint32_t, indexed) \
     X(uint32_t, indexed_no_handler) \
     X(uint32_t, indexed_timeout) \
@@ -163,8 +189,16 @@ typedef struct _cb_info_t
     X(uint32_t, find_invalid) \
     X(uint32_t, timestamp) \
     X(uint32_t, timestamp_invalid) \
+    X(uint32_t, wait) \
+    X(uint32_t, wait_invalid) \
     X(uint32_t, memuse) \
-    X(uint32_t, memuse_invalid)
+    X(uint32_t, memuse_invalid) \
+    X(uint32_t, aggregate) \
+    X(uint32_t, aggregate_invalid) \
+    X(uint32_t, expired) \
+    X(uint32_t, expired_callbacks) \
+    X(uint32_t, traverse_held_max) \
+    X(uint32_t, traverse_cancelled)
 
 /* Counters */
 typedef struct _counters_t
@@ -189,21 +223,60 @@ bool db_add (const char *path, const unsigned char *value, size_t length, uint64
 bool db_add_no_lock (const char *path, const unsigned char *value, size_t length,
                      uint64_t ts);
 bool db_delete (const char *path, uint64_t ts);
+bool db_unchanged_no_lock (const char *path, const unsigned char *value, size_t length);
 void db_prune (const char *path);
 bool db_delete_no_lock (const char *path, uint64_t ts);
 bool db_get (const char *path, unsigned char **value, size_t *length);
 GList *db_search (const char *path);
+GList *db_search_range (const char *path, const char *after, size_t limit);
+int db_natural_compare (const char *a, const char *b);
 uint64_t db_timestamp (const char *path);
+uint64_t db_timestamp_no_lock (const char *path);
 uint64_t db_memuse (const char *path);
+size_t db_children_no_lock (const char *path);
+size_t db_values_no_lock (const char *path);
+typedef void (*db_number_fn) (int64_t number, void *data);
+size_t db_numbers_no_lock (const char *pattern, db_number_fn fn, void *data);
 void db_update_timestamps (const char *path, uint64_t ts);
+typedef bool (*db_traverse_fn) (const char *path, const unsigned char *value,
+                                size_t length, void *data);
+bool db_traverse_no_lock (const char *path, db_traverse_fn fn, void *data);
+typedef struct db_part_s
+{
+    char *path;
+    /* Include the node's own value */
+    bool value;
+    /* Include every child - otherwise only those whose keys are listed */
+    bool subtree;
+    GList *children;
+} db_part;
+typedef struct db_size_s
+{
+    size_t nodes;
+    size_t bytes;
+} db_size;
+GList *db_partition_no_lock (const char *path, const db_size *limit);
+bool db_traverse_part_no_lock (db_part *part, db_traverse_fn fn, void *data);
+void db_part_free (db_part *part);
 
 /* RPC API */
 #define RPC_TIMEOUT_US 1000000
 #define RPC_CLIENT_TIMEOUT_US 1000000
 typedef struct rpc_instance_s *rpc_instance;
 typedef struct rpc_client_t *rpc_client;
+typedef enum
+{
+    RPC_POOL_ROUND_ROBIN,
+    RPC_POOL_LEAST_INFLIGHT,
+} rpc_pool_policy;
 #define RPC_TEST_DELAY_MASK 0x7FF
 extern bool rpc_test_random_watch_delay;
+extern bool rpc_socket_io_uring;
+#ifdef TEST
+extern uint64_t rpc_socket_syscalls;
+extern int rpc_socket_queued_max;
+int rpc_test_garbage (rpc_instance rpc);
+#endif
 typedef struct rpc_message_t
 {
     /* Raw buffer */
@@ -222,18 +295,60 @@ uint8_t rpc_msg_decode_uint8 (rpc_message msg);
 void rpc_msg_encode_uint64 (rpc_message msg, uint64_t value);
 uint64_t rpc_msg_decode_uint64 (rpc_message msg);
 void rpc_msg_encode_string (rpc_message msg, const char *value);
+void rpc_msg_append (rpc_message msg, rpc_message other);
 char* rpc_msg_decode_string (rpc_message msg);
 bool rpc_msg_send (rpc_client client, rpc_message msg);
 void rpc_msg_reset (rpc_message msg);
+/* Streamed responses - sent in parts of about RPC_STREAM_CHUNK_SIZE bytes */
+#define RPC_STREAM_CHUNK_SIZE (64 * 1024)
+rpc_id rpc_msg_send_stream (rpc_client client, rpc_message msg);
+bool rpc_msg_recv_stream (rpc_client client, rpc_id id, rpc_message msg, bool *more);
+/* Stop a streamed response before the last part rather than read the rest */
+void rpc_msg_cancel_stream (rpc_client client, rpc_id id);
+bool rpc_msg_stream (rpc_message msg);
+/* Hold back streamed parts (e.g. while a lock is held) and send them later.
+ * Once rpc_msg_stream_full the holder should release what it has before
+ * going on. Release returns the number of bytes that were held back. */
+void rpc_msg_stream_hold (rpc_message msg);
+bool rpc_msg_stream_full (rpc_message msg);
+size_t rpc_msg_stream_release (rpc_message msg);
+/* Nobody is waiting for the rest - the request expired or was cancelled */
+bool rpc_msg_expired (void);
+bool rpc_msg_cancelled (void);
+/* When the request being handled by this thread expires (0 if never) */
+uint64_t rpc_msg_deadline (void);
+/* Answer the request being handled by this thread later, from any thread.
+ * The handler returns true without a response and leaves msg to whoever
+ * responds - it stays valid until rpc_deferred_respond sends it. */
+typedef struct rpc_work_s *rpc_deferred;
+rpc_deferred rpc_msg_defer (void);
+void rpc_deferred_respond (rpc_deferred deferred);
 
 rpc_instance rpc_init (int timeout, rpc_msg_handler handler);
 void rpc_shutdown (rpc_instance rpc);
 bool rpc_server_bind (rpc_instance rpc, const char *guid, const char *url);
 bool rpc_server_release (rpc_instance rpc, const char *guid);
-int rpc_server_process (rpc_instance rpc, bool poll);
+/* Process up to max_jobs (0 = all) queued requests, stopping early once
+ * max_us (0 = no limit) has elapsed */
+int rpc_server_process (rpc_instance rpc, bool poll, int max_jobs, uint64_t max_us);
 rpc_client rpc_client_existing (rpc_instance rpc, const char *url);
 rpc_client rpc_client_connect (rpc_instance rpc, const char *url);
 void rpc_client_release (rpc_instance rpc, rpc_client client, bool keep);
+void rpc_client_pool_set (rpc_instance rpc, int size, rpc_pool_policy policy);
+/* Limit requests queued or in progress per client process (0 = unlimited).
+ * Requests over the limit are refused and fail in the client with -EBUSY */
+void rpc_server_limit (rpc_instance rpc, int limit);
+typedef struct rpc_peer_stats_s
+{
+    int pid;
+    uint32_t requests;
+    uint32_t rejected;
+    uint32_t queued;
+    uint32_t inflight;
+    uint32_t max_pending;
+} rpc_peer_stats;
+/* Returns a list of rpc_peer_stats (free with g_list_free_full (list, g_free)) */
+GList *rpc_server_peers (rpc_instance rpc);
 
 /* Apteryx configuration */
 void config_init (void);
@@ -250,10 +365,23 @@ GList *config_get_refreshers (const char *path);
 GList *config_get_proxies (const char *path);
 GList *config_get_watchers (const char *path);
 GList *config_get_validators (const char *path);
+GList *config_get_tree_watchers (const char *path, uint32_t flags);
 
+bool config_tree_has_watchers (const char *path);
+bool config_tree_has_watchers_except (const char *path, uint32_t flags);
+bool config_has_prune_watchers (void);
+bool config_has_suppress (void);
+bool config_suppress_unchanged (const char *path);
+bool config_tree_has_validators (const char *path);
 bool config_tree_has_refreshers (const char *path);
 bool config_tree_has_providers (const char *path);
 bool config_tree_has_indexers (const char *path);
+bool config_tree_has_proxies (const char *path);
+
+/* Call apteryxd's own handler for a path (false if there is none) */
+bool config_internal_watch (const char *path, const char *value);
+bool config_internal_index (const char *path, GList **result);
+bool config_internal_provide (const char *path, char **value);
 
 /* Callbacks to clients */
 struct callback_node *cb_init (void);
@@ -269,15 +397,22 @@ void cb_release (cb_info_t *cb);
 #define CB_MATCH_WILD_PATH  (1<<4)
 #define CB_PATH_MATCH_PART  (1<<5)
 GList *cb_match (struct callback_node *list, const char *path);
+/* Returns the callbacks with any of flags that match path or a path below it */
+GList *cb_match_tree (struct callback_node *list, const char *path, uint32_t flags);
 bool cb_exists (struct callback_node *list, const char *path);
+/* As cb_exists but ignores callbacks with any of flags */
+bool cb_exists_except (struct callback_node *list, const char *path, uint32_t flags);
 /* Returns a list of paths which have callbacks further down. */
 GList *cb_search (struct callback_node *node, const char *path);
 void cb_foreach (struct callback_node *list, GFunc func, gpointer user_data);
 void cb_shutdown (struct callback_node *root);
 
 /* Callbacks to users */
+/* Callback flags - CB_FLAG_PRUNE is passed on to apteryxd in the guid */
+#define CB_FLAG_TREE        (1<<0)
+#define CB_FLAG_PRUNE       (1<<1)
 bool add_callback (const char *type, const char *path, void *fn, bool value, void *data, uint32_t flags);
-bool delete_callback (const char *type, const char *path, void *fn, void *data);
+bool delete_callback (const char *type, const char *path, void *fn, void *data, uint32_t flags);
 
 /* Tests */
 void run_unit_tests (const char *filter);
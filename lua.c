@@ -498,7 +498,7 @@ lua_apteryx_unindex (lua_State *L)
     const char *path = lua_tostring (L, 1);
     size_t ref = ref_callback (L, 2);
 
-    if (!delete_callback (APTERYX_INDEXERS_PATH, path, (void *)lua_do_index, (void *) ref))
+    if (!delete_callback (APTERYX_INDEXERS_PATH, path, (void *)lua_do_index, (void *) ref, 0))
     {
         luaL_error (L, "Failed to unregister callback\n");
         lua_pushboolean (L, false);
@@ -555,7 +555,7 @@ lua_apteryx_unwatch (lua_State *L)
     const char *path = lua_tostring (L, 1);
     size_t ref = ref_callback (L, 2);
 
-    if (!delete_callback (APTERYX_WATCHERS_PATH, path, (void *)lua_do_watch, (void *) ref))
+    if (!delete_callback (APTERYX_WATCHERS_PATH, path, (void *)lua_do_watch, (void *) ref, 0))
     {
         luaL_error (L, "Failed to unregister callback\n");
         lua_pushboolean (L, false);
@@ -617,7 +617,7 @@ lua_apteryx_unrefresh (lua_State *L)
     const char *path = lua_tostring (L, 1);
     size_t ref = ref_callback (L, 2);
 
-    if (!delete_callback (APTERYX_REFRESHERS_PATH, path, (void *)lua_do_refresh, (void *) ref))
+    if (!delete_callback (APTERYX_REFRESHERS_PATH, path, (void *)lua_do_refresh, (void *) ref, 0))
     {
         luaL_error (L, "Failed to unregister callback\n");
         lua_pushboolean (L, false);
@@ -680,7 +680,7 @@ lua_apteryx_unvalidate (lua_State *L)
     const char *path = lua_tostring (L, 1);
     size_t ref = ref_callback (L, 2);
 
-    if (!delete_callback (APTERYX_VALIDATORS_PATH, path, (void *)lua_do_validate, (void *) ref))
+    if (!delete_callback (APTERYX_VALIDATORS_PATH, path, (void *)lua_do_validate, (void *) ref, 0))
     {
         luaL_error (L, "Failed to unregister callback\n");
         lua_pushboolean (L, false);
@@ -742,7 +742,7 @@ lua_apteryx_unprovide (lua_State *L)
     const char *path = lua_tostring (L, 1);
     size_t ref = ref_callback (L, 2);
 
-    if (!delete_callback (APTERYX_PROVIDERS_PATH, path, (void *)lua_do_provide, (void *) ref))
+    if (!delete_callback (APTERYX_PROVIDERS_PATH, path, (void *)lua_do_provide, (void *) ref, 0))
     {
         luaL_error (L, "Failed to unregister callback\n");
         lua_pushboolean (L, false);
@@ -798,7 +798,6 @@ lua_apteryx_mainloop (lua_State *L)
 {
     int fd = 0;
     struct pollfd pfd;
-    uint8_t dummy = 0;
 
     if (lua_gettop (L) > 1 ||
         (lua_gettop (L) == 1 && !lua_isboolean (L, 1)))
@@ -821,9 +820,9 @@ lua_apteryx_mainloop (lua_State *L)
         pfd.fd = fd;
         pfd.events = POLLIN;
         poll (&pfd, 1, -1);
-        if (running && (!(pfd.revents & POLLIN) || read (fd, &dummy, 1) == 0))
+        if (running && !(pfd.revents & POLLIN))
         {
-            luaL_error (L, "Poll/Read error: %s\n", strerror (errno));
+            luaL_error (L, "Poll error: %s\n", strerror (errno));
         }
     }
     return 0;
@@ -18,6 +18,7 @@
  * along with this library. If not, see <http://www.gnu.org/licenses/>
  */
 #include "internal.h"
+#include <sys/eventfd.h>
 
 /* An RPC instance.
  * Provides the service, service
@@ -29,7 +30,6 @@ struct rpc_instance_s {
 
     /* General settings */
     int timeout;
-    uint64_t gc_time;
     sigset_t worker_sigmask;
 
     /* Single service */
@@ -37,17 +37,65 @@ struct rpc_instance_s {
     rpc_service server;
     GThreadPool *workers;
     GThreadPool *slow_workers;
-    int pollfd[2];
+    int pollfd;
     GAsyncQueue *queue;
-    uint32_t overflow;
 
-    /* Clients */
+    /* Requests waiting for a worker, queued per client process and served
+     * in turn so that one busy client cannot starve the others */
+    pthread_mutex_t fair_lock;
+    GHashTable *peers;
+    GQueue active;
+    int peer_limit;
+
+    /* Connections per destination and how to choose between them */
+    int pool_size;
+    rpc_pool_policy pool_policy;
+    int pool_next;
+
+    /* Clients - a read-only snapshot that is replaced (under lock) on change
+     * so that lookups can be done without taking the instance lock */
     GHashTable *clients;
+
+    /* Lock-free readers of the snapshot count themselves in the current
+     * epoch. Memory retired from the snapshot is freed once every reader
+     * that could have seen it has finished */
+    int epoch;
+    int readers[2];
+    GList *garbage;         /* Retired in the current epoch */
+    GList *garbage_old;     /* Retired before the last epoch change */
+
+    /* Reaper for dead sockets and clients */
+    pthread_t reaper;
+    pthread_cond_t reaper_cond;
+    bool reaper_stop;
+    int reaper_pid;
 };
 
 /* Garbage collection timer */
 #define RPC_GC_TIMEOUT_US (10 * RPC_TIMEOUT_US)
 
+/* Every instance, so that their locks can be held across fork () */
+static GList *instances = NULL;
+static pthread_mutex_t instances_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+/* Memory retired from the client cache */
+struct rpc_garbage_s {
+    gpointer data;
+    GDestroyNotify destroy;
+};
+
+/* Requests from one client process */
+struct rpc_peer_s {
+    int pid;
+    GQueue queue;
+    bool active;
+    int inflight;
+    uint32_t requests;
+    uint32_t rejected;
+    uint32_t max_pending;
+};
+
 /* Force test delay */
 bool rpc_test_random_watch_delay = false;
 
@@ -55,10 +103,12 @@ bool rpc_test_random_watch_delay = false;
 typedef struct rpc_client_t
 {
     rpc_socket sock;
-    uint32_t refcount;
+    int refcount;
     char *url;
+    char *key;
     uint64_t timeout;
     int pid;
+    int inflight;
 } rpc_client_t;
 
 /* Message header */
@@ -72,12 +122,22 @@ struct rpc_work_s {
     rpc_msg_handler handler;
     rpc_message_t msg;
     bool responded;
+    bool stream;
+    uint64_t deadline;
+    GArray *held; /* where each held back part ends */
 };
 
+/* Work being handled by this thread */
+static __thread struct rpc_work_s *current_work = NULL;
+/* Set once the handler has kept the work to respond to later */
+static __thread bool current_deferred = false;
+
 static void
 work_destroy (gpointer data)
 {
     struct rpc_work_s *work = (struct rpc_work_s *)data;
+    if (work->held)
+        g_array_free (work->held, true);
     rpc_msg_reset (&work->msg);
     rpc_socket_deref (work->sock);
     g_free (work);
@@ -104,18 +164,40 @@ worker_func (gpointer a, gpointer b)
 
         /* Process the callback */
         DEBUG ("RPC[%d]: processing message from %d\n", sock->sock, sock->pid);
+        current_work = work;
+        current_deferred = false;
         if (!handler (msg))
         {
-            ERROR ("RPC[%i]: handler failed\n", sock->sock);
+            if (work->stream && rpc_socket_stream_end (sock, id))
+            {
+                /* Close the stream so the requester can forget it */
+                uint8_t empty[RPC_SOCKET_HDR_SIZE];
+                DEBUG ("RPC[%i]: dropped cancelled request\n", sock->sock);
+                rpc_socket_send_response (sock, id, empty, 0);
+            }
+            else if (rpc_msg_expired ())
+            {
+                DEBUG ("RPC[%i]: dropped expired request\n", sock->sock);
+            }
+            else
+            {
+                ERROR ("RPC[%i]: handler failed\n", sock->sock);
+            }
+            current_work = NULL;
             work_destroy (work);
             return;
         }
+        current_work = NULL;
+
+        /* Whoever kept the work responds (and may already have) */
+        if (current_deferred)
+            return;
 
         /* Send result */
         DEBUG ("RPC[%d]: sending %zd bytes\n", sock->sock, msg->length);
         if (!work->responded)
         {
-            if (!msg->length)
+            if (!msg->buffer)
             {
                 msg->buffer = g_malloc0 (RPC_SOCKET_HDR_SIZE);
                 msg->size = RPC_SOCKET_HDR_SIZE;
@@ -126,8 +208,80 @@ worker_func (gpointer a, gpointer b)
     }
 }
 
+static bool
+fair_push (rpc_instance rpc, struct rpc_work_s *work)
+{
+    struct rpc_peer_s *peer;
+    int pid = work->sock->pid;
+
+    pthread_mutex_lock (&rpc->fair_lock);
+    peer = g_hash_table_lookup (rpc->peers, GINT_TO_POINTER (pid));
+    if (!peer)
+    {
+        peer = g_malloc0 (sizeof (*peer));
+        peer->pid = pid;
+        g_queue_init (&peer->queue);
+        g_hash_table_insert (rpc->peers, GINT_TO_POINTER (pid), peer);
+    }
+    peer->requests++;
+    if (rpc->peer_limit && peer->queue.length + peer->inflight >= rpc->peer_limit)
+    {
+        DEBUG ("RPC[%i]: rejecting request from busy client %d\n", work->sock->sock, pid);
+        peer->rejected++;
+        pthread_mutex_unlock (&rpc->fair_lock);
+        return false;
+    }
+    g_queue_push_tail (&peer->queue, work);
+    peer->max_pending = MAX (peer->max_pending, peer->queue.length + peer->inflight);
+    if (!peer->active)
+    {
+        peer->active = true;
+        g_queue_push_tail (&rpc->active, peer);
+    }
+    pthread_mutex_unlock (&rpc->fair_lock);
+
+    /* Each push lets a worker take the next request in turn */
+    g_thread_pool_push (rpc->workers, rpc, NULL);
+    return true;
+}
+
+static void
+fair_worker_func (gpointer a, gpointer b)
+{
+    rpc_instance rpc = (rpc_instance) b;
+    struct rpc_work_s *work;
+    struct rpc_peer_s *peer;
+
+    /* Round robin over the clients with queued requests */
+    pthread_mutex_lock (&rpc->fair_lock);
+    peer = g_queue_pop_head (&rpc->active);
+    work = g_queue_pop_head (&peer->queue);
+    if (peer->queue.length)
+        g_queue_push_tail (&rpc->active, peer);
+    else
+        peer->active = false;
+    peer->inflight++;
+    pthread_mutex_unlock (&rpc->fair_lock);
+
+    worker_func (work, &rpc->worker_sigmask);
+
+    pthread_mutex_lock (&rpc->fair_lock);
+    peer->inflight--;
+    pthread_mutex_unlock (&rpc->fair_lock);
+}
+
+/* Forget idle clients that have gone away */
+static gboolean
+fair_peer_gone (gpointer key, gpointer value, gpointer data)
+{
+    struct rpc_peer_s *peer = (struct rpc_peer_s *) value;
+    return !peer->active && !peer->inflight && peer->pid &&
+           kill (peer->pid, 0) < 0 && errno == ESRCH;
+}
+
 static void
-request_cb (rpc_socket sock, rpc_id id, void *buffer, size_t len)
+request_cb (rpc_socket sock, rpc_id id, void *buffer, size_t len, bool stream,
+            uint32_t timeout)
 {
     rpc_instance rpc;
     struct rpc_work_s *work;
@@ -150,6 +304,7 @@ request_cb (rpc_socket sock, rpc_id id, void *buffer, size_t len)
     work->id = id;
     work->handler = rpc->handler;
     work->responded = false;
+    work->stream = stream;
     rpc_msg_push (&work->msg, len);
     memcpy (work->msg.buffer + work->msg.offset, buffer, len);
     work->msg.length = len;
@@ -173,21 +328,32 @@ request_cb (rpc_socket sock, rpc_id id, void *buffer, size_t len)
         watch = true;
     }
 
+    /* The sender stops waiting for the result after its timeout. Watches
+     * are not cancelled as the change they report has already been made.
+     */
+    if (timeout && !watch)
+    {
+        work->deadline = get_time_us () + timeout;
+    }
+
     /* Check if in polling mode first */
     if (rpc->queue)
     {
-        uint8_t dummy = 0;
         g_async_queue_push (rpc->queue, (gpointer) work);
-        if (write (rpc->pollfd[1], &dummy, 1) != 1)
-        {
-            g_atomic_int_inc (&rpc->overflow);
-        }
+        eventfd_write (rpc->pollfd, 1);
     }
     /* Callbacks from local Apteryx threads */
     else if (rpc->slow_workers && (watch || work->responded))
         g_thread_pool_push (rpc->slow_workers, work, NULL);
     else if (rpc->workers)
-        g_thread_pool_push (rpc->workers, work, NULL);
+    {
+        if (!fair_push (rpc, work))
+        {
+            /* Let the client know now rather than have it time out */
+            rpc_socket_send_busy_response (sock, id);
+            goto error;
+        }
+    }
     else
         goto error;
 
@@ -196,12 +362,67 @@ request_cb (rpc_socket sock, rpc_id id, void *buffer, size_t len)
 error:
     if (work)
     {
+        rpc_msg_reset (&work->msg);
         g_free (work);
     }
     rpc_socket_deref (sock);
     return;
 }
 
+static void *reaper_thread (void *data);
+
+/* Do not let a child inherit an instance lock held by another thread */
+static void
+atfork_prepare (void)
+{
+    GList *iter;
+
+    pthread_mutex_lock (&instances_lock);
+    for (iter = instances; iter; iter = g_list_next (iter))
+    {
+        rpc_instance rpc = (rpc_instance) iter->data;
+        pthread_mutex_lock (&rpc->lock);
+        pthread_mutex_lock (&rpc->fair_lock);
+    }
+}
+
+static void
+atfork_parent (void)
+{
+    GList *iter;
+
+    for (iter = instances; iter; iter = g_list_next (iter))
+    {
+        rpc_instance rpc = (rpc_instance) iter->data;
+        pthread_mutex_unlock (&rpc->fair_lock);
+        pthread_mutex_unlock (&rpc->lock);
+    }
+    pthread_mutex_unlock (&instances_lock);
+}
+
+static void
+atfork_child (void)
+{
+    GList *iter;
+
+    for (iter = instances; iter; iter = g_list_next (iter))
+    {
+        rpc_instance rpc = (rpc_instance) iter->data;
+        /* Only the forking thread exists, and it is not a reader */
+        rpc->readers[0] = 0;
+        rpc->readers[1] = 0;
+        pthread_mutex_unlock (&rpc->fair_lock);
+        pthread_mutex_unlock (&rpc->lock);
+    }
+    pthread_mutex_unlock (&instances_lock);
+}
+
+static void
+atfork_register (void)
+{
+    pthread_atfork (atfork_prepare, atfork_parent, atfork_child);
+}
+
 rpc_instance
 rpc_init (int timeout, rpc_msg_handler handler)
 {
@@ -223,11 +444,16 @@ rpc_init (int timeout, rpc_msg_handler handler)
     pthread_mutex_init (&rpc->lock, NULL);
     pthread_sigmask (SIG_SETMASK, NULL, &rpc->worker_sigmask);
     rpc->timeout = timeout;
-    rpc->gc_time = get_time_us ();
+    rpc->pollfd = -1;
+    rpc->pool_size = 1;
+    rpc->pool_policy = RPC_POOL_ROUND_ROBIN;
     rpc->handler = handler;
     rpc->server = server;
-    rpc->clients = g_hash_table_new (g_str_hash, g_str_equal);
-    rpc->workers = g_thread_pool_new ((GFunc)worker_func, (gpointer)&rpc->worker_sigmask,
+    rpc->clients = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    pthread_mutex_init (&rpc->fair_lock, NULL);
+    rpc->peers = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+    g_queue_init (&rpc->active);
+    rpc->workers = g_thread_pool_new ((GFunc)fair_worker_func, (gpointer)rpc,
                                       8, FALSE, NULL);
     /* slow_workers handles the watch callbacks and jobs that have already been
      * responded to and must be served by a single thread.
@@ -236,24 +462,45 @@ rpc_init (int timeout, rpc_msg_handler handler)
                                            (gpointer)&rpc->worker_sigmask,
                                            1, FALSE, NULL);
 
+    /* Hold the locks of every instance over fork () */
+    pthread_once (&atfork_once, atfork_register);
+    pthread_mutex_lock (&instances_lock);
+    instances = g_list_prepend (instances, rpc);
+    pthread_mutex_unlock (&instances_lock);
+
+    /* Start collecting dead clients */
+    pthread_cond_init (&rpc->reaper_cond, NULL);
+    rpc->reaper_pid = getpid ();
+    if (pthread_create (&rpc->reaper, NULL, reaper_thread, (void *) rpc) != 0)
+    {
+        ERROR ("RPC: Failed to start client reaper\n");
+        rpc->reaper_pid = 0;
+    }
+
     DEBUG ("RPC: New Instance (%p)\n", rpc);
     return rpc;
 }
 
-static bool
-destroy_rpc_client (gpointer key, gpointer value, gpointer rpc)
+static void
+client_free (gpointer data)
 {
-    rpc_client_t *client = (rpc_client_t *) value;
+    rpc_client_t *client = (rpc_client_t *) data;
 
-    DEBUG ("RPC: Destroy client to %s\n", (const char *)key);
+    DEBUG ("RPC[%d]: Release client\n", client->sock ? client->sock->sock : -1);
 
     /* Release the socket and free the client */
     rpc_socket_deref (client->sock);
+    g_free (client->key);
     g_free (client->url);
     g_free (client);
-    g_free (key);
+}
 
-    return true;
+static void
+garbage_free (gpointer data)
+{
+    struct rpc_garbage_s *garbage = (struct rpc_garbage_s *) data;
+    garbage->destroy (garbage->data);
+    g_free (garbage);
 }
 
 void
@@ -265,6 +512,10 @@ rpc_shutdown (rpc_instance rpc)
 
     DEBUG ("RPC: Shutdown Instance (%p)\n", rpc);
 
+    pthread_mutex_lock (&instances_lock);
+    instances = g_list_remove (instances, rpc);
+    pthread_mutex_unlock (&instances_lock);
+
     /* Need to wait until all threads are cleaned up */
     for (i=0; i<10; i++)
     {
@@ -293,17 +544,66 @@ rpc_shutdown (rpc_instance rpc)
         rpc->queue = NULL;
     }
 
+    /* Stop the reaper (it does not exist in a forked child) */
+    pthread_mutex_lock (&rpc->lock);
+    rpc->reaper_stop = true;
+    pthread_cond_signal (&rpc->reaper_cond);
+    pthread_mutex_unlock (&rpc->lock);
+    if (rpc->reaper_pid && rpc->reaper_pid == getpid ())
+        pthread_join (rpc->reaper, NULL);
+    pthread_cond_destroy (&rpc->reaper_cond);
+
     /* Stop the server */
     rpc_service_die (rpc->server);
 
     /* Remove all clients */
-    g_hash_table_foreach_remove (rpc->clients, (GHRFunc)destroy_rpc_client, rpc);
+    g_list_free_full (rpc->garbage_old, garbage_free);
+    g_list_free_full (rpc->garbage, garbage_free);
+    GList *clients = g_hash_table_get_values (rpc->clients);
+    g_list_free_full (clients, client_free);
     g_hash_table_destroy (rpc->clients);
+    g_hash_table_destroy (rpc->peers);
 
     /* Free instance */
     g_free ((void*) rpc);
 }
 
+void
+rpc_server_limit (rpc_instance rpc, int limit)
+{
+    assert (rpc);
+
+    pthread_mutex_lock (&rpc->fair_lock);
+    rpc->peer_limit = limit > 0 ? limit : 0;
+    pthread_mutex_unlock (&rpc->fair_lock);
+}
+
+GList *
+rpc_server_peers (rpc_instance rpc)
+{
+    GHashTableIter iter;
+    struct rpc_peer_s *peer;
+    GList *stats = NULL;
+
+    assert (rpc);
+
+    pthread_mutex_lock (&rpc->fair_lock);
+    g_hash_table_iter_init (&iter, rpc->peers);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &peer))
+    {
+        rpc_peer_stats *s = g_malloc0 (sizeof (*s));
+        s->pid = peer->pid;
+        s->requests = peer->requests;
+        s->rejected = peer->rejected;
+        s->queued = peer->queue.length;
+        s->inflight = peer->inflight;
+        s->max_pending = peer->max_pending;
+        stats = g_list_prepend (stats, s);
+    }
+    pthread_mutex_unlock (&rpc->fair_lock);
+    return stats;
+}
+
 bool
 rpc_server_bind (rpc_instance rpc, const char *guid, const char *url)
 {
@@ -325,66 +625,60 @@ rpc_server_release (rpc_instance rpc, const char *guid)
 }
 
 int
-rpc_server_process (rpc_instance rpc, bool poll)
+rpc_server_process (rpc_instance rpc, bool poll, int max_jobs, uint64_t max_us)
 {
     assert (rpc);
-    int flags;
-    int dummy = 0;
+    eventfd_t count;
 
     /* Start polling if requested */
     if (poll && rpc->queue == NULL)
     {
         DEBUG ("RPC: Starting Polling mode\n");
-        if (pipe (rpc->pollfd) < 0 ||
+        /* Non-blocking so that neither side waits on the counter */
+        if ((rpc->pollfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
          (rpc->queue = g_async_queue_new_full (work_destroy)) == NULL)
         {
             ERROR ("RPC: Failed to enable poll mode\n");
             goto cleanup;
         }
-        /* Write is non-blocking to avoid blocking apteryxd */
-        flags = fcntl (rpc->pollfd[1], F_GETFL, 0);
-        if (fcntl (rpc->pollfd[1], F_SETFL, flags | O_NONBLOCK) < 0)
-        {
-            ERROR ("RPC: Failed to set pipe nonblocking\n");
-            goto cleanup;
-        }
     }
 
     /* Check for work and process it if required */
     if (poll)
     {
-        gpointer *work = g_async_queue_try_pop (rpc->queue);
-        if (work)
+        uint64_t start = max_us ? get_time_us () : 0;
+        int done = 0;
+
+        /* Clear the wakeup - anything queued from now on sets it again */
+        eventfd_read (rpc->pollfd, &count);
+        while (max_jobs <= 0 || done < max_jobs)
         {
-            /* Process a single work job */
+            gpointer *work = g_async_queue_try_pop (rpc->queue);
+            if (!work)
+                break;
             DEBUG ("RPC: Polled processing...\n");
             worker_func (work, NULL);
+            done++;
+            if (max_us && get_time_us () - start >= max_us)
+                break;
         }
-        else
-        {
-            DEBUG ("RPC: Polling. Nothing to process\n");
-        }
+        DEBUG ("RPC: Polled %d jobs\n", done);
 
-        /* Check for overflow */
-        if (g_atomic_int_get (&rpc->overflow) &&
-            write (rpc->pollfd[1], &dummy, 1) == 1)
-        {
-            g_atomic_int_dec_and_test (&rpc->overflow);
-        }
+        /* Wake the caller again for what is left */
+        if (g_async_queue_length (rpc->queue) > 0)
+            eventfd_write (rpc->pollfd, 1);
 
         /* Return the poll fd for the client to monitor */
-        return rpc->pollfd[0];
+        return rpc->pollfd;
     }
 
     /* Disable poll mode */
     DEBUG ("RPC: Stopping Polling mode\n");
 cleanup:
-    if (rpc->pollfd[0] != -1)
+    if (rpc->pollfd != -1)
     {
-        close (rpc->pollfd[0]);
-        rpc->pollfd[0] = -1;
-        close (rpc->pollfd[1]);
-        rpc->pollfd[1] = -1;
+        close (rpc->pollfd);
+        rpc->pollfd = -1;
     }
     if (rpc->queue)
     {
@@ -394,124 +688,368 @@ cleanup:
     return -1;
 }
 
-static void
-client_release (rpc_instance rpc, rpc_client_t *client, bool keep)
+/* Start a lock-free read of the client snapshot */
+static int
+clients_read_begin (rpc_instance rpc)
 {
-    bool done;
+    int epoch;
 
-    /* Remove this client from the active list if requested */
-    if (!keep)
+    while (true)
     {
-        rpc_client_t *existing = NULL;
-        char *name = NULL;
+        epoch = g_atomic_int_get (&rpc->epoch);
+        g_atomic_int_inc (&rpc->readers[epoch & 1]);
+        if (g_atomic_int_get (&rpc->epoch) == epoch)
+            return epoch;
+        /* Raced with an epoch change - count ourselves in the new one */
+        g_atomic_int_add (&rpc->readers[epoch & 1], -1);
+    }
+}
 
-        /* Make sure it is actually on the list */
-        if (g_hash_table_lookup_extended (rpc->clients, client->url, (void **)&name, (void **)&existing)
-                && existing == client)
+static void
+clients_read_end (rpc_instance rpc, int epoch)
+{
+    g_atomic_int_add (&rpc->readers[epoch & 1], -1);
+}
+
+/* Memory no longer reachable from the snapshot. Must hold the instance lock */
+static void
+retire (rpc_instance rpc, gpointer data, GDestroyNotify destroy)
+{
+    struct rpc_garbage_s *garbage = g_malloc0 (sizeof (*garbage));
+    garbage->data = data;
+    garbage->destroy = destroy;
+    rpc->garbage = g_list_prepend (rpc->garbage, garbage);
+}
+
+/* Take the retired memory that no reader can still be using.
+ * Must hold the instance lock */
+static GList *
+collect_locked (rpc_instance rpc)
+{
+    int epoch = rpc->epoch;
+    GList *garbage = NULL;
+
+    /* Readers from before the last epoch change might still be using
+     * what was retired before it */
+    if (g_atomic_int_get (&rpc->readers[(epoch - 1) & 1]) != 0)
+        return NULL;
+    garbage = rpc->garbage_old;
+    rpc->garbage_old = NULL;
+
+    /* Move on an epoch so that new readers can not see what has been
+     * retired since. It is free once the readers of this epoch are done */
+    if (rpc->garbage)
+    {
+        rpc->garbage_old = rpc->garbage;
+        rpc->garbage = NULL;
+        g_atomic_int_set (&rpc->epoch, epoch + 1);
+        if (g_atomic_int_get (&rpc->readers[epoch & 1]) == 0)
         {
-            DEBUG ("RPC[%d]: Abandon client to %s\n", client->sock ? client->sock->sock : -1, client->url);
-            /* Release the client and remove it from the list */
-            g_hash_table_remove (rpc->clients, client->url);
-            g_free (name);
-            client->refcount--;
+            garbage = g_list_concat (garbage, rpc->garbage_old);
+            rpc->garbage_old = NULL;
         }
     }
+    return garbage;
+}
 
-    /* Release the client */
-    done = (client->refcount <= 1);
-    client->refcount--;
-    if (done)
+/* Free what we can of the retired memory, outside the instance lock */
+static void
+collect (rpc_instance rpc)
+{
+    GList *garbage;
+
+    pthread_mutex_lock (&rpc->lock);
+    garbage = collect_locked (rpc);
+    pthread_mutex_unlock (&rpc->lock);
+    g_list_free_full (garbage, garbage_free);
+}
+
+#ifdef TEST
+/* Retired memory that has not been freed yet */
+int
+rpc_test_garbage (rpc_instance rpc)
+{
+    int count;
+
+    pthread_mutex_lock (&rpc->lock);
+    count = g_list_length (rpc->garbage) + g_list_length (rpc->garbage_old);
+    pthread_mutex_unlock (&rpc->lock);
+    return count;
+}
+#endif
+
+/* Take a reference only if the client has not already been released */
+static bool
+client_ref (rpc_client_t *client)
+{
+    int refcount;
+
+    do
     {
-        DEBUG ("RPC[%d]: Release client\n", client->sock ? client->sock->sock : -1);
-        /* Release the socket and free the client */
-        rpc_socket_deref (client->sock);
-        g_free (client->url);
-        g_free (client);
+        refcount = g_atomic_int_get (&client->refcount);
+        if (refcount <= 0)
+            return false;
+    } while (!g_atomic_int_compare_and_exchange (&client->refcount, refcount, refcount + 1));
+    return true;
+}
+
+/* Drop a reference. Must hold the instance lock */
+static void
+client_unref_locked (rpc_instance rpc, rpc_client_t *client)
+{
+    if (g_atomic_int_dec_and_test (&client->refcount))
+        retire (rpc, client, client_free);
+}
+
+static void
+client_unref (rpc_instance rpc, rpc_client_t *client)
+{
+    if (g_atomic_int_dec_and_test (&client->refcount))
+    {
+        pthread_mutex_lock (&rpc->lock);
+        retire (rpc, client, client_free);
+        pthread_mutex_unlock (&rpc->lock);
+        collect (rpc);
     }
+}
 
-    return;
+static bool
+client_usable (rpc_client_t *client)
+{
+    return client->sock != NULL && !client->sock->dead && client->pid == getpid ();
 }
 
+/* Publish a new copy of the client cache with the listed clients removed and
+ * the (optional) new client added. Must hold the instance lock */
 static void
-gc_clients (rpc_instance rpc)
+clients_update_locked (rpc_instance rpc, GList *remove, rpc_client_t *add)
 {
+    GHashTable *old = rpc->clients;
+    GHashTable *clients;
     GHashTableIter hiter;
     const char *url;
     rpc_client_t *client;
-    GList *dead = NULL;
-    GList *iter = NULL;
 
-    /* Minimum timeout between collections */
-    if (get_time_us () > rpc->gc_time + RPC_GC_TIMEOUT_US)
+    clients = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_iter_init (&hiter, old);
+    while (g_hash_table_iter_next (&hiter, (void **)&url, (void **)&client))
     {
-        /* Iterate over all clients */
-        g_hash_table_iter_init (&hiter, rpc->clients);
-        while (g_hash_table_iter_next (&hiter, (void **)&url, (void **)&client))
+        if (g_list_find (remove, client))
         {
-            if (client->sock && client->sock->dead)
-                dead = g_list_append (dead, client);
+            DEBUG ("RPC[%d]: Abandon client to %s\n", client->sock ? client->sock->sock : -1, url);
+            client_unref_locked (rpc, client);
         }
-
-        /* Cleanup any dead clients */
-        for (iter = dead; iter; iter = g_list_next (iter))
+        else if (add && strcmp (url, add->key) == 0)
+        {
+            DEBUG ("RPC[%d]: Replace client to %s\n", client->sock ? client->sock->sock : -1, url);
+            client_unref_locked (rpc, client);
+        }
+        else
         {
-            client = (rpc_client_t *) iter->data;
-            DEBUG ("RPC[%d]: Collecting dead socket for %s\n", client->sock->sock, client->url);
-            if (client->refcount < 2)
-                client_release (rpc, client, false);
+            g_hash_table_insert (clients, g_strdup (url), client);
         }
-        g_list_free (dead);
+    }
+    if (add)
+    {
+        /* The cache holds a reference */
+        g_atomic_int_inc (&add->refcount);
+        g_hash_table_insert (clients, g_strdup (add->key), add);
+    }
+    g_atomic_pointer_set (&rpc->clients, clients);
+    retire (rpc, old, (GDestroyNotify) g_hash_table_destroy);
+}
 
-        /* Wait another timeout */
-        rpc->gc_time = get_time_us ();
+static void
+client_release (rpc_instance rpc, rpc_client_t *client, bool keep)
+{
+    /* Remove this client from the cache if requested */
+    if (!keep)
+    {
+        pthread_mutex_lock (&rpc->lock);
+        /* Make sure it is actually in the cache */
+        if (g_hash_table_lookup (rpc->clients, client->key) == client)
+        {
+            GList *remove = g_list_prepend (NULL, client);
+            clients_update_locked (rpc, remove, NULL);
+            g_list_free (remove);
+        }
+        pthread_mutex_unlock (&rpc->lock);
     }
+
+    /* Release the client */
+    client_unref (rpc, client);
+    if (!keep)
+        collect (rpc);
 }
 
-static rpc_client_t *
-rpc_client_existing_s (rpc_instance rpc, const char *url)
+static void
+gc_clients (rpc_instance rpc)
 {
-    rpc_client_t *client = NULL;
-    char *name = NULL;
+    GHashTableIter hiter;
+    const char *url;
+    rpc_client_t *client;
+    GList *dead = NULL;
 
-    /* Garbage collect any stale clients */
-    gc_clients (rpc);
+    /* Find all clients whose socket has gone away */
+    g_hash_table_iter_init (&hiter, rpc->clients);
+    while (g_hash_table_iter_next (&hiter, (void **)&url, (void **)&client))
+    {
+        if (client->sock && client->sock->dead)
+        {
+            DEBUG ("RPC[%d]: Collecting dead socket for %s\n", client->sock->sock, url);
+            dead = g_list_prepend (dead, client);
+        }
+    }
+
+    /* Remove them all in one update */
+    if (dead)
+        clients_update_locked (rpc, dead, NULL);
+    g_list_free (dead);
+
+    /* And forget the client processes that have gone */
+    pthread_mutex_lock (&rpc->fair_lock);
+    g_hash_table_foreach_remove (rpc->peers, fair_peer_gone, NULL);
+    pthread_mutex_unlock (&rpc->fair_lock);
+}
 
-    /* Find an existing client */
-    if (g_hash_table_lookup_extended (rpc->clients, url, (void **)&name, (void **)&client))
+static void *
+reaper_thread (void *data)
+{
+    rpc_instance rpc = (rpc_instance) data;
+    struct timespec waitUntil;
+    struct timeval now;
+    GList *garbage;
+
+    pthread_mutex_lock (&rpc->lock);
+    while (!rpc->reaper_stop)
     {
-        /* Reference this client */
-        client->refcount++;
+        gettimeofday (&now, NULL);
+        waitUntil.tv_sec = now.tv_sec + RPC_GC_TIMEOUT_US / (1000UL * 1000UL);
+        waitUntil.tv_nsec = now.tv_usec * 1000UL;
+        pthread_cond_timedwait (&rpc->reaper_cond, &rpc->lock, &waitUntil);
+        if (rpc->reaper_stop)
+            break;
+
+        /* Drop dead clients from the cache and free what readers were
+         * still using when it was retired */
+        gc_clients (rpc);
+        garbage = collect_locked (rpc);
+        pthread_mutex_unlock (&rpc->lock);
+        g_list_free_full (garbage, garbage_free);
+        pthread_mutex_lock (&rpc->lock);
+    }
+    pthread_mutex_unlock (&rpc->lock);
+    return NULL;
+}
 
+/* Lock-free lookup in the current client cache snapshot */
+static rpc_client_t *
+client_lookup (rpc_instance rpc, const char *key)
+{
+    GHashTable *clients;
+    rpc_client_t *client;
+    bool found;
+    int epoch;
+
+    epoch = clients_read_begin (rpc);
+    clients = g_atomic_pointer_get (&rpc->clients);
+    client = (rpc_client_t *) g_hash_table_lookup (clients, key);
+    found = client && client_ref (client);
+    clients_read_end (rpc, epoch);
+    if (found)
+    {
         /* Check the attached socket is still valid */
-        if (client->sock != NULL && !client->sock->dead && client->pid == getpid ())
+        if (client_usable (client))
         {
             /* This client will do */
             return client;
         }
 
         /* Otherwise chuck this one away and make another */
-        DEBUG ("RPC[%d]: Pruning dead socket for %s\n", client->sock ? client->sock->sock : -1, url);
+        DEBUG ("RPC[%d]: Pruning dead socket for %s\n", client->sock ? client->sock->sock : -1, key);
         client_release (rpc, client, false);
     }
-
     return NULL;
 }
 
+/* Cache key for a connection slot. The first slot is just the url */
+static char *
+client_key (const char *url, int slot)
+{
+    return slot ? g_strdup_printf ("%s#%d", url, slot) : (char *) url;
+}
+
+static void
+client_key_free (char *key, int slot)
+{
+    if (slot)
+        g_free (key);
+}
+
+/* Choose which of the connections to a destination to use */
+static int
+client_slot (rpc_instance rpc, const char *url)
+{
+    int size = g_atomic_int_get (&rpc->pool_size);
+    GHashTable *clients;
+    rpc_client_t *client;
+    int best = -1, unused = -1;
+    int inflight, least = 0;
+    int slot, epoch;
+    char *key;
+
+    if (size <= 1)
+        return 0;
+
+    if (g_atomic_int_get (&rpc->pool_policy) == RPC_POOL_ROUND_ROBIN)
+        return (unsigned int) g_atomic_int_add (&rpc->pool_next, 1) % size;
+
+    /* Use an idle connection if there is one, otherwise open another
+     * connection before sharing the least busy one */
+    epoch = clients_read_begin (rpc);
+    clients = g_atomic_pointer_get (&rpc->clients);
+    for (slot = 0; slot < size; slot++)
+    {
+        key = client_key (url, slot);
+        client = (rpc_client_t *) g_hash_table_lookup (clients, key);
+        client_key_free (key, slot);
+        if (!client)
+        {
+            if (unused < 0)
+                unused = slot;
+            continue;
+        }
+        inflight = g_atomic_int_get (&client->inflight);
+        if (inflight == 0)
+        {
+            best = slot;
+            unused = -1;
+            break;
+        }
+        if (best < 0 || inflight < least)
+        {
+            best = slot;
+            least = inflight;
+        }
+    }
+    clients_read_end (rpc, epoch);
+    return unused >= 0 ? unused : best;
+}
+
 rpc_client
 rpc_client_existing (rpc_instance rpc, const char *url)
 {
-    rpc_client_t *client = NULL;
+    rpc_client_t *client;
+    int slot;
+    char *key;
 
     assert (rpc);
     assert (url);
 
-    /* Protect the instance */
-    pthread_mutex_lock (&rpc->lock);
-
-    client = rpc_client_existing_s (rpc, url);
-
-    /* Release the instance */
-    pthread_mutex_unlock (&rpc->lock);
+    slot = client_slot (rpc, url);
+    key = client_key (url, slot);
+    client = client_lookup (rpc, key);
+    client_key_free (key, slot);
     return client;
 }
 
@@ -519,20 +1057,38 @@ rpc_client
 rpc_client_connect (rpc_instance rpc, const char *url)
 {
     rpc_client_t *client = NULL;
+    int slot;
+    char *key;
 
     assert (rpc);
     assert (url);
 
+    /* Fast path - already connected */
+    slot = client_slot (rpc, url);
+    key = client_key (url, slot);
+    client = client_lookup (rpc, key);
+    if (client)
+        goto done;
+
     /* Protect the instance */
     pthread_mutex_lock (&rpc->lock);
 
-    client = rpc_client_existing_s (rpc, url);
-    if (client)
+    /* A forked child has no reaper so collects dead clients itself */
+    if (rpc->reaper_pid != getpid ())
+        gc_clients (rpc);
+
+    /* Someone else may have connected while we waited */
+    client = g_hash_table_lookup (rpc->clients, key);
+    if (client && client_ref (client))
     {
-        /* Found a client */
-        pthread_mutex_unlock (&rpc->lock);
-        return client;
+        if (client_usable (client))
+        {
+            pthread_mutex_unlock (&rpc->lock);
+            goto done;
+        }
+        client_unref_locked (rpc, client);
     }
+    client = NULL;
 
     /* Create a new socket */
     rpc_socket sock = rpc_socket_connect_service (url, request_cb);
@@ -540,7 +1096,7 @@ rpc_client_connect (rpc_instance rpc, const char *url)
     {
         ERROR ("RPC: Failed to create socket to %s\n", url);
         pthread_mutex_unlock (&rpc->lock);
-        return NULL;
+        goto done;
     }
     sock->priv = (void*)rpc;
 
@@ -551,47 +1107,60 @@ rpc_client_connect (rpc_instance rpc, const char *url)
         ERROR ("RPC: Failed to allocate memory for client service\n");
         rpc_socket_deref (sock);
         pthread_mutex_unlock (&rpc->lock);
-        return NULL;
+        goto done;
     }
     client->sock = sock;
     client->refcount = 1;
     client->url = g_strdup (url);
+    client->key = g_strdup (key);
     client->timeout = rpc->timeout;
     client->pid = getpid ();
 
-    DEBUG ("RPC[%d]: New client to %s\n", sock->sock, url);
-
-    /* Add it to the list of clients */
-    g_hash_table_insert (rpc->clients, g_strdup (url), client);
-    client->refcount++;
+    DEBUG ("RPC[%d]: New client to %s\n", sock->sock, key);
 
     /* Start processing this socket */
     if (!rpc_socket_process (sock))
     {
         ERROR ("RPC: Failed to start socket processing for client service\n");
-        g_hash_table_remove (rpc->clients, client->url);
+        g_free (client->key);
         g_free (client->url);
         g_free (client);
+        client = NULL;
         rpc_socket_deref (sock);
         pthread_mutex_unlock (&rpc->lock);
-        return NULL;
+        goto done;
     }
 
+    /* Add it to the cache of clients (replacing any stale one) */
+    clients_update_locked (rpc, NULL, client);
+
     /* Release the instance */
     pthread_mutex_unlock (&rpc->lock);
+    collect (rpc);
+
+done:
+    client_key_free (key, slot);
     return client;
 }
 
+void
+rpc_client_pool_set (rpc_instance rpc, int size, rpc_pool_policy policy)
+{
+    assert (rpc);
+
+    g_atomic_int_set (&rpc->pool_policy, policy);
+    g_atomic_int_set (&rpc->pool_size, size > 1 ? size : 1);
+    DEBUG ("RPC: %d connection(s) per destination (%s)\n", size,
+           policy == RPC_POOL_ROUND_ROBIN ? "round-robin" : "least in-flight");
+}
+
 void
 rpc_client_release (rpc_instance rpc, rpc_client client, bool keep)
 {
     assert (rpc);
     assert (client);
 
-    /* Protected release */
-    pthread_mutex_lock (&rpc->lock);
     client_release (rpc, client, keep);
-    pthread_mutex_unlock (&rpc->lock);
     return;
 }
 
@@ -676,6 +1245,18 @@ rpc_msg_encode_string (rpc_message msg, const char *value)
     return;
 }
 
+void
+rpc_msg_append (rpc_message msg, rpc_message other)
+{
+    if (!other->length)
+        return;
+    rpc_msg_push (msg, other->length);
+    memcpy (msg->buffer + msg->offset, other->buffer + RPC_SOCKET_HDR_SIZE, other->length);
+    msg->length += other->length;
+    msg->offset += other->length;
+    return;
+}
+
 char*
 rpc_msg_decode_string (rpc_message msg)
 {
@@ -686,16 +1267,97 @@ rpc_msg_decode_string (rpc_message msg)
     return value;
 }
 
+bool
+rpc_msg_expired (void)
+{
+    struct rpc_work_s *work = current_work;
+    return work && ((work->deadline && get_time_us () >= work->deadline) ||
+                    rpc_msg_cancelled ());
+}
+
+bool
+rpc_msg_cancelled (void)
+{
+    struct rpc_work_s *work = current_work;
+    return work && work->stream && rpc_socket_cancelled (work->sock, work->id);
+}
+
+uint64_t
+rpc_msg_deadline (void)
+{
+    struct rpc_work_s *work = current_work;
+    return work ? work->deadline : 0;
+}
+
+rpc_deferred
+rpc_msg_defer (void)
+{
+    struct rpc_work_s *work = current_work;
+
+    assert (work && !work->responded);
+    current_deferred = true;
+    return work;
+}
+
+void
+rpc_deferred_respond (rpc_deferred work)
+{
+    rpc_message msg = &work->msg;
+
+    DEBUG ("RPC[%d]: sending %zd bytes (deferred)\n", work->sock->sock, msg->length);
+    if (!msg->buffer)
+    {
+        msg->buffer = g_malloc0 (RPC_SOCKET_HDR_SIZE);
+        msg->size = RPC_SOCKET_HDR_SIZE;
+    }
+    rpc_socket_send_response (work->sock, work->id, msg->buffer, msg->length);
+    work_destroy (work);
+}
+
+/* Requests made while handling another inherit what is left of its
+ * budget, except watches which are never cut short.
+ */
+static bool
+request_timeout (rpc_client client, rpc_message msg, uint64_t *timeout)
+{
+    struct rpc_work_s *work = current_work;
+    uint8_t mode = 0;
+
+    *timeout = client->timeout;
+    if (msg->length)
+        mode = *(uint8_t *) (msg->buffer + RPC_SOCKET_HDR_SIZE);
+    if (work && work->deadline && mode != MODE_WATCH && mode != MODE_WATCH_WITH_ACK)
+    {
+        uint64_t now = get_time_us ();
+        if (now >= work->deadline)
+        {
+            DEBUG ("RPC[%d]: not sending for expired request\n", client->sock->sock);
+            return false;
+        }
+        *timeout = MIN (*timeout, work->deadline - now);
+    }
+    *timeout = MIN (*timeout, UINT32_MAX);
+    return true;
+}
+
 bool
 rpc_msg_send (rpc_client client, rpc_message msg)
 {
     void *buffer = NULL;
     size_t length = 0;
+    uint64_t timeout;
     bool rc = true;
 
+    if (!request_timeout (client, msg, &timeout))
+    {
+        errno = -ETIMEDOUT;
+        return false;
+    }
+
     /* Send the message */
     DEBUG ("RPC[%d]: sending %zd bytes\n", client->sock->sock, msg->length);
-    rpc_id id = rpc_socket_send_request (client->sock, msg->buffer, msg->length);
+    g_atomic_int_inc (&client->inflight);
+    rpc_id id = rpc_socket_send_request (client->sock, msg->buffer, msg->length, timeout);
     if (id == 0)
     {
         errno = -ETIMEDOUT;
@@ -706,9 +1368,10 @@ rpc_msg_send (rpc_client client, rpc_message msg)
     /* Wait for response */
     rpc_msg_reset (msg);
     DEBUG ("RPC[%d]: waiting for response\n", client->sock->sock);
-    if (!rpc_socket_recv (client->sock, id, (void **) &buffer, &length, client->timeout))
+    if (!rpc_socket_recv (client->sock, id, (void **) &buffer, &length, timeout))
     {
-        errno = -ETIMEDOUT;
+        errno = errno == EBUSY ? -EBUSY : -ETIMEDOUT;
+        rpc_socket_forget (client->sock, id);
         rc = false;
         goto error;
     }
@@ -719,9 +1382,155 @@ rpc_msg_send (rpc_client client, rpc_message msg)
     free (buffer);
 
 error:
+    g_atomic_int_add (&client->inflight, -1);
     return rc;
 }
 
+rpc_id
+rpc_msg_send_stream (rpc_client client, rpc_message msg)
+{
+    uint64_t timeout;
+
+    if (!request_timeout (client, msg, &timeout))
+    {
+        rpc_msg_reset (msg);
+        errno = -ETIMEDOUT;
+        return 0;
+    }
+
+    /* Send the message asking for a streamed response */
+    DEBUG ("RPC[%d]: sending %zd bytes (stream)\n", client->sock->sock, msg->length);
+    rpc_id id = rpc_socket_send_stream_request (client->sock, msg->buffer, msg->length,
+                                                timeout);
+    rpc_msg_reset (msg);
+    if (id == 0)
+        errno = -ETIMEDOUT;
+    else
+        g_atomic_int_inc (&client->inflight);
+    return id;
+}
+
+bool
+rpc_msg_recv_stream (rpc_client client, rpc_id id, rpc_message msg, bool *more)
+{
+    void *buffer = NULL;
+    size_t length = 0;
+
+    /* Wait for the next part of the response */
+    rpc_msg_reset (msg);
+    if (!rpc_socket_recv_stream (client->sock, id, (void **) &buffer, &length, client->timeout, more))
+    {
+        errno = errno == EBUSY ? -EBUSY : -ETIMEDOUT;
+        rpc_socket_forget (client->sock, id);
+        *more = false;
+        g_atomic_int_add (&client->inflight, -1);
+        return false;
+    }
+    rpc_msg_push (msg, length);
+    memcpy (msg->buffer + msg->offset, buffer, length);
+    msg->length = length;
+    DEBUG ("RPC[%d]: received %zd bytes%s\n", client->sock->sock, msg->length, *more ? " (partial)" : "");
+    free (buffer);
+    if (!*more)
+        g_atomic_int_add (&client->inflight, -1);
+    return true;
+}
+
+void
+rpc_msg_cancel_stream (rpc_client client, rpc_id id)
+{
+    DEBUG ("RPC[%d]: cancelling stream\n", client->sock->sock);
+    rpc_socket_cancel (client->sock, id);
+    g_atomic_int_add (&client->inflight, -1);
+}
+
+bool
+rpc_msg_stream (rpc_message msg)
+{
+    struct rpc_work_s *work = current_work;
+
+    size_t start = 0;
+
+    /* Only when handling a request that accepts a streamed response */
+    if (!work || !work->stream || msg != &work->msg || work->responded)
+        return false;
+    if (work->held && work->held->len)
+        start = g_array_index (work->held, size_t, work->held->len - 1);
+    if (msg->length - start < RPC_STREAM_CHUNK_SIZE)
+        return false;
+
+    /* Just remember where the part ends until it can be sent */
+    if (work->held)
+    {
+        g_array_append_val (work->held, msg->length);
+        return false;
+    }
+
+    /* Send what we have and start the next part */
+    DEBUG ("RPC[%d]: sending %zd bytes (partial)\n", work->sock->sock, msg->length);
+    if (!rpc_socket_send_partial_response (work->sock, work->id, msg->buffer, msg->length))
+        return false;
+    msg->length = 0;
+    msg->offset = RPC_SOCKET_HDR_SIZE;
+    return true;
+}
+
+void
+rpc_msg_stream_hold (rpc_message msg)
+{
+    struct rpc_work_s *work = current_work;
+
+    if (work && work->stream && msg == &work->msg && !work->held)
+        work->held = g_array_new (false, false, sizeof (size_t));
+}
+
+bool
+rpc_msg_stream_full (rpc_message msg)
+{
+    struct rpc_work_s *work = current_work;
+
+    /* As many parts as the reader takes at once are waiting */
+    return work && msg == &work->msg && work->held &&
+        work->held->len >= RPC_STREAM_WINDOW;
+}
+
+size_t
+rpc_msg_stream_release (rpc_message msg)
+{
+    struct rpc_work_s *work = current_work;
+    GArray *held;
+    size_t start = 0;
+    size_t length = 0;
+    guint i;
+
+    if (!work || msg != &work->msg || !work->held)
+        return 0;
+    held = work->held;
+    work->held = NULL;
+    if (held->len)
+        length = g_array_index (held, size_t, held->len - 1);
+
+    /* Each header goes over the end of the part sent before it */
+    for (i = 0; i < held->len && !work->responded; i++)
+    {
+        size_t end = g_array_index (held, size_t, i);
+        DEBUG ("RPC[%d]: sending %zd bytes (partial)\n", work->sock->sock, end - start);
+        if (!rpc_socket_send_partial_response (work->sock, work->id,
+                                               msg->buffer + start, end - start))
+            break;
+        start = end;
+    }
+    if (start)
+    {
+        msg->length -= start;
+        memmove (msg->buffer + RPC_SOCKET_HDR_SIZE,
+                 msg->buffer + RPC_SOCKET_HDR_SIZE + start, msg->length);
+        msg->offset = RPC_SOCKET_HDR_SIZE + msg->length;
+    }
+    g_array_free (held, true);
+    return length;
+}
+
 void
 rpc_msg_free (rpc_message msg)
 {
@@ -6,14 +6,84 @@
 #include <unistd.h>
 #include <linux/tcp.h>
 #include <fcntl.h>
+#ifdef HAVE_IO_URING
+#include <liburing.h>
+#endif
 
+/* Peers from before RPC_PROTOCOL_STREAM only know requests and responses
+ * with the plain header, and drop the connection on anything else. Both
+ * ends announce their version with a response to id 0 (never used for a
+ * request), which older peers queue and never read. The other modes and
+ * the timeout are only sent to a peer that has announced a version that
+ * knows them */
 #define MODE_REQUEST 1
 #define MODE_RESPONSE 2
+#define MODE_REQUEST_STREAM 3       /* Requester accepts partial responses */
+#define MODE_RESPONSE_PARTIAL 4     /* More responses follow with the same id */
+#define MODE_RESPONSE_BUSY 5        /* The request was refused unprocessed */
+#define MODE_CANCEL 6               /* The requester has given up on a stream */
+#define MODE_FLAG_TIMEOUT 0x100     /* The header is followed by a timeout */
+
+#define RPC_HELLO_ID 0
+#define RPC_PROTOCOL_STREAM 2       /* Streams, busy responses and timeouts */
+#define RPC_PROTOCOL_CANCEL 3       /* Cancelling a stream */
+#define RPC_PROTOCOL_VERSION 3
+
+/* How long a new connection waits to hear from its peer before sending
+ * the first request. Only ever waited in full for an older peer */
+#define RPC_HELLO_TIMEOUT_US 100000
 
 struct msg_s {
     rpc_id id;
     void *data;
     size_t len;
+    bool partial;
+    bool busy;
+};
+
+/* Responses received for one request, oldest first */
+struct in_queue_s {
+    GQueue parts;
+    bool discard;   /* The requester has given up on the rest */
+};
+
+/* Receive in chunks so that a header and its body, or several small
+ * messages, arrive with a single syscall */
+#define RPC_SOCKET_CHUNK_SIZE (16 * 1024)
+
+/* io_uring receive - one multishot recv into a small ring of provided buffers */
+#define RPC_URING_BUFS 8
+#define RPC_URING_BUF_SIZE (4 * 1024)
+
+/* Use io_uring when built with it and the kernel supports it */
+bool rpc_socket_io_uring = true;
+
+#ifdef TEST
+/* Receive/send syscalls made by socket threads */
+uint64_t rpc_socket_syscalls = 0;
+#define COUNT_SYSCALL() __atomic_add_fetch (&rpc_socket_syscalls, 1, __ATOMIC_RELAXED)
+/* Most parts of one streamed response queued at once */
+int rpc_socket_queued_max = 0;
+#define COUNT_QUEUED(n) if ((n) > rpc_socket_queued_max) rpc_socket_queued_max = (n)
+#else
+#define COUNT_SYSCALL()
+#define COUNT_QUEUED(n)
+#endif
+
+struct reader_s {
+    int fd;
+    uint8_t *data;
+    size_t len;
+    uint8_t chunk[RPC_SOCKET_CHUNK_SIZE];
+#ifdef HAVE_IO_URING
+    bool uring;
+    bool armed;
+    bool received;
+    int bid;
+    struct io_uring ring;
+    struct io_uring_buf_ring *br;
+    uint8_t *bufs;
+#endif
 };
 
 static bool
@@ -22,6 +92,7 @@ recv_data (int fd, void *data, size_t len)
     ssize_t recvd = 0;
     while (recvd < len)
     {
+        COUNT_SYSCALL ();
         ssize_t r = recv (fd, data + recvd, len - recvd, 0);
         if (r < 0)
         {
@@ -51,6 +122,274 @@ finished:
     return false;
 }
 
+#ifdef HAVE_IO_URING
+static void
+uring_free (struct reader_s *r)
+{
+    if (r->br)
+        io_uring_free_buf_ring (&r->ring, r->br, RPC_URING_BUFS, 0);
+    r->br = NULL;
+    io_uring_queue_exit (&r->ring);
+    g_free (r->bufs);
+    r->bufs = NULL;
+    r->uring = false;
+}
+
+static bool
+uring_init (struct reader_s *r)
+{
+    int ret, i;
+
+    if (io_uring_queue_init (4, &r->ring, 0) < 0)
+        return false;
+    r->br = io_uring_setup_buf_ring (&r->ring, RPC_URING_BUFS, 0, 0, &ret);
+    if (!r->br)
+    {
+        io_uring_queue_exit (&r->ring);
+        return false;
+    }
+    r->bufs = g_malloc (RPC_URING_BUFS * RPC_URING_BUF_SIZE);
+    for (i = 0; i < RPC_URING_BUFS; i++)
+    {
+        io_uring_buf_ring_add (r->br, r->bufs + i * RPC_URING_BUF_SIZE, RPC_URING_BUF_SIZE,
+                               i, io_uring_buf_ring_mask (RPC_URING_BUFS), i);
+    }
+    io_uring_buf_ring_advance (r->br, RPC_URING_BUFS);
+    r->bid = -1;
+    r->uring = true;
+    return true;
+}
+
+/* Next chunk from the ring. Completions that are already queued are
+ * consumed without entering the kernel */
+static int
+uring_fill (struct reader_s *r)
+{
+    struct io_uring_cqe *cqe = NULL;
+    struct io_uring_sqe *sqe;
+    unsigned flags;
+    int res;
+
+    /* Hand back the buffer we have finished with */
+    if (r->bid >= 0)
+    {
+        io_uring_buf_ring_add (r->br, r->bufs + r->bid * RPC_URING_BUF_SIZE, RPC_URING_BUF_SIZE,
+                               r->bid, io_uring_buf_ring_mask (RPC_URING_BUFS), 0);
+        io_uring_buf_ring_advance (r->br, 1);
+        r->bid = -1;
+    }
+
+    while (true)
+    {
+        if (!r->armed)
+        {
+            sqe = io_uring_get_sqe (&r->ring);
+            io_uring_prep_recv_multishot (sqe, r->fd, NULL, 0, 0);
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            COUNT_SYSCALL ();
+            if (io_uring_submit (&r->ring) < 0)
+                return -1;
+            r->armed = true;
+        }
+        if (io_uring_peek_cqe (&r->ring, &cqe) != 0)
+        {
+            COUNT_SYSCALL ();
+            res = io_uring_wait_cqe (&r->ring, &cqe);
+            if (res == -EINTR)
+                continue;
+            if (res < 0)
+                return -1;
+        }
+        res = cqe->res;
+        flags = cqe->flags;
+        io_uring_cqe_seen (&r->ring, cqe);
+        if (!(flags & IORING_CQE_F_MORE))
+            r->armed = false;
+        if (res == -ENOBUFS || res == -EINTR)
+            continue;
+        if (res == -EINVAL && !r->received)
+        {
+            /* No multishot receive in this kernel */
+            DEBUG ("RPC[%i]: io_uring receive not supported\n", r->fd);
+            return 0;
+        }
+        if (res <= 0)
+        {
+            if (res < 0 && res != -ECONNRESET && res != -ECONNABORTED)
+                ERROR ("RPC[%i]: Recv data error: %s\n", r->fd, strerror (-res));
+            DEBUG ("RPC[%i]: Shutdown\n", r->fd);
+            return -1;
+        }
+        r->received = true;
+        r->bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        r->data = r->bufs + r->bid * RPC_URING_BUF_SIZE;
+        r->len = res;
+        return 1;
+    }
+}
+#endif
+
+static void
+reader_init (struct reader_s *r, int fd)
+{
+    r->fd = fd;
+    r->len = 0;
+#ifdef HAVE_IO_URING
+    r->uring = false;
+    r->armed = false;
+    r->received = false;
+    r->br = NULL;
+    r->bufs = NULL;
+    if (rpc_socket_io_uring && !uring_init (r))
+        DEBUG ("RPC[%i]: io_uring not available\n", fd);
+#endif
+}
+
+static void
+reader_free (void *p)
+{
+    struct reader_s *r = (struct reader_s *) p;
+#ifdef HAVE_IO_URING
+    if (r->uring)
+        uring_free (r);
+#endif
+    g_free (r);
+}
+
+static bool
+reader_fill (struct reader_s *r)
+{
+#ifdef HAVE_IO_URING
+    if (r->uring)
+    {
+        int res = uring_fill (r);
+        if (res != 0)
+            return res > 0;
+        /* Fall back to plain receives */
+        uring_free (r);
+    }
+#endif
+    while (true)
+    {
+        COUNT_SYSCALL ();
+        ssize_t res = recv (r->fd, r->chunk, sizeof (r->chunk), 0);
+        if (res < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (res <= 0)
+        {
+            if (res < 0 && errno != ECONNRESET && errno != ECONNABORTED)
+                ERROR ("RPC[%i]: Recv data error: %s\n", r->fd, strerror (errno));
+            DEBUG ("RPC[%i]: Shutdown\n", r->fd);
+            return false;
+        }
+        r->data = r->chunk;
+        r->len = res;
+        return true;
+    }
+}
+
+static bool
+reader_recv (struct reader_s *r, void *data, size_t len)
+{
+    while (len)
+    {
+        if (r->len == 0)
+        {
+            /* Large bodies go straight to their destination */
+            if (len >= RPC_SOCKET_CHUNK_SIZE
+#ifdef HAVE_IO_URING
+                && !r->uring
+#endif
+                )
+            {
+                return recv_data (r->fd, data, len);
+            }
+            if (!reader_fill (r))
+                return false;
+        }
+        size_t n = MIN (len, r->len);
+        memcpy (data, r->data, n);
+        r->data += n;
+        r->len -= n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void
+msg_free (gpointer data)
+{
+    struct msg_s *m = (struct msg_s *) data;
+    g_free (m->data);
+    g_free (m);
+}
+
+static void
+in_queue_clear (struct in_queue_s *q)
+{
+    struct msg_s *m;
+
+    while ((m = g_queue_pop_head (&q->parts)) != NULL)
+        msg_free (m);
+}
+
+static void
+in_queue_free (gpointer data)
+{
+    struct in_queue_s *q = (struct in_queue_s *) data;
+    in_queue_clear (q);
+    g_free (q);
+}
+
+static void
+in_lock_release (void *p)
+{
+    pthread_mutex_unlock ((pthread_mutex_t *) p);
+}
+
+/* Hand a response to its requester. A streamed response stops the socket
+ * being read (pushing back on the sender) while too many of its parts are
+ * waiting, unless someone is waiting for a response further along.
+ * Must hold in_lock */
+static void
+in_queue_push (rpc_socket sock, struct msg_s *m)
+{
+    struct in_queue_s *q;
+
+    q = g_hash_table_lookup (sock->in_queue, GUINT_TO_POINTER (m->id));
+    if (!q)
+    {
+        q = g_malloc0 (sizeof (*q));
+        g_queue_init (&q->parts);
+        g_hash_table_insert (sock->in_queue, GUINT_TO_POINTER (m->id), q);
+    }
+    if (q->discard)
+    {
+        if (!m->partial)
+            g_hash_table_remove (sock->in_queue, GUINT_TO_POINTER (m->id));
+        msg_free (m);
+        return;
+    }
+    g_queue_push_tail (&q->parts, m);
+    COUNT_QUEUED (q->parts.length);
+    if (sock->waiting)
+    {
+        pthread_cond_broadcast (&sock->in_cond);
+    }
+    if (m->partial)
+    {
+        pthread_cleanup_push (in_lock_release, &sock->in_lock);
+        while (q->parts.length >= RPC_STREAM_WINDOW && !q->discard &&
+               !sock->waiting && !sock->dead)
+        {
+            pthread_cond_wait (&sock->space_cond, &sock->in_lock);
+        }
+        pthread_cleanup_pop (0);
+    }
+}
+
 static void *
 listen_thread (void *p)
 {
@@ -61,61 +400,105 @@ listen_thread (void *p)
     sigfillset (&set);
     pthread_sigmask (SIG_BLOCK, &set, NULL);
 
+    struct reader_s *reader = g_malloc (sizeof (*reader));
+    reader_init (reader, sock->sock);
+#ifdef HAVE_IO_URING
+    if (reader->uring)
+        sock->uring_pid = getpid ();
+#endif
+    pthread_cleanup_push (reader_free, reader);
     do
     {
-        int fd = sock->sock;
         struct rpc_hdr_s hdr;
+        uint32_t timeout = 0;
+        uint32_t mode;
         size_t len;
         rpc_id id;
 
         /* Get the header */
-        if (!recv_data (fd, &hdr, sizeof (hdr)))
+        if (!reader_recv (reader, &hdr, sizeof (hdr)))
         {
-            goto finished;
+            break;
         }
         len = ntohl (hdr.len);
         id = ntohl (hdr.id);
+        mode = ntohl (hdr.mode);
+        if (mode & MODE_FLAG_TIMEOUT)
+        {
+            if (!reader_recv (reader, &timeout, sizeof (timeout)))
+            {
+                break;
+            }
+            timeout = ntohl (timeout);
+            mode &= ~MODE_FLAG_TIMEOUT;
+        }
 
         /* Get the message */
         void *data = g_malloc (len);
-        if (!recv_data (fd, data, len))
+        if (!reader_recv (reader, data, len))
         {
             g_free (data);
-            goto finished;
+            break;
         }
 
-        if (ntohl (hdr.mode) == MODE_RESPONSE)
+        if (mode == MODE_RESPONSE && id == RPC_HELLO_ID)
+        {
+            /* The peer knows the newer modes */
+            pthread_mutex_lock (&sock->in_lock);
+            sock->peer_version = len >= sizeof (uint32_t) ? ntohl (*(uint32_t *) data) : 0;
+            DEBUG ("RPC[%i]: Peer protocol version %d\n", sock->sock, sock->peer_version);
+            pthread_cond_broadcast (&sock->in_cond);
+            pthread_mutex_unlock (&sock->in_lock);
+            g_free (data);
+        }
+        else if (mode == MODE_RESPONSE || mode == MODE_RESPONSE_PARTIAL ||
+                 mode == MODE_RESPONSE_BUSY)
         {
             struct msg_s *m = g_malloc0 (sizeof (*m));
             m->id = id;
             m->data = data;
             m->len = len;
+            m->partial = (mode == MODE_RESPONSE_PARTIAL);
+            m->busy = (mode == MODE_RESPONSE_BUSY);
             pthread_mutex_lock (&sock->in_lock);
-            sock->in_queue = g_list_prepend (sock->in_queue, m);
-            if (sock->waiting)
-            {
-                pthread_cond_broadcast (&sock->in_cond);
-            }
+            in_queue_push (sock, m);
             pthread_mutex_unlock (&sock->in_lock);
         }
-        else if (ntohl (hdr.mode) == MODE_REQUEST)
+        else if (mode == MODE_CANCEL)
+        {
+            /* Only a response still being streamed can be stopped */
+            pthread_mutex_lock (&sock->lock);
+            if (g_hash_table_contains (sock->streams, GUINT_TO_POINTER (id)))
+                g_hash_table_insert (sock->streams, GUINT_TO_POINTER (id), GINT_TO_POINTER (true));
+            pthread_mutex_unlock (&sock->lock);
+            g_free (data);
+        }
+        else if (mode == MODE_REQUEST || mode == MODE_REQUEST_STREAM)
         {
+            if (mode == MODE_REQUEST_STREAM)
+            {
+                pthread_mutex_lock (&sock->lock);
+                g_hash_table_insert (sock->streams, GUINT_TO_POINTER (id), GINT_TO_POINTER (false));
+                pthread_mutex_unlock (&sock->lock);
+            }
+
             /* Call the request callback */
             if (sock->request_cb)
             {
-                sock->request_cb (sock, id, data, len);
+                sock->request_cb (sock, id, data, len,
+                                  mode == MODE_REQUEST_STREAM, timeout);
             }
             g_free (data);
         }
         else
         {
-            ERROR ("Unknown message type %x", ntohl(hdr.mode));
+            ERROR ("Unknown message type %x", mode);
             g_free (data);
-            goto finished;
+            break;
         }
     } while (!sock->dead);
+    pthread_cleanup_pop (1);
 
-finished:
     /* Socket is no longer useful */
     sock->dead = true;
 
@@ -134,10 +517,11 @@ finished:
     return 0;
 }
 
-bool
-rpc_socket_recv (rpc_socket sock, rpc_id id, void **data, size_t *len, uint64_t waitUS)
+static bool
+rpc_socket_recv_s (rpc_socket sock, rpc_id id, void **data, size_t *len, uint64_t waitUS, bool *more)
 {
     struct msg_s *m = NULL;
+    struct in_queue_s *q;
 
     struct timespec waitUntil;
     struct timeval now;
@@ -158,20 +542,18 @@ rpc_socket_recv (rpc_socket sock, rpc_id id, void **data, size_t *len, uint64_t
         if (sock->dead)
         {
             pthread_mutex_unlock (&sock->in_lock);
+            errno = ETIMEDOUT;
             return false;
         }
-        for (GList *itr = sock->in_queue; itr; itr = itr->next)
-        {
-            struct msg_s *msg = (struct msg_s *) itr->data;
-            if (msg->id == id)
-            {
-                m = msg;
-                break;
-            }
-        }
+        /* A streamed response may have several parts queued */
+        q = g_hash_table_lookup (sock->in_queue, GUINT_TO_POINTER (id));
+        if (q)
+            m = g_queue_pop_head (&q->parts);
         if (m == NULL)
         {
+            /* The listener may be holding back for a stream */
             sock->waiting++;
+            pthread_cond_signal (&sock->space_cond);
             if (waitUS)
             {
                 ret = pthread_cond_timedwait (&sock->in_cond, &sock->in_lock, &waitUntil);
@@ -185,15 +567,105 @@ rpc_socket_recv (rpc_socket sock, rpc_id id, void **data, size_t *len, uint64_t
     } while (ret == 0 && m == NULL);
     if (m)
     {
-        sock->in_queue = g_list_remove (sock->in_queue, m);
+        if (m->partial)
+            pthread_cond_signal (&sock->space_cond);
+        else
+            g_hash_table_remove (sock->in_queue, GUINT_TO_POINTER (id));
+        if (m->busy)
+        {
+            g_free (m->data);
+            g_free (m);
+            pthread_mutex_unlock (&sock->in_lock);
+            errno = EBUSY;
+            return false;
+        }
         *data = m->data;
         *len = m->len;
+        if (more)
+            *more = m->partial;
         g_free (m);
     }
+    else
+    {
+        errno = ETIMEDOUT;
+    }
     pthread_mutex_unlock (&sock->in_lock);
     return m != NULL;
 }
 
+bool
+rpc_socket_recv (rpc_socket sock, rpc_id id, void **data, size_t *len, uint64_t waitUS)
+{
+    return rpc_socket_recv_s (sock, id, data, len, waitUS, NULL);
+}
+
+bool
+rpc_socket_recv_stream (rpc_socket sock, rpc_id id, void **data, size_t *len, uint64_t waitUS, bool *more)
+{
+    return rpc_socket_recv_s (sock, id, data, len, waitUS, more);
+}
+
+/* Drop anything received, or still to come, for a request we gave up on.
+ * Returns true if more is still to come */
+static bool
+in_queue_forget (rpc_socket sock, rpc_id id)
+{
+    struct in_queue_s *q;
+    bool more = false;
+
+    pthread_mutex_lock (&sock->in_lock);
+    q = g_hash_table_lookup (sock->in_queue, GUINT_TO_POINTER (id));
+    if (!q)
+    {
+        q = g_malloc0 (sizeof (*q));
+        g_queue_init (&q->parts);
+        g_hash_table_insert (sock->in_queue, GUINT_TO_POINTER (id), q);
+    }
+    if (q->parts.tail && !((struct msg_s *) q->parts.tail->data)->partial)
+    {
+        /* Already complete */
+        g_hash_table_remove (sock->in_queue, GUINT_TO_POINTER (id));
+    }
+    else
+    {
+        in_queue_clear (q);
+        q->discard = true;
+        pthread_cond_signal (&sock->space_cond);
+        more = true;
+    }
+    pthread_mutex_unlock (&sock->in_lock);
+    return more;
+}
+
+void
+rpc_socket_forget (rpc_socket sock, rpc_id id)
+{
+    in_queue_forget (sock, id);
+}
+
+bool
+rpc_socket_cancelled (rpc_socket sock, rpc_id id)
+{
+    bool cancelled;
+
+    pthread_mutex_lock (&sock->lock);
+    cancelled = GPOINTER_TO_INT (g_hash_table_lookup (sock->streams, GUINT_TO_POINTER (id)));
+    pthread_mutex_unlock (&sock->lock);
+    return cancelled;
+}
+
+bool
+rpc_socket_stream_end (rpc_socket sock, rpc_id id)
+{
+    bool cancelled;
+
+    pthread_mutex_lock (&sock->lock);
+    cancelled = GPOINTER_TO_INT (g_hash_table_lookup (sock->streams, GUINT_TO_POINTER (id)));
+    g_hash_table_remove (sock->streams, GUINT_TO_POINTER (id));
+    pthread_mutex_unlock (&sock->lock);
+    return cancelled;
+}
+
 rpc_socket
 rpc_socket_create (int fd, rpc_callback cb, rpc_server parent, int pid)
 {
@@ -211,12 +683,35 @@ rpc_socket_create (int fd, rpc_callback cb, rpc_server parent, int pid)
     pthread_mutex_init (&sock->out_lock, NULL);
     pthread_mutex_init (&sock->lock, NULL);
     pthread_cond_init (&sock->in_cond, NULL);
+    pthread_cond_init (&sock->space_cond, NULL);
+    sock->in_queue = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, in_queue_free);
+    sock->streams = g_hash_table_new (g_direct_hash, g_direct_equal);
     return sock;
 }
 
+static bool rpc_socket_send_s (rpc_socket sock, rpc_id id, void *data, size_t len,
+                               uint32_t mode, uint32_t timeout);
+
+/* Tell the peer that it can use the newer modes */
+static bool
+send_hello (rpc_socket sock)
+{
+    uint8_t data[RPC_SOCKET_HDR_SIZE + sizeof (uint32_t)];
+    bool res;
+
+    *(uint32_t *) (data + RPC_SOCKET_HDR_SIZE) = htonl (RPC_PROTOCOL_VERSION);
+    pthread_mutex_lock (&sock->out_lock);
+    res = rpc_socket_send_s (sock, RPC_HELLO_ID, data, sizeof (uint32_t), MODE_RESPONSE, 0);
+    pthread_mutex_unlock (&sock->out_lock);
+    return res;
+}
+
 bool
 rpc_socket_process (rpc_socket sock)
 {
+    if (!send_hello (sock))
+        return false;
+    sock->thread_pid = getpid ();
     int ret = pthread_create (&sock->thread, NULL, listen_thread, sock);
     if (ret != 0)
     {
@@ -239,16 +734,44 @@ rpc_socket_priv_get (rpc_socket sock)
     return sock->priv;
 }
 
+static void
+free_in_queue (rpc_socket sock)
+{
+    if (sock->in_queue)
+        g_hash_table_destroy (sock->in_queue);
+    sock->in_queue = NULL;
+    if (sock->streams)
+        g_hash_table_destroy (sock->streams);
+    sock->streams = NULL;
+}
+
 static bool
 rpc_socket_die (rpc_socket sock)
 {
     DEBUG ("RPC[%i]: Socket Die\n", sock->sock);
+
+    /* A socket inherited over fork () has no listener thread in this
+     * process, and its locks may have been held by a thread that was
+     * not copied, so just let go of the descriptor and memory */
+    if (sock->thread_pid != getpid ())
+    {
+        close (sock->sock);
+        free_in_queue (sock);
+        g_free (sock);
+        return true;
+    }
+
     pthread_mutex_lock (&sock->lock);
     assert (sock->refcount == 0);
     sock->dead = true;
     pthread_mutex_unlock (&sock->lock);
     pthread_mutex_lock (&sock->in_lock);
+    /* A pending io_uring receive is not a cancellation point and holds
+     * its own reference to the socket, so wake it explicitly */
+    if (sock->uring_pid && sock->uring_pid == getpid ())
+        shutdown (sock->sock, SHUT_RD);
     close (sock->sock);
+    pthread_cond_broadcast (&sock->space_cond);
     usleep (1000);
     pthread_mutex_unlock (&sock->in_lock);
     if (!pthread_equal (pthread_self (), sock->thread))
@@ -261,14 +784,7 @@ rpc_socket_die (rpc_socket sock)
         pthread_detach (sock->thread);
     }
     pthread_mutex_lock (&sock->in_lock);
-    for (GList *itr = sock->in_queue; itr; itr = itr->next)
-    {
-        struct msg_s *m = (struct msg_s *)itr->data;
-        g_free (m->data);
-        g_free (m);
-    }
-    g_list_free (sock->in_queue);
-    sock->in_queue = NULL;
+    free_in_queue (sock);
     while (sock->waiting)
     {
         pthread_cond_broadcast (&sock->in_cond);
@@ -291,43 +807,55 @@ rpc_socket_ref (rpc_socket sock)
     {
         return;
     }
-    pthread_mutex_lock (&sock->lock);
-    sock->refcount++;
-    pthread_mutex_unlock (&sock->lock);
+    g_atomic_int_inc (&sock->refcount);
 }
 
 void
 rpc_socket_deref (rpc_socket sock)
 {
-    pthread_mutex_lock (&sock->lock);
-    sock->refcount--;
-    bool destroy = sock->refcount == 0;
-    pthread_mutex_unlock (&sock->lock);
-    if (destroy)
+    if (g_atomic_int_dec_and_test (&sock->refcount))
     {
         rpc_socket_die (sock);
     }
 }
 
 static bool
-rpc_socket_send_s (rpc_socket sock, rpc_id id, void *data, size_t len, uint32_t mode)
+rpc_socket_send_s (rpc_socket sock, rpc_id id, void *data, size_t len, uint32_t mode,
+                   uint32_t timeout)
 {
     ssize_t sent = 0;
-    struct rpc_hdr_s *hdr = (struct rpc_hdr_s *)data;
+    struct rpc_hdr_s *hdr;
+    size_t hdr_len;
 
     if (sock->dead)
     {
         return false;
     }
 
+    /* The header goes just before the message, with a timeout
+     * only for a peer that understands one */
+    if (timeout && sock->peer_version >= RPC_PROTOCOL_STREAM)
+    {
+        hdr = (struct rpc_hdr_s *) data;
+        *(uint32_t *) (hdr + 1) = htonl (timeout);
+        mode |= MODE_FLAG_TIMEOUT;
+        hdr_len = RPC_SOCKET_HDR_SIZE;
+    }
+    else
+    {
+        data += RPC_SOCKET_HDR_SIZE - sizeof (struct rpc_hdr_s);
+        hdr = (struct rpc_hdr_s *) data;
+        hdr_len = sizeof (struct rpc_hdr_s);
+    }
     hdr->len = htonl (len);
     hdr->mode = htonl (mode);
     hdr->id = htonl (id);
 
-    len += sizeof (struct rpc_hdr_s);
+    len += hdr_len;
 
     while (sent < len)
     {
+        COUNT_SYSCALL ();
         ssize_t s = send (sock->sock, data + sent, len - sent, MSG_NOSIGNAL);
         if (s < 0)
         {
@@ -340,16 +868,46 @@ rpc_socket_send_s (rpc_socket sock, rpc_id id, void *data, size_t len, uint32_t
     return true;
 }
 
-rpc_id
-rpc_socket_send_request (rpc_socket sock, void *data, size_t len)
+/* Give a new connection a moment to hear which version its peer is */
+static void
+wait_hello (rpc_socket sock)
+{
+    struct timespec waitUntil;
+    struct timeval now;
+
+    if (g_atomic_int_get (&sock->hello_waited))
+        return;
+    gettimeofday (&now, NULL);
+    now.tv_usec += RPC_HELLO_TIMEOUT_US;
+    waitUntil.tv_sec = now.tv_sec + now.tv_usec / 1000000;
+    waitUntil.tv_nsec = (now.tv_usec % 1000000) * 1000;
+    pthread_mutex_lock (&sock->in_lock);
+    while (!sock->peer_version && !sock->dead)
+    {
+        if (pthread_cond_timedwait (&sock->in_cond, &sock->in_lock, &waitUntil) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock (&sock->in_lock);
+    g_atomic_int_set (&sock->hello_waited, true);
+}
+
+static rpc_id
+rpc_socket_send_request_s (rpc_socket sock, void *data, size_t len, uint32_t mode,
+                           uint32_t timeout)
 {
     rpc_id id = 0;
+
+    /* Older peers can only answer with one response */
+    wait_hello (sock);
+    if (sock->peer_version < RPC_PROTOCOL_STREAM && mode == MODE_REQUEST_STREAM)
+        mode = MODE_REQUEST;
+
     pthread_mutex_lock (&sock->out_lock);
-    while (id == 0)
+    while (id == RPC_HELLO_ID)
     {
         id = sock->next_id++;
     }
-    if (!rpc_socket_send_s (sock, id, data, len, MODE_REQUEST))
+    if (!rpc_socket_send_s (sock, id, data, len, mode, timeout))
     {
         id = 0;
     }
@@ -357,15 +915,71 @@ rpc_socket_send_request (rpc_socket sock, void *data, size_t len)
     return id;
 }
 
+rpc_id
+rpc_socket_send_request (rpc_socket sock, void *data, size_t len, uint32_t timeout)
+{
+    return rpc_socket_send_request_s (sock, data, len, MODE_REQUEST, timeout);
+}
+
+rpc_id
+rpc_socket_send_stream_request (rpc_socket sock, void *data, size_t len, uint32_t timeout)
+{
+    return rpc_socket_send_request_s (sock, data, len, MODE_REQUEST_STREAM, timeout);
+}
+
 bool
 rpc_socket_send_response (rpc_socket sock, rpc_id id, void *data, size_t len)
 {
+    /* Just close a stream the requester has cancelled */
+    if (rpc_socket_stream_end (sock, id))
+        len = 0;
+    pthread_mutex_lock (&sock->out_lock);
+    bool res = rpc_socket_send_s (sock, id, data, len, MODE_RESPONSE, 0);
+    pthread_mutex_unlock (&sock->out_lock);
+    return res;
+}
+
+bool
+rpc_socket_send_partial_response (rpc_socket sock, rpc_id id, void *data, size_t len)
+{
+    if (rpc_socket_cancelled (sock, id))
+        return false;
+    pthread_mutex_lock (&sock->out_lock);
+    bool res = rpc_socket_send_s (sock, id, data, len, MODE_RESPONSE_PARTIAL, 0);
+    pthread_mutex_unlock (&sock->out_lock);
+    return res;
+}
+
+bool
+rpc_socket_send_busy_response (rpc_socket sock, rpc_id id)
+{
+    uint8_t data[RPC_SOCKET_HDR_SIZE];
+    bool res;
+
+    rpc_socket_stream_end (sock, id);
+
+    /* Older peers would drop the connection */
+    if (sock->peer_version < RPC_PROTOCOL_STREAM)
+        return false;
     pthread_mutex_lock (&sock->out_lock);
-    bool res = rpc_socket_send_s (sock, id, data, len, MODE_RESPONSE);
+    res = rpc_socket_send_s (sock, id, data, 0, MODE_RESPONSE_BUSY, 0);
     pthread_mutex_unlock (&sock->out_lock);
     return res;
 }
 
+void
+rpc_socket_cancel (rpc_socket sock, rpc_id id)
+{
+    uint8_t data[RPC_SOCKET_HDR_SIZE];
+
+    /* Older peers would drop the connection so just discard the rest */
+    if (!in_queue_forget (sock, id) || sock->peer_version < RPC_PROTOCOL_CANCEL)
+        return;
+    pthread_mutex_lock (&sock->out_lock);
+    rpc_socket_send_s (sock, id, data, 0, MODE_CANCEL, 0);
+    pthread_mutex_unlock (&sock->out_lock);
+}
+
 rpc_server
 rpc_socket_parent_get (rpc_socket sock)
 {
@@ -15,7 +15,8 @@ typedef uint32_t rpc_id;
 typedef struct rpc_socket_s *rpc_socket;
 typedef struct rpc_server_s *rpc_server;
 typedef struct rpc_service_s *rpc_service;
-typedef void (*rpc_callback) (rpc_socket, rpc_id, void *data, size_t len);
+typedef void (*rpc_callback) (rpc_socket, rpc_id, void *data, size_t len, bool stream,
+                              uint32_t timeout);
 typedef struct socket_info_s *socket_info;
 
 struct rpc_socket_s {
@@ -28,14 +29,21 @@ struct rpc_socket_s {
     rpc_id next_id;
 
     pthread_t thread;
+    int thread_pid; /* Process the listener thread was started in */
     rpc_callback request_cb;
 
     pthread_mutex_t in_lock;
     pthread_cond_t in_cond;
-    GList *in_queue;
+    pthread_cond_t space_cond;
+    GHashTable *in_queue;   /* rpc_id to the responses received for it */
     int waiting;
     bool dead;
     int pid;
+    int uring_pid;  /* Process whose thread reads with io_uring */
+    int peer_version;   /* Protocol version the peer announced (0 = none) */
+    int hello_waited;
+    GHashTable *streams;    /* rpc_id of each response being streamed to the peer
+                             * to whether the peer has cancelled it (under lock) */
 };
 
 struct rpc_server_s {
@@ -68,13 +76,19 @@ struct socket_info_s {
     } address;
 };
 
+/* The listener stops reading once this many parts of one streamed
+ * response are waiting to be consumed */
+#define RPC_STREAM_WINDOW 4
+
 struct __attribute__ ((__packed__)) rpc_hdr_s {
     uint32_t id;
     uint32_t len;
     uint32_t mode;
 };
 
-#define RPC_SOCKET_HDR_SIZE sizeof (struct rpc_hdr_s)
+/* Room before each message for the header and an optional timeout
+ * (the remaining request budget in us) */
+#define RPC_SOCKET_HDR_SIZE (sizeof (struct rpc_hdr_s) + sizeof (uint32_t))
 
 rpc_service rpc_service_init (rpc_callback request_callback, void *priv);
 void *rpc_service_priv_get (rpc_service s);
@@ -98,8 +112,20 @@ void rpc_socket_deref (rpc_socket sock);
 void *rpc_socket_priv_get (rpc_socket s);
 rpc_server rpc_socket_parent_get (rpc_socket s);
 
-rpc_id rpc_socket_send_request (rpc_socket sock, void *data, size_t len);
+rpc_id rpc_socket_send_request (rpc_socket sock, void *data, size_t len, uint32_t timeout);
+rpc_id rpc_socket_send_stream_request (rpc_socket sock, void *data, size_t len, uint32_t timeout);
 bool rpc_socket_send_response (rpc_socket sock, rpc_id id, void *data, size_t len);
+bool rpc_socket_send_partial_response (rpc_socket sock, rpc_id id, void *data, size_t len);
+bool rpc_socket_send_busy_response (rpc_socket sock, rpc_id id);
+/* These fail with errno EBUSY if the peer refused the request, otherwise ETIMEDOUT */
 bool rpc_socket_recv (rpc_socket sock, rpc_id id, void **data, size_t *len, uint64_t waitUS);
+bool rpc_socket_recv_stream (rpc_socket sock, rpc_id id, void **data, size_t *len, uint64_t waitUS, bool *more);
+void rpc_socket_forget (rpc_socket sock, rpc_id id);
+/* Forget a streamed response and ask the peer to stop sending it */
+void rpc_socket_cancel (rpc_socket sock, rpc_id id);
+/* True once the requester has cancelled the response being streamed for id */
+bool rpc_socket_cancelled (rpc_socket sock, rpc_id id);
+/* Stop streaming id, returning true if it was cancelled */
+bool rpc_socket_stream_end (rpc_socket sock, rpc_id id);
 
 #endif /* _RPC_TRANSPORT_H_ */
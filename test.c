@@ -723,6 +723,79 @@ exit:
     CU_ASSERT (assert_apteryx_empty ());
 }
 
+static char *
+test_search_range_provide (const char *path)
+{
+    return strdup ("-");
+}
+
+static char *
+test_search_range_key (GList *iter)
+{
+    return strrchr ((char *) iter->data, '/') + 1;
+}
+
+void
+test_search_range ()
+{
+    GList *paths = NULL, *iter;
+    char *after = NULL;
+    char key[16];
+    int count = 0, i;
+
+    for (i = 1; i <= 25; i++)
+    {
+        sprintf (key, "%d", i);
+        CU_ASSERT (apteryx_set_int (TEST_PATH"/rows", key, i));
+    }
+    CU_ASSERT (apteryx_set_string (TEST_PATH"/rows", "a", "-"));
+
+    /* First page in natural order */
+    CU_ASSERT ((paths = apteryx_search_range (TEST_PATH"/rows/", NULL, 10)) != NULL);
+    CU_ASSERT (g_list_length (paths) == 10);
+    CU_ASSERT (paths && strcmp (paths->data, TEST_PATH"/rows/1") == 0);
+    CU_ASSERT (paths && strcmp (test_search_range_key (g_list_last (paths)), "10") == 0);
+    g_list_free_full (paths, free);
+
+    /* Page through everything */
+    do
+    {
+        paths = apteryx_search_range (TEST_PATH"/rows/", after, 10);
+        for (iter = paths; iter; iter = iter->next)
+        {
+            count++;
+            if (count <= 25)
+                CU_ASSERT (atoi (test_search_range_key (iter)) == count);
+        }
+        free (after);
+        after = paths ? strdup (test_search_range_key (g_list_last (paths))) : NULL;
+        g_list_free_full (paths, free);
+    } while (after);
+    CU_ASSERT (count == 26);
+
+    /* Changes are kept in order */
+    CU_ASSERT (apteryx_set_string (TEST_PATH"/rows/3", NULL, NULL));
+    CU_ASSERT (apteryx_set_string (TEST_PATH"/rows", "2b", "-"));
+    CU_ASSERT ((paths = apteryx_search_range (TEST_PATH"/rows/", "2", 2)) != NULL);
+    CU_ASSERT (g_list_length (paths) == 2);
+    CU_ASSERT (paths && strcmp (paths->data, TEST_PATH"/rows/2b") == 0);
+    CU_ASSERT (paths && paths->next && strcmp (paths->next->data, TEST_PATH"/rows/4") == 0);
+    g_list_free_full (paths, free);
+    CU_ASSERT (apteryx_search_range (TEST_PATH"/rows/", "a", 10) == NULL);
+
+    /* Provided paths are included */
+    CU_ASSERT (apteryx_provide (TEST_PATH"/rows/30", test_search_range_provide));
+    CU_ASSERT ((paths = apteryx_search_range (TEST_PATH"/rows/", "25", 0)) != NULL);
+    CU_ASSERT (g_list_length (paths) == 2);
+    CU_ASSERT (paths && strcmp (paths->data, TEST_PATH"/rows/30") == 0);
+    g_list_free_full (paths, free);
+    CU_ASSERT (apteryx_unprovide (TEST_PATH"/rows/30", test_search_range_provide));
+
+    CU_ASSERT (apteryx_prune (TEST_PATH"/rows"));
+    CU_ASSERT (apteryx_search_range (TEST_PATH"/rows/", NULL, 10) == NULL);
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 static GList*
 test_index_cb (const char *path)
 {
@@ -1461,6 +1534,219 @@ test_watch_prune_multiple ()
     _watch_cleanup ();
 }
 
+void
+test_watch_prune_partial ()
+{
+    _path = _value = NULL;
+    _cb_count = 0;
+    const char *path = TEST_PATH"/entity/zones/public/state";
+    char *other;
+    int i;
+
+    /* Only the watched part of the pruned tree is reported */
+    for (i = 0; i < 100; i++)
+    {
+        other = g_strdup_printf (TEST_PATH"/entity/zones/private%d/state", i);
+        CU_ASSERT (apteryx_set (other, "up"));
+        g_free (other);
+    }
+    CU_ASSERT (apteryx_set (path, "up"));
+    CU_ASSERT (apteryx_watch (TEST_PATH"/entity/zones/public/*", test_watch_callback));
+    CU_ASSERT (apteryx_prune (TEST_PATH"/entity"));
+    usleep (TEST_SLEEP_TIMEOUT);
+    CU_ASSERT (_cb_count == 1);
+    CU_ASSERT (_path && strcmp (_path, path) == 0);
+    CU_ASSERT (apteryx_search (TEST_PATH"/entity/") == NULL);
+    CU_ASSERT (apteryx_unwatch (TEST_PATH"/entity/zones/public/*", test_watch_callback));
+    _watch_cleanup ();
+}
+
+static int _prune_count = 0;
+static bool
+test_watch_prune_event_callback (const char *path, const char *value)
+{
+    CU_ASSERT (strcmp (path, TEST_PATH"/entity/*") == 0);
+    CU_ASSERT (value == NULL);
+    _prune_count++;
+    return true;
+}
+
+void
+test_watch_prune_event ()
+{
+    _path = _value = NULL;
+    _cb_count = 0;
+    _prune_count = 0;
+    char *path;
+    int i;
+
+    for (i = 0; i < 50; i++)
+    {
+        path = g_strdup_printf (TEST_PATH"/entity/zones/private%d/state", i);
+        CU_ASSERT (apteryx_set (path, "up"));
+        g_free (path);
+    }
+    CU_ASSERT (apteryx_watch_prune (TEST_PATH"/entity/zones/*", test_watch_prune_event_callback));
+    CU_ASSERT (apteryx_watch (TEST_PATH"/entity/zones/*", test_watch_callback));
+    CU_ASSERT (apteryx_prune (TEST_PATH"/entity"));
+    usleep (TEST_SLEEP_TIMEOUT);
+    CU_ASSERT (_prune_count == 1);
+    CU_ASSERT (_cb_count == 50);
+    CU_ASSERT (apteryx_unwatch_prune (TEST_PATH"/entity/zones/*", test_watch_prune_event_callback));
+    CU_ASSERT (apteryx_unwatch (TEST_PATH"/entity/zones/*", test_watch_callback));
+
+    /* Sets are still reported as normal */
+    CU_ASSERT (apteryx_watch_prune (TEST_PATH"/entity/zones/*", test_watch_callback));
+    CU_ASSERT (apteryx_set (TEST_PATH"/entity/zones/public/state", "up"));
+    usleep (TEST_SLEEP_TIMEOUT);
+    CU_ASSERT (_cb_count == 51);
+    CU_ASSERT (_value && strcmp (_value, "up") == 0);
+    CU_ASSERT (apteryx_unwatch_prune (TEST_PATH"/entity/zones/*", test_watch_callback));
+    CU_ASSERT (apteryx_set (TEST_PATH"/entity/zones/public/state", NULL));
+    _watch_cleanup ();
+}
+
+void
+test_watch_prune_sibling ()
+{
+    _path = _value = NULL;
+    _cb_count = 0;
+    _prune_count = 0;
+
+    /* Only prune watchers at or below the pruned path hear about it */
+    CU_ASSERT (apteryx_set (TEST_PATH"/entity/zones/private/state", "up"));
+    CU_ASSERT (apteryx_set (TEST_PATH"/interfaces/eth0/state", "up"));
+    CU_ASSERT (apteryx_watch_prune (TEST_PATH"/entity/zones/*", test_watch_prune_event_callback));
+    CU_ASSERT (apteryx_watch_prune (TEST_PATH"/interfaces/*", test_watch_callback));
+    CU_ASSERT (apteryx_prune (TEST_PATH"/entity"));
+    usleep (TEST_SLEEP_TIMEOUT);
+    CU_ASSERT (_prune_count == 1);
+    CU_ASSERT (_cb_count == 0);
+
+    /* Nothing is left to prune */
+    CU_ASSERT (apteryx_prune (TEST_PATH"/entity"));
+    usleep (TEST_SLEEP_TIMEOUT);
+    CU_ASSERT (_prune_count == 1);
+
+    CU_ASSERT (apteryx_unwatch_prune (TEST_PATH"/entity/zones/*", test_watch_prune_event_callback));
+    CU_ASSERT (apteryx_unwatch_prune (TEST_PATH"/interfaces/*", test_watch_callback));
+    CU_ASSERT (apteryx_set (TEST_PATH"/interfaces/eth0/state", NULL));
+    _watch_cleanup ();
+}
+
+void
+test_watch_prune_unwatch ()
+{
+    char *path;
+    int i;
+
+    for (i = 0; i < 10; i++)
+    {
+        path = g_strdup_printf (TEST_PATH"/entity/zones/private%d/state", i);
+        CU_ASSERT (apteryx_set (path, "up"));
+        g_free (path);
+    }
+
+    /* Unwatch only removes the plain watcher */
+    _cb_count = 0;
+    CU_ASSERT (apteryx_watch_prune (TEST_PATH"/entity/zones/*", test_watch_callback));
+    CU_ASSERT (apteryx_watch (TEST_PATH"/entity/zones/*", test_watch_callback));
+    CU_ASSERT (apteryx_unwatch (TEST_PATH"/entity/zones/*", test_watch_callback));
+    CU_ASSERT (apteryx_prune (TEST_PATH"/entity"));
+    usleep (TEST_SLEEP_TIMEOUT);
+    CU_ASSERT (_cb_count == 1);
+    CU_ASSERT (!apteryx_unwatch (TEST_PATH"/entity/zones/*", test_watch_callback));
+    CU_ASSERT (apteryx_unwatch_prune (TEST_PATH"/entity/zones/*", test_watch_callback));
+
+    for (i = 0; i < 10; i++)
+    {
+        path = g_strdup_printf (TEST_PATH"/entity/zones/private%d/state", i);
+        CU_ASSERT (apteryx_set (path, "up"));
+        g_free (path);
+    }
+
+    /* Unwatch prune only removes the prune watcher */
+    _cb_count = 0;
+    CU_ASSERT (apteryx_watch (TEST_PATH"/entity/zones/*", test_watch_callback));
+    CU_ASSERT (apteryx_watch_prune (TEST_PATH"/entity/zones/*", test_watch_callback));
+    CU_ASSERT (apteryx_unwatch_prune (TEST_PATH"/entity/zones/*", test_watch_callback));
+    CU_ASSERT (apteryx_prune (TEST_PATH"/entity"));
+    usleep (TEST_SLEEP_TIMEOUT);
+    CU_ASSERT (_cb_count == 10);
+    CU_ASSERT (!apteryx_unwatch_prune (TEST_PATH"/entity/zones/*", test_watch_callback));
+    CU_ASSERT (apteryx_unwatch (TEST_PATH"/entity/zones/*", test_watch_callback));
+    _watch_cleanup ();
+}
+
+static int
+_get_counter (const char *name)
+{
+    char *path = g_strdup_printf (APTERYX_COUNTERS"/%s", name);
+    char *value = apteryx_get (path);
+    int count = value ? atoi (value) : -1;
+    free (value);
+    g_free (path);
+    return count;
+}
+
+void
+test_watch_set_unchanged ()
+{
+    _path = _value = NULL;
+    _cb_count = 0;
+    const char *path = TEST_PATH"/entity/zones/private/state";
+    GNode *root;
+    uint64_t ts;
+    int unchanged;
+
+    CU_ASSERT (apteryx_set (APTERYX_SUPPRESS_PATH"/test", TEST_PATH"/entity/"));
+    CU_ASSERT (apteryx_watch (TEST_PATH"/entity/*", test_watch_callback));
+    unchanged = _get_counter ("set_unchanged");
+
+    CU_ASSERT (apteryx_set_wait (path, "up"));
+    CU_ASSERT (_cb_count == 1);
+    ts = apteryx_timestamp (path);
+
+    /* Setting the same value again is ignored */
+    CU_ASSERT (apteryx_set_wait (path, "up"));
+    CU_ASSERT (_cb_count == 1);
+    CU_ASSERT (apteryx_timestamp (path) == ts);
+    CU_ASSERT (_get_counter ("set_unchanged") == unchanged + 1);
+
+    /* Only the changed part of a tree is reported */
+    root = APTERYX_NODE (NULL, strdup (TEST_PATH"/entity/zones/private"));
+    APTERYX_LEAF (root, strdup ("state"), strdup ("up"));
+    APTERYX_LEAF (root, strdup ("speed"), strdup ("1000"));
+    CU_ASSERT (apteryx_set_tree_full (root, UINT64_MAX, true));
+    apteryx_free_tree (root);
+    CU_ASSERT (_cb_count == 2);
+    CU_ASSERT (_path && strcmp (_path, TEST_PATH"/entity/zones/private/speed") == 0);
+    CU_ASSERT (_get_counter ("set_unchanged") == unchanged + 2);
+
+    /* Nor is deleting something that is not there */
+    CU_ASSERT (apteryx_set_wait (TEST_PATH"/entity/zones/private/none", NULL));
+    CU_ASSERT (_cb_count == 2);
+    CU_ASSERT (apteryx_set_wait (path, "down"));
+    CU_ASSERT (_cb_count == 3);
+
+    /* A prefix only covers whole path elements */
+    CU_ASSERT (apteryx_set (APTERYX_SUPPRESS_PATH"/test2", TEST_PATH"/entity/zones/priv"));
+    CU_ASSERT (apteryx_set_wait (TEST_PATH"/entity/zones/private2/state", "up"));
+    CU_ASSERT (_cb_count == 4);
+    CU_ASSERT (apteryx_set (APTERYX_SUPPRESS_PATH"/test", NULL));
+    CU_ASSERT (apteryx_set_wait (TEST_PATH"/entity/zones/private2/state", "up"));
+    CU_ASSERT (_cb_count == 5);
+    CU_ASSERT (apteryx_set (APTERYX_SUPPRESS_PATH"/test2", NULL));
+
+    /* Everywhere else sets are always reported */
+    CU_ASSERT (apteryx_set_wait (path, "down"));
+    CU_ASSERT (_cb_count == 6);
+
+    CU_ASSERT (apteryx_unwatch (TEST_PATH"/entity/*", test_watch_callback));
+    CU_ASSERT (apteryx_prune (TEST_PATH"/entity"));
+    _watch_cleanup ();
+}
+
 void
 test_watch_one_level_path_prune ()
 {
@@ -1780,6 +2066,38 @@ test_watch_removes_all_watches ()
     _watch_cleanup ();
 }
 
+void
+test_watch_many ()
+{
+    const int count = 1000;
+    char *path;
+    int i;
+
+    _cb_count = 0;
+    _path = _value = NULL;
+    for (i = 0; i < count; i++)
+    {
+        path = g_strdup_printf (TEST_PATH"/interfaces/eth%d/state", i);
+        CU_ASSERT (apteryx_watch (path, test_watch_callback));
+        g_free (path);
+    }
+    path = g_strdup_printf (TEST_PATH"/interfaces/eth%d/state", count / 2);
+    CU_ASSERT (apteryx_set (path, "up"));
+    usleep (TEST_SLEEP_TIMEOUT);
+    CU_ASSERT (_cb_count == 1);
+    CU_ASSERT (_path && strcmp (_path, path) == 0);
+    CU_ASSERT (_value && strcmp (_value, "up") == 0);
+    CU_ASSERT (apteryx_set (path, NULL));
+    g_free (path);
+    for (i = 0; i < count; i++)
+    {
+        path = g_strdup_printf (TEST_PATH"/interfaces/eth%d/state", i);
+        CU_ASSERT (apteryx_unwatch (path, test_watch_callback));
+        g_free (path);
+    }
+    _watch_cleanup ();
+}
+
 static pthread_mutex_t watch_count_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static bool
@@ -2894,6 +3212,48 @@ test_provide_timeout ()
     CU_ASSERT (assert_apteryx_empty ());
 }
 
+static int _provide_expired_count = 0;
+static char*
+test_provide_expired_cb (const char *path)
+{
+    g_atomic_int_inc (&_provide_expired_count);
+    usleep (1.1 * RPC_TIMEOUT_US);
+    return NULL;
+}
+
+static char*
+test_provide_expired_cb2 (const char *path)
+{
+    return test_provide_expired_cb (path);
+}
+
+void
+test_provide_expired ()
+{
+    const char *path = TEST_PATH"/interfaces/eth0/state";
+    const char *value = NULL;
+    int expired = 0;
+
+    _provide_expired_count = 0;
+    if ((value = apteryx_get ("/apteryx/counters/expired_callbacks")) != NULL)
+    {
+        expired = atoi (value);
+        free ((void *) value);
+    }
+    CU_ASSERT (apteryx_provide (path, test_provide_expired_cb));
+    CU_ASSERT (apteryx_provide (path, test_provide_expired_cb2));
+    CU_ASSERT ((value = apteryx_get (path)) == NULL);
+    /* The second provider is not called once the get has expired */
+    usleep (1.2 * RPC_TIMEOUT_US);
+    CU_ASSERT (_provide_expired_count == 1);
+    CU_ASSERT ((value = apteryx_get ("/apteryx/counters/expired_callbacks")) != NULL);
+    CU_ASSERT (value && atoi (value) > expired);
+    free ((void *) value);
+    apteryx_unprovide (path, test_provide_expired_cb);
+    apteryx_unprovide (path, test_provide_expired_cb2);
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 bool test_provide_thread_running = false;
 static int
 test_provide_thread_client (void *data)
@@ -3463,6 +3823,131 @@ test_get_tree ()
     CU_ASSERT (assert_apteryx_empty ());
 }
 
+void
+test_get_trees ()
+{
+    GList *paths = NULL;
+    GNode *root = NULL;
+    GNode *node = NULL;
+
+    CU_ASSERT (apteryx_set (TEST_PATH"/interfaces/eth0/speed", "1000"));
+    CU_ASSERT (apteryx_set (TEST_PATH"/interfaces/eth1/speed", "100"));
+    CU_ASSERT (apteryx_set (TEST_PATH"/vlans/10/name", "ten"));
+    CU_ASSERT (apteryx_set (TEST_PATH"/vlans/20/name", "twenty"));
+    _cb_count = 0;
+    _cb_timeout = 5000;
+    CU_ASSERT (apteryx_refresh (TEST_PATH"/interfaces/*", test_refresh_tree_callback));
+
+    /* eth0 is inside interfaces so is only refreshed and returned once */
+    paths = g_list_append (paths, TEST_PATH"/interfaces/eth0");
+    paths = g_list_append (paths, TEST_PATH"/vlans/10");
+    paths = g_list_append (paths, TEST_PATH"/interfaces");
+    paths = g_list_append (paths, TEST_PATH"/missing");
+    root = apteryx_get_trees (paths);
+    CU_ASSERT (root != NULL);
+    CU_ASSERT (_cb_count == 1);
+    CU_ASSERT (root && strcmp (APTERYX_NAME (root), "/") == 0);
+    node = root ? apteryx_path_node (root, TEST_PATH"/interfaces") : NULL;
+    CU_ASSERT (node && g_node_n_children (node) == 2);
+    node = root ? apteryx_path_node (root, TEST_PATH"/interfaces/eth0") : NULL;
+    CU_ASSERT (node && g_node_n_children (node) == 2);
+    node = root ? apteryx_path_node (root, TEST_PATH"/interfaces/eth0/state") : NULL;
+    CU_ASSERT (node && g_node_n_children (node) == 3);
+    node = root ? apteryx_path_node (root, TEST_PATH"/vlans") : NULL;
+    CU_ASSERT (node && g_node_n_children (node) == 1);
+    CU_ASSERT (root && g_node_n_nodes (root, G_TRAVERSE_LEAVES) == 6);
+    apteryx_free_tree (root);
+    g_list_free (paths);
+
+    /* The root covers everything */
+    _cb_count = 0;
+    usleep (_cb_timeout);
+    paths = g_list_append (NULL, TEST_PATH"/vlans/10");
+    paths = g_list_append (paths, "/");
+    paths = g_list_append (paths, TEST_PATH"/interfaces");
+    root = apteryx_get_trees (paths);
+    CU_ASSERT (root != NULL);
+    CU_ASSERT (_cb_count == 1);
+    node = root ? apteryx_path_node (root, TEST_PATH"/interfaces/eth0/state") : NULL;
+    CU_ASSERT (node && g_node_n_children (node) == 3);
+    node = root ? apteryx_path_node (root, TEST_PATH"/vlans") : NULL;
+    CU_ASSERT (node && g_node_n_children (node) == 2);
+    apteryx_free_tree (root);
+    g_list_free (paths);
+    /* Refreshing everything filled in the statistics and clients */
+    CU_ASSERT (apteryx_prune (APTERYX_STATISTICS));
+    CU_ASSERT (apteryx_prune (APTERYX_CLIENTS));
+
+    /* Nothing there */
+    paths = g_list_append (NULL, TEST_PATH"/missing");
+    CU_ASSERT (apteryx_get_trees (paths) == NULL);
+    g_list_free (paths);
+
+    apteryx_unrefresh (TEST_PATH"/interfaces/*", test_refresh_tree_callback);
+    _cb_count = 0;
+    CU_ASSERT (apteryx_prune (TEST_PATH"/interfaces"));
+    CU_ASSERT (apteryx_prune (TEST_PATH"/vlans"));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
+void
+test_get_tree_if_modified ()
+{
+    const char *path = TEST_PATH"/interfaces/eth0";
+    GNode *root = NULL;
+    char *value = NULL;
+    uint64_t ts = 0, vts = 0;
+
+    CU_ASSERT (apteryx_set_string (path, "state", "up"));
+    CU_ASSERT (apteryx_set_string (path, "speed", "1000"));
+
+    /* First fetch */
+    CU_ASSERT (apteryx_get_tree_if_modified (path, &ts, &root));
+    CU_ASSERT (root && g_node_n_children (root) == 2);
+    CU_ASSERT (ts && ts == apteryx_timestamp (path));
+    apteryx_free_tree (root);
+    root = NULL;
+    CU_ASSERT (apteryx_get_if_modified (TEST_PATH"/interfaces/eth0/state", &vts, &value));
+    CU_ASSERT (value && strcmp (value, "up") == 0);
+    free (value);
+    value = NULL;
+
+    /* Nothing changed */
+    CU_ASSERT (!apteryx_get_tree_if_modified (path, &ts, &root));
+    CU_ASSERT (root == NULL);
+    CU_ASSERT (!apteryx_get_if_modified (TEST_PATH"/interfaces/eth0/state", &vts, &value));
+    CU_ASSERT (value == NULL);
+
+    /* Changed */
+    CU_ASSERT (apteryx_set_string (path, "state", "down"));
+    CU_ASSERT (apteryx_get_tree_if_modified (path, &ts, &root));
+    CU_ASSERT (root && g_node_n_children (root) == 2);
+    apteryx_free_tree (root);
+    root = NULL;
+    CU_ASSERT (apteryx_get_if_modified (TEST_PATH"/interfaces/eth0/state", &vts, &value));
+    CU_ASSERT (value && strcmp (value, "down") == 0);
+    free (value);
+    value = NULL;
+
+    /* Provided values are always fetched */
+    CU_ASSERT (apteryx_provide (TEST_PATH"/interfaces/eth0/duplex", test_provide_callback_up));
+    CU_ASSERT (apteryx_get_tree_if_modified (path, &ts, &root));
+    CU_ASSERT (root && g_node_n_children (root) == 3);
+    apteryx_free_tree (root);
+    vts = ts;
+    CU_ASSERT (apteryx_get_if_modified (TEST_PATH"/interfaces/eth0/duplex", &vts, &value));
+    CU_ASSERT (value && strcmp (value, "up") == 0);
+    free (value);
+    CU_ASSERT (apteryx_unprovide (TEST_PATH"/interfaces/eth0/duplex", test_provide_callback_up));
+
+    /* Removed */
+    CU_ASSERT (apteryx_prune (path));
+    root = (GNode *) path;
+    CU_ASSERT (apteryx_get_tree_if_modified (path, &ts, &root));
+    CU_ASSERT (root == NULL);
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 void
 test_get_tree_single_node ()
 {
@@ -3576,10 +4061,121 @@ database_thrasher (void *unused)
     return NULL;
 }
 
-void
-test_get_tree_while_thrashing ()
+static int _sync_validate_count = 0;
+static int
+test_sync_validate_callback (const char *path, const char *value)
 {
-    pthread_t thrasher_thread;
+    _sync_validate_count++;
+    return (value && strcmp (value, "bad") == 0) ? -EPERM : 0;
+}
+
+void
+test_sync_tree ()
+{
+    const char *path = TEST_PATH"/interfaces/eth0";
+    const char *watch = TEST_PATH"/interfaces/eth0/*";
+    GNode *root;
+    const char *value;
+
+    _path = _value = NULL;
+    _cb_count = 0;
+    _sync_validate_count = 0;
+    CU_ASSERT (apteryx_set_string (path, "state", "up"));
+    CU_ASSERT (apteryx_set_string (path, "speed", "1000"));
+    CU_ASSERT (apteryx_set_string (path, "duplex", "full"));
+    CU_ASSERT (apteryx_watch (watch, test_watch_callback));
+    CU_ASSERT (apteryx_validate (watch, test_sync_validate_callback));
+
+    /* One change, one delete and one add */
+    root = APTERYX_NODE (NULL, strdup (path));
+    APTERYX_LEAF (root, strdup ("state"), strdup ("up"));
+    APTERYX_LEAF (root, strdup ("speed"), strdup ("100"));
+    APTERYX_LEAF (root, strdup ("mtu"), strdup ("1500"));
+    CU_ASSERT (apteryx_sync_tree (root) == 3);
+    usleep (TEST_SLEEP_TIMEOUT);
+    CU_ASSERT (_cb_count == 3);
+    CU_ASSERT (_sync_validate_count == 3);
+    CU_ASSERT ((value = apteryx_get_string (path, "speed")) && strcmp (value, "100") == 0);
+    free ((void *) value);
+    CU_ASSERT ((value = apteryx_get_string (path, "mtu")) && strcmp (value, "1500") == 0);
+    free ((void *) value);
+    CU_ASSERT ((value = apteryx_get_string (path, "duplex")) == NULL);
+
+    /* Nothing to do the second time */
+    CU_ASSERT (apteryx_sync_tree (root) == 0);
+    usleep (TEST_SLEEP_TIMEOUT);
+    CU_ASSERT (_cb_count == 3);
+    apteryx_free_tree (root);
+
+    /* Refused changes are not made */
+    root = APTERYX_NODE (NULL, strdup (path));
+    APTERYX_LEAF (root, strdup ("state"), strdup ("bad"));
+    CU_ASSERT (apteryx_sync_tree (root) == -EPERM);
+    CU_ASSERT ((value = apteryx_get_string (path, "speed")) && strcmp (value, "100") == 0);
+    free ((void *) value);
+    apteryx_free_tree (root);
+    CU_ASSERT (apteryx_unvalidate (watch, test_sync_validate_callback));
+
+    /* An empty tree removes everything */
+    root = APTERYX_NODE (NULL, strdup (path));
+    CU_ASSERT (apteryx_sync_tree (root) == 3);
+    apteryx_free_tree (root);
+    usleep (TEST_SLEEP_TIMEOUT);
+    CU_ASSERT (_cb_count == 6);
+    CU_ASSERT (apteryx_unwatch (watch, test_watch_callback));
+    _cb_count = 0;
+    _watch_cleanup ();
+}
+
+void
+test_get_tree_large ()
+{
+    const char *path = TEST_PATH"/large";
+    GNode *root, *group, *node;
+    int counts[] = { 1000, 6000, 1000, 1000, 1000, 1000 };
+    int ngroups = sizeof (counts) / sizeof (counts[0]);
+    int total = 0;
+    int g, i;
+
+    /* Big enough to be walked in parts when the daemon has helpers */
+    root = APTERYX_NODE (NULL, strdup (path));
+    for (g = 0; g < ngroups; g++)
+    {
+        group = APTERYX_NODE (root, g_strdup_printf ("%d", g));
+        for (i = 0; i < counts[g]; i++)
+            APTERYX_LEAF (group, g_strdup_printf ("%d", i), g_strdup_printf ("%d-%d", g, i));
+        total += counts[g];
+    }
+    CU_ASSERT (apteryx_set_tree (root));
+    apteryx_free_tree (root);
+
+    CU_ASSERT ((root = apteryx_get_tree (path)) != NULL);
+    if (!root)
+        goto exit;
+    CU_ASSERT (g_node_n_children (root) == ngroups);
+    CU_ASSERT (g_node_n_nodes (root, G_TRAVERSE_LEAVES) == total);
+    for (group = g_node_first_child (root); group; group = g_node_next_sibling (group))
+    {
+        g = atoi (APTERYX_NAME (group));
+        CU_ASSERT (g_node_n_children (group) == counts[g]);
+        for (node = g_node_first_child (group); node; node = g_node_next_sibling (node))
+        {
+            char *expected = g_strdup_printf ("%d-%s", g, APTERYX_NAME (node));
+            CU_ASSERT (APTERYX_HAS_VALUE (node));
+            CU_ASSERT (APTERYX_HAS_VALUE (node) && strcmp (APTERYX_VALUE (node), expected) == 0);
+            g_free (expected);
+        }
+    }
+    apteryx_free_tree (root);
+exit:
+    CU_ASSERT (apteryx_prune (path));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
+void
+test_get_tree_while_thrashing ()
+{
+    pthread_t thrasher_thread;
 
     pthread_create (&thrasher_thread, NULL, database_thrasher, NULL);
 
@@ -3620,6 +4216,141 @@ test_get_tree_while_thrashing ()
     apteryx_prune (TEST_PATH"/database/filled/with/nothing");
 }
 
+void
+test_traverse_iter ()
+{
+    const char *path = TEST_PATH"/interfaces";
+    const char *ipath, *ivalue;
+    apteryx_iter *iter;
+    char name[64];
+    char value[64];
+    int count = 10000;
+    int cancelled;
+    int status;
+    int pid;
+    int i;
+
+    /* Enough data to need several streamed parts */
+    for (i = 0; i < count; i++)
+    {
+        sprintf (name, "%s/eth%d/name", path, i);
+        sprintf (value, "interface-number-%d", i);
+        CU_ASSERT (apteryx_set (name, value));
+    }
+
+    /* Read everything */
+    CU_ASSERT ((iter = apteryx_traverse_iter (path)) != NULL);
+    i = 0;
+    while (iter && apteryx_iter_next (iter, &ipath, &ivalue))
+    {
+        int n = -1;
+        CU_ASSERT (sscanf (ipath, TEST_PATH"/interfaces/eth%d/name", &n) == 1);
+        sprintf (value, "interface-number-%d", n);
+        CU_ASSERT (strcmp (ivalue, value) == 0);
+        i++;
+    }
+    CU_ASSERT (i == count);
+    apteryx_iter_free (iter);
+
+    /* A slow reader only has a few parts queued at once */
+    rpc_socket_queued_max = 0;
+    CU_ASSERT ((iter = apteryx_traverse_iter (path)) != NULL);
+    i = 0;
+    while (iter && apteryx_iter_next (iter, &ipath, &ivalue))
+    {
+        if (i++ % 1000 == 0)
+            usleep (20000);
+    }
+    CU_ASSERT (i == count);
+    CU_ASSERT (rpc_socket_queued_max > 1 && rpc_socket_queued_max <= RPC_STREAM_WINDOW);
+    apteryx_iter_free (iter);
+
+    /* Other requests still complete while a stream is held back */
+    CU_ASSERT ((iter = apteryx_traverse_iter (path)) != NULL);
+    i = 0;
+    while (iter && apteryx_iter_next (iter, &ipath, &ivalue))
+    {
+        if (i++ % 1000 == 0)
+        {
+            usleep (20000);
+            CU_ASSERT (apteryx_has_value (TEST_PATH"/interfaces/eth0/name"));
+        }
+    }
+    CU_ASSERT (i == count);
+    apteryx_iter_free (iter);
+
+    /* A stalled reader does not hold up writers */
+    GNode *big = APTERYX_NODE (NULL, strdup (TEST_PATH"/big"));
+    char large[1001];
+    memset (large, 'x', sizeof (large) - 1);
+    large[sizeof (large) - 1] = '\0';
+    for (i = 0; i < 4000; i++)
+        APTERYX_LEAF (big, g_strdup_printf ("%d", i), strdup (large));
+    CU_ASSERT (apteryx_set_tree (big));
+    CU_ASSERT ((iter = apteryx_traverse_iter (TEST_PATH"/big")) != NULL);
+    CU_ASSERT (iter && apteryx_iter_next (iter, &ipath, &ivalue));
+    usleep (TEST_SLEEP_TIMEOUT);
+    if ((pid = fork ()) == 0)
+    {
+        uint64_t start = get_time_us ();
+        bool ok = apteryx_set (TEST_PATH"/stalled", "written");
+        exit (ok && get_time_us () - start < 500000 ? 0 : 1);
+    }
+    CU_ASSERT (pid > 0);
+    if (pid > 0)
+    {
+        CU_ASSERT (waitpid (pid, &status, 0) == pid);
+        CU_ASSERT (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+    }
+    i = 1;
+    while (iter && apteryx_iter_next (iter, &ipath, &ivalue))
+        i++;
+    CU_ASSERT (i == 4000);
+    apteryx_iter_free (iter);
+    CU_ASSERT (apteryx_set (TEST_PATH"/stalled", NULL));
+
+    /* The server only held back a few parts of the tree at a time */
+    CU_ASSERT (_get_counter ("traverse_held_max") > 0);
+    CU_ASSERT (_get_counter ("traverse_held_max") <=
+               2 * (RPC_STREAM_WINDOW + 1) * RPC_STREAM_CHUNK_SIZE);
+
+    /* Stopping early stops the server too rather than reading the rest */
+    cancelled = _get_counter ("traverse_cancelled");
+    CU_ASSERT ((iter = apteryx_traverse_iter (TEST_PATH"/big")) != NULL);
+    CU_ASSERT (iter && apteryx_iter_next (iter, &ipath, &ivalue));
+    apteryx_iter_free (iter);
+    for (i = 0; i < 100 && _get_counter ("traverse_cancelled") == cancelled; i++)
+        usleep (10000);
+    CU_ASSERT (_get_counter ("traverse_cancelled") == cancelled + 1);
+    CU_ASSERT (apteryx_has_value (TEST_PATH"/big/0"));
+    CU_ASSERT (apteryx_prune (TEST_PATH"/big"));
+    apteryx_free_tree (big);
+
+    /* Stop early */
+    CU_ASSERT ((iter = apteryx_traverse_iter (path)) != NULL);
+    CU_ASSERT (iter && apteryx_iter_next (iter, &ipath, &ivalue));
+    apteryx_iter_free (iter);
+
+    /* Nothing there */
+    CU_ASSERT ((iter = apteryx_traverse_iter (TEST_PATH"/nothing")) != NULL);
+    CU_ASSERT (iter && !apteryx_iter_next (iter, &ipath, &ivalue));
+    apteryx_iter_free (iter);
+
+    /* Query */
+    GNode *root = g_node_new (strdup ("/"));
+    apteryx_path_to_node (root, TEST_PATH"/interfaces/*/name", NULL);
+    CU_ASSERT ((iter = apteryx_query_iter (root)) != NULL);
+    i = 0;
+    while (iter && apteryx_iter_next (iter, &ipath, &ivalue))
+        i++;
+    CU_ASSERT (i == count);
+    apteryx_iter_free (iter);
+    apteryx_free_tree (root);
+
+    CU_ASSERT (apteryx_prune (path));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 void
 test_query_basic ()
 {
@@ -4054,6 +4785,44 @@ test_query_provided ()
     apteryx_prune (TEST_PATH);
 }
 
+void
+test_query_multi_leaf_provided ()
+{
+    GNode *root = NULL;
+    GNode *rroot = NULL;
+    GNode *node;
+    int i;
+
+    /* Only state is provided - the other leaves come from the database */
+    CU_ASSERT (apteryx_provide (TEST_PATH"/interfaces/eth1/state", test_provide_cb));
+    root = APTERYX_NODE (NULL, strdup (TEST_PATH"/interfaces"));
+    for (i = 0; i < 3; i++)
+    {
+        node = APTERYX_NODE (root, g_strdup_printf ("eth%d", i));
+        APTERYX_LEAF (node, strdup ("name"), g_strdup_printf ("eth%d", i));
+        APTERYX_LEAF (node, strdup ("speed"), strdup ("1000"));
+        APTERYX_LEAF (node, strdup ("mtu"), strdup ("1500"));
+    }
+    CU_ASSERT (apteryx_set_tree (root));
+    apteryx_free_tree (root);
+
+    root = g_node_new (strdup (TEST_PATH"/interfaces"));
+    node = APTERYX_NODE (root, strdup ("*"));
+    APTERYX_NODE (node, strdup ("name"));
+    APTERYX_NODE (node, strdup ("state"));
+    APTERYX_NODE (node, strdup ("speed"));
+    rroot = apteryx_query (root);
+    CU_ASSERT (rroot && g_node_n_nodes (rroot, G_TRAVERSE_LEAVES) == 7);
+    CU_ASSERT (rroot && apteryx_path_node (rroot, TEST_PATH"/interfaces/eth1/state") != NULL);
+    CU_ASSERT (rroot && apteryx_path_node (rroot, TEST_PATH"/interfaces/eth0/mtu") == NULL);
+    apteryx_free_tree (rroot);
+    apteryx_free_tree (root);
+
+    CU_ASSERT (apteryx_unprovide (TEST_PATH"/interfaces/eth1/state", test_provide_cb));
+    CU_ASSERT (apteryx_prune (TEST_PATH));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 void
 test_cas_tree ()
 {
@@ -4079,6 +4848,46 @@ test_cas_tree ()
     CU_ASSERT (assert_apteryx_empty ());
 }
 
+void
+test_cas_tree_per_path ()
+{
+    const char *path = TEST_PATH"/table";
+    GHashTable *timestamps;
+    GNode *root;
+    uint64_t ts1, ts2;
+    const char *value;
+
+    CU_ASSERT (apteryx_set (TEST_PATH"/table/row1/value", "1"));
+    CU_ASSERT (apteryx_set (TEST_PATH"/table/row2/value", "2"));
+    ts1 = apteryx_timestamp (TEST_PATH"/table/row1");
+    ts2 = apteryx_timestamp (TEST_PATH"/table/row2");
+    timestamps = g_hash_table_new (g_str_hash, g_str_equal);
+    g_hash_table_insert (timestamps, TEST_PATH"/table/row1", &ts1);
+
+    /* A change to another row does not matter */
+    CU_ASSERT (apteryx_set (TEST_PATH"/table/row2/value", "20"));
+    root = APTERYX_NODE (NULL, (char *) TEST_PATH"/table/row1");
+    APTERYX_LEAF (root, "value", "10");
+    CU_ASSERT (apteryx_cas_tree_full (root, timestamps, false));
+    CU_ASSERT ((value = apteryx_get (TEST_PATH"/table/row1/value")) && strcmp (value, "10") == 0);
+    free ((void *) value);
+
+    /* But a change to this one does, even with the other row current */
+    g_hash_table_insert (timestamps, TEST_PATH"/table/row2", &ts2);
+    CU_ASSERT (!apteryx_cas_tree_full (root, timestamps, false));
+    CU_ASSERT (errno == -EBUSY);
+    ts2 = apteryx_timestamp (TEST_PATH"/table/row2");
+    CU_ASSERT (!apteryx_cas_tree_full (root, timestamps, false));
+    CU_ASSERT (errno == -EBUSY);
+    ts1 = apteryx_timestamp (TEST_PATH"/table/row1");
+    CU_ASSERT (apteryx_cas_tree_full (root, timestamps, true));
+
+    g_hash_table_destroy (timestamps);
+    g_node_destroy (root);
+    CU_ASSERT (apteryx_prune (path));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 static bool atomic_tree_running = true;
 static pthread_mutex_t atomic_tree_set_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t atomic_tree_prune_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -4306,6 +5115,79 @@ test_watch_tree_prune ()
     _watch_tree_cleanup ();
 }
 
+void
+test_txn ()
+{
+    const char *path = TEST_PATH"/interfaces";
+    apteryx_txn txn;
+    uint64_t ts;
+    const char *value;
+
+    _cb_count = 0;
+    CU_ASSERT (apteryx_set (TEST_PATH"/interfaces/eth0/state", "up"));
+    CU_ASSERT (apteryx_set (TEST_PATH"/interfaces/eth1/state", "up"));
+    ts = apteryx_timestamp (TEST_PATH"/interfaces/eth0/state");
+    CU_ASSERT (apteryx_watch_tree (TEST_PATH"/interfaces/*", test_watch_tree_callback));
+    CU_ASSERT (apteryx_validate (TEST_PATH"/interfaces/*", test_sync_validate_callback));
+
+    /* Mixed sets and deletes arrive as one change */
+    CU_ASSERT ((txn = apteryx_txn_begin ()) != NULL);
+    CU_ASSERT (apteryx_txn_check (txn, TEST_PATH"/interfaces/eth0/state", ts));
+    CU_ASSERT (apteryx_txn_add (txn, TEST_PATH"/interfaces/eth0/state", "down"));
+    CU_ASSERT (apteryx_txn_add (txn, TEST_PATH"/interfaces/eth0/speed", "1000"));
+    CU_ASSERT (apteryx_txn_add (txn, TEST_PATH"/interfaces/eth1/state", NULL));
+    CU_ASSERT (apteryx_txn_commit (txn, true));
+    CU_ASSERT (_cb_count == 1);
+    CU_ASSERT (watch_tree_root && g_node_n_nodes (watch_tree_root, G_TRAVERSE_LEAVES) == 3);
+    CU_ASSERT ((value = apteryx_get (TEST_PATH"/interfaces/eth0/state")) && strcmp (value, "down") == 0);
+    free ((void *) value);
+    CU_ASSERT ((value = apteryx_get (TEST_PATH"/interfaces/eth1/state")) == NULL);
+
+    /* Nothing is done if a precondition fails */
+    CU_ASSERT ((txn = apteryx_txn_begin ()) != NULL);
+    CU_ASSERT (apteryx_txn_add (txn, TEST_PATH"/interfaces/eth0/speed", "100"));
+    CU_ASSERT (apteryx_txn_check (txn, TEST_PATH"/interfaces/eth0/state", ts));
+    CU_ASSERT (!apteryx_txn_commit (txn, true));
+    CU_ASSERT (errno == -EBUSY);
+
+    /* ... or any change is refused */
+    CU_ASSERT ((txn = apteryx_txn_begin ()) != NULL);
+    CU_ASSERT (apteryx_txn_add (txn, TEST_PATH"/interfaces/eth0/speed", "100"));
+    CU_ASSERT (apteryx_txn_add (txn, TEST_PATH"/interfaces/eth0/state", "bad"));
+    CU_ASSERT (!apteryx_txn_commit (txn, true));
+    CU_ASSERT (errno == -EPERM);
+    CU_ASSERT ((value = apteryx_get (TEST_PATH"/interfaces/eth0/speed")) && strcmp (value, "1000") == 0);
+    free ((void *) value);
+    CU_ASSERT (_cb_count == 1);
+
+    /* Proxied paths cannot be changed or checked in one go */
+    CU_ASSERT (apteryx_bind (TEST_TCP_URL));
+    CU_ASSERT (apteryx_proxy (TEST_PATH"/remote/*", TEST_TCP_URL));
+    CU_ASSERT ((txn = apteryx_txn_begin ()) != NULL);
+    CU_ASSERT (apteryx_txn_add (txn, TEST_PATH"/interfaces/eth0/speed", "100"));
+    CU_ASSERT (apteryx_txn_check (txn, TEST_PATH"/remote/test/interfaces/eth0/state", ts));
+    CU_ASSERT (!apteryx_txn_commit (txn, true));
+    CU_ASSERT (errno == -ENOTSUP);
+    CU_ASSERT ((txn = apteryx_txn_begin ()) != NULL);
+    CU_ASSERT (apteryx_txn_add (txn, TEST_PATH"/remote/test/interfaces/eth0/speed", "100"));
+    CU_ASSERT (!apteryx_txn_commit (txn, true));
+    CU_ASSERT (errno == -ENOTSUP);
+    CU_ASSERT (apteryx_unproxy (TEST_PATH"/remote/*", TEST_TCP_URL));
+    CU_ASSERT (apteryx_unbind (TEST_TCP_URL));
+    CU_ASSERT ((value = apteryx_get (TEST_PATH"/interfaces/eth0/speed")) && strcmp (value, "1000") == 0);
+    free ((void *) value);
+
+    /* Aborted transactions do nothing */
+    CU_ASSERT ((txn = apteryx_txn_begin ()) != NULL);
+    CU_ASSERT (apteryx_txn_add (txn, TEST_PATH"/interfaces/eth0/speed", "100"));
+    apteryx_txn_abort (txn);
+
+    CU_ASSERT (apteryx_unvalidate (TEST_PATH"/interfaces/*", test_sync_validate_callback));
+    CU_ASSERT (apteryx_unwatch_tree (TEST_PATH"/interfaces/*", test_watch_tree_callback));
+    CU_ASSERT (apteryx_prune (path));
+    _watch_tree_cleanup ();
+}
+
 void
 test_watch_tree_prune_tree ()
 {
@@ -4809,6 +5691,38 @@ exit:
     CU_ASSERT (assert_apteryx_empty ());
 }
 
+void
+test_perf_traverse_iter_5000 ()
+{
+    const char *path = TEST_PATH"/interfaces/eth0";
+    const char *ipath, *ivalue;
+    apteryx_iter *iter;
+    char value[32];
+    uint64_t start, time;
+    int count = 5000;
+    int i;
+
+    for (i=0; i<count; i++)
+    {
+        sprintf (value, "value%d", i);
+        CU_ASSERT (apteryx_set_string (path, value, value));
+    }
+    start = get_time_us ();
+    CU_ASSERT ((iter = apteryx_traverse_iter (path)) != NULL)
+    if (!iter)
+        goto exit;
+    i = 0;
+    while (apteryx_iter_next (iter, &ipath, &ivalue))
+        i++;
+    apteryx_iter_free (iter);
+    CU_ASSERT (i == count);
+    time = (get_time_us () - start);
+    printf ("%"PRIu64"us ... ", time);
+exit:
+    CU_ASSERT (apteryx_prune (path));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 void
 test_perf_get_tree_5000 ()
 {
@@ -4836,6 +5750,42 @@ exit:
     CU_ASSERT (assert_apteryx_empty ());
 }
 
+void
+test_perf_query_multi_leaf ()
+{
+    GNode *root, *node;
+    uint64_t start, time;
+    int count = 1000;
+    int i;
+
+    root = APTERYX_NODE (NULL, strdup (TEST_PATH"/interfaces"));
+    for (i = 0; i < count; i++)
+    {
+        node = APTERYX_NODE (root, g_strdup_printf ("eth%d", i));
+        APTERYX_LEAF (node, strdup ("name"), g_strdup_printf ("eth%d", i));
+        APTERYX_LEAF (node, strdup ("state"), strdup ("up"));
+        APTERYX_LEAF (node, strdup ("speed"), strdup ("1000"));
+        APTERYX_LEAF (node, strdup ("mtu"), strdup ("1500"));
+    }
+    CU_ASSERT (apteryx_set_tree (root));
+    apteryx_free_tree (root);
+
+    root = g_node_new (strdup (TEST_PATH"/interfaces"));
+    node = APTERYX_NODE (root, strdup ("*"));
+    APTERYX_NODE (node, strdup ("name"));
+    APTERYX_NODE (node, strdup ("state"));
+    APTERYX_NODE (node, strdup ("speed"));
+    start = get_time_us ();
+    node = apteryx_query (root);
+    time = (get_time_us () - start);
+    printf ("%"PRIu64"us ... ", time);
+    CU_ASSERT (node && g_node_n_nodes (node, G_TRAVERSE_LEAVES) == count * 3);
+    apteryx_free_tree (node);
+    apteryx_free_tree (root);
+    CU_ASSERT (apteryx_prune (TEST_PATH"/interfaces"));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 /* This test is an attempt to reproduce the performance of a
  * moderately large tree with realistic branch layouts.
  */
@@ -5003,6 +5953,54 @@ test_proxy_set ()
     CU_ASSERT (assert_apteryx_empty ());
 }
 
+void
+test_proxy_set_tree_multi ()
+{
+    GNode *root = NULL;
+    GNode *rroot = NULL;
+    const char *value = NULL;
+
+    CU_ASSERT (apteryx_bind (TEST_TCP_URL));
+    CU_ASSERT (apteryx_bind (TEST_TCP6_URL));
+    CU_ASSERT (apteryx_proxy (TEST_PATH"/remote1/*", TEST_TCP_URL));
+    CU_ASSERT (apteryx_proxy (TEST_PATH"/remote2/*", TEST_TCP6_URL));
+
+    /* One set spread over two proxied instances and the local database */
+    root = APTERYX_NODE (NULL, TEST_PATH);
+    APTERYX_LEAF (root, "remote1"TEST_PATH"/local/cat", "felix");
+    APTERYX_LEAF (root, "remote1"TEST_PATH"/local/dog", "fido");
+    APTERYX_LEAF (root, "remote2"TEST_PATH"/local/fish", "nemo");
+    APTERYX_LEAF (root, "other", "test");
+    CU_ASSERT (apteryx_set_tree (root));
+    g_node_destroy (root);
+    CU_ASSERT ((value = apteryx_get (TEST_PATH"/local/fish")) != NULL);
+    CU_ASSERT (value && strcmp (value, "nemo") == 0);
+    free ((void *) value);
+    CU_ASSERT ((value = apteryx_get (TEST_PATH"/other")) != NULL);
+    CU_ASSERT (value && strcmp (value, "test") == 0);
+    free ((void *) value);
+
+    /* One query spread over both proxied instances */
+    root = g_node_new (strdup (TEST_PATH));
+    APTERYX_NODE (root, strdup ("remote1"TEST_PATH"/local/cat"));
+    APTERYX_NODE (root, strdup ("remote2"TEST_PATH"/local/fish"));
+    APTERYX_NODE (root, strdup ("other"));
+    rroot = apteryx_query (root);
+    CU_ASSERT (rroot && g_node_n_nodes (rroot, G_TRAVERSE_LEAVES) == 3);
+    CU_ASSERT ((value = apteryx_get_string (TEST_PATH"/remote2"TEST_PATH"/local", "fish")) != NULL);
+    CU_ASSERT (value && strcmp (value, "nemo") == 0);
+    free ((void *) value);
+    apteryx_free_tree (rroot);
+    apteryx_free_tree (root);
+
+    CU_ASSERT (apteryx_unproxy (TEST_PATH"/remote1/*", TEST_TCP_URL));
+    CU_ASSERT (apteryx_unproxy (TEST_PATH"/remote2/*", TEST_TCP6_URL));
+    CU_ASSERT (apteryx_unbind (TEST_TCP_URL));
+    CU_ASSERT (apteryx_unbind (TEST_TCP6_URL));
+    CU_ASSERT (apteryx_prune (TEST_PATH));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 void
 test_proxy_not_listening ()
 {
@@ -5112,6 +6110,8 @@ test_proxy_prune ()
 void
 test_proxy_timestamp ()
 {
+    GHashTable *timestamps;
+    GList *paths = NULL;
     uint64_t ts = 0;
 
     CU_ASSERT (apteryx_set (TEST_PATH"/local", "test"));
@@ -5119,46 +6119,115 @@ test_proxy_timestamp ()
     CU_ASSERT (apteryx_bind (TEST_TCP_URL));
     CU_ASSERT (apteryx_proxy (TEST_PATH"/remote/*", TEST_TCP_URL));
     CU_ASSERT (apteryx_timestamp (TEST_PATH"/remote/test/local") == ts);
+
+    /* Several proxied paths in one request */
+    paths = g_list_append (paths, TEST_PATH"/remote/test/local");
+    paths = g_list_append (paths, TEST_PATH"/remote/test/missing");
+    paths = g_list_append (paths, TEST_PATH"/local");
+    paths = g_list_append (paths, TEST_PATH"/remote/test/local");
+    CU_ASSERT ((timestamps = apteryx_timestamps (paths)) != NULL);
+    if (timestamps)
+    {
+        uint64_t *value = g_hash_table_lookup (timestamps, TEST_PATH"/remote/test/local");
+        CU_ASSERT (value && *value == ts);
+        value = g_hash_table_lookup (timestamps, TEST_PATH"/remote/test/missing");
+        CU_ASSERT (value && *value == 0);
+        value = g_hash_table_lookup (timestamps, TEST_PATH"/local");
+        CU_ASSERT (value && *value == ts);
+        g_hash_table_destroy (timestamps);
+    }
+    g_list_free (paths);
+
     CU_ASSERT (apteryx_unproxy (TEST_PATH"/remote/*", TEST_TCP_URL));
     CU_ASSERT (apteryx_unbind (TEST_TCP_URL));
     CU_ASSERT (apteryx_set (TEST_PATH"/local", NULL));
     CU_ASSERT (assert_apteryx_empty ());
 }
 
+static void *
+_wait_set_thread (void *data)
+{
+    usleep (100000);
+    apteryx_set (TEST_PATH"/wait/a/b", (const char *) data);
+    return NULL;
+}
+
 void
-test_proxy_cas ()
+test_proxy_wait ()
 {
-    const char *path = TEST_PATH"/remote/test/local";
-    char *value = NULL;
+    const char *path = TEST_PATH"/remote/test/wait";
+    pthread_t writer;
     uint64_t ts;
 
+    CU_ASSERT (apteryx_set (TEST_PATH"/wait/a/b", "1"));
     CU_ASSERT (apteryx_bind (TEST_TCP_URL));
     CU_ASSERT (apteryx_proxy (TEST_PATH"/remote/*", TEST_TCP_URL));
-
-    value = g_strdup_printf ("%d", 1);
-    CU_ASSERT (apteryx_cas (path, value, 0));
-    CU_ASSERT (!apteryx_cas (path, value, 0));
-    CU_ASSERT (errno == -EBUSY);
     CU_ASSERT ((ts = apteryx_timestamp (path)) != 0);
-    CU_ASSERT (apteryx_cas (path, value, ts));
-    CU_ASSERT (!apteryx_cas (path, value, ts));
-    CU_ASSERT (errno == -EBUSY);
-    g_free (value);
-
-    CU_ASSERT (apteryx_set (path, NULL));
+    CU_ASSERT (apteryx_wait (path, ts, 100000) == 0);
+    pthread_create (&writer, NULL, _wait_set_thread, "2");
+    CU_ASSERT (apteryx_wait (path, ts, 5 * RPC_CLIENT_TIMEOUT_US) > ts);
+    pthread_join (writer, NULL);
     CU_ASSERT (apteryx_unproxy (TEST_PATH"/remote/*", TEST_TCP_URL));
     CU_ASSERT (apteryx_unbind (TEST_TCP_URL));
+    CU_ASSERT (apteryx_prune (TEST_PATH"/wait"));
     CU_ASSERT (assert_apteryx_empty ());
 }
 
 void
-test_timestamp ()
+test_proxy_aggregate ()
 {
-    const char *path = TEST_PATH"/timestamp";
-    uint64_t ts;
+    int64_t result = -1;
 
-    CU_ASSERT (apteryx_set_int (path, "value", 10));
-    CU_ASSERT (apteryx_set_int (path, "value2", 11));
+    CU_ASSERT (apteryx_set_int (TEST_PATH"/routes/1", "metric", 20));
+    CU_ASSERT (apteryx_set_int (TEST_PATH"/routes/2", "metric", 5));
+    CU_ASSERT (apteryx_bind (TEST_TCP_URL));
+    CU_ASSERT (apteryx_proxy (TEST_PATH"/remote/*", TEST_TCP_URL));
+    CU_ASSERT (apteryx_aggregate (TEST_PATH"/remote"TEST_PATH"/routes/*/metric",
+                                  APTERYX_AGGREGATE_SUM, &result) && result == 25);
+    CU_ASSERT (apteryx_aggregate (TEST_PATH"/remote"TEST_PATH"/routes",
+                                  APTERYX_AGGREGATE_CHILDREN, &result) && result == 2);
+    CU_ASSERT (apteryx_aggregate (TEST_PATH"/remote"TEST_PATH"/routes/3",
+                                  APTERYX_AGGREGATE_EXISTS, &result) && result == 0);
+    CU_ASSERT (apteryx_unproxy (TEST_PATH"/remote/*", TEST_TCP_URL));
+    CU_ASSERT (apteryx_unbind (TEST_TCP_URL));
+    CU_ASSERT (apteryx_prune (TEST_PATH"/routes"));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
+void
+test_proxy_cas ()
+{
+    const char *path = TEST_PATH"/remote/test/local";
+    char *value = NULL;
+    uint64_t ts;
+
+    CU_ASSERT (apteryx_bind (TEST_TCP_URL));
+    CU_ASSERT (apteryx_proxy (TEST_PATH"/remote/*", TEST_TCP_URL));
+
+    value = g_strdup_printf ("%d", 1);
+    CU_ASSERT (apteryx_cas (path, value, 0));
+    CU_ASSERT (!apteryx_cas (path, value, 0));
+    CU_ASSERT (errno == -EBUSY);
+    CU_ASSERT ((ts = apteryx_timestamp (path)) != 0);
+    CU_ASSERT (apteryx_cas (path, value, ts));
+    CU_ASSERT (!apteryx_cas (path, value, ts));
+    CU_ASSERT (errno == -EBUSY);
+    g_free (value);
+
+    CU_ASSERT (apteryx_set (path, NULL));
+    CU_ASSERT (apteryx_unproxy (TEST_PATH"/remote/*", TEST_TCP_URL));
+    CU_ASSERT (apteryx_unbind (TEST_TCP_URL));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
+void
+test_timestamp ()
+{
+    const char *path = TEST_PATH"/timestamp";
+    uint64_t ts;
+
+    CU_ASSERT (apteryx_set_int (path, "value", 10));
+    CU_ASSERT (apteryx_set_int (path, "value2", 11));
     ts = apteryx_timestamp (path);
     CU_ASSERT (ts != 0);
     CU_ASSERT (apteryx_prune (TEST_PATH"/timestamp/value"));
@@ -5166,6 +6235,181 @@ test_timestamp ()
     CU_ASSERT (apteryx_prune (TEST_PATH));
 }
 
+void
+test_timestamps ()
+{
+    GHashTable *timestamps = NULL;
+    GList *paths = NULL;
+    GNode *root;
+    uint64_t *ts;
+
+    CU_ASSERT (apteryx_set (TEST_PATH"/table/row1/value", "1"));
+    CU_ASSERT (apteryx_set (TEST_PATH"/table/row2/value", "2"));
+    CU_ASSERT (apteryx_bind (TEST_TCP_URL));
+    CU_ASSERT (apteryx_proxy (TEST_PATH"/remote/*", TEST_TCP_URL));
+    paths = g_list_append (paths, TEST_PATH"/table/row1");
+    paths = g_list_append (paths, TEST_PATH"/table/row2/value");
+    paths = g_list_append (paths, TEST_PATH"/table/row3");
+    paths = g_list_append (paths, TEST_PATH"/remote/test/table/row1");
+
+    timestamps = apteryx_timestamps (paths);
+    CU_ASSERT (timestamps != NULL);
+    CU_ASSERT (timestamps && g_hash_table_size (timestamps) == 4);
+    ts = timestamps ? g_hash_table_lookup (timestamps, TEST_PATH"/table/row1") : NULL;
+    CU_ASSERT (ts && *ts != 0 && *ts == apteryx_timestamp (TEST_PATH"/table/row1"));
+    ts = timestamps ? g_hash_table_lookup (timestamps, TEST_PATH"/table/row2/value") : NULL;
+    CU_ASSERT (ts && *ts != 0 && *ts == apteryx_timestamp (TEST_PATH"/table/row2/value"));
+    ts = timestamps ? g_hash_table_lookup (timestamps, TEST_PATH"/table/row3") : NULL;
+    CU_ASSERT (ts && *ts == 0);
+    ts = timestamps ? g_hash_table_lookup (timestamps, TEST_PATH"/remote/test/table/row1") : NULL;
+    CU_ASSERT (ts && *ts == apteryx_timestamp (TEST_PATH"/table/row1"));
+    CU_ASSERT (apteryx_unproxy (TEST_PATH"/remote/*", TEST_TCP_URL));
+    CU_ASSERT (apteryx_unbind (TEST_TCP_URL));
+
+    /* The timestamps can be used to only set if nothing has changed */
+    if (timestamps)
+    {
+        g_hash_table_remove (timestamps, TEST_PATH"/remote/test/table/row1");
+        root = APTERYX_NODE (NULL, (char *) TEST_PATH"/table/row3");
+        APTERYX_LEAF (root, "value", "3");
+        CU_ASSERT (apteryx_cas_tree_full (root, timestamps, false));
+        CU_ASSERT (!apteryx_cas_tree_full (root, timestamps, false));
+        g_node_destroy (root);
+        g_hash_table_destroy (timestamps);
+    }
+    g_list_free (paths);
+
+    CU_ASSERT (apteryx_prune (TEST_PATH"/table"));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
+void
+test_wait ()
+{
+    const char *path = TEST_PATH"/wait";
+    pthread_t writer;
+    uint64_t ts, start;
+
+    CU_ASSERT (apteryx_set (TEST_PATH"/wait/a/b", "1"));
+    CU_ASSERT ((ts = apteryx_timestamp (path)) != 0);
+
+    /* Nothing changes */
+    CU_ASSERT (apteryx_wait (path, ts, 0) == 0);
+    start = get_time_us ();
+    CU_ASSERT (apteryx_wait (path, ts, 200000) == 0);
+    CU_ASSERT (get_time_us () - start >= 200000);
+
+    /* Longer than a single request */
+    start = get_time_us ();
+    CU_ASSERT (apteryx_wait (path, ts, RPC_CLIENT_TIMEOUT_US) == 0);
+    CU_ASSERT (get_time_us () - start >= RPC_CLIENT_TIMEOUT_US);
+
+    /* Woken by a change below the path */
+    pthread_create (&writer, NULL, _wait_set_thread, "2");
+    start = get_time_us ();
+    CU_ASSERT ((ts = apteryx_wait (path, ts, 5 * RPC_CLIENT_TIMEOUT_US)) != 0);
+    CU_ASSERT (get_time_us () - start < RPC_CLIENT_TIMEOUT_US);
+    CU_ASSERT (ts == apteryx_timestamp (path));
+    pthread_join (writer, NULL);
+
+    /* Missed changes are reported straight away */
+    CU_ASSERT (apteryx_set (TEST_PATH"/wait/a/b", "3"));
+    CU_ASSERT (apteryx_wait (path, ts, 5 * RPC_CLIENT_TIMEOUT_US) > ts);
+
+    /* Removed */
+    ts = apteryx_timestamp (TEST_PATH"/wait/a/b");
+    CU_ASSERT (apteryx_prune (path));
+    CU_ASSERT (apteryx_wait (TEST_PATH"/wait/a/b", ts, 0) == UINT64_MAX);
+    CU_ASSERT (apteryx_wait (TEST_PATH"/wait/a/b", UINT64_MAX, 0) == 0);
+    CU_ASSERT (apteryx_wait (TEST_PATH"/wait/a/b", 0, 0) == 0);
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
+#define TEST_WAITERS 32
+
+static void *
+_wait_many_thread (void *data)
+{
+    uint64_t ts = *(uint64_t *) data;
+    return (void *) (size_t) (apteryx_wait (TEST_PATH"/wait", ts, 5 * RPC_CLIENT_TIMEOUT_US) > ts);
+}
+
+void
+test_wait_many ()
+{
+    const char *path = TEST_PATH"/wait";
+    pthread_t waiters[TEST_WAITERS];
+    uint64_t ts, start;
+    void *woken;
+    int i;
+
+    CU_ASSERT (apteryx_set (TEST_PATH"/wait/a/b", "1"));
+    CU_ASSERT ((ts = apteryx_timestamp (path)) != 0);
+
+    /* Many more waiters than apteryxd has workers */
+    for (i = 0; i < TEST_WAITERS; i++)
+        pthread_create (&waiters[i], NULL, _wait_many_thread, &ts);
+    usleep (TEST_SLEEP_TIMEOUT);
+
+    /* A set is still handled straight away and wakes every one of them */
+    start = get_time_us ();
+    CU_ASSERT (apteryx_set (TEST_PATH"/wait/a/b", "2"));
+    CU_ASSERT (get_time_us () - start < RPC_CLIENT_TIMEOUT_US / 4);
+    for (i = 0; i < TEST_WAITERS; i++)
+    {
+        pthread_join (waiters[i], &woken);
+        CU_ASSERT (woken != NULL);
+    }
+    CU_ASSERT (apteryx_prune (path));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
+void
+test_aggregate ()
+{
+    const char *path = TEST_PATH"/routes";
+    int64_t result = -1;
+
+    CU_ASSERT (apteryx_set_int (TEST_PATH"/routes/1", "metric", 20));
+    CU_ASSERT (apteryx_set_string (TEST_PATH"/routes/1", "nexthop", "eth0"));
+    CU_ASSERT (apteryx_set_int (TEST_PATH"/routes/2", "metric", 5));
+    CU_ASSERT (apteryx_set_int (TEST_PATH"/routes/3", "metric", -7));
+    CU_ASSERT (apteryx_set_string (TEST_PATH"/routes/4", "metric", "unknown"));
+
+    CU_ASSERT (apteryx_aggregate (path, APTERYX_AGGREGATE_CHILDREN, &result) && result == 4);
+    CU_ASSERT (apteryx_aggregate (path, APTERYX_AGGREGATE_VALUES, &result) && result == 5);
+    CU_ASSERT (apteryx_aggregate (TEST_PATH"/routes/1", APTERYX_AGGREGATE_EXISTS, &result) && result == 1);
+    CU_ASSERT (apteryx_aggregate (TEST_PATH"/routes/5", APTERYX_AGGREGATE_EXISTS, &result) && result == 0);
+    CU_ASSERT (apteryx_aggregate (TEST_PATH"/routes/*/metric", APTERYX_AGGREGATE_SUM, &result) && result == 18);
+    CU_ASSERT (apteryx_aggregate (TEST_PATH"/routes/*/metric", APTERYX_AGGREGATE_MIN, &result) && result == -7);
+    CU_ASSERT (apteryx_aggregate (TEST_PATH"/routes/*/metric", APTERYX_AGGREGATE_MAX, &result) && result == 20);
+    CU_ASSERT (apteryx_aggregate (TEST_PATH"/routes/2/metric", APTERYX_AGGREGATE_MAX, &result) && result == 5);
+    CU_ASSERT (!apteryx_aggregate (TEST_PATH"/routes/*/nexthop", APTERYX_AGGREGATE_SUM, &result));
+    CU_ASSERT (!apteryx_aggregate (TEST_PATH"/routes/", APTERYX_AGGREGATE_CHILDREN, &result));
+
+    CU_ASSERT (apteryx_prune (TEST_PATH"/routes/1"));
+    CU_ASSERT (apteryx_aggregate (path, APTERYX_AGGREGATE_CHILDREN, &result) && result == 3);
+    CU_ASSERT (apteryx_aggregate (path, APTERYX_AGGREGATE_VALUES, &result) && result == 3);
+    CU_ASSERT (apteryx_aggregate (TEST_PATH"/routes/*/metric", APTERYX_AGGREGATE_MAX, &result) && result == 5);
+    CU_ASSERT (apteryx_prune (path));
+    CU_ASSERT (apteryx_aggregate (path, APTERYX_AGGREGATE_VALUES, &result) && result == 0);
+
+    /* Refreshed values are included, provided ones are not */
+    _cb_count = 0;
+    _cb_timeout = 5000;
+    CU_ASSERT (apteryx_refresh (TEST_PATH"/interfaces/*", test_refresh_tree_callback));
+    CU_ASSERT (apteryx_provide (TEST_PATH"/interfaces/eth1/speed", test_provide_callback_up));
+    CU_ASSERT (apteryx_aggregate (TEST_PATH"/interfaces", APTERYX_AGGREGATE_VALUES, &result) && result == 3);
+    CU_ASSERT (_cb_count == 1);
+    usleep (_cb_timeout);
+    CU_ASSERT (apteryx_aggregate (TEST_PATH"/interfaces/*/state/speed", APTERYX_AGGREGATE_SUM, &result) && result == 1000);
+    CU_ASSERT (_cb_count == 2);
+    CU_ASSERT (apteryx_unprovide (TEST_PATH"/interfaces/eth1/speed", test_provide_callback_up));
+    CU_ASSERT (apteryx_unrefresh (TEST_PATH"/interfaces/*", test_refresh_tree_callback));
+    CU_ASSERT (apteryx_prune (TEST_PATH"/interfaces"));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 void
 test_memuse ()
 {
@@ -5182,6 +6426,31 @@ test_memuse ()
     CU_ASSERT (apteryx_prune (TEST_PATH));
 }
 
+void
+test_counters ()
+{
+    const char *value = NULL;
+    GList *paths = NULL;
+    GNode *root = NULL;
+    int sets = 0;
+
+    CU_ASSERT ((value = apteryx_get (APTERYX_COUNTERS"/set")) != NULL);
+    sets = value ? atoi (value) : 0;
+    free ((void *) value);
+    CU_ASSERT (apteryx_set (TEST_PATH"/local", "test"));
+    CU_ASSERT ((value = apteryx_get (APTERYX_COUNTERS"/set")) != NULL);
+    CU_ASSERT (value && atoi (value) > sets);
+    free ((void *) value);
+    CU_ASSERT ((paths = apteryx_search (APTERYX_COUNTERS"/")) != NULL);
+    CU_ASSERT (g_list_find_custom (paths, APTERYX_COUNTERS"/set", (GCompareFunc) strcmp) != NULL);
+    g_list_free_full (paths, free);
+    CU_ASSERT ((root = apteryx_get_tree (APTERYX_COUNTERS)) != NULL);
+    CU_ASSERT (root && apteryx_find_child (root, "set") != NULL);
+    apteryx_free_tree (root);
+    CU_ASSERT (apteryx_set (TEST_PATH"/local", NULL));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 static bool
 test_deadlock_callback (const char *path, const char *value)
 {
@@ -5646,13 +6915,436 @@ exit:
     rpc_shutdown (rpc);
 }
 
+#define TEST_RPC_THREADS 8
+
+static rpc_instance test_rpc_instance = NULL;
+
+static void *
+_rpc_ping_thread (void *data)
+{
+    char *url = APTERYX_SERVER".test";
+    rpc_message_t msg = {};
+    rpc_client rpc_client;
+    char *value;
+    int i;
+
+    for (i = 0; i < TEST_ITERATIONS / TEST_RPC_THREADS; i++)
+    {
+        rpc_client = rpc_client_connect (test_rpc_instance, url);
+        CU_ASSERT (rpc_client != NULL);
+        if (!rpc_client)
+            break;
+        rpc_msg_encode_uint8 (&msg, MODE_TEST);
+        rpc_msg_encode_string (&msg, url);
+        CU_ASSERT (rpc_msg_send (rpc_client, &msg));
+        value = rpc_msg_decode_string (&msg);
+        CU_ASSERT (value && strcmp (value, url) == 0);
+        rpc_msg_reset (&msg);
+        /* Occasionally abandon the cached client */
+        rpc_client_release (test_rpc_instance, rpc_client, (i % 100) != 0);
+    }
+    return NULL;
+}
+
+void
+test_rpc_concurrent ()
+{
+    char *url = APTERYX_SERVER".test";
+    pthread_t threads[TEST_RPC_THREADS];
+    uint64_t start;
+    long i;
+
+    CU_ASSERT ((test_rpc_instance = rpc_init (RPC_TIMEOUT_US, test_handler)) != NULL);
+    CU_ASSERT (rpc_server_bind (test_rpc_instance, url, url));
+
+    start = get_time_us ();
+    for (i = 0; i < TEST_RPC_THREADS; i++)
+        pthread_create (&threads[i], NULL, _rpc_ping_thread, (void *) i);
+    for (i = 0; i < TEST_RPC_THREADS; i++)
+        pthread_join (threads[i], NULL);
+    printf ("%"PRIu64"us ... ", (get_time_us () - start) / TEST_ITERATIONS);
+
+    CU_ASSERT (rpc_server_release (test_rpc_instance, url));
+    rpc_shutdown (test_rpc_instance);
+    test_rpc_instance = NULL;
+}
+
+#define TEST_RPC_FORKS 20
+
+static int test_rpc_fork_stop = 0;
+
+static void *
+_rpc_lock_thread (void *data)
+{
+    while (!g_atomic_int_get (&test_rpc_fork_stop))
+    {
+        if (data)
+            rpc_test_garbage (test_rpc_instance);
+        else
+            g_list_free_full (rpc_server_peers (test_rpc_instance), g_free);
+    }
+    return NULL;
+}
+
+void
+test_rpc_fork ()
+{
+    char *url = APTERYX_SERVER".test";
+    pthread_t threads[2];
+    rpc_message_t msg = {};
+    rpc_client rpc_client;
+    int status = 0;
+    pid_t pid;
+    int i, j;
+
+    CU_ASSERT ((test_rpc_instance = rpc_init (RPC_TIMEOUT_US, test_handler)) != NULL);
+    CU_ASSERT (rpc_server_bind (test_rpc_instance, url, url));
+    CU_ASSERT ((rpc_client = rpc_client_connect (test_rpc_instance, url)) != NULL);
+    rpc_client_release (test_rpc_instance, rpc_client, true);
+
+    /* Keep the instance locks busy while forking */
+    test_rpc_fork_stop = 0;
+    for (i = 0; i < 2; i++)
+        pthread_create (&threads[i], NULL, _rpc_lock_thread, (void *) (long) i);
+    for (i = 0; i < TEST_RPC_FORKS; i++)
+    {
+        if ((pid = fork ()) == 0)
+        {
+            /* There is no reaper in the child so what it abandons
+             * (including the parent's clients) must be freed inline */
+            for (j = 0; j < 10; j++)
+            {
+                rpc_client = rpc_client_connect (test_rpc_instance, url);
+                if (!rpc_client)
+                    _exit (1);
+                rpc_msg_encode_uint8 (&msg, MODE_TEST);
+                rpc_msg_encode_string (&msg, url);
+                if (!rpc_msg_send (rpc_client, &msg))
+                    _exit (2);
+                rpc_msg_reset (&msg);
+                rpc_client_release (test_rpc_instance, rpc_client, false);
+            }
+            _exit (rpc_test_garbage (test_rpc_instance) == 0 ? 0 : 3);
+        }
+        for (j = 0; j < 500 && waitpid (pid, &status, WNOHANG) == 0; j++)
+            usleep (10000);
+        if (j == 500)
+        {
+            kill (pid, SIGKILL);
+            waitpid (pid, &status, 0);
+        }
+        CU_ASSERT (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+    }
+    g_atomic_int_set (&test_rpc_fork_stop, 1);
+    for (i = 0; i < 2; i++)
+        pthread_join (threads[i], NULL);
+
+    CU_ASSERT (rpc_server_release (test_rpc_instance, url));
+    rpc_shutdown (test_rpc_instance);
+    test_rpc_instance = NULL;
+}
+
+/* Plays a server from before the header could carry more than
+ * requests and responses. Returns true if all it saw was a hello
+ * and one plain request, which it answered */
+static void *
+_rpc_old_server_thread (void *data)
+{
+    int s = GPOINTER_TO_INT (data);
+    uint32_t hdr[3];
+    char buf[256];
+    bool ok = false;
+    int s2;
+
+    if ((s2 = accept (s, NULL, NULL)) < 0)
+        return NULL;
+    /* A newer peer says hello first, which an old one just queues */
+    if (recv (s2, hdr, sizeof (hdr), MSG_WAITALL) == sizeof (hdr) &&
+        ntohl (hdr[0]) == 0 && ntohl (hdr[2]) == 2 && ntohl (hdr[1]) <= sizeof (buf) &&
+        recv (s2, buf, ntohl (hdr[1]), MSG_WAITALL) == ntohl (hdr[1]) &&
+        recv (s2, hdr, sizeof (hdr), MSG_WAITALL) == sizeof (hdr) &&
+        ntohl (hdr[2]) == 1 && ntohl (hdr[1]) <= sizeof (buf) &&
+        recv (s2, buf, ntohl (hdr[1]), MSG_WAITALL) == ntohl (hdr[1]))
+    {
+        hdr[1] = htonl (strlen ("pong") + 1);
+        hdr[2] = htonl (2);
+        ok = write (s2, hdr, sizeof (hdr)) == sizeof (hdr) &&
+             write (s2, "pong", strlen ("pong") + 1) == strlen ("pong") + 1;
+    }
+    usleep (RPC_TIMEOUT_US / 10);
+    close (s2);
+    return ok ? (void *) 1 : NULL;
+}
+
+void
+test_rpc_old_peer ()
+{
+    char *url = APTERYX_SERVER".test";
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    rpc_message_t msg = {};
+    rpc_client rpc_client;
+    rpc_instance rpc;
+    pthread_t thread;
+    void *result = NULL;
+    uint32_t hdr[3];
+    char buf[256];
+    bool more = true;
+    rpc_id id;
+    int s;
+
+    strcpy (addr.sun_path, TEST_RPC_PATH);
+
+    /* A newer client sends an older server only what it understands */
+    unlink (TEST_RPC_PATH);
+    CU_ASSERT ((s = socket (AF_UNIX, SOCK_STREAM, 0)) >= 0);
+    CU_ASSERT (bind (s, (struct sockaddr *) &addr, sizeof (addr)) == 0);
+    CU_ASSERT (listen (s, 1) == 0);
+    CU_ASSERT (pthread_create (&thread, NULL, _rpc_old_server_thread, GINT_TO_POINTER (s)) == 0);
+    CU_ASSERT ((rpc = rpc_init (RPC_TIMEOUT_US, test_handler)) != NULL);
+    CU_ASSERT ((rpc_client = rpc_client_connect (rpc, url)) != NULL);
+    rpc_msg_encode_uint8 (&msg, MODE_TEST);
+    rpc_msg_encode_string (&msg, "ping");
+    CU_ASSERT ((id = rpc_msg_send_stream (rpc_client, &msg)) != 0);
+    CU_ASSERT (rpc_msg_recv_stream (rpc_client, id, &msg, &more));
+    CU_ASSERT (!more);
+    CU_ASSERT (g_strcmp0 (rpc_msg_decode_string (&msg), "pong") == 0);
+    rpc_msg_reset (&msg);
+    rpc_client_release (rpc, rpc_client, false);
+    pthread_join (thread, &result);
+    CU_ASSERT (result != NULL);
+    close (s);
+    unlink (TEST_RPC_PATH);
+
+    /* An older client gets plain responses from a newer server */
+    CU_ASSERT (rpc_server_bind (rpc, url, url));
+    CU_ASSERT ((s = socket (AF_UNIX, SOCK_STREAM, 0)) >= 0);
+    CU_ASSERT (connect (s, (struct sockaddr *) &addr, sizeof (addr)) == 0);
+    buf[0] = MODE_TEST;
+    strcpy (buf + 1, "ping");
+    hdr[0] = htonl (1);
+    hdr[1] = htonl (strlen ("ping") + 2);
+    hdr[2] = htonl (1);
+    CU_ASSERT (write (s, hdr, sizeof (hdr)) == sizeof (hdr));
+    CU_ASSERT (write (s, buf, strlen ("ping") + 2) == strlen ("ping") + 2);
+    /* The hello, which an old client would queue and never read */
+    CU_ASSERT (recv (s, hdr, sizeof (hdr), MSG_WAITALL) == sizeof (hdr));
+    CU_ASSERT (ntohl (hdr[0]) == 0 && ntohl (hdr[1]) == sizeof (uint32_t) && ntohl (hdr[2]) == 2);
+    CU_ASSERT (recv (s, buf, sizeof (uint32_t), MSG_WAITALL) == sizeof (uint32_t));
+    /* Then the response */
+    CU_ASSERT (recv (s, hdr, sizeof (hdr), MSG_WAITALL) == sizeof (hdr));
+    CU_ASSERT (ntohl (hdr[0]) == 1 && ntohl (hdr[2]) == 2);
+    CU_ASSERT (ntohl (hdr[1]) == strlen ("ping") + 1);
+    CU_ASSERT (recv (s, buf, strlen ("ping") + 1, MSG_WAITALL) == strlen ("ping") + 1);
+    CU_ASSERT (strcmp (buf, "ping") == 0);
+    close (s);
+    CU_ASSERT (rpc_server_release (rpc, url));
+    rpc_shutdown (rpc);
+}
+
+static double
+_rpc_syscalls_per_req (bool io_uring)
+{
+    char *url = APTERYX_SERVER".test";
+    pthread_t threads[TEST_RPC_THREADS];
+    uint64_t count;
+    long i;
+
+    /* Sockets pick their receive path when they start */
+    rpc_socket_io_uring = io_uring;
+    CU_ASSERT ((test_rpc_instance = rpc_init (RPC_TIMEOUT_US, test_handler)) != NULL);
+    CU_ASSERT (rpc_server_bind (test_rpc_instance, url, url));
+    count = __atomic_load_n (&rpc_socket_syscalls, __ATOMIC_RELAXED);
+    for (i = 0; i < TEST_RPC_THREADS; i++)
+        pthread_create (&threads[i], NULL, _rpc_ping_thread, (void *) i);
+    for (i = 0; i < TEST_RPC_THREADS; i++)
+        pthread_join (threads[i], NULL);
+    count = __atomic_load_n (&rpc_socket_syscalls, __ATOMIC_RELAXED) - count;
+    CU_ASSERT (rpc_server_release (test_rpc_instance, url));
+    rpc_shutdown (test_rpc_instance);
+    test_rpc_instance = NULL;
+    rpc_socket_io_uring = true;
+    return (double) count / ((TEST_ITERATIONS / TEST_RPC_THREADS) * TEST_RPC_THREADS);
+}
+
+void
+test_rpc_syscalls ()
+{
+    double plain = _rpc_syscalls_per_req (false);
+    double uring = _rpc_syscalls_per_req (true);
+    printf ("recv %.2f io_uring %.2f syscalls/req ... ", plain, uring);
+}
+
+void
+test_rpc_pool ()
+{
+    char *url = APTERYX_SERVER".test";
+    rpc_client clients[5];
+    rpc_client rpc_client;
+    rpc_instance rpc;
+    int i;
+
+    CU_ASSERT ((rpc = rpc_init (RPC_TIMEOUT_US, test_handler)) != NULL);
+    CU_ASSERT (rpc_server_bind (rpc, url, url));
+
+    /* Round-robin uses each connection in turn */
+    rpc_client_pool_set (rpc, 4, RPC_POOL_ROUND_ROBIN);
+    for (i = 0; i < 5; i++)
+        CU_ASSERT ((clients[i] = rpc_client_connect (rpc, url)) != NULL);
+    CU_ASSERT (clients[0] != clients[1] && clients[1] != clients[2] &&
+               clients[2] != clients[3] && clients[3] != clients[0]);
+    CU_ASSERT (clients[4] == clients[0]);
+    for (i = 0; i < 5; i++)
+        rpc_client_release (rpc, clients[i], true);
+
+    /* Least in-flight reuses an idle connection */
+    rpc_client_pool_set (rpc, 4, RPC_POOL_LEAST_INFLIGHT);
+    CU_ASSERT ((rpc_client = rpc_client_connect (rpc, url)) != NULL);
+    CU_ASSERT (rpc_client == clients[0]);
+    rpc_client_release (rpc, rpc_client, true);
+    CU_ASSERT ((rpc_client = rpc_client_connect (rpc, url)) != NULL);
+    CU_ASSERT (rpc_client == clients[0]);
+    rpc_client_release (rpc, rpc_client, true);
+
+    CU_ASSERT (rpc_server_release (rpc, url));
+    rpc_shutdown (rpc);
+}
+
+/* Takes a while so that a flood of requests backs up */
+static bool
+_test_slow_handler (rpc_message msg)
+{
+    usleep (1000);
+    return test_handler (msg);
+}
+
+/* Counts of flood requests that were served, refused or lost */
+static int test_rpc_served = 0;
+static int test_rpc_refused = 0;
+static int test_rpc_lost = 0;
+
+static void *
+_rpc_flood_thread (void *data)
+{
+    char *url = APTERYX_SERVER".test";
+    rpc_message_t msg = {};
+    rpc_client rpc_client;
+    int i;
+
+    for (i = 0; i < 100; i++)
+    {
+        if (!(rpc_client = rpc_client_connect (test_rpc_instance, url)))
+        {
+            g_atomic_int_inc (&test_rpc_lost);
+            break;
+        }
+        rpc_msg_encode_uint8 (&msg, MODE_TEST);
+        rpc_msg_encode_string (&msg, url);
+        if (rpc_msg_send (rpc_client, &msg))
+            g_atomic_int_inc (&test_rpc_served);
+        else if (errno == -EBUSY)
+            g_atomic_int_inc (&test_rpc_refused);
+        else
+            g_atomic_int_inc (&test_rpc_lost);
+        rpc_msg_reset (&msg);
+        rpc_client_release (test_rpc_instance, rpc_client, true);
+    }
+    return NULL;
+}
+
+static rpc_peer_stats *
+_rpc_peer_find (GList *peers, int pid)
+{
+    for (GList *iter = peers; iter; iter = iter->next)
+    {
+        if (((rpc_peer_stats *) iter->data)->pid == pid)
+            return (rpc_peer_stats *) iter->data;
+    }
+    return NULL;
+}
+
+void
+test_rpc_fair ()
+{
+    char *url = APTERYX_SERVER".test";
+    pthread_t threads[TEST_RPC_THREADS];
+    rpc_peer_stats *stats;
+    rpc_message_t msg = {};
+    rpc_client rpc_client;
+    GList *peers = NULL;
+    int status = 0;
+    pid_t pid;
+    long i;
+
+    CU_ASSERT ((test_rpc_instance = rpc_init (RPC_TIMEOUT_US, _test_slow_handler)) != NULL);
+    CU_ASSERT (rpc_server_bind (test_rpc_instance, url, url));
+    rpc_server_limit (test_rpc_instance, 2);
+
+    /* One client floods the server from many threads */
+    if ((pid = fork ()) == 0)
+    {
+        for (i = 0; i < TEST_RPC_THREADS; i++)
+            pthread_create (&threads[i], NULL, _rpc_flood_thread, (void *) i);
+        for (i = 0; i < TEST_RPC_THREADS; i++)
+            pthread_join (threads[i], NULL);
+        /* What it cannot have now is refused, never dropped */
+        _exit (test_rpc_served && test_rpc_refused && !test_rpc_lost ? 0 : 1);
+    }
+    CU_ASSERT (pid > 0);
+
+    /* While another within its limit is still served every time */
+    usleep (10000);
+    for (i = 0; i < 100; i++)
+    {
+        CU_ASSERT ((rpc_client = rpc_client_connect (test_rpc_instance, url)) != NULL);
+        if (!rpc_client)
+            break;
+        rpc_msg_encode_uint8 (&msg, MODE_TEST);
+        rpc_msg_encode_string (&msg, url);
+        CU_ASSERT (rpc_msg_send (rpc_client, &msg));
+        rpc_msg_reset (&msg);
+        rpc_client_release (test_rpc_instance, rpc_client, true);
+    }
+    CU_ASSERT (waitpid (pid, &status, 0) == pid);
+    CU_ASSERT (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+
+    /* The last response can beat the worker finishing with it */
+    for (i = 0; i < 100; i++)
+    {
+        g_list_free_full (peers, g_free);
+        peers = rpc_server_peers (test_rpc_instance);
+        stats = _rpc_peer_find (peers, pid);
+        if (stats && !stats->inflight)
+            break;
+        usleep (1000);
+    }
+    CU_ASSERT (stats != NULL);
+    if (stats)
+    {
+        CU_ASSERT (stats->requests == 100 * TEST_RPC_THREADS);
+        CU_ASSERT (stats->rejected > 0 && stats->rejected < stats->requests);
+        CU_ASSERT (stats->queued == 0 && stats->inflight == 0);
+        CU_ASSERT (stats->max_pending == 2);
+    }
+    stats = _rpc_peer_find (peers, getpid ());
+    CU_ASSERT (stats != NULL);
+    if (stats)
+    {
+        CU_ASSERT (stats->requests == 100);
+        CU_ASSERT (stats->rejected == 0);
+    }
+    g_list_free_full (peers, g_free);
+
+    CU_ASSERT (rpc_server_release (test_rpc_instance, url));
+    rpc_shutdown (test_rpc_instance);
+    test_rpc_instance = NULL;
+}
+
 static pthread_t single_thread = -1;
 static int
 _single_thread (void *data)
 {
     int fd = 0;
     struct pollfd pfd;
-    uint8_t dummy = 0;
 
     while (fd >= 0)
     {
@@ -5661,10 +7353,6 @@ _single_thread (void *data)
         pfd.fd = fd;
         pfd.events = POLLIN;
         poll (&pfd, 1, 0);
-        if (read (fd, &dummy, 1) == 0)
-        {
-            ERROR ("Poll/Read error: %s\n", strerror (errno));
-        }
     }
     return 0;
 }
@@ -5776,9 +7464,10 @@ test_single_provide_no_polling ()
     CU_ASSERT (apteryx_provide (path, test_provide_callback_up));
     CU_ASSERT ((value = apteryx_get (path)) == NULL);
     apteryx_unprovide (path, test_provide_callback_up);
-    CU_ASSERT (assert_apteryx_empty ());
     apteryx_process (false);
+    /* apteryxd gives up on the provider just after we give up on it */
     usleep (1.1 * RPC_TIMEOUT_US);
+    CU_ASSERT (assert_apteryx_empty ());
 }
 
 static bool
@@ -5814,40 +7503,52 @@ test_single_watch_myself ()
     apteryx_process (false);
 }
 
+static bool
+_process_fd_ready (int fd)
+{
+    struct pollfd poll_fd = {
+        .fd = fd,
+        .events = POLLIN | POLLERR | POLLHUP,
+    };
+    return poll (&poll_fd, 1, 1) == 1;
+}
+
 void
-test_single_watch_myself_blocked ()
+test_single_watch_myself_batch ()
 {
     const char *path = TEST_PATH"/entity/zones/private/state";
     int fd = apteryx_process (true);
-    long pipe_size = (long)fcntl(fd, F_GETPIPE_SZ);
-    int count = pipe_size + 50;
-    char dummy;
+    int count = 200;
+    int remaining;
     int i;
 
     watch_count = 0;
     CU_ASSERT (apteryx_watch (path, test_single_watch_myself_callback));
     for (i = 0; i < count; i++)
     {
-        CU_ASSERT (apteryx_set (path, "down"));
+        CU_ASSERT (apteryx_set (path, i & 1 ? "up" : "down"));
     }
     usleep (TEST_SLEEP_TIMEOUT);
-    CU_ASSERT (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) | O_NONBLOCK) == 0);
-    for (i = 0; i <= count; i++)
-    {
-        struct pollfd poll_fd = {
-            .fd = fd,
-            .events = POLLIN | POLLERR | POLLHUP,
-        };
-        if (i == count) {
-            CU_ASSERT (poll (&poll_fd, 1, 1) == 0);
-            CU_ASSERT (read (fd, &dummy, 1) < 0);
-        }
-        else {
-            CU_ASSERT (poll (&poll_fd, 1, 1) == 1 && read (fd, &dummy, 1) == 1);
-            apteryx_process (true);
-        }
+
+    /* A batch leaves the rest queued and the fd readable */
+    CU_ASSERT (_process_fd_ready (fd));
+    CU_ASSERT (apteryx_process_batch (50, 0) == fd);
+    CU_ASSERT (watch_count == 50);
+    CU_ASSERT (_process_fd_ready (fd));
+
+    /* A time budget always runs at least one job but may run more */
+    CU_ASSERT (apteryx_process_batch (0, 1) == fd);
+    CU_ASSERT (watch_count > 50 && watch_count <= count);
+    remaining = count - watch_count;
+
+    /* Each call drains a full batch (PROCESS_BATCH) of what is left */
+    for (i = 0; i < count && _process_fd_ready (fd); i++)
+    {
+        apteryx_process (true);
     }
+    CU_ASSERT (i == (remaining + 63) / 64);
     CU_ASSERT (watch_count == count);
+    CU_ASSERT (!_process_fd_ready (fd));
     CU_ASSERT (apteryx_unwatch (path, test_single_watch_myself_callback));
     CU_ASSERT (apteryx_set (path, NULL));
     CU_ASSERT (assert_apteryx_empty ());
@@ -6378,6 +8079,7 @@ static CU_TestInfo tests_api[] = {
     { "delete", test_delete },
     { "search paths", test_search_paths },
     { "search root path", test_search_paths_root },
+    { "search range", test_search_range },
     { "multi threads writing to same table", test_thread_multi_write },
     { "multi processes writing to same table", test_process_multi_write },
     { "prune", test_prune },
@@ -6392,7 +8094,12 @@ static CU_TestInfo tests_api[] = {
     { "remote path contains colon", test_remote_path_colon },
     { "double fork", test_double_fork },
     { "timestamp", test_timestamp },
+    { "timestamps", test_timestamps },
+    { "wait", test_wait },
+    { "wait many", test_wait_many },
     { "memuse", test_memuse },
+    { "aggregate", test_aggregate },
+    { "counters", test_counters },
     CU_TEST_INFO_NULL,
 };
 
@@ -6420,6 +8127,11 @@ static CU_TestInfo tests_api_watch[] = {
     { "watch one level miss", test_watch_one_level_miss },
     { "watch prune", test_watch_prune },
     { "watch prune multiple", test_watch_prune_multiple },
+    { "watch prune partial", test_watch_prune_partial },
+    { "watch prune event", test_watch_prune_event },
+    { "watch prune sibling", test_watch_prune_sibling },
+    { "watch prune unwatch", test_watch_prune_unwatch },
+    { "watch set unchanged", test_watch_set_unchanged },
     { "watch one level path prune", test_watch_one_level_path_prune },
     { "watch empty path prune", test_watch_empty_path_prune },
     { "watch wildpath", test_watch_wildpath },
@@ -6433,6 +8145,7 @@ static CU_TestInfo tests_api_watch[] = {
     { "watch and set from another thread", test_watch_set_thread },
     { "watch adds / removes watches", test_watch_adds_watch },
     { "watch removes multiple watches", test_watch_removes_all_watches },
+    { "watch many callbacks", test_watch_many },
     { "watch when busy", test_watch_when_busy },
     { "watch order", test_watch_order },
     { "watch rpc restart", test_watch_rpc_restart },
@@ -6479,6 +8192,7 @@ static CU_TestInfo tests_api_refresh[] = {
 static CU_TestInfo tests_api_provide[] = {
     { "provide", test_provide },
     { "provider timeout", test_provide_timeout },
+    { "provider expired", test_provide_expired },
     { "provide replace handler", test_provide_replace_handler },
     { "provide no handler", test_provide_no_handler },
     { "provide remove handler", test_provide_remove_handler },
@@ -6500,6 +8214,7 @@ static CU_TestInfo tests_api_proxy[] = {
     { "proxy get", test_proxy_get },
     { "proxy tree get", test_proxy_tree_get },
     { "proxy set", test_proxy_set },
+    { "proxy set tree multiple", test_proxy_set_tree_multi },
     { "proxy not listening", test_proxy_not_listening },
     { "proxy before db get", test_proxy_before_db_get },
     { "proxy before db set", test_proxy_before_db_set },
@@ -6507,6 +8222,8 @@ static CU_TestInfo tests_api_proxy[] = {
     { "proxy search", test_proxy_search },
     { "proxy prune", test_proxy_prune },
     { "proxy timestamp", test_proxy_timestamp },
+    { "proxy wait", test_proxy_wait },
+    { "proxy aggregate", test_proxy_aggregate },
     { "proxy cas", test_proxy_cas },
     CU_TEST_INFO_NULL,
 };
@@ -6520,13 +8237,18 @@ static CU_TestInfo tests_api_tree[] = {
     { "tree find node", test_tree_path_node },
     { "tree sort children", test_tree_sort_children },
     { "set tree", test_set_tree },
+    { "sync tree", test_sync_tree },
     { "get tree", test_get_tree },
+    { "get tree if modified", test_get_tree_if_modified },
+    { "get trees", test_get_trees },
     { "get tree single node", test_get_tree_single_node },
     { "get tree null", test_get_tree_null },
     { "get tree indexed/provided", test_get_tree_indexed_provided },
     { "get tree provided", test_get_tree_provided },
     { "get tree provider writes", test_get_tree_provider_write },
     { "get tree thrashing" , test_get_tree_while_thrashing },
+    { "get tree large", test_get_tree_large },
+    { "traverse iter", test_traverse_iter },
     { "query basic", test_query_basic},
     { "query subtree root", test_query_subtree_root},
     { "query one star", test_query_one_star},
@@ -6538,7 +8260,9 @@ static CU_TestInfo tests_api_tree[] = {
     { "query null values", test_query_null_values},
     { "query two branches", test_query_two_branches},
     { "query provided", test_query_provided},
+    { "query multi leaf provided", test_query_multi_leaf_provided},
     { "cas tree", test_cas_tree},
+    { "cas tree per path", test_cas_tree_per_path},
     { "tree atomic", test_tree_atomic},
     { "watch tree", test_watch_tree },
     { "watch tree wildcard", test_watch_tree_wildcard },
@@ -6549,6 +8273,7 @@ static CU_TestInfo tests_api_tree[] = {
     { "watch tree one level", test_watch_tree_one_level },
     { "watch tree one level multi", test_watch_tree_one_level_multi },
     { "watch tree one level miss", test_watch_tree_one_level_miss },
+    { "transaction", test_txn },
     CU_TEST_INFO_NULL,
 };
 
@@ -6571,7 +8296,7 @@ static CU_TestInfo tests_single_threaded[] = {
     { "single-threaded provide", test_single_provide },
     { "single-threaded provide no polling", test_single_provide_no_polling },
     { "single-threaded watch myself", test_single_watch_myself },
-    { "single-threaded watch myself blocked", test_single_watch_myself_blocked },
+    { "single-threaded watch myself batch", test_single_watch_myself_batch },
     CU_TEST_INFO_NULL,
 };
 
@@ -6589,7 +8314,9 @@ static CU_TestInfo tests_performance[] = {
     { "get(tcp6)", test_perf_tcp6_get },
     { "get tree 50", test_perf_get_tree },
     { "get tree 5000", test_perf_get_tree_5000 },
+    { "traverse iter 5000", test_perf_traverse_iter_5000 },
     { "get tree real", test_perf_get_tree_real },
+    { "query 1000 x 3 leaves", test_perf_query_multi_leaf },
     { "get null", test_perf_get_null },
     { "search", test_perf_search },
     { "watch", test_perf_watch },
@@ -6613,6 +8340,12 @@ CU_TestInfo tests_rpc[] = {
     { "rpc ping", test_rpc_ping },
     { "rpc double bind", test_rpc_double_bind },
     { "rpc perf", test_rpc_perf },
+    { "rpc concurrent", test_rpc_concurrent },
+    { "rpc fork", test_rpc_fork },
+    { "rpc old peer", test_rpc_old_peer },
+    { "rpc syscalls", test_rpc_syscalls },
+    { "rpc pool", test_rpc_pool },
+    { "rpc fair", test_rpc_fair },
     CU_TEST_INFO_NULL,
 };
 